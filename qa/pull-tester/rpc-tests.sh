@@ -45,6 +45,7 @@ testScriptsExt=(
     'keypool.py'
     'receivedby.py'
     'reindex.py'
+    'addressindex.py'
     'rpcbind_test.py'
 #   'script_test.py'
     'smartfees.py'
@@ -0,0 +1,93 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test -addressindex: building it for an existing chain, maintaining it
+# for new blocks, pagination, and removing it
+#
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import time
+
+class AddressIndexTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = []
+        self.is_network_split = False
+        self.nodes.append(start_node(0, self.options.tmpdir))
+
+    def restart_node(self, extra_args):
+        stop_node(self.nodes[0], 0)
+        wait_bitcoinds()
+        self.nodes[0] = start_node(0, self.options.tmpdir, extra_args)
+
+    def wait_for_index(self, address):
+        for i in range(60):
+            try:
+                return self.nodes[0].getaddressbalance({"addresses": [address]})
+            except JSONRPCException as e:
+                assert("still being built" in e.error['message'])
+                time.sleep(0.5)
+        raise AssertionError("address index was not built")
+
+    def run_test(self):
+        self.nodes[0].generate(105)
+        utxo = self.nodes[0].listunspent()[0]
+        address = utxo['address']
+
+        # Enabling the index on an existing chain builds it in the background
+        self.restart_node(["-addressindex", "-spentindex"])
+        balance = self.wait_for_index(address)
+        assert(balance['balance'] >= utxo['amount'] * 100000000)
+        assert_equal(balance['balance'], balance['received'])
+
+        txids = self.nodes[0].getaddresstxids({"addresses": [address]})
+        assert(utxo['txid'] in txids)
+        utxos = self.nodes[0].getaddressutxos({"addresses": [address]})
+        assert(utxo['txid'] in [u['txid'] for u in utxos])
+
+        # New blocks are indexed as they are connected
+        height = self.nodes[0].getblockcount()
+        txid = self.nodes[0].sendtoaddress(address, 1.5)
+        self.nodes[0].generate(1)
+        deltas = self.nodes[0].getaddressdeltas({"addresses": [address], "start": height + 1})
+        received = [d for d in deltas if d['txid'] == txid and d['satoshis'] > 0]
+        assert_equal(len(received), 1)
+        assert_equal(received[0]['satoshis'], 150000000)
+        assert_equal(received[0]['height'], height + 1)
+        assert_equal(received[0]['address'], address)
+        assert(txid in self.nodes[0].getaddresstxids({"addresses": [address], "start": height + 1}))
+
+        # Paging through the deltas returns all of them once
+        deltas = self.nodes[0].getaddressdeltas({"addresses": [address]})
+        paged = []
+        cursor = None
+        while True:
+            query = {"addresses": [address], "limit": 2}
+            if cursor is not None:
+                query["cursor"] = cursor
+            page = self.nodes[0].getaddressdeltas(query)
+            paged += page['deltas']
+            if 'cursor' not in page:
+                break
+            cursor = page['cursor']
+        assert_equal(paged, deltas)
+
+        # Disabling the index removes it
+        self.restart_node([])
+        try:
+            self.nodes[0].getaddressbalance({"addresses": [address]})
+            raise AssertionError("address index still enabled")
+        except JSONRPCException as e:
+            assert("not enabled" in e.error['message'])
+
+        print "Success"
+
+if __name__ == '__main__':
+    AddressIndexTest().main()
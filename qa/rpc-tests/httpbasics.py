@@ -10,6 +10,7 @@
 from test_framework.test_framework import BitcoinTestFramework
 from test_framework.util import *
 import base64
+import socket
 
 try:
     import http.client as httplib
@@ -38,9 +39,13 @@ class HTTPBasicsTest (BitcoinTestFramework):
         conn.request('POST', '/', '{"method": "getbestblockhash"}', headers)
         out1 = conn.getresponse().read();
         assert_equal('"error":null' in out1, True)
+        assert_equal(conn.sock!=None, True) #according to http/1.1 connection must still be open!
 
-        # TODO #1856: Re-enable support for persistent connections.
-        assert_equal(conn.sock!=None, False)
+        #send 2nd request without closing connection
+        conn.request('POST', '/', '{"method": "getchaintips"}', headers)
+        out2 = conn.getresponse().read();
+        assert_equal('"error":null' in out2, True) #must also response with a correct json-rpc message
+        assert_equal(conn.sock!=None, True) #according to http/1.1 connection must still be open!
         conn.close()
         
         #same should be if we add keep-alive because this should be the std. behaviour
@@ -51,9 +56,13 @@ class HTTPBasicsTest (BitcoinTestFramework):
         conn.request('POST', '/', '{"method": "getbestblockhash"}', headers)
         out1 = conn.getresponse().read();
         assert_equal('"error":null' in out1, True)
+        assert_equal(conn.sock!=None, True) #according to http/1.1 connection must still be open!
 
-        # TODO #1856: Re-enable support for persistent connections.
-        assert_equal(conn.sock!=None, False)
+        #send 2nd request without closing connection
+        conn.request('POST', '/', '{"method": "getchaintips"}', headers)
+        out2 = conn.getresponse().read();
+        assert_equal('"error":null' in out2, True) #must also response with a correct json-rpc message
+        assert_equal(conn.sock!=None, True) #according to http/1.1 connection must still be open!
         conn.close()
         
         #now do the same with "Connection: close"
@@ -78,7 +87,7 @@ class HTTPBasicsTest (BitcoinTestFramework):
         assert_equal('"error":null' in out1, True)
         assert_equal(conn.sock!=None, False) #connection must be closed because keep-alive was set to false
         
-        #node2 (third node) is running with standard keep-alive parameters which means keep-alive is off
+        #node2 (third node) is running with standard keep-alive parameters which means keep-alive is on
         urlNode2 = urlparse.urlparse(self.nodes[2].url)
         authpair = urlNode2.username + ':' + urlNode2.password
         headers = {"Authorization": "Basic " + base64.b64encode(authpair)}
@@ -88,10 +97,28 @@ class HTTPBasicsTest (BitcoinTestFramework):
         conn.request('POST', '/', '{"method": "getbestblockhash"}', headers)
         out1 = conn.getresponse().read();
         assert_equal('"error":null' in out1, True)
-
-        # TODO #1856: Re-enable support for persistent connections.
-        assert_equal(conn.sock!=None, False)
+        assert_equal(conn.sock!=None, True) #connection must be still open because bitcoind uses keep-alive by default
         conn.close()
+
+        #pipelined requests are answered in order on the same connection
+        body1 = '{"method": "getbestblockhash", "id": 1}'
+        body2 = '{"method": "getblockcount", "id": 2}'
+        request = ''
+        for body in [body1, body2]:
+            request += 'POST / HTTP/1.1\r\nAuthorization: Basic ' + base64.b64encode(authpair) + '\r\n'
+            request += 'Content-Length: ' + str(len(body)) + '\r\n\r\n' + body
+        sock = socket.create_connection((urlNode2.hostname, urlNode2.port))
+        sock.sendall(request)
+        sock.shutdown(socket.SHUT_WR)
+        reply = ''
+        while True:
+            data = sock.recv(4096)
+            if not data:
+                break
+            reply += data
+        sock.close()
+        assert_equal(reply.count('HTTP/1.1 200 OK'), 2)
+        assert(reply.index('"id":1') < reply.index('"id":2'))
         
 if __name__ == '__main__':
     HTTPBasicsTest ().main ()
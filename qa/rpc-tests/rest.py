@@ -286,6 +286,43 @@ class RESTTest (BitcoinTestFramework):
         for tx in txs:
             assert_equal(tx in json_obj['tx'], True)
 
+        #################
+        # /rest/blocks/ #
+        #################
+
+        # a range of blocks is the blocks back to back, as served one by one
+        tip_height = self.nodes[0].getblockcount()
+        hash1 = self.nodes[0].getblockhash(1)
+        hash2 = self.nodes[0].getblockhash(2)
+        response = http_get_call(url.hostname, url.port, '/rest/blocks/2/'+hash1+self.FORMAT_SEPARATOR+"bin", "", True)
+        assert_equal(response.status, 200)
+        blocks_str = response.read()
+        block1_str = http_get_call(url.hostname, url.port, '/rest/block/'+hash1+self.FORMAT_SEPARATOR+"bin")
+        block2_str = http_get_call(url.hostname, url.port, '/rest/block/'+hash2+self.FORMAT_SEPARATOR+"bin")
+        assert_equal(blocks_str, block1_str + block2_str)
+
+        # the same range by height
+        blocks_hex = http_get_call(url.hostname, url.port, '/rest/blocks/2'+self.FORMAT_SEPARATOR+"hex?since=1")
+        assert_equal(blocks_hex, blocks_str.encode("hex") + "\n")
+
+        # following the chain with since= stops at the tip
+        json_string = http_get_call(url.hostname, url.port, '/rest/blocks/notxdetails/1000'+self.FORMAT_SEPARATOR+"json?since="+str(tip_height-2))
+        json_obj = json.loads(json_string)
+        assert_equal([block['height'] for block in json_obj], range(tip_height-2, tip_height+1))
+        assert_equal(json_obj[-1]['hash'], self.nodes[0].getbestblockhash())
+        json_string = http_get_call(url.hostname, url.port, '/rest/blocks/1000'+self.FORMAT_SEPARATOR+"json?since="+str(tip_height+1))
+        assert_equal(json.loads(json_string), [])
+
+        # headers of the whole chain, beyond the old limit of 2000 per request
+        response = http_get_call(url.hostname, url.port, '/rest/headers/5000'+self.FORMAT_SEPARATOR+"bin?since=0", "", True)
+        assert_equal(response.status, 200)
+        assert_equal(len(response.read()), 177 * (tip_height + 1))
+
+        response = http_get_call(url.hostname, url.port, '/rest/blocks/1001/'+hash1+self.FORMAT_SEPARATOR+"bin", "", True)
+        assert_equal(response.status, 400) # too many blocks at once
+        response = http_get_call(url.hostname, url.port, '/rest/blocks/1'+self.FORMAT_SEPARATOR+"bin?since=-1", "", True)
+        assert_equal(response.status, 400)
+
         #test rest bestblock
         bb_hash = self.nodes[0].getbestblockhash()
 
@@ -0,0 +1,114 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+
+#include "main.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "txdb.h"
+#include "undo.h"
+
+using namespace std;
+
+CAddressIndex* paddressindex = NULL;
+CSpentIndex* pspentindex = NULL;
+
+AddressIndexType GetScriptAddress(const CScript& script, uint160& hashBytes)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(script, dest))
+        return ADDRESSINDEX_NONE;
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest)) {
+        hashBytes = *keyID;
+        return ADDRESSINDEX_P2PKH;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest)) {
+        hashBytes = *scriptID;
+        return ADDRESSINDEX_P2SH;
+    }
+    return ADDRESSINDEX_NONE;
+}
+
+void GetAddressIndexEntries(const CBlock& block, const CBlockUndo& blockundo, int nHeight,
+                            AddressIndexEntries* pvAddressIndex, SpentIndexEntries* pvSpentIndex)
+{
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 txhash = tx.GetHash();
+
+        // The undo data of a block has an entry for every transaction but the coinbase
+        if (!tx.IsCoinBase()) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CTxOut& prevout = txundo.vprevout[j].txout;
+                uint160 hashBytes;
+                AddressIndexType type = GetScriptAddress(prevout.scriptPubKey, hashBytes);
+                if (pvAddressIndex && type != ADDRESSINDEX_NONE)
+                    pvAddressIndex->push_back(make_pair(CAddressIndexKey(type, hashBytes, nHeight, i, txhash, j, true), -prevout.nValue));
+                if (pvSpentIndex) {
+                    CSpentIndexValue value;
+                    value.txid = txhash;
+                    value.nInput = j;
+                    value.nHeight = nHeight;
+                    value.nValue = prevout.nValue;
+                    value.addressType = type;
+                    value.addressHash = hashBytes;
+                    pvSpentIndex->push_back(make_pair(CSpentIndexKey(tx.vin[j].prevout.hash, tx.vin[j].prevout.n), value));
+                }
+            }
+        }
+
+        if (pvAddressIndex) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                uint160 hashBytes;
+                AddressIndexType type = GetScriptAddress(tx.vout[k].scriptPubKey, hashBytes);
+                if (type != ADDRESSINDEX_NONE)
+                    pvAddressIndex->push_back(make_pair(CAddressIndexKey(type, hashBytes, nHeight, i, txhash, k, false), tx.vout[k].nValue));
+            }
+        }
+    }
+}
+
+bool CAddressIndex::WriteBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    AddressIndexEntries vAddressIndex;
+    GetAddressIndexEntries(block, blockundo, pindex->nHeight, &vAddressIndex, NULL);
+    pblocktree->WriteAddressIndexes(batch, vAddressIndex, SpentIndexEntries());
+    return true;
+}
+
+bool CAddressIndex::RewindBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    AddressIndexEntries vAddressIndex;
+    GetAddressIndexEntries(block, blockundo, pindex->nHeight, &vAddressIndex, NULL);
+    pblocktree->EraseAddressIndexes(batch, vAddressIndex, SpentIndexEntries());
+    return true;
+}
+
+bool CAddressIndex::Wipe()
+{
+    return pblocktree->WipeAddressIndex();
+}
+
+bool CSpentIndex::WriteBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    SpentIndexEntries vSpentIndex;
+    GetAddressIndexEntries(block, blockundo, pindex->nHeight, NULL, &vSpentIndex);
+    pblocktree->WriteAddressIndexes(batch, AddressIndexEntries(), vSpentIndex);
+    return true;
+}
+
+bool CSpentIndex::RewindBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    SpentIndexEntries vSpentIndex;
+    GetAddressIndexEntries(block, blockundo, pindex->nHeight, NULL, &vSpentIndex);
+    pblocktree->EraseAddressIndexes(batch, AddressIndexEntries(), vSpentIndex);
+    return true;
+}
+
+bool CSpentIndex::Wipe()
+{
+    return pblocktree->WipeSpentIndex();
+}
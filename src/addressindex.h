@@ -0,0 +1,195 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "amount.h"
+#include "baseindex.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <utility>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+class CScript;
+
+/** Defaults for -addressindex and -spentindex */
+static const bool DEFAULT_ADDRESSINDEX = false;
+static const bool DEFAULT_SPENTINDEX = false;
+
+//! Kinds of scripts the address index knows about
+enum AddressIndexType {
+    ADDRESSINDEX_NONE = 0,
+    ADDRESSINDEX_P2PKH = 1,     //!< Pay to public key hash, and pay to public key under its key hash
+    ADDRESSINDEX_P2SH = 2,
+};
+
+/**
+ * Key of an address index entry: one output paying an address, or one input
+ * spending from it. Heights and transaction positions are serialized big
+ * endian, so the entries of an address are sorted by where they are in the
+ * chain and can be read a height range at a time.
+ */
+struct CAddressIndexKey
+{
+    unsigned char type;
+    uint160 hashBytes;
+    int nHeight;
+    unsigned int nTxIndex;      //!< Position of the transaction in its block
+    uint256 txhash;
+    unsigned int nIndex;        //!< Output index, or input index when spending
+    bool fSpending;
+
+    CAddressIndexKey() : type(ADDRESSINDEX_NONE), nHeight(0), nTxIndex(0), nIndex(0), fSpending(false) {}
+
+    CAddressIndexKey(unsigned char typeIn, const uint160& hashBytesIn, int nHeightIn, unsigned int nTxIndexIn,
+                     const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn) :
+        type(typeIn), hashBytes(hashBytesIn), nHeight(nHeightIn), nTxIndex(nTxIndexIn),
+        txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 20 + 4 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata8(s, type);
+        hashBytes.Serialize(s, nType, nVersion);
+        ser_writedata32be(s, nHeight);
+        ser_writedata32be(s, nTxIndex);
+        txhash.Serialize(s, nType, nVersion);
+        ser_writedata32(s, nIndex);
+        ser_writedata8(s, fSpending);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        type = ser_readdata8(s);
+        hashBytes.Unserialize(s, nType, nVersion);
+        nHeight = ser_readdata32be(s);
+        nTxIndex = ser_readdata32be(s);
+        txhash.Unserialize(s, nType, nVersion);
+        nIndex = ser_readdata32(s);
+        fSpending = ser_readdata8(s) != 0;
+    }
+};
+
+/** Prefix of CAddressIndexKey, to seek to the entries of an address from a given height on */
+struct CAddressIndexIteratorKey
+{
+    unsigned char type;
+    uint160 hashBytes;
+    int nHeight;
+
+    CAddressIndexIteratorKey(unsigned char typeIn, const uint160& hashBytesIn, int nHeightIn) :
+        type(typeIn), hashBytes(hashBytesIn), nHeight(nHeightIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 20 + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata8(s, type);
+        hashBytes.Serialize(s, nType, nVersion);
+        ser_writedata32be(s, nHeight);
+    }
+};
+
+/** Key of a spent index entry: the output that was spent */
+struct CSpentIndexKey
+{
+    uint256 txid;
+    unsigned int nOutput;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(txid);
+        READWRITE(nOutput);
+    }
+
+    CSpentIndexKey() : nOutput(0) {}
+    CSpentIndexKey(const uint256& txidIn, unsigned int nOutputIn) : txid(txidIn), nOutput(nOutputIn) {}
+};
+
+/** Where an output was spent, and what it held */
+struct CSpentIndexValue
+{
+    uint256 txid;               //!< Spending transaction
+    unsigned int nInput;
+    int nHeight;
+    CAmount nValue;
+    unsigned char addressType;  //!< ADDRESSINDEX_NONE if the output doesn't pay an indexed address
+    uint160 addressHash;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(txid);
+        READWRITE(nInput);
+        READWRITE(nHeight);
+        READWRITE(nValue);
+        READWRITE(addressType);
+        READWRITE(addressHash);
+    }
+
+    CSpentIndexValue() : nInput(0), nHeight(0), nValue(0), addressType(ADDRESSINDEX_NONE) {}
+};
+
+typedef std::vector<std::pair<CAddressIndexKey, CAmount> > AddressIndexEntries;
+typedef std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > SpentIndexEntries;
+
+/**
+ * Find the address a script pays, if it is one the address index covers.
+ * Returns ADDRESSINDEX_NONE otherwise.
+ */
+AddressIndexType GetScriptAddress(const CScript& script, uint160& hashBytes);
+
+/**
+ * Compute the address and spent index entries of a block. The outputs its
+ * transactions spend are taken from its undo data, so this works for blocks
+ * connected long ago as well as for the one being connected. Either output
+ * may be NULL if that index isn't wanted. The values of address index
+ * entries are negative for spends.
+ */
+void GetAddressIndexEntries(const CBlock& block, const CBlockUndo& blockundo, int nHeight,
+                            AddressIndexEntries* pvAddressIndex, SpentIndexEntries* pvSpentIndex);
+
+/** Index of the outputs paying each address and the inputs spending from it */
+class CAddressIndex : public CBaseIndex
+{
+protected:
+    bool WriteBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex);
+    bool RewindBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex);
+    bool UsesUndo() const { return true; }
+    bool Wipe();
+
+public:
+    CAddressIndex() : CBaseIndex("addressindex") {}
+};
+
+/** Index of where each output of the chain was spent */
+class CSpentIndex : public CBaseIndex
+{
+protected:
+    bool WriteBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex);
+    bool RewindBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex);
+    bool UsesUndo() const { return true; }
+    bool Wipe();
+
+public:
+    CSpentIndex() : CBaseIndex("spentindex") {}
+};
+
+/** The address and spent indexes, NULL unless -addressindex and -spentindex are set */
+extern CAddressIndex* paddressindex;
+extern CSpentIndex* pspentindex;
+
+#endif // BITCOIN_ADDRESSINDEX_H
@@ -28,7 +28,7 @@ std::map<OperationStatus, std::string> OperationStatusMap = {
 /**
  * Every operation instance should have a globally unique id
  */
-AsyncRPCOperation::AsyncRPCOperation() : error_code_(0), error_message_() {
+AsyncRPCOperation::AsyncRPCOperation() : error_code_(0), error_message_(), priority_(OperationPriority::NORMAL) {
     // Set a unique reference for each operation
     boost::uuids::uuid uuid = uuidgen();
     id_ = "opid-" + boost::uuids::to_string(uuid);
@@ -37,7 +37,7 @@ AsyncRPCOperation::AsyncRPCOperation() : error_code_(0), error_message_() {
 }
 
 AsyncRPCOperation::AsyncRPCOperation(const AsyncRPCOperation& o) :
-        id_(o.id_), creation_time_(o.creation_time_), state_(o.state_.load()),
+        id_(o.id_), creation_time_(o.creation_time_), priority_(o.priority_), state_(o.state_.load()),
         start_time_(o.start_time_), end_time_(o.end_time_),
         error_code_(o.error_code_), error_message_(o.error_message_),
         result_(o.result_)
@@ -47,6 +47,7 @@ AsyncRPCOperation::AsyncRPCOperation(const AsyncRPCOperation& o) :
 AsyncRPCOperation& AsyncRPCOperation::operator=( const AsyncRPCOperation& other ) {
     this->id_ = other.id_;
     this->creation_time_ = other.creation_time_;
+    this->priority_ = other.priority_;
     this->state_.store(other.state_.load());
     this->start_time_ = other.start_time_;
     this->end_time_ = other.end_time_;
@@ -41,6 +41,16 @@ typedef enum class operationStateEnum {
     SUCCESS
 } OperationStatus;
 
+// Operations of a higher priority are started before any queued operation
+// of a lower priority.
+typedef enum class operationPriorityEnum {
+    HIGH = 0,
+    NORMAL,
+    LOW
+} OperationPriority;
+
+#define ASYNC_RPC_OPERATION_PRIORITY_COUNT 3
+
 class AsyncRPCOperation {
 public:
     AsyncRPCOperation();
@@ -66,9 +76,25 @@ public:
         return creation_time_;
     }
 
+    OperationPriority getPriority() const {
+        return priority_;
+    }
+
+    // Set before adding the operation to a queue.
+    void setPriority(OperationPriority priority) {
+        priority_ = priority;
+    }
+
+    // Override this method to return true if main() computes JoinSplit
+    // proofs. Each of these needs several GB of memory and all cores, so the
+    // queue limits how many of them execute at once.
+    virtual bool isProving() const {
+        return false;
+    }
+
     Value getStatus() const;
 
-    Value getError() const;
+    virtual Value getError() const;
     
     Value getResult() const;
 
@@ -150,6 +176,7 @@ private:
     // Initialized in the operation constructor, never to be modified again.
     AsyncRPCOperationId id_;
     int64_t creation_time_;
+    OperationPriority priority_;
 };
 
 #endif /* ASYNCRPCOPERATION_H */
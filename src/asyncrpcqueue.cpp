@@ -4,6 +4,8 @@
 
 #include "asyncrpcqueue.h"
 
+#include <algorithm>
+
 static std::atomic<size_t> workerCounter(0);
 
 /**
@@ -15,7 +17,9 @@ shared_ptr<AsyncRPCQueue> AsyncRPCQueue::sharedInstance() {
     return q;
 }
 
-AsyncRPCQueue::AsyncRPCQueue() : closed_(false), finish_(false) {
+AsyncRPCQueue::AsyncRPCQueue() : closed_(false), finish_(false), next_sequence_(0),
+        proving_count_(0), max_proving_(0), operation_ttl_(0),
+        num_workers_(0), idle_workers_(0), min_workers_(0), max_workers_(0) {
 }
 
 AsyncRPCQueue::~AsyncRPCQueue() {
@@ -30,46 +34,145 @@ void AsyncRPCQueue::run(size_t workerId) {
     while (true) {
         AsyncRPCOperationId key;
         std::shared_ptr<AsyncRPCOperation> operation;
+        bool fProving = false;
+        bool fExit = false;
         {
             std::unique_lock<std::mutex> guard(lock_);
-            while (operation_id_queue_.empty() && !isClosed() && !isFinishing()) {
-                this->condition_.wait(guard);
+            evict_finished_operations();
+
+            idle_workers_++;
+            bool fIdleTimeout = false;
+            while (true) {
+                // Exit if the queue is closing.
+                if (isClosed()) {
+                    clear_queued_operations();
+                    fExit = true;
+                    break;
+                }
+
+                operation = next_operation(fProving);
+                if (operation) {
+                    break;
+                }
+
+                // Exit if the queue is empty and we are finishing up
+                if (isFinishing() && queued_operation_count() == 0) {
+                    fExit = true;
+                    break;
+                }
+
+                // Retire if there are more workers than wanted
+                if (num_workers_ > max_workers_ || (fIdleTimeout && num_workers_ > min_workers_)) {
+                    fExit = true;
+                    break;
+                }
+
+                if (num_workers_ > min_workers_) {
+                    fIdleTimeout = (this->condition_.wait_for(guard, std::chrono::seconds(ASYNC_RPC_QUEUE_WORKER_IDLE_SECS)) == std::cv_status::timeout);
+                } else {
+                    this->condition_.wait(guard);
+                }
             }
+            idle_workers_--;
 
-            // Exit if the queue is empty and we are finishing up
-            if (isFinishing() && operation_id_queue_.empty()) {
+            if (fExit) {
+                num_workers_--;
+                exited_workers_.push_back(workerId);
                 break;
             }
+            key = operation->getId();
+        }
 
-            // Exit if the queue is closing.
-            if (isClosed()) {
-                while (!operation_id_queue_.empty()) {
-                    operation_id_queue_.pop();
-                }
-                break;
+        operation->main();
+
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (fProving) {
+                proving_count_--;
+                // A proving operation may be waiting for this slot
+                this->condition_.notify_all();
             }
+            mark_finished(key);
+        }
+    }
+}
 
-            // Get operation id
-            key = operation_id_queue_.front();
-            operation_id_queue_.pop();
+/**
+ * Take the next operation to execute: the oldest of the highest priority
+ * that isn't held back by the proving limit. Cancelled operations and those
+ * no longer in the map are dropped on the way.
+ */
+std::shared_ptr<AsyncRPCOperation> AsyncRPCQueue::next_operation(bool& fProving) {
+    for (size_t p = 0; p < ASYNC_RPC_OPERATION_PRIORITY_COUNT; p++) {
+        AsyncRPCOperationIdQueue& queue = operation_id_queue_[p];
+        AsyncRPCOperationIdQueue& provingQueue = proving_id_queue_[p];
+        while (true) {
+            bool fCanProve = (max_proving_ == 0 || proving_count_ < max_proving_) && !provingQueue.empty();
+            if (queue.empty() && !fCanProve) {
+                break;
+            }
+            fProving = fCanProve && (queue.empty() || provingQueue.front().first < queue.front().first);
+            AsyncRPCOperationIdQueue& from = fProving ? provingQueue : queue;
+            AsyncRPCOperationId key = from.front().second;
+            from.pop_front();
 
-            // Search operation map
             AsyncRPCOperationMap::const_iterator iter = operation_map_.find(key);
-            if (iter != operation_map_.end()) {
-                operation = iter->second;
+            if (iter == operation_map_.end()) {
+                // cannot find operation in map, may have been removed
+                continue;
+            }
+            if (iter->second->isCancelled()) {
+                // skip cancelled operation
+                mark_finished(key);
+                continue;
+            }
+            if (fProving) {
+                proving_count_++;
             }
+            return iter->second;
         }
+    }
+    return nullptr;
+}
 
-        if (!operation) {
-            // cannot find operation in map, may have been removed
-        } else if (operation->isCancelled()) {
-            // skip cancelled operation
-        } else {
-            operation->main();
-        }
+size_t AsyncRPCQueue::queued_operation_count() const {
+    size_t n = 0;
+    for (size_t p = 0; p < ASYNC_RPC_OPERATION_PRIORITY_COUNT; p++) {
+        n += operation_id_queue_[p].size() + proving_id_queue_[p].size();
+    }
+    return n;
+}
+
+void AsyncRPCQueue::clear_queued_operations() {
+    for (size_t p = 0; p < ASYNC_RPC_OPERATION_PRIORITY_COUNT; p++) {
+        operation_id_queue_[p].clear();
+        proving_id_queue_[p].clear();
+    }
+}
+
+/**
+ * Remember when an operation finished, so it can be evicted after the TTL.
+ */
+void AsyncRPCQueue::mark_finished(const AsyncRPCOperationId& id) {
+    if (operation_ttl_ > 0) {
+        finished_.push_back(std::make_pair(std::chrono::steady_clock::now(), id));
     }
 }
 
+/**
+ * Remove operations which finished more than the TTL ago. Operations already
+ * removed with popOperationForId() are simply skipped.
+ */
+void AsyncRPCQueue::evict_finished_operations() {
+    if (operation_ttl_ <= 0) {
+        return;
+    }
+    std::chrono::steady_clock::time_point cutoff = std::chrono::steady_clock::now() - std::chrono::seconds(operation_ttl_);
+    while (!finished_.empty() && finished_.front().first < cutoff) {
+        operation_map_.erase(finished_.front().second);
+        finished_.pop_front();
+    }
+}
 
 /**
  * Add shared_ptr to operation.
@@ -89,9 +192,22 @@ void AsyncRPCQueue::addOperation(const std::shared_ptr<AsyncRPCOperation> &ptrOp
         return;
     }
 
+    evict_finished_operations();
+
     AsyncRPCOperationId id = ptrOperation->getId();
     operation_map_.emplace(id, ptrOperation);
-    operation_id_queue_.push(id);
+    bool fProving = ptrOperation->isProving();
+    size_t priority = static_cast<size_t>(ptrOperation->getPriority());
+    AsyncRPCOperationIdQueue& queue = fProving ? proving_id_queue_[priority] : operation_id_queue_[priority];
+    queue.push_back(std::make_pair(next_sequence_++, id));
+
+    // Don't leave the operation waiting behind long running ones if another
+    // worker is allowed; it exits again once idle. A proving operation held
+    // back by the proving limit wouldn't be started by a new worker anyway.
+    bool fCanStart = !fProving || max_proving_ == 0 || proving_count_ < max_proving_;
+    if (fCanStart && queued_operation_count() > idle_workers_ && num_workers_ < max_workers_) {
+        spawn_worker();
+    }
     this->condition_.notify_one();
 }
 
@@ -168,23 +284,90 @@ void AsyncRPCQueue::cancelAllOperations() {
  */
 size_t AsyncRPCQueue::getOperationCount() const {
     std::lock_guard<std::mutex> guard(lock_);
-    return operation_id_queue_.size();
+    return queued_operation_count();
+}
+
+/**
+ * Spawn a worker thread, first joining any that have retired
+ */
+void AsyncRPCQueue::spawn_worker() {
+    for (size_t id : exited_workers_) {
+        auto it = workers_.find(id);
+        if (it != workers_.end()) {
+            it->second.join();
+            workers_.erase(it);
+        }
+    }
+    exited_workers_.clear();
+
+    size_t id = ++workerCounter;
+    workers_.emplace(id, std::thread(&AsyncRPCQueue::run, this, id));
+    num_workers_++;
 }
 
 /**
- * Spawn a worker thread
+ * Spawn a worker thread which is kept running even when idle
  */
 void AsyncRPCQueue::addWorker() {
     std::lock_guard<std::mutex> guard(lock_);
-    workers_.emplace_back( std::thread(&AsyncRPCQueue::run, this, ++workerCounter) );
+    min_workers_++;
+    max_workers_ = std::max(max_workers_, min_workers_);
+    spawn_worker();
 }
 
 /**
- * Return the number of worker threads spawned by the queue
+ * Return the number of worker threads currently running
  */
 size_t AsyncRPCQueue::getNumberOfWorkers() const {
     std::lock_guard<std::mutex> guard(lock_);
-    return workers_.size();
+    return num_workers_;
+}
+
+/**
+ * Change the number of workers kept running. Surplus workers exit once they
+ * have finished their current operation.
+ */
+void AsyncRPCQueue::setNumberOfWorkers(size_t n) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (isClosed() || isFinishing()) {
+        return;
+    }
+    min_workers_ = n;
+    max_workers_ = std::max(max_workers_, min_workers_);
+    while (num_workers_ < min_workers_) {
+        spawn_worker();
+    }
+    this->condition_.notify_all();
+}
+
+/**
+ * Let the queue spawn workers, up to n in total, when operations would
+ * otherwise wait behind those executing.
+ */
+void AsyncRPCQueue::setMaxWorkers(size_t n) {
+    std::lock_guard<std::mutex> guard(lock_);
+    max_workers_ = std::max(n, min_workers_);
+    this->condition_.notify_all();
+}
+
+/**
+ * Limit the number of proving operations executing at once.
+ */
+void AsyncRPCQueue::setMaxProvingOperations(size_t n) {
+    std::lock_guard<std::mutex> guard(lock_);
+    max_proving_ = n;
+    this->condition_.notify_all();
+}
+
+/**
+ * Forget finished operations this many seconds after they finished.
+ */
+void AsyncRPCQueue::setOperationTTL(int64_t seconds) {
+    std::lock_guard<std::mutex> guard(lock_);
+    operation_ttl_ = seconds;
+    if (operation_ttl_ <= 0) {
+        finished_.clear();
+    }
 }
 
 /**
@@ -225,9 +408,9 @@ void AsyncRPCQueue::wait_for_worker_threads() {
         this->condition_.notify_all();
     }
         
-    for (std::thread & t : this->workers_) {
-        if (t.joinable()) {
-            t.join();
+    for (auto & entry : this->workers_) {
+        if (entry.second.joinable()) {
+            entry.second.join();
         }
     }
 }
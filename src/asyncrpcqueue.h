@@ -10,7 +10,9 @@
 #include <iostream>
 #include <string>
 #include <chrono>
-#include <queue>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 #include <future>
@@ -21,6 +23,12 @@
 
 typedef std::unordered_map<AsyncRPCOperationId, std::shared_ptr<AsyncRPCOperation> > AsyncRPCOperationMap; 
 
+// Queued operation ids, tagged with the order in which they were added
+typedef std::deque<std::pair<uint64_t, AsyncRPCOperationId> > AsyncRPCOperationIdQueue;
+
+// How long a worker above the minimum number of workers waits for an operation before exiting
+#define ASYNC_RPC_QUEUE_WORKER_IDLE_SECS 60
+
 
 class AsyncRPCQueue {
 public:
@@ -37,6 +45,10 @@ public:
 
     void addWorker();
     size_t getNumberOfWorkers() const;
+    void setNumberOfWorkers(size_t n); // keep n workers running, spawning or retiring as needed
+    void setMaxWorkers(size_t n); // spawn workers on demand, up to n, while operations are waiting
+    void setMaxProvingOperations(size_t n); // at most n proving operations execute at once, 0 for no limit
+    void setOperationTTL(int64_t seconds); // forget finished operations after this long, 0 to keep them
     bool isClosed() const;
     bool isFinishing() const;
     void close(); // close queue and cancel all operations
@@ -55,14 +67,40 @@ private:
     void run(size_t workerId);
     void wait_for_worker_threads();
 
+    // The methods below must be called with lock_ held
+    void spawn_worker();
+    std::shared_ptr<AsyncRPCOperation> next_operation(bool& fProving);
+    size_t queued_operation_count() const;
+    void clear_queued_operations();
+    void mark_finished(const AsyncRPCOperationId& id);
+    void evict_finished_operations();
+
     // Why this is not a recursive lock: http://www.zaval.org/resources/library/butenhof1.html
     mutable std::mutex lock_;
     std::condition_variable condition_;
     std::atomic<bool> closed_;
     std::atomic<bool> finish_;
     AsyncRPCOperationMap operation_map_;
-    std::queue <AsyncRPCOperationId> operation_id_queue_;
-    std::vector<std::thread> workers_;
+
+    // One queue per priority, with proving operations kept apart so workers
+    // can pass over them while the proving limit is reached.
+    AsyncRPCOperationIdQueue operation_id_queue_[ASYNC_RPC_OPERATION_PRIORITY_COUNT];
+    AsyncRPCOperationIdQueue proving_id_queue_[ASYNC_RPC_OPERATION_PRIORITY_COUNT];
+    uint64_t next_sequence_;
+
+    size_t proving_count_;      // proving operations executing
+    size_t max_proving_;
+
+    // Finished operations, oldest first, for evicting them once their TTL has passed
+    std::deque<std::pair<std::chrono::steady_clock::time_point, AsyncRPCOperationId> > finished_;
+    int64_t operation_ttl_;
+
+    std::unordered_map<size_t, std::thread> workers_;
+    std::vector<size_t> exited_workers_;    // retired workers, still to be joined
+    size_t num_workers_;        // workers running
+    size_t idle_workers_;       // workers waiting for an operation
+    size_t min_workers_;        // workers kept running even when idle
+    size_t max_workers_;
 };
 
 #endif
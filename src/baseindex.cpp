@@ -0,0 +1,268 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "baseindex.h"
+
+#include "leveldbwrapper.h"
+#include "main.h"
+#include "txdb.h"
+#include "undo.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+
+using namespace std;
+
+/** Number of blocks read and indexed per batch while an index catches up */
+static const unsigned int INDEX_SYNC_BATCH = 500;
+
+/** A block the sync thread of an index is writing or rewinding */
+struct CIndexSyncBlock
+{
+    const CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    CDiskBlockPos undoPos;
+    uint256 hashPrev;
+    bool fHaveData;             //!< False for the genesis block, and blocks below a loaded snapshot
+    bool fRewind;
+    bool fFailed;
+    CLevelDBBatch batch;
+
+    CIndexSyncBlock() : pindex(NULL), fHaveData(false), fRewind(false), fFailed(false) {}
+};
+
+CBaseIndex::CBaseIndex(const string& strNameIn) :
+    strName(strNameIn), pindexBest(NULL), fSynced(false), fStopped(false), fChainTipChanged(false)
+{
+}
+
+CBaseIndex::~CBaseIndex()
+{
+    Stop();
+}
+
+bool CBaseIndex::Start()
+{
+    uint256 hashBest;
+    if (pblocktree->ReadIndexBestBlock(strName, hashBest)) {
+        LOCK(cs_main);
+        BlockMap::iterator it = mapBlockIndex.find(hashBest);
+        if (it != mapBlockIndex.end()) {
+            pindexBest = it->second;
+            LogPrintf("%s: %s is synced to height %d\n", __func__, strName, pindexBest->nHeight);
+        } else {
+            // Entries of a block nobody knows can't be rewound, start over
+            LogPrintf("%s: %s is synced to unknown block %s, rebuilding it\n", __func__, strName, hashBest.ToString());
+            if (!pblocktree->EraseIndexBestBlock(strName) || !Wipe())
+                return error("%s: failed to clear %s", __func__, strName);
+        }
+    } else {
+        // Start from scratch, without entries an interrupted removal may have left
+        LogPrintf("%s: building %s\n", __func__, strName);
+        if (!Wipe())
+            return error("%s: failed to clear %s", __func__, strName);
+    }
+
+    RegisterValidationInterface(this);
+    boost::function<void()> func = boost::bind(&CBaseIndex::ThreadSync, this);
+    threadSync = boost::thread(boost::bind(&TraceThread<boost::function<void()> >, strName.c_str(), func));
+    return true;
+}
+
+void CBaseIndex::Stop()
+{
+    UnregisterValidationInterface(this);
+    if (threadSync.joinable()) {
+        threadSync.interrupt();
+        threadSync.join();
+    }
+}
+
+bool CBaseIndex::Remove()
+{
+    // Forget the best block first, so that an interrupted removal starts over
+    if (!pblocktree->EraseIndexBestBlock(strName) || !Wipe())
+        return error("%s: failed to remove %s", __func__, strName);
+    return true;
+}
+
+bool CBaseIndex::IsSynced() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return fSynced;
+}
+
+bool CBaseIndex::BlockUntilSyncedToCurrentChain() const
+{
+    const CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        if (!fSynced || fStopped)
+            return false;
+        if (pindexTip == NULL || (pindexBest != NULL && pindexBest->GetAncestor(pindexTip->nHeight) == pindexTip))
+            return true;
+        condSynced.wait(lock);
+    }
+}
+
+void CBaseIndex::ChainTip(const CBlockIndex *pindex, const CBlock *pblock, ZCIncrementalMerkleTree tree, bool added)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fChainTipChanged = true;
+    condChainTip.notify_all();
+}
+
+bool CBaseIndex::Commit(CLevelDBBatch& batch, const CBlockIndex* pindex)
+{
+    // The block index is only written now and then, so after a crash the
+    // latest blocks can be unknown. Record a block as the best one only once
+    // its entry is in the database; the blocks after it are simply written
+    // again on the next start.
+    const CBlockIndex* pindexRecord = NULL;
+    {
+        LOCK(cs_main);
+        if (pindexBestOnDisk != NULL) {
+            if (pindexBestOnDisk->GetAncestor(pindex->nHeight) == pindex)
+                pindexRecord = pindex;
+            else if (pindex->GetAncestor(pindexBestOnDisk->nHeight) == pindexBestOnDisk)
+                pindexRecord = pindexBestOnDisk;
+        }
+    }
+    bool fOk = pindexRecord ? pblocktree->WriteIndexBatch(batch, strName, pindexRecord->GetBlockHash())
+                            : pblocktree->WriteBatch(batch);
+    if (!fOk)
+        return error("%s: failed to write %s", __func__, strName);
+    boost::unique_lock<boost::mutex> lock(mutex);
+    pindexBest = pindex;
+    condSynced.notify_all();
+    return true;
+}
+
+/** Compute the batch of every nStep-th block of vBlocks, starting at nStart */
+void CBaseIndex::ProcessBlocks(vector<CIndexSyncBlock>& vBlocks, size_t nStart, size_t nStep)
+{
+    for (size_t i = nStart; i < vBlocks.size(); i += nStep) {
+        boost::this_thread::interruption_point();
+        CIndexSyncBlock& b = vBlocks[i];
+        if (!b.fHaveData)
+            continue;
+        CBlock block;
+        CBlockUndo blockundo;
+        if (!ReadBlockFromDisk(block, b.pos) || (UsesUndo() && !UndoReadFromDisk(blockundo, b.undoPos, b.hashPrev))) {
+            b.fFailed = true;
+            continue;
+        }
+        if (b.fRewind)
+            b.fFailed = !RewindBlock(b.batch, block, blockundo, b.pindex);
+        else
+            b.fFailed = !WriteBlock(b.batch, block, blockundo, b.pindex);
+    }
+}
+
+void CBaseIndex::ThreadSync()
+{
+    const unsigned int nThreads = max(nScriptCheckThreads, 1);
+    int64_t nStart = GetTimeMillis();
+
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            // Only this thread changes pindexBest, so it can read it without the lock
+            vector<CIndexSyncBlock> vBlocks;
+            {
+                LOCK(cs_main);
+                if (pindexBest != NULL && !chainActive.Contains(pindexBest)) {
+                    // Step back off a branch that left the chain, one block at a time
+                    vBlocks.resize(1);
+                    vBlocks[0].pindex = pindexBest;
+                    vBlocks[0].fRewind = true;
+                } else {
+                    const CBlockIndex* pindex = pindexBest ? chainActive.Next(pindexBest) : chainActive.Genesis();
+                    for (; pindex != NULL && vBlocks.size() < INDEX_SYNC_BATCH; pindex = chainActive.Next(pindex)) {
+                        vBlocks.push_back(CIndexSyncBlock());
+                        vBlocks.back().pindex = pindex;
+                    }
+                }
+                BOOST_FOREACH(CIndexSyncBlock& b, vBlocks) {
+                    b.fHaveData = b.pindex->pprev != NULL && (b.pindex->nStatus & BLOCK_HAVE_DATA) &&
+                                  (!UsesUndo() || (b.pindex->nStatus & BLOCK_HAVE_UNDO));
+                    if (b.fHaveData) {
+                        b.pos = b.pindex->GetBlockPos();
+                        b.undoPos = b.pindex->GetUndoPos();
+                        b.hashPrev = b.pindex->pprev->GetBlockHash();
+                    }
+                }
+            }
+
+            if (vBlocks.empty()) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (!fSynced) {
+                    LogPrintf("%s: %s synced to height %d in %.2fs\n", __func__, strName,
+                              pindexBest ? pindexBest->nHeight : -1, 0.001 * (GetTimeMillis() - nStart));
+                    fSynced = true;
+                    condSynced.notify_all();
+                }
+                while (!fChainTipChanged)
+                    condChainTip.wait(lock);
+                fChainTipChanged = false;
+                continue;
+            }
+
+            // Read and index the blocks in parallel
+            unsigned int nWorkers = min<size_t>(nThreads, vBlocks.size());
+            if (nWorkers == 1) {
+                ProcessBlocks(vBlocks, 0, 1);
+            } else {
+                boost::thread_group workers;
+                try {
+                    for (unsigned int i = 0; i < nWorkers; i++)
+                        workers.create_thread(boost::bind(&CBaseIndex::ProcessBlocks, this, boost::ref(vBlocks), i, nWorkers));
+                    workers.join_all();
+                } catch (const boost::thread_interrupted&) {
+                    workers.interrupt_all();
+                    workers.join_all();
+                    throw;
+                }
+            }
+
+            // The entries of a batch are written before its last block is recorded
+            // as the best one, so a crash in between only makes the next run write
+            // them again
+            bool fOk = true;
+            for (size_t i = 0; i < vBlocks.size() && fOk; i++) {
+                CIndexSyncBlock& b = vBlocks[i];
+                if (b.fFailed) {
+                    LogPrintf("%s: failed to index block %s, stopping %s\n", __func__, b.pindex->GetBlockHash().ToString(), strName);
+                    fOk = false;
+                } else if (b.fRewind) {
+                    fOk = Commit(b.batch, b.pindex->pprev);
+                } else if (i + 1 == vBlocks.size()) {
+                    fOk = Commit(b.batch, b.pindex);
+                } else {
+                    fOk = pblocktree->WriteBatch(b.batch);
+                }
+            }
+            if (!fOk)
+                break;
+            if (!vBlocks.back().fRewind && vBlocks.front().pindex->nHeight / 10000 != vBlocks.back().pindex->nHeight / 10000)
+                LogPrintf("%s: %s at height %d\n", __func__, strName, vBlocks.back().pindex->nHeight);
+        }
+    } catch (const boost::thread_interrupted&) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStopped = true;
+        condSynced.notify_all();
+        throw;
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fStopped = true;
+    condSynced.notify_all();
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BASEINDEX_H
+#define BITCOIN_BASEINDEX_H
+
+#include "validationinterface.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+class CBlockUndo;
+class CLevelDBBatch;
+struct CIndexSyncBlock;
+
+/**
+ * Base of the optional indexes kept in the block tree database, such as the
+ * transaction index. An index is not updated while blocks are connected: it
+ * records the block it is synced to, and a thread of its own reads the
+ * blocks it is missing back from the block files, both to catch up with the
+ * chain when it is enabled on an existing node and to follow the tip from
+ * then on. An index can therefore be enabled, disabled or rebuilt without
+ * reindexing the chain state, and costs nothing to ConnectBlock.
+ */
+class CBaseIndex : public CValidationInterface
+{
+private:
+    std::string strName;
+    boost::thread threadSync;
+
+    //! Guards the fields below, which the sync thread updates
+    mutable boost::mutex mutex;
+    mutable boost::condition_variable condSynced;
+    boost::condition_variable condChainTip;
+    const CBlockIndex* pindexBest;      //!< Last block the index covers, NULL for none
+    bool fSynced;                       //!< Whether the index caught up with the chain once
+    bool fStopped;                      //!< Whether the sync thread stopped, on an error or at shutdown
+    bool fChainTipChanged;
+
+    void ThreadSync();
+    void ProcessBlocks(std::vector<CIndexSyncBlock>& vBlocks, size_t nStart, size_t nStep);
+    bool Commit(CLevelDBBatch& batch, const CBlockIndex* pindex);
+
+protected:
+    CBaseIndex(const std::string& strNameIn);
+
+    /**
+     * Add the entries of a block to the index, as a batch of database writes.
+     * Blocks are processed several at a time, so this may be called from
+     * several threads at once. Writing the same block twice must be harmless.
+     */
+    virtual bool WriteBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex) = 0;
+
+    /**
+     * Add the removal of the entries of a block that left the chain. Entries
+     * that stay correct, like where a transaction is on disk, can be left.
+     */
+    virtual bool RewindBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex) { return true; }
+
+    //! Whether WriteBlock and RewindBlock need the undo data of blocks
+    virtual bool UsesUndo() const { return false; }
+
+    //! Remove all entries of the index from the database
+    virtual bool Wipe() = 0;
+
+    void ChainTip(const CBlockIndex *pindex, const CBlock *pblock, ZCIncrementalMerkleTree tree, bool added);
+
+public:
+    virtual ~CBaseIndex();
+
+    const std::string& GetName() const { return strName; }
+
+    /**
+     * Load the block the index is synced to, and start following the chain.
+     * If that block is unknown, the index is rebuilt. Call once the block
+     * index is loaded.
+     */
+    virtual bool Start();
+
+    //! Stop following the chain
+    void Stop();
+
+    //! Remove the index from the database, when it was disabled
+    virtual bool Remove();
+
+    //! Whether the index caught up with the chain once, so it can be queried
+    bool IsSynced() const;
+
+    /**
+     * Wait until the index covers the current chain tip, so that queries see
+     * the blocks already connected. Returns false if the index is still
+     * catching up or stopped on an error. Must not be called with cs_main held.
+     */
+    bool BlockUntilSyncedToCurrentChain() const;
+};
+
+#endif // BITCOIN_BASEINDEX_H
@@ -6,6 +6,7 @@
 #include "chainparamsbase.h"
 #include "clientversion.h"
 #include "rpcclient.h"
+#include "rpcjson.h"
 #include "rpcprotocol.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -143,7 +144,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ParseJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -0,0 +1,208 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+
+#include <limits>
+
+class CTxMemPool;
+
+/**
+ * Compact block relay.
+ *
+ * A compact block ("cmpctblock") carries a block's header, a 6-byte short ID
+ * for each of its transactions and, in full, the transactions the receiver
+ * cannot have yet (the coinbase). Short IDs are SipHash-2-4 of the txid,
+ * keyed with a hash of the header and a random nonce so that they differ
+ * between announcements and collisions cannot be mined in advance.
+ *
+ * The receiver rebuilds the block from its mempool and requests whatever is
+ * missing by index with "getblocktxn", answered by "blocktxn". The block is
+ * then validated as if it had been received in full.
+ */
+
+/** The transactions of a block a peer asks for by index (getblocktxn) */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    //! Absolute indexes, differentially encoded on the wire
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        uint64_t indexes_size = (uint64_t)indexes.size();
+        READWRITE(COMPACTSIZE(indexes_size));
+        if (ser_action.ForRead()) {
+            // Grow as data actually arrives rather than trusting the count
+            size_t i = 0;
+            while (indexes.size() < indexes_size) {
+                indexes.resize(std::min((uint64_t)(1000 + indexes.size()), indexes_size));
+                for (; i < indexes.size(); i++) {
+                    uint64_t index = 0;
+                    READWRITE(COMPACTSIZE(index));
+                    if (index > std::numeric_limits<uint16_t>::max())
+                        throw std::ios_base::failure("index overflowed 16 bits");
+                    indexes[i] = index;
+                }
+            }
+
+            uint16_t offset = 0;
+            for (size_t j = 0; j < indexes.size(); j++) {
+                if (uint64_t(indexes[j]) + uint64_t(offset) > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("indexes overflowed 16 bits");
+                indexes[j] = indexes[j] + offset;
+                offset = indexes[j] + 1;
+            }
+        } else {
+            for (size_t i = 0; i < indexes.size(); i++) {
+                uint64_t index = indexes[i] - (i == 0 ? 0 : (indexes[i - 1] + 1));
+                READWRITE(COMPACTSIZE(index));
+            }
+        }
+    }
+};
+
+/** The transactions requested with getblocktxn, in the order asked for (blocktxn) */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) :
+        blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full as part of a compact block */
+struct PrefilledTransaction
+{
+    //! Differentially encoded: the number of transactions since the previous
+    //! prefilled one
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        uint64_t idx = index;
+        READWRITE(COMPACTSIZE(idx));
+        if (idx > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = idx;
+        READWRITE(tx);
+    }
+};
+
+typedef enum ReadStatus_t
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //! Invalid object, peer is sending bogus data
+    READ_STATUS_FAILED, //! Failed to process object, e.g. a short ID collision
+} ReadStatus;
+
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(header);
+        READWRITE(nonce);
+
+        uint64_t shorttxids_size = (uint64_t)shorttxids.size();
+        READWRITE(COMPACTSIZE(shorttxids_size));
+        if (ser_action.ForRead()) {
+            size_t i = 0;
+            while (shorttxids.size() < shorttxids_size) {
+                shorttxids.resize(std::min((uint64_t)(1000 + shorttxids.size()), shorttxids_size));
+                for (; i < shorttxids.size(); i++) {
+                    uint32_t lsb = 0; uint16_t msb = 0;
+                    READWRITE(lsb);
+                    READWRITE(msb);
+                    shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+                }
+            }
+        } else {
+            for (size_t i = 0; i < shorttxids.size(); i++) {
+                uint32_t lsb = shorttxids[i] & 0xffffffff;
+                uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+                READWRITE(lsb);
+                READWRITE(msb);
+            }
+        }
+
+        READWRITE(prefilledtxn);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** A block being rebuilt from a compact block and the mempool */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> have_txn;
+    size_t prefilled_count, mempool_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), pool(poolIn) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    //! Number of transactions that still have to be requested from the peer
+    size_t MissingTxCount() const { return txn_available.size() - prefilled_count - mempool_count; }
+    //! Assemble the block from what is available and vtx_missing, which
+    //! must hold exactly the missing transactions in order
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
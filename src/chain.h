@@ -92,6 +92,10 @@ enum BlockStatus {
     BLOCK_FAILED_VALID       =   32, //! stage after last reached validness failed
     BLOCK_FAILED_CHILD       =   64, //! descends from failed block
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
+
+    //! Only TREE valid, but part of the chain below a trusted chain state
+    //! snapshot, whose transactions are assumed valid without being checked
+    BLOCK_ASSUMED_VALID      =  128,
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -261,6 +265,15 @@ public:
         return ((nStatus & BLOCK_VALID_MASK) >= nUpTo);
     }
 
+    //! Check whether this block index entry is valid up to the passed validity
+    //! level, or is assumed to be because it lies below a chain state snapshot.
+    bool IsValidOrAssumed(enum BlockStatus nUpTo = BLOCK_VALID_TRANSACTIONS) const
+    {
+        if (nStatus & BLOCK_FAILED_MASK)
+            return false;
+        return (nStatus & BLOCK_ASSUMED_VALID) || IsValid(nUpTo);
+    }
+
     //! Raise the validity level of this block index entry.
     //! Returns true if the validity was changed.
     bool RaiseValidity(enum BlockStatus nUpTo)
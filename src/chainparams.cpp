@@ -139,6 +139,10 @@ public:
             5083   // * estimated number of transactions per day after checkpoint
         };
 
+        // No chain state snapshot is trusted until the history below one can
+        // be validated in the background; see -loadsnapshot.
+        mapSnapshots.clear();
+
         // Founders reward script expects a vector of 2-of-3 multisig addresses
         vFoundersRewardAddress = {
             "t3Vz22vK5z2LcKEdg16Yv4FFneEL1zg9ojd", /* main-index: 0*/
@@ -12,6 +12,7 @@
 #include "primitives/block.h"
 #include "protocol.h"
 
+#include <map>
 #include <vector>
 
 struct CDNSSeedData {
@@ -24,6 +25,17 @@ struct SeedSpec6 {
     uint16_t port;
 };
 
+/** A chain state snapshot this release trusts -loadsnapshot to load */
+struct CSnapshotData {
+    uint256 hashBlock;
+    //! gettxoutsetinfo's hash_serialized of the chain state at hashBlock
+    uint256 hashSerialized;
+    //! dumpchainstate's hash_shielded: the best anchor, anchor trees and nullifiers
+    uint256 hashShielded;
+};
+
+typedef std::map<int, CSnapshotData> MapSnapshots;
+
 
 /**
  * CChainParams defines various tweakable parameters of a given instance of the
@@ -78,12 +90,16 @@ public:
     const std::vector<unsigned char>& Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const Checkpoints::CCheckpointData& Checkpoints() const { return checkpointData; }
+    /** Chain state snapshots that may be loaded, by height */
+    const MapSnapshots& Snapshots() const { return mapSnapshots; }
     /** Return the founder's reward address and script for a given block height */
     std::string GetFoundersRewardAddressAtHeight(int height) const;
     CScript GetFoundersRewardScriptAtHeight(int height) const;
     std::string GetFoundersRewardAddressAtIndex(int i) const;
     /** Enforce coinbase consensus rule in regtest mode */
     void SetRegTestCoinbaseMustBeProtected() { consensus.fCoinbaseMustBeProtected = true; }
+    /** Replace the trusted chain state snapshots, for unit tests */
+    void SetSnapshots(const MapSnapshots &snapshots) { mapSnapshots = snapshots; }
 protected:
     CChainParams() {}
 
@@ -110,6 +126,7 @@ protected:
     bool fMineBlocksOnDemand = false;
     bool fTestnetToBeDeprecatedFieldRPC = false;
     Checkpoints::CCheckpointData checkpointData;
+    MapSnapshots mapSnapshots;
     std::vector<std::string> vFoundersRewardAddress;
 };
 
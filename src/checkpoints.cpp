@@ -34,7 +34,7 @@ namespace Checkpoints {
     }
 
     //! Guess how far we are in the verification process at the given block index
-    double GuessVerificationProgress(const CCheckpointData& data, CBlockIndex *pindex, bool fSigchecks) {
+    double GuessVerificationProgress(const CCheckpointData& data, const CBlockIndex *pindex, bool fSigchecks) {
         if (pindex==NULL)
             return 0.0;
 
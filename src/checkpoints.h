@@ -35,7 +35,7 @@ int GetTotalBlocksEstimate(const CCheckpointData& data);
 //! Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
 CBlockIndex* GetLastCheckpoint(const CCheckpointData& data);
 
-double GuessVerificationProgress(const CCheckpointData& data, CBlockIndex* pindex, bool fSigchecks = true);
+double GuessVerificationProgress(const CCheckpointData& data, const CBlockIndex* pindex, bool fSigchecks = true);
 
 } //namespace Checkpoints
 
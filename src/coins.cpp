@@ -52,6 +52,7 @@ bool CCoinsView::BatchWrite(CCoinsMap &mapCoins,
                             CAnchorsMap &mapAnchors,
                             CNullifiersMap &mapNullifiers) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
+bool CCoinsView::Traverse(CCoinsViewVisitor &visitor) const { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
@@ -69,6 +70,7 @@ bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins,
                                   CAnchorsMap &mapAnchors,
                                   CNullifiersMap &mapNullifiers) { return base->BatchWrite(mapCoins, hashBlock, hashAnchor, mapAnchors, mapNullifiers); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
+bool CCoinsViewBacked::Traverse(CCoinsViewVisitor &visitor) const { return base->Traverse(visitor); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
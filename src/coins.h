@@ -339,6 +339,21 @@ struct CCoinsStats
 };
 
 
+/** Receives the whole content of a CCoinsView, see CCoinsView::Traverse */
+class CCoinsViewVisitor
+{
+public:
+    //! Called first, with the best block and anchor the rest of the walk reflects
+    virtual bool VisitBest(const uint256 &hashBlock, const uint256 &hashAnchor) = 0;
+    //! Called for every anchor in ascending order of roots, then every nullifier in ascending order
+    virtual bool VisitAnchor(const uint256 &rt, const ZCIncrementalMerkleTree &tree) = 0;
+    virtual bool VisitNullifier(const uint256 &nullifier) = 0;
+    //! Called last, for every unspent transaction in ascending txid order
+    virtual bool VisitCoins(const uint256 &txid, const CCoins &coins) = 0;
+
+    virtual ~CCoinsViewVisitor() {}
+};
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -373,6 +388,10 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const;
 
+    //! Feed a consistent copy of the persisted view to visitor. Stops and
+    //! returns false as soon as a visitor call does, or if unsupported.
+    virtual bool Traverse(CCoinsViewVisitor &visitor) const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -399,6 +418,7 @@ public:
                     CAnchorsMap &mapAnchors,
                     CNullifiersMap &mapNullifiers);
     bool GetStats(CCoinsStats &stats) const;
+    bool Traverse(CCoinsViewVisitor &visitor) const;
 };
 
 
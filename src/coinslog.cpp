@@ -0,0 +1,641 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinslog.h"
+
+#include "hash.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+//! Starts a record that completes a write
+static const char LOG_MAGIC[4] = {'Z', 'C', 'L', 'G'};
+//! Starts a record of a write that continues in the next record
+static const char LOG_MAGIC_PARTIAL[4] = {'Z', 'C', 'L', 'P'};
+//! Magic and payload size
+static const uint64_t RECORD_HEADER_SIZE = sizeof(LOG_MAGIC) + sizeof(uint32_t);
+
+//! Upper bound on a single record, to reject garbage lengths when replaying
+static const uint32_t MAX_RECORD_SIZE = 0x20000000;
+
+//! Writes are split into records once they grow past this size
+static const size_t RECORD_SPLIT_SIZE = 16 << 20;
+
+//! Never rewrite the snapshot for logs smaller than this
+static const uint64_t MIN_COMPACT_LOG_SIZE = 64 << 20;
+
+//! Coins are bucketed by the first byte of their txid
+static const int COINS_LOG_BUCKETS = 256;
+static const int COINS_LOG_BUCKETS_PER_SHARD = COINS_LOG_BUCKETS / COINS_STATS_SHARDS;
+
+static inline int CoinsLogBucket(const uint256& txid)
+{
+    return *txid.begin();
+}
+
+namespace {
+
+/**
+ * Collects changes to the state and serializes them as records, in the
+ * format ApplyRecord reads: the best block and anchor, then the coins, the
+ * anchors and the nullifiers, each section prefixed with its count.
+ */
+class CRecordBuilder
+{
+private:
+    CDataStream ssCoins;
+    CDataStream ssAnchors;
+    CDataStream ssNullifiers;
+    uint64_t nCoins;
+    uint64_t nAnchors;
+    uint64_t nNullifiers;
+
+public:
+    CRecordBuilder() : ssCoins(SER_DISK, CLIENT_VERSION), ssAnchors(SER_DISK, CLIENT_VERSION), ssNullifiers(SER_DISK, CLIENT_VERSION),
+                       nCoins(0), nAnchors(0), nNullifiers(0) {}
+
+    void AddCoins(const uint256& txid, const CCoins& coins)
+    {
+        bool fErase = coins.IsPruned();
+        ssCoins << txid << fErase;
+        if (!fErase)
+            ssCoins << coins;
+        nCoins++;
+    }
+
+    void AddAnchor(const uint256& root, bool fErase, const ZCIncrementalMerkleTree& tree)
+    {
+        ssAnchors << root << fErase;
+        if (!fErase)
+            ssAnchors << tree;
+        nAnchors++;
+    }
+
+    void AddNullifier(const uint256& nf, bool fSpent)
+    {
+        ssNullifiers << nf << fSpent;
+        nNullifiers++;
+    }
+
+    //! Whether the changes collected so far should go in a record of their own
+    bool Full() const
+    {
+        return ssCoins.size() + ssAnchors.size() + ssNullifiers.size() >= RECORD_SPLIT_SIZE;
+    }
+
+    //! Move the changes collected so far into ssRecord; null hashes leave the best block and anchor alone
+    void Take(CDataStream& ssRecord, const uint256& hashBlock, const uint256& hashAnchor)
+    {
+        ssRecord.clear();
+        ssRecord << hashBlock << hashAnchor;
+        WriteCompactSize(ssRecord, nCoins);
+        ssRecord += ssCoins;
+        WriteCompactSize(ssRecord, nAnchors);
+        ssRecord += ssAnchors;
+        WriteCompactSize(ssRecord, nNullifiers);
+        ssRecord += ssNullifiers;
+        ssCoins.clear();
+        ssAnchors.clear();
+        ssNullifiers.clear();
+        nCoins = nAnchors = nNullifiers = 0;
+    }
+};
+
+} // anon namespace
+
+/**
+ * A consistent read of the coins: from its start until it ends, BatchWrite
+ * keeps the values coins had at the start for the buckets not yet copied by
+ * CopyBucketForRead. Only one read runs at a time.
+ */
+class CCoinsViewLog::CConsistentRead
+{
+private:
+    const CCoinsViewLog& view;
+    CCriticalBlock lockRead;
+
+public:
+    uint256 hashBlock;
+    uint256 hashAnchor;
+
+    CConsistentRead(const CCoinsViewLog& viewIn,
+                    vector<pair<uint256, ZCIncrementalMerkleTree> >* pvAnchors = NULL,
+                    vector<uint256>* pvNullifiers = NULL) :
+        view(viewIn), lockRead(viewIn.csRead, "csRead", __FILE__, __LINE__)
+    {
+        LOCK(view.cs);
+        view.fReading = true;
+        view.vBucketRead.assign(COINS_LOG_BUCKETS, false);
+        hashBlock = view.hashBestBlock;
+        hashAnchor = view.hashBestAnchor;
+        if (pvAnchors)
+            pvAnchors->assign(view.mapAnchors.begin(), view.mapAnchors.end());
+        if (pvNullifiers)
+            pvNullifiers->assign(view.setNullifiers.begin(), view.setNullifiers.end());
+    }
+
+    ~CConsistentRead()
+    {
+        LOCK(view.cs);
+        view.fReading = false;
+        for (int i = 0; i < COINS_LOG_BUCKETS; i++)
+            view.vReadPreimages[i].clear();
+    }
+};
+
+CCoinsViewLog::CCoinsViewLog(const boost::filesystem::path& path, bool fMemoryIn, bool fWipe) :
+    pathDir(path), fMemory(fMemoryIn), vCoins(COINS_LOG_BUCKETS), fileLog(NULL), nLogSize(0), nSnapshotSize(0),
+    fReading(false), vReadPreimages(COINS_LOG_BUCKETS)
+{
+    hashBestAnchor = ZCIncrementalMerkleTree::empty_root();
+    if (fMemory)
+        return;
+
+    if (fWipe) {
+        LogPrintf("Wiping chain state log in %s\n", pathDir.string());
+        boost::filesystem::remove_all(pathDir);
+    }
+    TryCreateDirectory(pathDir);
+
+    LogPrintf("Loading chain state log from %s\n", pathDir.string());
+    int64_t nStart = GetTimeMillis();
+    if (!LoadFile(pathDir / "snapshot.dat", false, nSnapshotSize))
+        throw runtime_error("CCoinsViewLog: corrupt chain state snapshot");
+    if (!LoadFile(pathDir / "log.dat", true, nLogSize))
+        throw runtime_error("CCoinsViewLog: corrupt chain state log");
+
+    fileLog = fopen((pathDir / "log.dat").string().c_str(), "ab");
+    if (!fileLog)
+        throw runtime_error("CCoinsViewLog: unable to open chain state log for writing");
+    LogPrintf("Loaded %u coins, %u anchors and %u nullifiers in %dms\n",
+        CoinsCount(), mapAnchors.size(), setNullifiers.size(), GetTimeMillis() - nStart);
+}
+
+CCoinsViewLog::~CCoinsViewLog()
+{
+    if (fileLog) {
+        fclose(fileLog);
+        fileLog = NULL;
+    }
+}
+
+bool CCoinsViewLog::ApplyRecord(CDataStream& ssRecord)
+{
+    uint256 hashBlock, hashAnchor;
+    ssRecord >> hashBlock >> hashAnchor;
+
+    uint64_t nCoins = ReadCompactSize(ssRecord);
+    for (uint64_t i = 0; i < nCoins; i++) {
+        uint256 txid;
+        bool fErase;
+        ssRecord >> txid >> fErase;
+        SaveReadPreimage(txid);
+        CoinsTable& bucket = vCoins[CoinsLogBucket(txid)];
+        if (fErase) {
+            bucket.erase(txid);
+        } else {
+            ssRecord >> bucket[txid];
+        }
+    }
+
+    uint64_t nAnchors = ReadCompactSize(ssRecord);
+    for (uint64_t i = 0; i < nAnchors; i++) {
+        uint256 root;
+        bool fErase;
+        ssRecord >> root >> fErase;
+        if (fErase) {
+            mapAnchors.erase(root);
+        } else {
+            ssRecord >> mapAnchors[root];
+        }
+    }
+
+    uint64_t nNullifiers = ReadCompactSize(ssRecord);
+    for (uint64_t i = 0; i < nNullifiers; i++) {
+        uint256 nf;
+        bool fSpent;
+        ssRecord >> nf >> fSpent;
+        if (fSpent)
+            setNullifiers.insert(nf);
+        else
+            setNullifiers.erase(nf);
+    }
+
+    if (!hashBlock.IsNull())
+        hashBestBlock = hashBlock;
+    if (!hashAnchor.IsNull())
+        hashBestAnchor = hashAnchor;
+    return ssRecord.empty();
+}
+
+size_t CCoinsViewLog::CoinsCount() const
+{
+    size_t nCount = 0;
+    for (int i = 0; i < COINS_LOG_BUCKETS; i++)
+        nCount += vCoins[i].size();
+    return nCount;
+}
+
+void CCoinsViewLog::SaveReadPreimage(const uint256& txid)
+{
+    if (!fReading)
+        return;
+    int nBucket = CoinsLogBucket(txid);
+    if (vBucketRead[nBucket] || vReadPreimages[nBucket].count(txid))
+        return;
+    CoinsTable::const_iterator it = vCoins[nBucket].find(txid);
+    vReadPreimages[nBucket][txid] = (it == vCoins[nBucket].end()) ? CCoins() : it->second;
+}
+
+void CCoinsViewLog::CopyBucketForRead(int nBucket, vector<pair<uint256, CCoins> >& vCoinsRet) const
+{
+    vCoinsRet.clear();
+    LOCK(cs);
+    assert(fReading && !vBucketRead[nBucket]);
+    const CoinsTable& bucket = vCoins[nBucket];
+    CoinsTable& preimages = vReadPreimages[nBucket];
+    vCoinsRet.reserve(bucket.size() + preimages.size());
+    for (CoinsTable::const_iterator it = bucket.begin(); it != bucket.end(); it++) {
+        if (!preimages.count(it->first))
+            vCoinsRet.push_back(*it);
+    }
+    for (CoinsTable::const_iterator it = preimages.begin(); it != preimages.end(); it++) {
+        if (!it->second.IsPruned())
+            vCoinsRet.push_back(*it);
+    }
+    preimages.clear();
+    vBucketRead[nBucket] = true;
+}
+
+bool CCoinsViewLog::LoadFile(const boost::filesystem::path& path, bool fTruncateTail, uint64_t& nSizeRet)
+{
+    nSizeRet = 0;
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return true;
+    const uint64_t nFileSize = boost::filesystem::file_size(path);
+
+    // Records of a write are only applied once its last record was read
+    vector<CDataStream> vPending;
+    uint64_t nPendingSize = 0;
+    // Set when the file ends in the middle of a write
+    bool fTorn = false;
+    bool fOk = true;
+    while (true) {
+        boost::this_thread::interruption_point();
+        const uint64_t nOffset = nSizeRet + nPendingSize;
+        if (nOffset == nFileSize) {
+            fTorn = !vPending.empty();
+            break;
+        }
+        if (nFileSize - nOffset < RECORD_HEADER_SIZE) {
+            fTorn = true;
+            break;
+        }
+        char pchMagic[4];
+        uint32_t nSize;
+        if (fread(pchMagic, 1, sizeof(pchMagic), file) != sizeof(pchMagic) ||
+            fread(&nSize, 1, sizeof(nSize), file) != sizeof(nSize)) {
+            fOk = error("%s: read failed at offset %u of %s", __func__, nOffset, path.string());
+            break;
+        }
+        bool fPartial = memcmp(pchMagic, LOG_MAGIC_PARTIAL, sizeof(LOG_MAGIC_PARTIAL)) == 0;
+        if (!fPartial && memcmp(pchMagic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) {
+            fOk = error("%s: bad record header at offset %u of %s", __func__, nOffset, path.string());
+            break;
+        }
+        nSize = le32toh(nSize);
+        const uint64_t nRecordSize = RECORD_HEADER_SIZE + nSize + 32;
+        if (nRecordSize > nFileSize - nOffset) {
+            // Runs past the end of the file: the append never completed
+            fTorn = true;
+            break;
+        }
+        if (nSize > MAX_RECORD_SIZE) {
+            fOk = error("%s: oversized record at offset %u of %s", __func__, nOffset, path.string());
+            break;
+        }
+        vPending.push_back(CDataStream(SER_DISK, CLIENT_VERSION));
+        CDataStream& ssRecord = vPending.back();
+        ssRecord.resize(nSize);
+        uint256 hashChecksum;
+        if ((nSize > 0 && fread(&ssRecord[0], 1, nSize, file) != nSize) ||
+            fread(hashChecksum.begin(), 1, 32, file) != 32) {
+            fOk = error("%s: read failed at offset %u of %s", __func__, nOffset, path.string());
+            break;
+        }
+        if (Hash(ssRecord.begin(), ssRecord.end()) != hashChecksum) {
+            // Only the last record can be one whose data didn't all reach
+            // the disk before a crash; anywhere else this is corruption.
+            if (nOffset + nRecordSize == nFileSize) {
+                vPending.pop_back();
+                fTorn = true;
+            } else {
+                fOk = error("%s: checksum mismatch at offset %u of %s", __func__, nOffset, path.string());
+            }
+            break;
+        }
+        nPendingSize += nRecordSize;
+        if (fPartial)
+            continue;
+
+        try {
+            for (size_t i = 0; fOk && i < vPending.size(); i++) {
+                if (!ApplyRecord(vPending[i]))
+                    fOk = error("%s: malformed record before offset %u of %s", __func__, nOffset + nRecordSize, path.string());
+            }
+        } catch (const std::exception& e) {
+            fOk = error("%s: deserialize error in %s: %s", __func__, path.string(), e.what());
+        }
+        if (!fOk)
+            break;
+        vPending.clear();
+        nSizeRet += nPendingSize;
+        nPendingSize = 0;
+    }
+    fclose(file);
+
+    if (fOk && fTorn) {
+        if (!fTruncateTail)
+            return error("%s: %s is incomplete", __func__, path.string());
+        // A write that was under way when we went down; everything before
+        // it was synced and has been applied.
+        LogPrintf("%s: discarding incomplete write at offset %u of %s\n", __func__, nSizeRet, path.string());
+        boost::filesystem::resize_file(path, nSizeRet);
+    }
+    return fOk;
+}
+
+bool CCoinsViewLog::AppendRecord(FILE* file, const CDataStream& ssRecord, bool fPartial, uint64_t& nSizeRet)
+{
+    if (ssRecord.size() > MAX_RECORD_SIZE)
+        return error("%s: record of %u bytes is too large", __func__, ssRecord.size());
+    uint32_t nSize = htole32(ssRecord.size());
+    uint256 hashChecksum = Hash(ssRecord.begin(), ssRecord.end());
+    const char* pchMagic = fPartial ? LOG_MAGIC_PARTIAL : LOG_MAGIC;
+    if (fwrite(pchMagic, 1, sizeof(LOG_MAGIC), file) != sizeof(LOG_MAGIC) ||
+        fwrite(&nSize, 1, sizeof(nSize), file) != sizeof(nSize) ||
+        (ssRecord.size() > 0 && fwrite(&ssRecord[0], 1, ssRecord.size(), file) != ssRecord.size()) ||
+        fwrite(hashChecksum.begin(), 1, 32, file) != 32)
+        return error("%s: write failed", __func__);
+    nSizeRet += RECORD_HEADER_SIZE + ssRecord.size() + 32;
+    return true;
+}
+
+bool CCoinsViewLog::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree) const {
+    if (rt == ZCIncrementalMerkleTree::empty_root()) {
+        ZCIncrementalMerkleTree new_tree;
+        tree = new_tree;
+        return true;
+    }
+
+    LOCK(cs);
+    AnchorsTable::const_iterator it = mapAnchors.find(rt);
+    if (it == mapAnchors.end())
+        return false;
+    tree = it->second;
+    return true;
+}
+
+bool CCoinsViewLog::GetNullifier(const uint256 &nf) const {
+    LOCK(cs);
+    return setNullifiers.count(nf) > 0;
+}
+
+bool CCoinsViewLog::GetCoins(const uint256 &txid, CCoins &coins) const {
+    LOCK(cs);
+    const CoinsTable& bucket = vCoins[CoinsLogBucket(txid)];
+    CoinsTable::const_iterator it = bucket.find(txid);
+    if (it == bucket.end())
+        return false;
+    coins = it->second;
+    return true;
+}
+
+bool CCoinsViewLog::HaveCoins(const uint256 &txid) const {
+    LOCK(cs);
+    return vCoins[CoinsLogBucket(txid)].count(txid) > 0;
+}
+
+uint256 CCoinsViewLog::GetBestBlock() const {
+    LOCK(cs);
+    return hashBestBlock;
+}
+
+uint256 CCoinsViewLog::GetBestAnchor() const {
+    LOCK(cs);
+    return hashBestAnchor;
+}
+
+bool CCoinsViewLog::BatchWrite(CCoinsMap &mapCoinsIn,
+                               const uint256 &hashBlock,
+                               const uint256 &hashAnchor,
+                               CAnchorsMap &mapAnchorsIn,
+                               CNullifiersMap &mapNullifiersIn) {
+    // A large write is split into records below MAX_RECORD_SIZE; only its
+    // last record commits it, so it is replayed in full or not at all.
+    vector<CDataStream> vRecords;
+    CRecordBuilder builder;
+
+    size_t count = 0;
+    size_t changed = 0;
+    for (CCoinsMap::iterator it = mapCoinsIn.begin(); it != mapCoinsIn.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            builder.AddCoins(it->first, it->second.coins);
+            changed++;
+        }
+        count++;
+        if (builder.Full()) {
+            vRecords.push_back(CDataStream(SER_DISK, CLIENT_VERSION));
+            builder.Take(vRecords.back(), uint256(), uint256());
+        }
+    }
+
+    for (CAnchorsMap::iterator it = mapAnchorsIn.begin(); it != mapAnchorsIn.end(); it++) {
+        if (it->second.flags & CAnchorsCacheEntry::DIRTY)
+            builder.AddAnchor(it->first, !it->second.entered, it->second.tree);
+    }
+
+    for (CNullifiersMap::iterator it = mapNullifiersIn.begin(); it != mapNullifiersIn.end(); it++) {
+        if (it->second.flags & CNullifiersCacheEntry::DIRTY)
+            builder.AddNullifier(it->first, it->second.entered);
+    }
+    vRecords.push_back(CDataStream(SER_DISK, CLIENT_VERSION));
+    builder.Take(vRecords.back(), hashBlock, hashAnchor);
+
+    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin log in %u records...\n",
+        (unsigned int)changed, (unsigned int)count, (unsigned int)vRecords.size());
+
+    LOCK(cs);
+    if (fileLog) {
+        for (size_t i = 0; i < vRecords.size(); i++) {
+            if (!AppendRecord(fileLog, vRecords[i], i + 1 < vRecords.size(), nLogSize))
+                return false;
+        }
+        if (fflush(fileLog) != 0)
+            return error("%s: fflush failed", __func__);
+        FileCommit(fileLog);
+    }
+
+    for (size_t i = 0; i < vRecords.size(); i++) {
+        if (!ApplyRecord(vRecords[i]))
+            return error("%s: failed to apply record", __func__);
+    }
+    mapCoinsIn.clear();
+    mapAnchorsIn.clear();
+    mapNullifiersIn.clear();
+
+    if (fileLog && nLogSize > std::max(nSnapshotSize, MIN_COMPACT_LOG_SIZE))
+        return WriteSnapshot();
+    return true;
+}
+
+bool CCoinsViewLog::WriteSnapshot()
+{
+    AssertLockHeld(cs);
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathTmp = pathDir / "snapshot.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("%s: unable to create %s", __func__, pathTmp.string());
+
+    uint64_t nSize = 0;
+    bool fOk = true;
+
+    // The snapshot is replaced as a whole, so its records need not commit
+    // together: each is complete on its own, and the last one carries the
+    // best block and anchor.
+    CRecordBuilder builder;
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    for (AnchorsTable::const_iterator it = mapAnchors.begin(); fOk && it != mapAnchors.end(); it++) {
+        builder.AddAnchor(it->first, false, it->second);
+        if (builder.Full()) {
+            builder.Take(ssRecord, uint256(), uint256());
+            fOk = AppendRecord(file, ssRecord, false, nSize);
+        }
+    }
+    for (NullifiersTable::const_iterator it = setNullifiers.begin(); fOk && it != setNullifiers.end(); it++) {
+        builder.AddNullifier(*it, true);
+        if (builder.Full()) {
+            builder.Take(ssRecord, uint256(), uint256());
+            fOk = AppendRecord(file, ssRecord, false, nSize);
+        }
+    }
+    for (int nBucket = 0; fOk && nBucket < COINS_LOG_BUCKETS; nBucket++) {
+        for (CoinsTable::const_iterator it = vCoins[nBucket].begin(); fOk && it != vCoins[nBucket].end(); it++) {
+            builder.AddCoins(it->first, it->second);
+            if (builder.Full()) {
+                builder.Take(ssRecord, uint256(), uint256());
+                fOk = AppendRecord(file, ssRecord, false, nSize);
+            }
+        }
+    }
+    if (fOk) {
+        builder.Take(ssRecord, hashBestBlock, hashBestAnchor);
+        fOk = AppendRecord(file, ssRecord, false, nSize);
+    }
+
+    if (fOk && fflush(file) != 0)
+        fOk = false;
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, pathDir / "snapshot.dat"))
+        return error("%s: unable to write %s", __func__, pathTmp.string());
+
+    // Replaying the old log over the new snapshot would be harmless (it
+    // only restates values the snapshot already holds), so a crash before
+    // this truncation is safe.
+    if (!TruncateFile(fileLog, 0))
+        return error("%s: unable to truncate log", __func__);
+    FileCommit(fileLog);
+    nSnapshotSize = nSize;
+    nLogSize = 0;
+    LogPrint("coindb", "Wrote %u byte chain state snapshot in %dms\n", nSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CCoinsViewLog::Compact()
+{
+    LOCK(cs);
+    if (!fileLog)
+        return true;
+    return WriteSnapshot();
+}
+
+static bool CoinsEntryTxidLess(const pair<uint256, CCoins>& a, const pair<uint256, CCoins>& b)
+{
+    return a.first < b.first;
+}
+
+static bool AnchorEntryRootLess(const pair<uint256, ZCIncrementalMerkleTree>& a, const pair<uint256, ZCIncrementalMerkleTree>& b)
+{
+    return a.first < b.first;
+}
+
+bool CCoinsViewLog::GetStatsShard(int nShard, CCoinsStats &stats, CHashWriter &ss) const
+{
+    // Hash in the same order as the LevelDB backend iterates its keys so
+    // both backends report the same hash_serialized: buckets are txid
+    // ranges, each is sorted on its own.
+    vector<pair<uint256, CCoins> > vBucket;
+    for (int nBucket = nShard * COINS_LOG_BUCKETS_PER_SHARD; nBucket < (nShard + 1) * COINS_LOG_BUCKETS_PER_SHARD; nBucket++) {
+        CopyBucketForRead(nBucket, vBucket);
+        sort(vBucket.begin(), vBucket.end(), CoinsEntryTxidLess);
+        for (vector<pair<uint256, CCoins> >::const_iterator it = vBucket.begin(); it != vBucket.end(); it++) {
+            boost::this_thread::interruption_point();
+            ApplyCoinsStats(stats, ss, it->first, it->second, ::GetSerializeSize(it->second, SER_DISK, CLIENT_VERSION));
+        }
+    }
+    return true;
+}
+
+bool CCoinsViewLog::GetStats(CCoinsStats &stats) const {
+    // Writers only wait while a bucket is copied, not for the hashing; the
+    // copies held at any time are one bucket per hashing thread.
+    CConsistentRead read(*this);
+    stats.hashBlock = read.hashBlock;
+    return ComputeCoinsStats(stats, boost::bind(&CCoinsViewLog::GetStatsShard, this, _1, _2, _3));
+}
+
+bool CCoinsViewLog::Traverse(CCoinsViewVisitor &visitor) const {
+    // Visit a consistent read of the state one bucket at a time, without
+    // holding cs while visiting, so blocks keep being connected while a
+    // snapshot is written. The visitor may also take cs_main, which
+    // BatchWrite callers hold.
+    vector<pair<uint256, ZCIncrementalMerkleTree> > vAnchors;
+    vector<uint256> vNullifiers;
+    CConsistentRead read(*this, &vAnchors, &vNullifiers);
+    sort(vAnchors.begin(), vAnchors.end(), AnchorEntryRootLess);
+    sort(vNullifiers.begin(), vNullifiers.end());
+
+    if (!visitor.VisitBest(read.hashBlock, read.hashAnchor))
+        return false;
+    for (vector<pair<uint256, ZCIncrementalMerkleTree> >::const_iterator it = vAnchors.begin(); it != vAnchors.end(); it++) {
+        if (!visitor.VisitAnchor(it->first, it->second))
+            return false;
+    }
+    for (vector<uint256>::const_iterator it = vNullifiers.begin(); it != vNullifiers.end(); it++) {
+        if (!visitor.VisitNullifier(*it))
+            return false;
+    }
+    vector<pair<uint256, CCoins> > vBucket;
+    for (int nBucket = 0; nBucket < COINS_LOG_BUCKETS; nBucket++) {
+        CopyBucketForRead(nBucket, vBucket);
+        sort(vBucket.begin(), vBucket.end(), CoinsEntryTxidLess);
+        for (vector<pair<uint256, CCoins> >::const_iterator it = vBucket.begin(); it != vBucket.end(); it++) {
+            if (!visitor.VisitCoins(it->first, it->second))
+                return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,115 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSLOG_H
+#define BITCOIN_COINSLOG_H
+
+#include "coins.h"
+#include "sync.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+class CDataStream;
+class CHashWriter;
+
+/**
+ * CCoinsView that keeps the whole chain state (coins, nullifiers and anchors)
+ * in hash tables in memory, for nodes with enough RAM to hold it.
+ *
+ * Durability comes from an append-only log: every BatchWrite appends its
+ * changes as checksummed records, split to stay below the record size limit,
+ * and syncs them before returning; the last record of a write commits it. On
+ * startup the newest snapshot is loaded and the log replayed on top of it. A
+ * write torn at the end of the log (from a crash mid-append) is discarded as
+ * a whole; a damaged record anywhere else is corruption and fails the load. Once the log grows
+ * past the size of the snapshot the state is rewritten as a fresh snapshot,
+ * so there is never any background compaction work.
+ *
+ * The coins are kept in buckets by the first byte of their txid, so that
+ * GetStats and Traverse can read a consistent state bucket by bucket without
+ * holding the lock for the whole read: while a read is under way, BatchWrite
+ * saves the old value of every coin it changes in a bucket the read has not
+ * copied yet, and the read puts those values back in its copy.
+ *
+ * Selected with -chainstatebackend=memory. Data lives in chainstate-log/.
+ */
+class CCoinsViewLog : public CCoinsView
+{
+private:
+    typedef boost::unordered_map<uint256, CCoins, CCoinsKeyHasher> CoinsTable;
+    typedef boost::unordered_map<uint256, ZCIncrementalMerkleTree, CCoinsKeyHasher> AnchorsTable;
+    typedef boost::unordered_set<uint256, CCoinsKeyHasher> NullifiersTable;
+
+    boost::filesystem::path pathDir;
+    bool fMemory;
+
+    mutable CCriticalSection cs;
+    //! coins, in COINS_LOG_BUCKETS buckets by the first byte of the txid
+    std::vector<CoinsTable> vCoins;
+    AnchorsTable mapAnchors;
+    NullifiersTable setNullifiers;
+    uint256 hashBestBlock;
+    uint256 hashBestAnchor;
+
+    //! log being appended to (NULL when running purely in memory)
+    FILE* fileLog;
+    //! bytes of valid records in the log
+    uint64_t nLogSize;
+    //! bytes in the current snapshot
+    uint64_t nSnapshotSize;
+
+    //! serializes consistent reads of the coins
+    mutable CCriticalSection csRead;
+    //! set while a consistent read is under way
+    mutable bool fReading;
+    //! buckets the read has copied already
+    mutable std::vector<bool> vBucketRead;
+    //! per bucket, the values coins changed since the read started had when
+    //! it started (pruned for coins that didn't exist then)
+    mutable std::vector<CoinsTable> vReadPreimages;
+
+    class CConsistentRead;
+
+    size_t CoinsCount() const;
+    void SaveReadPreimage(const uint256& txid);
+    void CopyBucketForRead(int nBucket, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const;
+    bool GetStatsShard(int nShard, CCoinsStats &stats, CHashWriter &ss) const;
+
+    bool ApplyRecord(CDataStream& ssRecord);
+    bool LoadFile(const boost::filesystem::path& path, bool fTruncateTail, uint64_t& nSizeRet);
+    bool AppendRecord(FILE* file, const CDataStream& ssRecord, bool fPartial, uint64_t& nSizeRet);
+    bool WriteSnapshot();
+
+    CCoinsViewLog(const CCoinsViewLog&);
+    void operator=(const CCoinsViewLog&);
+
+public:
+    CCoinsViewLog(const boost::filesystem::path& path, bool fMemoryIn = false, bool fWipe = false);
+    ~CCoinsViewLog();
+
+    bool GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree) const;
+    bool GetNullifier(const uint256 &nf) const;
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    uint256 GetBestAnchor() const;
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashAnchor,
+                    CAnchorsMap &mapAnchors,
+                    CNullifiersMap &mapNullifiers);
+    bool GetStats(CCoinsStats &stats) const;
+    bool Traverse(CCoinsViewVisitor &visitor) const;
+
+    //! Rewrite the snapshot from memory and empty the log
+    bool Compact();
+};
+
+#endif // BITCOIN_COINSLOG_H
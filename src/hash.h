@@ -161,6 +161,9 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4 of a 256-bit value with the 128-bit key (k0, k1) */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
 #endif // BITCOIN_HASH_H
@@ -9,9 +9,11 @@
 
 #include "init.h"
 #include "crypto/common.h"
+#include "addressindex.h"
 #include "addrman.h"
 #include "amount.h"
 #include "checkpoints.h"
+#include "coinslog.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
 #include "key.h"
@@ -22,7 +24,9 @@
 #include "rpcserver.h"
 #include "script/standard.h"
 #include "scheduler.h"
+#include "snapshot.h"
 #include "txdb.h"
+#include "txindex.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -142,9 +146,35 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
+static CCoinsView *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 
+/** Start an optional index, or remove what is left of it if it is disabled */
+template <typename Index>
+static bool InitIndex(Index*& pindexer, bool fEnabled)
+{
+    Index* pnew = new Index();
+    if (fEnabled ? !pnew->Start() : !pnew->Remove()) {
+        delete pnew;
+        return false;
+    }
+    if (fEnabled)
+        pindexer = pnew;
+    else
+        delete pnew;
+    return true;
+}
+
+template <typename Index>
+static void StopIndex(Index*& pindexer)
+{
+    if (pindexer) {
+        pindexer->Stop();
+        delete pindexer;
+        pindexer = NULL;
+    }
+}
+
 void Shutdown()
 {
     LogPrintf("%s: In progress...\n", __func__);
@@ -167,6 +197,9 @@ void Shutdown()
 #endif
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
+    StopIndex(ptxindex);
+    StopIndex(paddressindex);
+    StopIndex(pspentindex);
 
     if (fFeeEstimatesInitialized)
     {
@@ -276,9 +309,11 @@ std::string HelpMessage(HelpMessageMode mode)
 
     string strUsage = HelpMessageGroup(_("Options:"));
     strUsage += HelpMessageOpt("-?", _("This help message"));
+    strUsage += HelpMessageOpt("-addressindex", strprintf(_("Maintain an index of the transactions paying and spending each address, used by the getaddress* rpc calls (default: %u)"), DEFAULT_ADDRESSINDEX));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
+    strUsage += HelpMessageOpt("-chainstatebackend=<name>", strprintf(_("Store the chain state in LevelDB (leveldb) or in memory, persisted through an append-only log (memory). Changing this requires -reindex (default: %s)"), DEFAULT_CHAINSTATE_BACKEND));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), "zcash.conf"));
@@ -290,8 +325,21 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    if (showDebug)
+    {
+        strUsage += HelpMessageOpt("-dbblockcache=<n>", strprintf("Percentage of each database's cache used for the LevelDB block cache (default: %u)", CLevelDBOptions().nBlockCachePercent));
+        strUsage += HelpMessageOpt("-dbblocksize=<n>", strprintf("Size of LevelDB data blocks in KiB (default: %u)", CLevelDBOptions().nBlockSize / 1024));
+        strUsage += HelpMessageOpt("-dbbloombits=<n>", strprintf("Bloom filter bits per key, 0 to disable (default: %u)", CLevelDBOptions().nBloomFilterBits));
+        strUsage += HelpMessageOpt("-dbcompression", strprintf("Compress LevelDB data blocks (default: %u)", CLevelDBOptions().fCompression));
+        strUsage += HelpMessageOpt("-dbmaxopenfiles=<n>", strprintf("Number of table files each LevelDB database may keep open (default: %u)", CLevelDBOptions().nMaxOpenFiles));
+        strUsage += HelpMessageOpt("-dbwritebuffer=<n>", strprintf("Percentage of each database's cache used per write buffer; larger buffers mean fewer, bigger compactions (default: %u)", CLevelDBOptions().nWriteBufferPercent));
+        strUsage += HelpMessageOpt("-<name>db<option>", "Apply one of the -db<option> settings above to a single database only, where <name> is chainstate, anchors or blockindex (e.g. -chainstatedbmaxopenfiles=500)");
+    }
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-loadsnapshot=<file>", _("Bootstrap an empty data directory from a chain state snapshot written by dumpchainstate. Only snapshots pinned by this release are accepted"));
+    strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (0 = no expiry, default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphansize=<n>", strprintf(_("Keep unconnectable transactions in memory below <n> kilobytes (default: %u)"), DEFAULT_MAX_ORPHAN_SIZE));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
@@ -301,10 +349,11 @@ std::string HelpMessage(HelpMessageMode mode)
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files on startup"));
+    strUsage += HelpMessageOpt("-spentindex", strprintf(_("Maintain an index of where each output was spent, used by the getspentinfo rpc call (default: %u)"), DEFAULT_SPENTINDEX));
 #if !defined(WIN32)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
-    strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -318,6 +367,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-externalip=<ip>", _("Specify your own public address"));
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
+    strUsage += HelpMessageOpt("-msghandlers=<n>", strprintf(_("Number of threads processing peer messages (1 to %d, 0 = auto, default: %d)"), MAX_MESSAGE_HANDLER_THREADS, DEFAULT_MESSAGE_HANDLER_THREADS));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
@@ -328,6 +378,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), 1));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Wait for socket events with <mode>: select or epoll, which has no limit on the number of connections (default: %s)"), DEFAULT_SOCKETEVENTS));
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -343,11 +394,13 @@ std::string HelpMessage(HelpMessageMode mode)
 #ifdef ENABLE_WALLET
     strUsage += HelpMessageGroup(_("Wallet options:"));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
+    strUsage += HelpMessageOpt("-joinsplitproofthreads=<n>", strprintf(_("Number of independent JoinSplit proofs of one z_sendmany to compute concurrently (default: %u)"), DEFAULT_JOINSPLIT_PROOF_THREADS));
     strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), 100));
     if (showDebug)
         strUsage += HelpMessageOpt("-mintxfee=<amt>", strprintf("Fees (in BTC/Kb) smaller than this are considered zero fee for transaction creation (default: %s)",
             FormatMoney(CWallet::minTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in BTC/kB) to add to transactions you send (default: %s)"), FormatMoney(payTxFee.GetFeePerK())));
+    strUsage += HelpMessageOpt("-preloadprovingkey", strprintf(_("Load the proving key in the background at startup, so the first shielded send doesn't wait for it (default: %u)"), 0));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the blockchain for missing wallet transactions") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), 0));
@@ -393,7 +446,7 @@ std::string HelpMessage(HelpMessageMode mode)
     {
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", 0));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> entries (default: %u)", 50000));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (up to %u, default: %u)", MAX_MAX_SIG_CACHE_SIZE, DEFAULT_MAX_SIG_CACHE_SIZE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in BTC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-printtoconsole", _("Send trace/debug info to console instead of debug.log file"));
@@ -424,14 +477,15 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-rpcpassword=<pw>", _("Password for JSON-RPC connections"));
     strUsage += HelpMessageOpt("-rpcport=<port>", strprintf(_("Listen for JSON-RPC connections on <port> (default: %u or testnet: %u)"), 8232, 18232));
     strUsage += HelpMessageOpt("-rpcallowip=<ip>", _("Allow JSON-RPC connections from specified source. Valid for <ip> are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24). This option can be specified multiple times"));
-    strUsage += HelpMessageOpt("-rpcthreads=<n>", strprintf(_("Set the number of threads to service RPC calls (default: %d)"), 4));
-
-    // TODO #1856: Re-enable support for persistent connections.
-    // Disabled to avoid rpc deadlock #1680, until we backport upstream changes which replace boost::asio with libevent, or another solution is implemented.
-    //strUsage += HelpMessageOpt("-rpckeepalive", strprintf(_("RPC support for HTTP persistent connections (default: %d)"), 1));
+    strUsage += HelpMessageOpt("-rpcthreads=<n>", strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_RPC_THREADS));
+    strUsage += HelpMessageOpt("-rpckeepalive", strprintf(_("RPC support for HTTP persistent connections (default: %d)"), 1));
+    strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf(_("Timeout during HTTP requests and for idle connections, in seconds (default: %d)"), DEFAULT_RPC_SERVER_TIMEOUT));
+    strUsage += HelpMessageOpt("-rpcworkqueue=<n>", strprintf(_("Set the depth of the work queue to service RPC calls; requests beyond it are answered with 503 (default: %d)"), DEFAULT_RPC_WORK_QUEUE));
 
-    // Disabled until we can lock notes and also tune performance of libsnark which by default uses multiple threads
-    //strUsage += HelpMessageOpt("-rpcasyncthreads=<n>", strprintf(_("Set the number of threads to service Async RPC calls (default: %d)"), 1));
+    strUsage += HelpMessageOpt("-rpcasyncthreads=<n>", strprintf(_("Set the number of threads to service Async RPC calls (default: %d)"), 1));
+    strUsage += HelpMessageOpt("-rpcasyncmaxthreads=<n>", strprintf(_("Start more Async RPC threads, up to <n>, while operations are waiting (default: %d)"), 1));
+    strUsage += HelpMessageOpt("-rpcasyncoperationttl=<n>", strprintf(_("Forget finished Async RPC operations after <n> seconds, 0 to keep them until their result is fetched (default: %d)"), 24 * 60 * 60));
+    strUsage += HelpMessageOpt("-rpcasyncprovingthreads=<n>", strprintf(_("Set the number of Async RPC operations computing proofs at once; each needs several GB of memory and notes are not locked between them (default: %d)"), 1));
 
     strUsage += HelpMessageGroup(_("RPC SSL options: (see the Bitcoin Wiki for SSL setup instructions)"));
     strUsage += HelpMessageOpt("-rpcssl", _("Use OpenSSL (https) for JSON-RPC connections"));
@@ -635,6 +689,28 @@ static void ZC_LoadParams()
     pzcashParams->setProvingKeyPath(pk_path.string());
 }
 
+static void ThreadPreloadProvingKey()
+{
+    RenameThread("zcash-pkload");
+
+    struct timeval tv_start, tv_end;
+    float elapsed;
+
+    LogPrintf("Preloading proving key\n");
+    gettimeofday(&tv_start, 0);
+
+    try {
+        pzcashParams->loadProvingKey();
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to preload proving key: %s\n", e.what());
+        return;
+    }
+
+    gettimeofday(&tv_end, 0);
+    elapsed = float(tv_end.tv_sec-tv_start.tv_sec) + (tv_end.tv_usec-tv_start.tv_usec)/float(1000000);
+    LogPrintf("Loaded proving key in %fs seconds.\n", elapsed);
+}
+
 /** Initialize bitcoin.
  *  @pre Parameters should be parsed and config file should be read.
  */
@@ -772,18 +848,39 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    std::string strSocketEvents = GetArg("-socketevents", DEFAULT_SOCKETEVENTS);
+    if (strSocketEvents == "epoll") {
+#ifdef HAVE_SYS_EPOLL_H
+        fSocketEventsEpoll = true;
+#else
+        return InitError(_("-socketevents=epoll is not supported on this platform"));
+#endif
+    } else if (strSocketEvents != "select") {
+        return InitError(strprintf(_("Unknown -socketevents mode '%s'"), strSocketEvents));
+    }
+    if (fSocketEventsEpoll)
+        nMaxConnections = std::max(nMaxConnections, 0);
+    else
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
     if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
         nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
 
+    // The indexes can't be built for blocks that were never downloaded
+    bool fIndexes = GetBoolArg("-txindex", DEFAULT_TXINDEX) || GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) ||
+                    GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    if (mapArgs.count("-loadsnapshot") && fIndexes)
+        return InitError(_("A chain state snapshot is incompatible with -txindex, -addressindex and -spentindex."));
+
     // if using block pruning, then disable txindex
     // also disable the wallet (for now, until SPV support is implemented in wallet)
     if (GetArg("-prune", 0)) {
-        if (GetBoolArg("-txindex", false))
+        if (GetBoolArg("-txindex", DEFAULT_TXINDEX))
             return InitError(_("Prune mode is incompatible with -txindex."));
+        if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) || GetBoolArg("-spentindex", DEFAULT_SPENTINDEX))
+            return InitError(_("Prune mode is incompatible with -addressindex and -spentindex."));
 #ifdef ENABLE_WALLET
         if (!GetBoolArg("-disablewallet", false)) {
             if (SoftSetBoolArg("-disablewallet", true))
@@ -815,6 +912,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-benchmark", false))
         InitWarning(_("Warning: Unsupported argument -benchmark ignored, use -debug=bench."));
 
+    // -maxsigcachesize used to be a number of entries, now it is in MiB
+    if (GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) > MAX_MAX_SIG_CACHE_SIZE)
+        InitWarning(strprintf(_("Warning: -maxsigcachesize is a size in MiB, limiting the signature cache to %u MiB."), MAX_MAX_SIG_CACHE_SIZE));
+
     // Checkmempool and checkblockindex default to true in regtest mode
     mempool.setSanityCheck(GetBoolArg("-checkmempool", chainparams.DefaultConsistencyChecks()));
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
@@ -971,8 +1072,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadProofCheck);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -995,6 +1098,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Initialize Zcash circuit parameters
     ZC_LoadParams();
 
+#ifdef ENABLE_WALLET
+    // The proving key is otherwise loaded by the first shielded send
+    if (!GetBoolArg("-disablewallet", false) && GetBoolArg("-preloadprovingkey", false))
+        threadGroup.create_thread(&ThreadPreloadProvingKey);
+#endif
+
     /* Start the RPC server already.  It will be started in "warmup" mode
      * and not really process calls already (but it will signify connections
      * that the server is there and will be ready later).  Warmup mode will
@@ -1160,12 +1269,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    std::string strChainstateBackend = GetArg("-chainstatebackend", DEFAULT_CHAINSTATE_BACKEND);
+    if (strChainstateBackend != "leveldb" && strChainstateBackend != "memory")
+        return InitError(strprintf(_("Unknown -chainstatebackend: '%s'"), strChainstateBackend));
+
     // cache size calculations
     int64_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greated than nMaxDbcache
     int64_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", DEFAULT_TXINDEX))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
@@ -1173,7 +1286,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
-    LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for chain state database (including %.1fMiB for anchors)\n", nCoinDBCache * (1.0 / 1024 / 1024), nCoinDBCache / nAnchorDbCacheDivisor * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
     bool fLoaded = false;
@@ -1193,10 +1306,24 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                if (strChainstateBackend == "memory")
+                    pcoinsdbview = new CCoinsViewLog(GetDataDir() / "chainstate-log", false, fReindex);
+                else
+                    pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                if (mapArgs.count("-loadsnapshot") && !fReindex) {
+                    if (!pcoinsdbview->GetBestBlock().IsNull()) {
+                        LogPrintf("Chain state already exists, ignoring -loadsnapshot\n");
+                    } else {
+                        uiInterface.InitMessage(_("Loading chain state snapshot..."));
+                        std::string strSnapshotError;
+                        if (!LoadChainStateSnapshot(pcoinsdbview, GetArg("-loadsnapshot", ""), strSnapshotError))
+                            return InitError(strprintf(_("Unable to load chain state snapshot: %s"), strSnapshotError));
+                    }
+                }
+
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1220,15 +1347,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
-                // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
-                    break;
-                }
-
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
-                if (fHavePruned && !fPruneMode) {
+                if (fHavePruned && !fPruneMode && !fHaveSnapshot) {
                     strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
                     break;
                 }
@@ -1441,6 +1562,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             uiInterface.InitMessage(_("Pruning blockstore..."));
             PruneAndFlush();
         }
+    } else if (fHaveSnapshot) {
+        if (fIndexes)
+            return InitError(_("A chain state snapshot is incompatible with -txindex, -addressindex and -spentindex."));
+        LogPrintf("Unsetting NODE_NETWORK, chain state was loaded from a snapshot\n");
+        nLocalServices &= ~NODE_NETWORK;
     }
 
     // ********************************************************* Step 10: import blocks
@@ -1461,6 +1587,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+
+    // Start the optional indexes, which catch up with the chain in the background
+    if (!InitIndex(ptxindex, GetBoolArg("-txindex", DEFAULT_TXINDEX)) ||
+        !InitIndex(paddressindex, GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) ||
+        !InitIndex(pspentindex, GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)))
+        return InitError(_("Error initializing the block chain indexes"));
     if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
         while (!fRequestShutdown && chainActive.Tip() == NULL)
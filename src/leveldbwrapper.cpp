@@ -27,14 +27,39 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+static void ApplyArgsWithPrefix(CLevelDBOptions& tuning, const std::string& strPrefix)
+{
+    tuning.nBlockCachePercent = GetArg(strPrefix + "blockcache", tuning.nBlockCachePercent);
+    tuning.nWriteBufferPercent = GetArg(strPrefix + "writebuffer", tuning.nWriteBufferPercent);
+    tuning.nBlockSize = GetArg(strPrefix + "blocksize", tuning.nBlockSize / 1024) * 1024;
+    tuning.nMaxOpenFiles = GetArg(strPrefix + "maxopenfiles", tuning.nMaxOpenFiles);
+    tuning.nBloomFilterBits = GetArg(strPrefix + "bloombits", tuning.nBloomFilterBits);
+    tuning.fCompression = GetBoolArg(strPrefix + "compression", tuning.fCompression);
+}
+
+void CLevelDBOptions::ApplyArgs(const std::string& strName)
+{
+    ApplyArgsWithPrefix(*this, "-db");
+    ApplyArgsWithPrefix(*this, "-" + strName + "db");
+
+    // Keep the knobs within ranges LevelDB copes with; up to two write
+    // buffers may be held in memory simultaneously.
+    nBlockCachePercent = std::max(0, std::min(nBlockCachePercent, 100));
+    nWriteBufferPercent = std::max(1, std::min(nWriteBufferPercent, (100 - nBlockCachePercent) / 2));
+    nBlockSize = std::max(nBlockSize, (size_t)1024);
+    nMaxOpenFiles = std::max(nMaxOpenFiles, 16);
+    nBloomFilterBits = std::max(0, std::min(nBloomFilterBits, 32));
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBOptions& tuning)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.block_cache = leveldb::NewLRUCache(std::max(nCacheSize / 100 * tuning.nBlockCachePercent, (size_t)(8 << 10)));
+    options.write_buffer_size = std::max(nCacheSize / 100 * tuning.nWriteBufferPercent, (size_t)(64 << 10)); // up to two write buffers may be held in memory simultaneously
+    options.filter_policy = tuning.nBloomFilterBits > 0 ? leveldb::NewBloomFilterPolicy(tuning.nBloomFilterBits) : NULL;
+    options.compression = tuning.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.block_size = tuning.nBlockSize;
+    options.max_open_files = tuning.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -43,14 +68,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBOptions& tuning)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, tuning);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -63,6 +88,8 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
         }
         TryCreateDirectory(path);
         LogPrintf("Opening LevelDB in %s\n", path.string());
+        LogPrint("coindb", "LevelDB options: cache=%u block=%u buffer=%u open_files=%d bloom=%d compression=%d\n",
+            nCacheSize, options.block_size, options.write_buffer_size, options.max_open_files, tuning.nBloomFilterBits, tuning.fCompression);
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
@@ -24,6 +24,40 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(leveldb_error);
 
+/** Per-database tuning knobs for a CLevelDBWrapper. The defaults reproduce
+ *  the settings every database used before they became configurable. */
+struct CLevelDBOptions
+{
+    //! share of the cache budget used for LevelDB's block cache (percent)
+    int nBlockCachePercent;
+    //! share of the cache budget used for each memtable (percent); a memtable
+    //! filling up is what triggers a flush and level-0 compaction
+    int nWriteBufferPercent;
+    //! approximate size of uncompressed user data packed per block (bytes)
+    size_t nBlockSize;
+    //! number of table files LevelDB may keep open at once
+    int nMaxOpenFiles;
+    //! bloom filter bits per key (0 disables the filter)
+    int nBloomFilterBits;
+    //! compress blocks with snappy, if LevelDB was built with it
+    bool fCompression;
+
+    CLevelDBOptions() :
+        nBlockCachePercent(50),
+        nWriteBufferPercent(25),
+        nBlockSize(4096),
+        nMaxOpenFiles(64),
+        nBloomFilterBits(10),
+        fCompression(false) {}
+
+    /**
+     * Override the defaults from the command line. Node-wide -db<knob>
+     * options are applied first, then -<strName>db<knob> options for this
+     * database only (e.g. -chainstatedbmaxopenfiles=500).
+     */
+    void ApplyArgs(const std::string& strName);
+};
+
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
 {
@@ -86,19 +120,22 @@ private:
     leveldb::DB* pdb;
 
 public:
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CLevelDBOptions& tuning = CLevelDBOptions());
     ~CLevelDBWrapper();
 
+    //! Read a value, as of snapshot if one is given
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const throw(leveldb_error)
+    bool Read(const K& key, V& value, const leveldb::Snapshot* snapshot = NULL) const throw(leveldb_error)
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        options.snapshot = snapshot;
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -168,6 +205,25 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    //! Iterate over the database as it was when snapshot was taken
+    leveldb::Iterator* NewIterator(const leveldb::Snapshot* snapshot)
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot;
+        return pdb->NewIterator(options);
+    }
+
+    //! Pin the current state of the database; must be passed to ReleaseSnapshot
+    const leveldb::Snapshot* GetSnapshot()
+    {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot* snapshot)
+    {
+        pdb->ReleaseSnapshot(snapshot);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
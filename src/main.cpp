@@ -12,6 +12,7 @@
 #include "arith_uint256.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "blockencodings.h"
 #include "checkqueue.h"
 #include "consensus/validation.h"
 #include "init.h"
@@ -20,6 +21,7 @@
 #include "net.h"
 #include "pow.h"
 #include "txdb.h"
+#include "txindex.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "undo.h"
@@ -34,6 +36,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/static_assert.hpp>
 
@@ -52,14 +55,17 @@ CCriticalSection cs_main;
 BlockMap mapBlockIndex;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
+const CBlockIndex *pindexBestOnDisk = NULL;
+//! Only accessed through boost::atomic_load and boost::atomic_store
+static boost::shared_ptr<const CChainTipSnapshot> pchainTipSnapshot(new CChainTipSnapshot());
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
-bool fTxIndex = false;
 bool fHavePruned = false;
+bool fHaveSnapshot = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
@@ -77,9 +83,14 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    unsigned int nTxSize;
+    int64_t nTimeExpire;
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+//! Serialized size of all orphans, and of those from each peer
+size_t nOrphanTransactionsSize = 0;
+map<NodeId, size_t> mapOrphanTransactionsSizeByPeer;
 void EraseOrphansFor(NodeId peer);
 
 /**
@@ -187,6 +198,8 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, used for compact block reconstruction.
+        unsigned int nCompactBytes;  //! Bytes of compact block messages received so far for the reconstruction.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -250,6 +263,12 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! How fast this peer delivers the blocks we request.
+    CBlockDownloadStats download;
+    //! Whether this peer understands cmpctblock/getblocktxn/blocktxn.
+    bool fSupportsCompactBlocks;
+    //! Whether this peer wants new blocks announced with a cmpctblock instead of an inv.
+    bool fPreferHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -263,6 +282,8 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fSupportsCompactBlocks = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
@@ -325,12 +346,67 @@ void FinalizeNode(NodeId nodeid) {
     mapNodeState.erase(nodeid);
 }
 
+} // anon namespace
+
+/** Exponentially weighted moving average with a weight of 1/8 for new samples, as for TCP's SRTT. */
+static int64_t SmoothDownloadSample(int64_t nAverage, int64_t nSample)
+{
+    if (nAverage == 0)
+        return nSample;
+    return nAverage + (nSample - nAverage) / 8;
+}
+
+void UpdateBlockDownloadStats(CBlockDownloadStats& stats, int64_t nTimeRequested, bool fFirstInFlight, unsigned int nBytes, int64_t nNow)
+{
+    if (fFirstInFlight && nTimeRequested >= stats.nLastBlockReceived) {
+        // Nothing was queued ahead of this block, so its delay is a round
+        // trip plus one transfer.
+        stats.nBlockRTT = SmoothDownloadSample(stats.nBlockRTT, std::max<int64_t>(nNow - nTimeRequested, 1));
+    } else {
+        // The peer was busy with earlier blocks until the last one arrived,
+        // so the time since then is what this block alone took.
+        int64_t nServiceTime = std::max<int64_t>(nNow - std::max(nTimeRequested, stats.nLastBlockReceived), 1);
+        stats.nBlockServiceTime = SmoothDownloadSample(stats.nBlockServiceTime, nServiceTime);
+        if (nBytes > 0)
+            stats.nBlockBytesPerSecond = SmoothDownloadSample(stats.nBlockBytesPerSecond, (int64_t)nBytes * 1000000 / nServiceTime);
+    }
+    stats.nLastBlockReceived = nNow;
+    stats.nBlocksDownloaded++;
+}
+
+/**
+ * Enough blocks to cover the peer's round trip plus BLOCK_DOWNLOAD_QUEUE_TIME
+ * seconds at the rate it delivers blocks, so fast peers are kept busy while
+ * slow ones can't hold up much of the download window.
+ */
+int GetBlockDownloadWindow(const CBlockDownloadStats& stats)
+{
+    if (stats.nBlockServiceTime == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nWindow = 1 + (stats.nBlockRTT + 1000000 * BLOCK_DOWNLOAD_QUEUE_TIME) / stats.nBlockServiceTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, nWindow));
+}
+
+bool IsFasterDownloadPeer(const CBlockDownloadStats& stats, const CBlockDownloadStats& statsOther)
+{
+    if (stats.nBlockServiceTime == 0)
+        return false;
+    return statsOther.nBlockServiceTime == 0 || 2 * stats.nBlockServiceTime < statsOther.nBlockServiceTime;
+}
+
+namespace {
+
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// If the block came from the peer it was requested from (nodeFrom), its
+// size is used to update that peer's download statistics.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, unsigned int nBlockSize = 0) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom)
+            UpdateBlockDownloadStats(state->download, itInFlight->second.second->nTime,
+                                     itInFlight->second.second == state->vBlocksInFlight.begin(), nBlockSize, GetTimeMicros());
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
@@ -343,7 +419,8 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// If pit is given, it is set to the new entry in the peer's vBlocksInFlight.
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator *pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
@@ -351,12 +428,14 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
-    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
+    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams), boost::shared_ptr<PartiallyDownloadedBlock>(), 0};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    if (pit)
+        *pit = it;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -412,8 +491,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. If the download window is held up by another peer, that peer is returned in
+ *  nodeStaller and the block we are waiting for in pindexStalled. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalled) {
     if (count == 0)
         return;
 
@@ -449,6 +529,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex *pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -480,6 +561,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -490,6 +572,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -509,6 +592,10 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nDownloadWindow = GetBlockDownloadWindow(state->download);
+    stats.nBlockRTT = state->download.nBlockRTT;
+    stats.nBlockBytesPerSecond = state->download.nBlockBytesPerSecond;
+    stats.nBlocksDownloaded = state->download.nBlocksDownloaded;
     return true;
 }
 
@@ -553,6 +640,9 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
+// Orphans have all passed CheckTransaction (AcceptToMemoryPool only looks
+// for missing inputs after that), so the proofs of a shielded orphan are
+// not verified again when its inputs show up.
 bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
@@ -564,22 +654,25 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, tx.nVersion);
-    if (sz > 5000)
+    if (sz > MAX_ORPHAN_TX_SIZE)
     {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTxSize = sz;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    nOrphanTransactionsSize += sz;
+    mapOrphanTransactionsSizeByPeer[peer] += sz;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsSize);
     return true;
 }
 
@@ -597,11 +690,27 @@ void static EraseOrphanTx(uint256 hash)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    nOrphanTransactionsSize -= it->second.nTxSize;
+    map<NodeId, size_t>::iterator itPeer = mapOrphanTransactionsSizeByPeer.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanTransactionsSizeByPeer.end());
+    itPeer->second -= it->second.nTxSize;
+    if (itPeer->second == 0)
+        mapOrphanTransactionsSizeByPeer.erase(itPeer);
     mapOrphanTransactions.erase(it);
 }
 
+void static ClearOrphanTxs()
+{
+    mapOrphanTransactions.clear();
+    mapOrphanTransactionsByPrev.clear();
+    nOrphanTransactionsSize = 0;
+    mapOrphanTransactionsSizeByPeer.clear();
+}
+
 void EraseOrphansFor(NodeId peer)
 {
+    if (!mapOrphanTransactionsSizeByPeer.count(peer))
+        return;
     int nErased = 0;
     map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end())
@@ -616,11 +725,58 @@ void EraseOrphansFor(NodeId peer)
     if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
+/** Drop the oldest orphans from peer until they take at most nMaxBytes. */
+unsigned int static LimitOrphansFor(NodeId peer, size_t nMaxBytes)
+{
+    unsigned int nEvicted = 0;
+    map<NodeId, size_t>::iterator itPeer;
+    while ((itPeer = mapOrphanTransactionsSizeByPeer.find(peer)) != mapOrphanTransactionsSizeByPeer.end() &&
+           itPeer->second > nMaxBytes)
+    {
+        map<uint256, COrphanTx>::iterator itOldest = mapOrphanTransactions.end();
+        for (map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+        {
+            if (it->second.fromPeer == peer &&
+                (itOldest == mapOrphanTransactions.end() || it->second.nTimeExpire < itOldest->second.nTimeExpire))
+                itOldest = it;
+        }
+        assert(itOldest != mapOrphanTransactions.end());
+        EraseOrphanTx(itOldest->first);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+
+    // Sweep out orphans whose inputs never showed up
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
+        {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nEvicted;
+            }
+        }
+        nNextSweep = nNow + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nEvicted > 0) LogPrint("mempool", "Erased %u expired orphan tx\n", nEvicted);
+    }
+
+    // A peer going over its share of the pool loses its own oldest orphans,
+    // rather than pushing out everybody else's
+    vector<NodeId> vPeers;
+    for (map<NodeId, size_t>::iterator it = mapOrphanTransactionsSizeByPeer.begin(); it != mapOrphanTransactionsSizeByPeer.end(); ++it)
+        vPeers.push_back(it->first);
+    BOOST_FOREACH(NodeId peer, vPeers)
+        nEvicted += LimitOrphansFor(peer, nMaxOrphanBytes / ORPHAN_PEER_SHARE);
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > nMaxOrphanBytes)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -833,25 +989,95 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     return nSigOps;
 }
 
+bool CVerifiedTxCache::Get(const uint256 &txid)
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_verifiedtx);
+    return setValid.count(txid) != 0;
+}
+
+void CVerifiedTxCache::Set(const uint256 &txid)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs_verifiedtx);
+
+    while (setValid.size() >= MAX_VERIFIED_TX_CACHE_SIZE)
+    {
+        // Evict a random entry, as the signature cache does
+        std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
+        if (it == setValid.end())
+            it = setValid.begin();
+        setValid.erase(it);
+    }
+    setValid.insert(txid);
+}
+
+CVerifiedTxCache verifiedTxCache;
+
+namespace {
+
+/** Serializes use of the proof check queue, which takes one master at a time */
+boost::mutex cs_proofcheckqueue;
+
+} // anon namespace
+
+static CCheckQueue<CJoinSplitCheck> proofcheckqueue(8);
+
+void ThreadProofCheck() {
+    RenameThread("zcash-proofch");
+    proofcheckqueue.Thread();
+}
+
+bool CJoinSplitCheck::operator()() {
+    return ptx->vjoinsplit[nJoinSplit].Verify(*pzcashParams, ptx->joinSplitPubKey);
+}
+
+static bool VerifyJoinSplitProofs(const CTransaction& tx, CValidationState &state)
+{
+    if (tx.vjoinsplit.empty())
+        return true;
+
+    // Spread the proofs over the proof check threads when there is more
+    // than one, unless another thread is using the queue right now.
+    boost::unique_lock<boost::mutex> lock(cs_proofcheckqueue, boost::try_to_lock);
+    bool fParallel = nScriptCheckThreads && tx.vjoinsplit.size() > 1 && lock.owns_lock();
+
+    bool fOk = true;
+    if (fParallel) {
+        CCheckQueueControl<CJoinSplitCheck> control(&proofcheckqueue);
+        std::vector<CJoinSplitCheck> vChecks;
+        for (unsigned int i = 0; i < tx.vjoinsplit.size(); i++)
+            vChecks.push_back(CJoinSplitCheck(tx, i));
+        control.Add(vChecks);
+        fOk = control.Wait();
+    } else {
+        for (unsigned int i = 0; i < tx.vjoinsplit.size() && fOk; i++)
+            fOk = CJoinSplitCheck(tx, i)();
+    }
+
+    // Ensure that zk-SNARKs verify
+    if (!fOk)
+        return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
+                         REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+    return true;
+}
+
 bool CheckTransaction(const CTransaction& tx, CValidationState &state)
 {
+    if (!tx.vjoinsplit.empty() && verifiedTxCache.Get(tx.GetHash()))
+        return true;
+
     // Don't count coinbase transactions because mining skews the count
     if (!tx.IsCoinBase()) {
         transactionsValidated.increment();
     }
 
-    if (!CheckTransactionWithoutProofVerification(tx, state)) {
+    if (!CheckTransactionWithoutProofVerification(tx, state))
         return false;
-    } else {
-        // Ensure that zk-SNARKs verify
-        BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
-            if (!joinsplit.Verify(*pzcashParams, tx.joinSplitPubKey)) {
-                return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
-                                    REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
-            }
-        }
-        return true;
-    }
+    if (!VerifyJoinSplitProofs(tx, state))
+        return false;
+
+    if (!tx.vjoinsplit.empty())
+        verifiedTxCache.Set(tx.GetHash());
+    return true;
 }
 
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state)
@@ -1048,6 +1274,16 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+// An age of 0 disables it
+static void LimitMempoolAge(CTxMemPool& pool, unsigned long age)
+{
+    if (age > 0) {
+        int expired = pool.Expire(GetTime() - age);
+        if (expired != 0)
+            LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+    }
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectAbsurdFee)
 {
@@ -1055,6 +1291,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
+    // is it already in the memory pool?
+    uint256 hash = tx.GetHash();
+    if (pool.exists(hash))
+        return false;
+
+    // Finds the result in the verified transaction cache when the caller
+    // has already run CheckTransaction without cs_main
     if (!CheckTransaction(tx, state))
         return error("AcceptToMemoryPool: CheckTransaction failed");
 
@@ -1076,11 +1319,6 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     if (!CheckFinalTx(tx, STANDARD_LOCKTIME_VERIFY_FLAGS))
         return state.DoS(0, false, REJECT_NONSTANDARD, "non-final");
 
-    // is it already in the memory pool?
-    uint256 hash = tx.GetHash();
-    if (pool.exists(hash))
-        return false;
-
     // Check for conflicts with in-memory transactions
     {
     LOCK(pool.cs); // protect pool.mapNextTx
@@ -1240,6 +1478,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+
+        LimitMempoolAge(pool, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     }
 
     SyncWithWallets(tx, NULL);
@@ -1259,7 +1499,7 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         return true;
     }
 
-    if (fTxIndex) {
+    if (ptxindex) {
         CDiskTxPos postx;
         if (pblocktree->ReadTxIndex(hash, postx)) {
             CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
@@ -1374,6 +1614,34 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.IsNull() || pos.nPos < 8)
+        return error("ReadRawBlockFromDisk: no data for %s", pindex->ToString());
+
+    // The block is preceded by the message start and its size, see WriteBlockToDisk
+    pos.nPos -= 8;
+    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("ReadRawBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blockStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blockStart) >> nSize;
+        if (memcmp(blockStart, messageStart, MESSAGE_START_SIZE) != 0 || nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            return error("ReadRawBlockFromDisk: bad index header for %s at %s", pindex->ToString(), pos.ToString());
+        block.resize(nSize);
+        filein.read((char*)&block[0], nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 bool ReadBlockHeaderFromDisk(CBlockHeader& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
@@ -1545,7 +1813,7 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
+// Requires cs_main: message handlers on several threads update the same node state.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
@@ -1823,6 +2091,8 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
+} // anon namespace
+
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
@@ -1850,6 +2120,8 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -2138,9 +2410,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CAmount nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
 
     // Construct the incremental merkle tree at the current
@@ -2211,9 +2480,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 tree.append(note_commitment);
             }
         }
-
-        vPos.push_back(std::make_pair(tx.GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
     view.PushAnchor(tree);
@@ -2256,10 +2522,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return AbortNode(state, "Failed to write transaction index");
-
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2355,6 +2617,7 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
             if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                 return AbortNode(state, "Files to write to block index database");
             }
+            pindexBestOnDisk = chainActive.Tip();
         }
         // Finally remove any pruned files
         if (fFlushForPrune)
@@ -2397,10 +2660,36 @@ void PruneAndFlush() {
     FlushStateToDisk(state, FLUSH_STATE_NONE);
 }
 
+boost::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot()
+{
+    return boost::atomic_load(&pchainTipSnapshot);
+}
+
+/** Publish a new snapshot of chainActive's tip and of the best header. Requires cs_main. */
+static void UpdateChainTipSnapshot()
+{
+    boost::shared_ptr<CChainTipSnapshot> snapshot(new CChainTipSnapshot());
+    const CBlockIndex* pindex = chainActive.Tip();
+    if (pindex != NULL) {
+        snapshot->pindexTip = pindex;
+        snapshot->hashBestBlock = pindex->GetBlockHash();
+        snapshot->nHeight = pindex->nHeight;
+        snapshot->nTime = pindex->GetBlockTime();
+        snapshot->nBits = pindex->nBits;
+        snapshot->nNextBits = GetNextWorkRequired(pindex, NULL, Params().GetConsensus());
+        snapshot->nChainWork = pindex->nChainWork;
+        snapshot->nChainTx = pindex->nChainTx;
+    }
+    if (pindexBestHeader != NULL)
+        snapshot->nHeadersHeight = pindexBestHeader->nHeight;
+    boost::atomic_store(&pchainTipSnapshot, boost::shared_ptr<const CChainTipSnapshot>(snapshot));
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     const CChainParams& chainParams = Params();
     chainActive.SetTip(pindexNew);
+    UpdateChainTipSnapshot();
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -2741,10 +3030,23 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
             // Don't relay blocks if pruning -- could cause a peer to try to download, resulting
             // in a stalled download if the block file is pruned before the request.
             if (nLocalServices & NODE_NETWORK) {
-                LOCK(cs_vNodes);
+                // Peers that asked for it get the new tip as a cmpctblock
+                // right away instead of an inv, if we have the block at hand.
+                bool fCompact = pblock && pblock->GetHash() == hashNewTip;
+                CBlockHeaderAndShortTxIDs cmpctblock;
+                if (fCompact)
+                    cmpctblock = CBlockHeaderAndShortTxIDs(*pblock);
+                LOCK2(cs_main, cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        CNodeState *nodestate = State(pnode->GetId());
+                        if (fCompact && nodestate != NULL && nodestate->fPreferHeaderAndIDs) {
+                            pnode->AddInventoryKnown(CInv(MSG_BLOCK, hashNewTip));
+                            pnode->PushMessage("cmpctblock", cmpctblock);
+                        } else {
+                            pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                        }
+                    }
             }
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip);
@@ -2784,7 +3086,7 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
     // add it again.
     BlockMap::iterator it = mapBlockIndex.begin();
     while (it != mapBlockIndex.end()) {
-        if (it->second->IsValid(BLOCK_VALID_TRANSACTIONS) && it->second->nChainTx && !setBlockIndexCandidates.value_comp()(it->second, chainActive.Tip())) {
+        if (it->second->IsValidOrAssumed(BLOCK_VALID_TRANSACTIONS) && it->second->nChainTx && !setBlockIndexCandidates.value_comp()(it->second, chainActive.Tip())) {
             setBlockIndexCandidates.insert(it->second);
         }
         it++;
@@ -2805,7 +3107,7 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex) {
         if (!it->second->IsValid() && it->second->GetAncestor(nHeight) == pindex) {
             it->second->nStatus &= ~BLOCK_FAILED_MASK;
             setDirtyBlockIndex.insert(it->second);
-            if (it->second->IsValid(BLOCK_VALID_TRANSACTIONS) && it->second->nChainTx && setBlockIndexCandidates.value_comp()(chainActive.Tip(), it->second)) {
+            if (it->second->IsValidOrAssumed(BLOCK_VALID_TRANSACTIONS) && it->second->nChainTx && setBlockIndexCandidates.value_comp()(chainActive.Tip(), it->second)) {
                 setBlockIndexCandidates.insert(it->second);
             }
             if (it->second == pindexBestInvalid) {
@@ -2853,8 +3155,10 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
-    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
+    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork) {
         pindexBestHeader = pindexNew;
+        UpdateChainTipSnapshot();
+    }
 
     setDirtyBlockIndex.insert(pindexNew);
 
@@ -3300,14 +3604,16 @@ static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned
 }
 
 
-bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp)
+bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp, unsigned int nBytesReceived)
 {
     // Preliminary checks
     bool checked = CheckBlock(*pblock, state);
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        if (pfrom && nBytesReceived == 0)
+            nBytesReceived = ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1, nBytesReceived);
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3561,7 +3867,7 @@ bool static LoadBlockIndexDB()
                 pindex->nChainTx = pindex->nTx;
             }
         }
-        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
+        if (pindex->IsValidOrAssumed(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
@@ -3611,20 +3917,26 @@ bool static LoadBlockIndexDB()
     if (fHavePruned)
         LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
 
+    // A node bootstrapped from a snapshot is missing the same block data a
+    // pruned one is, and is treated as such.
+    pblocktree->ReadFlag("snapshot", fHaveSnapshot);
+    if (fHaveSnapshot) {
+        LogPrintf("LoadBlockIndexDB(): Chain state was loaded from a snapshot\n");
+        fHavePruned = true;
+    }
+
     // Check whether we need to continue reindexing
     bool fReindexing = false;
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
-
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    pindexBestOnDisk = chainActive.Tip();
+    UpdateChainTipSnapshot();
 
     PruneBlockIndexCandidates();
 
@@ -3670,6 +3982,11 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // Only go back as far as we have data
+            LogPrintf("VerifyDB(): block verification stopping at height %d (no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3731,9 +4048,10 @@ void UnloadBlockIndex()
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    pindexBestOnDisk = NULL;
+    UpdateChainTipSnapshot();
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    ClearOrphanTxs();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -3775,9 +4093,6 @@ bool InitBlockIndex() {
     if (chainActive.Genesis() != NULL)
         return true;
 
-    // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", false);
-    pblocktree->WriteFlag("txindex", fTxIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3956,13 +4271,15 @@ void static CheckBlockIndex()
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
     while (pindex != NULL) {
         nNodes++;
+        // Blocks below a chain state snapshot stand in for fully validated ones
+        unsigned int nValidity = (pindex->nStatus & BLOCK_ASSUMED_VALID) ? BLOCK_VALID_SCRIPTS : (pindex->nStatus & BLOCK_VALID_MASK);
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
         if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
-        if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
-        if (pindex->pprev != NULL && pindexFirstNotTransactionsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TRANSACTIONS) pindexFirstNotTransactionsValid = pindex;
-        if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
-        if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
+        if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && nValidity < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
+        if (pindex->pprev != NULL && pindexFirstNotTransactionsValid == NULL && nValidity < BLOCK_VALID_TRANSACTIONS) pindexFirstNotTransactionsValid = pindex;
+        if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && nValidity < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
+        if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && nValidity < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
 
         // Begin: actual consistency checks.
         if (pindex->pprev == NULL) {
@@ -3982,7 +4299,7 @@ void static CheckBlockIndex()
             if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
         }
         if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
-        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0)); // This is pruning-independent.
+        assert((nValidity >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0)); // This is pruning-independent.
         // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
         assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0)); // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert((pindexFirstNotTransactionsValid != NULL) == (pindex->nChainTx == 0));
@@ -3990,9 +4307,9 @@ void static CheckBlockIndex()
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork); // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight))); // The pskip pointer must point back for all but the first 2 blocks.
         assert(pindexFirstNotTreeValid == NULL); // All mapBlockIndex entries must at least be TREE valid
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TREE) assert(pindexFirstNotTreeValid == NULL); // TREE valid implies all parents are TREE valid
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_CHAIN) assert(pindexFirstNotChainValid == NULL); // CHAIN valid implies all parents are CHAIN valid
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_SCRIPTS) assert(pindexFirstNotScriptsValid == NULL); // SCRIPTS valid implies all parents are SCRIPTS valid
+        if (nValidity >= BLOCK_VALID_TREE) assert(pindexFirstNotTreeValid == NULL); // TREE valid implies all parents are TREE valid
+        if (nValidity >= BLOCK_VALID_CHAIN) assert(pindexFirstNotChainValid == NULL); // CHAIN valid implies all parents are CHAIN valid
+        if (nValidity >= BLOCK_VALID_SCRIPTS) assert(pindexFirstNotScriptsValid == NULL); // SCRIPTS valid implies all parents are SCRIPTS valid
         if (pindexFirstInvalid == NULL) {
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
@@ -4217,7 +4534,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -4248,6 +4565,15 @@ void static ProcessGetData(CNode* pfrom)
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Only recent blocks are worth reconstructing from the
+                        // peer's mempool, send older ones in full.
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -4263,7 +4589,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -4289,9 +4615,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, boost::shared_ptr<const CTransaction> >::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessage(inv.GetCommand(), *mi->second);
                         pushed = true;
                     }
                 }
@@ -4313,7 +4639,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4332,7 +4658,24 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+/** Hand a block reconstructed from a cmpctblock to validation, and punish the peer if it is invalid. */
+void static ProcessCompactBlock(CNode* pfrom, const string& strCommand, CBlock& block, unsigned int nBytesReceived)
+{
+    CValidationState state;
+    // The block was in flight from this peer, so it counts as requested.
+    ProcessNewBlock(state, pfrom, &block, true, NULL, nBytesReceived);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CNetDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
     RandAddSeedPerfmon();
@@ -4352,6 +4695,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pfrom->nVersion != 0)
         {
             pfrom->PushMessage("reject", strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 1);
             return false;
         }
@@ -4407,7 +4751,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -4470,6 +4817,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (pfrom->nVersion == 0)
     {
         // Must have a version message before anything else
+        LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 1);
         return false;
     }
@@ -4484,6 +4832,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we can relay compact blocks. Outbound peers are
+        // also asked to announce new blocks to us with a cmpctblock directly,
+        // saving the inv/getdata round trip.
+        pfrom->PushMessage("sendcmpct", !pfrom->fInbound, CMPCTBLOCKS_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fSupportsCompactBlocks = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -4497,6 +4863,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         if (vAddr.size() > 1000)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message addr size() = %u", vAddr.size());
         }
@@ -4560,6 +4927,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message inv size() = %u", vInv.size());
         }
@@ -4595,8 +4963,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        nodestate->nBlocksInFlight < GetBlockDownloadWindow(nodestate->download)) {
+                        // Peers that speak compact blocks can send the block as
+                        // short ids, which we try to fill from our mempool.
+                        if (nodestate->fSupportsCompactBlocks)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -4625,6 +4998,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message getdata size() = %u", vInv.size());
         }
@@ -4728,15 +5102,31 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // The context-free checks of a shielded transaction, joinsplit
+        // proofs and signature included, run before cs_main is taken so
+        // that block validation and other peers are not held up behind
+        // them. AcceptToMemoryPool then finds it in the verified
+        // transaction cache. A transaction we already have, or rejected,
+        // is not verified again.
+        CValidationState state;
+        bool fCheckedOk = true;
+        if (!tx.vjoinsplit.empty()) {
+            bool fAlreadyHave;
+            {
+                LOCK(cs_main);
+                fAlreadyHave = AlreadyHave(inv);
+            }
+            fCheckedOk = fAlreadyHave || CheckTransaction(tx, state);
+        }
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
-        CValidationState state;
 
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        if (fCheckedOk && !AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
@@ -4801,14 +5191,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             BOOST_FOREACH(uint256 hash, vEraseQueue)
                 EraseOrphanTx(hash);
         }
-        // TODO: currently, prohibit joinsplits from entering mapOrphans
-        else if (fMissingInputs && tx.vjoinsplit.size() == 0)
+        else if (fMissingInputs)
         {
             AddOrphanTx(tx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanSize = (size_t)std::max((int64_t)0, GetArg("-maxorphansize", DEFAULT_MAX_ORPHAN_SIZE)) * 1000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanSize);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else {
@@ -4855,6 +5245,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
         unsigned int nCount = ReadCompactSize(vRecv);
         if (nCount > MAX_HEADERS_RESULTS) {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("headers message size = %u", nCount);
         }
@@ -4902,6 +5293,198 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CheckBlockIndex();
     }
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        unsigned int nCompactBytes = 0;
+
+        {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect to anything we know, ask for the headers in between
+            // instead of rejecting the header as an orphan.
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received in cmpctblock from peer=%d", pfrom->id);
+            }
+        }
+        assert(pindex);
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        LogPrint("net", "received cmpctblock %s peer=%d\n", pindex->GetBlockHash().ToString(), pfrom->id);
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = itInFlight != mapBlocksInFlight.end();
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || pindex->nHeight > chainActive.Height() + 2) {
+            // Either we know something better, or the block is too far ahead
+            // for our mempool to be of much help. If we asked this peer for
+            // the block, ask again for the full block.
+            if (fAlreadyInFlight && itInFlight->second.first == pfrom->GetId()) {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                pfrom->PushMessage("getdata", vInv);
+            }
+            return true;
+        }
+
+        list<QueuedBlock>::iterator itQueued;
+        if (fAlreadyInFlight) {
+            // Only reconstruct blocks we asked this peer for; blocks in
+            // flight from elsewhere will arrive there.
+            if (itInFlight->second.first != pfrom->GetId())
+                return true;
+            itQueued = itInFlight->second.second;
+            if (itQueued->partialBlock) {
+                LogPrint("net", "peer=%d sent us a cmpctblock we are already reconstructing\n", pfrom->id);
+                return true;
+            }
+        } else {
+            // An unsolicited announcement. Only take it on when we are close
+            // to the tip and the peer has room in its download queue.
+            if (chainActive.Tip()->GetBlockTime() <= GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 ||
+                nodestate->nBlocksInFlight >= GetBlockDownloadWindow(nodestate->download))
+                return true;
+            MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &itQueued);
+        }
+
+        itQueued->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+        itQueued->nCompactBytes = ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION);
+        nCompactBytes = itQueued->nCompactBytes;
+        PartiallyDownloadedBlock& partialBlock = *itQueued->partialBlock;
+        ReadStatus status = partialBlock.InitData(cmpctblock);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(pindex->GetBlockHash());
+            Misbehaving(pfrom->GetId(), 100);
+            return error("invalid cmpctblock received from peer=%d", pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // Short id collision; the block stays in flight, just fetch all of it.
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+            pfrom->PushMessage("getdata", vInv);
+            return true;
+        }
+
+        BlockTransactionsRequest req;
+        for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+            if (!partialBlock.IsTxAvailable(i))
+                req.indexes.push_back(i);
+        }
+        if (req.indexes.empty()) {
+            status = partialBlock.FillBlock(block, vector<CTransaction>());
+            if (status == READ_STATUS_OK) {
+                fBlockReconstructed = true;
+            } else {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                pfrom->PushMessage("getdata", vInv);
+            }
+        } else {
+            req.blockhash = pindex->GetBlockHash();
+            pfrom->PushMessage("getblocktxn", req);
+        }
+        } // cs_main
+
+        if (fBlockReconstructed)
+            ProcessCompactBlock(pfrom, strCommand, block, nCompactBytes);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (!chainActive.Contains(mi->second) || mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Old blocks are served in full through the normal getdata path,
+            // so a peer cannot make us do expensive disk reads for the price
+            // of a small response.
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block more than %d deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getblocktxn with out-of-bounds tx indexes from peer=%d", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        unsigned int nCompactBytes = 0;
+
+        {
+        LOCK(cs_main);
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+        if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId() ||
+            !itInFlight->second.second->partialBlock) {
+            LogPrint("net", "peer=%d sent us block transactions for a block we weren't expecting\n", pfrom->id);
+            return true;
+        }
+
+        ReadStatus status = itInFlight->second.second->partialBlock->FillBlock(block, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("invalid blocktxn received from peer=%d", pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // Most likely a short id collision with a mempool transaction,
+            // fall back to fetching the whole block.
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+            pfrom->PushMessage("getdata", vInv);
+        } else {
+            fBlockReconstructed = true;
+            nCompactBytes = itInFlight->second.second->nCompactBytes + ::GetSerializeSize(resp, SER_NETWORK, PROTOCOL_VERSION);
+        }
+        } // cs_main
+
+        if (fBlockReconstructed)
+            ProcessCompactBlock(pfrom, strCommand, block, nCompactBytes);
+    }
+
+
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
@@ -4947,7 +5530,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addr);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5084,6 +5670,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 // This isn't a Misbehaving(100) (immediate ban) because the
                 // peer might be an older or different implementation with
                 // a different signature key, etc.
+                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), 10);
             }
         }
@@ -5096,8 +5683,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> filter;
 
         if (!filter.IsWithinSizeConstraints())
+        {
             // There is no excuse for sending a too-large filter
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
+        }
         else
         {
             LOCK(pfrom->cs_filter);
@@ -5116,15 +5706,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
         // and thus, the maximum size any matched object can have) in a filteradd message
+        bool bad = false;
         if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
         {
-            Misbehaving(pfrom->GetId(), 100);
+            bad = true;
         } else {
             LOCK(pfrom->cs_filter);
             if (pfrom->pfilter)
                 pfrom->pfilter->insert(vData);
             else
-                Misbehaving(pfrom->GetId(), 100);
+                bad = true;
+        }
+        if (bad) {
+            // Not under cs_filter, which is taken after cs_main elsewhere
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 100);
         }
     }
 
@@ -5240,7 +5836,7 @@ bool ProcessMessages(CNode* pfrom)
         unsigned int nMessageSize = hdr.nMessageSize;
 
         // Checksum
-        CDataStream& vRecv = msg.vRecv;
+        CNetDataStream& vRecv = msg.vRecv;
         uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
         if (nChecksum != hdr.nChecksum)
@@ -5347,8 +5943,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addr);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5362,25 +5960,28 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            // Other message handler threads push addresses to this node, so
+            // the batches are built under cs_addr and sent after.
+            vector<vector<CAddress> > vvAddr(1);
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_addr);
+                vvAddr.back().reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        // receiver rejects addr messages larger than 1000
+                        if (vvAddr.back().size() >= 1000)
+                            vvAddr.push_back(vector<CAddress>());
+                        vvAddr.back().push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            BOOST_FOREACH(const vector<CAddress>& vAddr, vvAddr)
+                if (!vAddr.empty())
+                    pto->PushMessage("addr", vAddr);
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -5429,53 +6030,54 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        int64_t nNow = GetTimeMicros();
+        vector<CInv> vInvRelay;
+        if (pto->nNextInvSend < nNow || pto->fWhitelisted) {
+            // Relayed transactions are announced to each peer in batches at
+            // random intervals, so the order in which peers learn about a
+            // transaction says little about where it came from. We are less
+            // worried about this towards the outbound peers we picked ourselves.
+            pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+            vector<boost::shared_ptr<const CTransaction> > vRelayed;
+            pto->nRelayCursor = relayLog.Read(pto->nRelayCursor, INVENTORY_BROADCAST_MAX, vRelayed);
+            // Don't announce what was mined or evicted since it was relayed
+            vector<bool> vInMempool(vRelayed.size());
+            for (size_t i = 0; i < vRelayed.size(); i++)
+                vInMempool[i] = mempool.exists(vRelayed[i]->GetHash());
+            LOCK(pto->cs_filter);
+            if (pto->fRelayTxes) {
+                for (size_t i = 0; i < vRelayed.size(); i++) {
+                    const boost::shared_ptr<const CTransaction>& ptx = vRelayed[i];
+                    if (!vInMempool[i])
+                        continue;
+                    if (!pto->pfilter || pto->pfilter->IsRelevantAndUpdate(*ptx))
+                        vInvRelay.push_back(CInv(MSG_TX, ptx->GetHash()));
+                }
+            }
+        }
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            vInv.reserve(pto->vInventoryToSend.size() + vInvRelay.size());
+            pto->vInventoryToSend.insert(pto->vInventoryToSend.end(), vInvRelay.begin(), vInvRelay.end());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -5510,16 +6112,30 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nDownloadWindow = GetBlockDownloadWindow(state.download);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nDownloadWindow) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex *pindexStalled = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nDownloadWindow - state.nBlocksInFlight, vToDownload, staller, pindexStalled);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
+            if (vToDownload.empty() && staller != -1 && pindexStalled != NULL && IsFasterDownloadPeer(state.download, State(staller)->download)) {
+                // The download window is held up by a block queued at a slower
+                // peer. Once it has been waiting longer than this peer would
+                // take to deliver it, move the request here.
+                const QueuedBlock &queuedStalled = *mapBlocksInFlight[pindexStalled->GetBlockHash()].second;
+                if (queuedStalled.nTime < nNow - state.download.nBlockRTT - state.download.nBlockServiceTime) {
+                    vGetData.push_back(CInv(MSG_BLOCK, pindexStalled->GetBlockHash()));
+                    MarkBlockAsInFlight(pto->GetId(), pindexStalled->GetBlockHash(), consensusParams, pindexStalled);
+                    LogPrint("net", "Re-requesting stalled block %s (%d) from peer=%d instead of peer=%d\n",
+                        pindexStalled->GetBlockHash().ToString(), pindexStalled->nHeight, pto->id, staller);
+                }
+            }
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
@@ -5575,7 +6191,6 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        ClearOrphanTxs();
     }
 } instance_of_cmaincleanup;
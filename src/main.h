@@ -35,10 +35,13 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CBloomFilter;
 class CInv;
 class CScriptCheck;
@@ -64,6 +67,20 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 1000;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphansize, maximum kilobytes of serialized orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_SIZE = 1000;
+/** Orphan transactions larger than this are not kept */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** A single peer's orphans may take at most 1/ORPHAN_PEER_SHARE of the orphan pool */
+static const unsigned int ORPHAN_PEER_SHARE = 4;
+/** Seconds after which an orphan transaction is dropped if its inputs still haven't shown up */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between sweeps for expired orphan transactions */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Number of transactions kept in the cache of transactions that passed CheckTransaction */
+static const unsigned int MAX_VERIFIED_TX_CACHE_SIZE = 20000;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours (0 = never) */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 0;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -74,8 +91,14 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer whose download speed we
+ *  haven't measured yet. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the per-peer block download window once the peer's download speed is known. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Seconds worth of block downloads to keep queued at each peer, on top of its round trip time. */
+static const unsigned int BLOCK_DOWNLOAD_QUEUE_TIME = 2;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -86,6 +109,12 @@ static const unsigned int MAX_HEADERS_RESULTS = 160;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Compact block protocol version negotiated with sendcmpct. */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Maximum depth of a block we still serve as a cmpctblock; older blocks are sent in full. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of a block we serve transactions from in response to getblocktxn. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -115,7 +144,6 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
-extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
@@ -129,12 +157,17 @@ extern bool fAlerts;
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
 
+/** Chain tip when the block index was last written, so it and its ancestors are in the database. */
+extern const CBlockIndex *pindexBestOnDisk;
+
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
 
 /** Pruning-related variables and constants */
 /** True if any block files have ever been pruned. */
 extern bool fHavePruned;
+/** True if the chain state was loaded from a snapshot, so blocks below it were never downloaded. */
+extern bool fHaveSnapshot;
 /** True if we're running in -prune mode. */
 extern bool fPruneMode;
 /** Number of MiB of block files that we're trying to stay below. */
@@ -167,9 +200,10 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @param[in]   pblock  The block we want to process.
  * @param[in]   fForceProcessing Process this block even if unrequested; used for non-network block sources and whitelisted peers.
  * @param[out]  dbp     If pblock is stored to disk (or already there), this will be set to its location.
+ * @param[in]   nBytesReceived What pfrom sent us for the block, if not the block itself (as for compact blocks).
  * @return True if state.IsValid()
  */
-bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp);
+bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp, unsigned int nBytesReceived = 0);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -197,6 +231,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the joinsplit proof checking thread */
+void ThreadProofCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -247,11 +283,42 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                         bool* pfMissingInputs, bool fRejectAbsurdFee=false);
 
 
+/** Measured block download performance of a peer, which sizes its download window */
+struct CBlockDownloadStats {
+    //! When the last block we requested from this peer arrived (in microseconds), or 0.
+    int64_t nLastBlockReceived;
+    //! Smoothed delay of blocks requested while nothing else was queued at this peer (in microseconds), or 0.
+    int64_t nBlockRTT;
+    //! Smoothed time this peer spends delivering each block of a full queue (in microseconds), or 0.
+    int64_t nBlockServiceTime;
+    //! Smoothed block download rate from this peer in bytes per second, or 0.
+    int64_t nBlockBytesPerSecond;
+    //! Number of requested blocks this peer has delivered.
+    int nBlocksDownloaded;
+
+    CBlockDownloadStats() : nLastBlockReceived(0), nBlockRTT(0), nBlockServiceTime(0), nBlockBytesPerSecond(0), nBlocksDownloaded(0) {}
+};
+
+/**
+ * Fold the arrival at nNow of a block requested at nTimeRequested into the
+ * statistics of a peer. fFirstInFlight tells whether nothing was queued at
+ * the peer ahead of it, and nBytes is what the peer sent us for it.
+ */
+void UpdateBlockDownloadStats(CBlockDownloadStats& stats, int64_t nTimeRequested, bool fFirstInFlight, unsigned int nBytes, int64_t nNow);
+/** Number of blocks to keep in flight from a peer */
+int GetBlockDownloadWindow(const CBlockDownloadStats& stats);
+/** Whether a block requested from a peer now would be expected to arrive well before another peer gets to it */
+bool IsFasterDownloadPeer(const CBlockDownloadStats& stats, const CBlockDownloadStats& statsOther);
+
 struct CNodeStateStats {
     int nMisbehavior;
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nDownloadWindow;
+    int64_t nBlockRTT;
+    int64_t nBlockBytesPerSecond;
+    int nBlocksDownloaded;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -334,7 +401,11 @@ bool NonContextualCheckInputs(const CTransaction& tx, CValidationState &state, c
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight);
 
-/** Context-independent validity checks */
+/**
+ * Context-independent validity checks. Does not need cs_main; a transaction
+ * with joinsplits that passes is remembered, so checking it again when it
+ * is accepted to the mempool or arrives in a block costs a lookup.
+ */
 bool CheckTransaction(const CTransaction& tx, CValidationState& state);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
 
@@ -392,11 +463,61 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the verification of one joinsplit proof of a
+ * transaction, for the proof check queue. Verification only reads the
+ * loaded verifying key, so proofs can be checked concurrently.
+ */
+class CJoinSplitCheck
+{
+private:
+    const CTransaction *ptx;
+    unsigned int nJoinSplit;
+
+public:
+    CJoinSplitCheck(): ptx(0), nJoinSplit(0) {}
+    CJoinSplitCheck(const CTransaction& txIn, unsigned int nJoinSplitIn) :
+        ptx(&txIn), nJoinSplit(nJoinSplitIn) { }
+
+    bool operator()();
+
+    void swap(CJoinSplitCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(nJoinSplit, check.nJoinSplit);
+    }
+};
+
+/**
+ * Transactions with joinsplits that passed CheckTransaction, by txid. Those
+ * checks do not depend on the chain and a txid commits to the whole
+ * transaction, proofs and joinsplit signature included, so CheckTransaction
+ * accepts a transaction found here without running any of them again. Only
+ * CheckTransaction adds to it, and only transactions that passed.
+ */
+class CVerifiedTxCache
+{
+private:
+    std::set<uint256> setValid;
+    boost::shared_mutex cs_verifiedtx;
+
+public:
+    bool Get(const uint256 &txid);
+    void Set(const uint256 &txid);
+};
+
+extern CVerifiedTxCache verifiedTxCache;
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/**
+ * Read a block as it is serialized on disk, without deserializing or checking
+ * it. Blocks are stored in network format, so this is what a peer would be sent.
+ */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -501,6 +622,33 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/**
+ * Summary of the tip of chainActive and of the best header. A new one is
+ * published whenever either changes and is never modified afterwards, so
+ * callers that only report on the tip can use it without locking cs_main.
+ */
+struct CChainTipSnapshot
+{
+    //! Only the fields of the index that don't change once the block is
+    //! connected (hash, height, header, pprev, nChainWork, nChainTx) may be
+    //! read without cs_main.
+    const CBlockIndex* pindexTip;
+    uint256 hashBestBlock;
+    int nHeight;
+    int64_t nTime;
+    uint32_t nBits;
+    //! Work required for a block on top of the tip
+    uint32_t nNextBits;
+    arith_uint256 nChainWork;
+    unsigned int nChainTx;
+    int nHeadersHeight;
+
+    CChainTipSnapshot() : pindexTip(NULL), nHeight(-1), nTime(0), nBits(0), nNextBits(0), nChainTx(0), nHeadersHeight(-1) {}
+};
+
+/** The latest chain tip snapshot, never NULL. Doesn't require cs_main. */
+boost::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot();
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
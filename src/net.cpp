@@ -17,10 +17,17 @@
 #include "ui_interface.h"
 #include "crypto/common.h"
 
+#include <math.h>
+
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -79,11 +86,13 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+bool fSocketEventsEpoll = false;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+CRelayLog relayLog;
+map<CInv, boost::shared_ptr<const CTransaction> > mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -107,6 +116,93 @@ boost::condition_variable messageHandlerCondition;
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+//
+// Socket event registrations (-socketevents=epoll). A node's socket is
+// registered once when the node is created and stays registered until it is
+// closed. Readability is edge-triggered; writability is only asked for while
+// vSendMsg holds data the socket did not accept.
+//
+#ifdef HAVE_SYS_EPOLL_H
+static int hEpoll = -1;
+
+// requires LOCK(cs_vSend)
+static uint32_t EpollNodeEvents(const CNode* pnode)
+{
+    return EPOLLIN | EPOLLRDHUP | EPOLLET | (pnode->fSocketWriteInterest ? (uint32_t)EPOLLOUT : 0);
+}
+#endif
+
+static void InitSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (fSocketEventsEpoll && hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("epoll_create1 failed: %s, falling back to select()\n", NetworkErrorString(errno));
+            fSocketEventsEpoll = false;
+        }
+        BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket) {
+            if (hEpoll == -1)
+                break;
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &hListenSocket;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("epoll_ctl for listening socket failed: %s\n", NetworkErrorString(errno));
+        }
+    }
+#else
+    fSocketEventsEpoll = false;
+#endif
+    LogPrintf("Using %s for socket events\n", fSocketEventsEpoll ? "epoll" : "select()");
+}
+
+static void SocketEventsAddNode(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll == -1)
+        return;
+    LOCK(pnode->cs_vSend);
+    struct epoll_event event;
+    event.events = EpollNodeEvents(pnode);
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl add for peer=%d failed: %s\n", pnode->id, NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
+static void SocketEventsRemoveNode(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    // Unregister explicitly rather than relying on close(): the descriptor
+    // may have been duplicated into a child process, which would keep the
+    // registration (and the pointer to pnode) alive.
+    if (hEpoll == -1)
+        return;
+    struct epoll_event event;
+    epoll_ctl(hEpoll, EPOLL_CTL_DEL, pnode->hSocket, &event);
+#endif
+}
+
+// requires LOCK(cs_vSend)
+static void SocketEventsSetWriteInterest(CNode* pnode, bool fWrite)
+{
+    pnode->fSocketWriteInterest = fWrite;
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EpollNodeEvents(pnode);
+    event.data.ptr = pnode;
+    // ENOENT means the node has not been registered yet; SocketEventsAddNode
+    // will pick up fSocketWriteInterest.
+    if (epoll_ctl(hEpoll, EPOLL_CTL_MOD, pnode->hSocket, &event) != 0 && errno != ENOENT)
+        LogPrintf("epoll_ctl mod for peer=%d failed: %s\n", pnode->id, NetworkErrorString(errno));
+#endif
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -376,7 +472,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!fSocketEventsEpoll && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -387,6 +483,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        SocketEventsAddNode(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -408,10 +505,17 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
-    if (hSocket != INVALID_SOCKET)
     {
-        LogPrint("net", "disconnecting peer=%d\n", id);
-        CloseSocket(hSocket);
+        // Message handlers change the epoll registration under cs_vSend, so
+        // they can't do so between unregistering and closing. Otherwise the
+        // descriptor could be reused for a new peer and point at this node.
+        LOCK(cs_vSend);
+        if (hSocket != INVALID_SOCKET)
+        {
+            LogPrint("net", "disconnecting peer=%d\n", id);
+            SocketEventsRemoveNode(this);
+            CloseSocket(hSocket);
+        }
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
@@ -570,6 +674,28 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+char* CNode::GetRecvMsgBuffer(unsigned int& nSize)
+{
+    if (vRecvMsg.empty())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (!msg.in_data || msg.complete() || msg.hdr.nMessageSize > MAX_PROTOCOL_MESSAGE_LENGTH)
+        return NULL;
+    return msg.GetDataBuffer(nSize);
+}
+
+void CNode::ReceivedMsgData(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    assert(msg.in_data && msg.nDataPos + nBytes <= msg.hdr.nMessageSize);
+    msg.nDataPos += nBytes;
+
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        messageHandlerCondition.notify_one();
+    }
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -603,20 +729,41 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
-    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    unsigned int nRemaining;
+    char *pchData = GetDataBuffer(nRemaining);
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
-
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    if (nCopy > 0)
+        memcpy(pchData, pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int& nRemaining)
+{
+    if (nDataPos == hdr.nMessageSize) {
+        nRemaining = 0;
+        return NULL;
+    }
+
+    // The data is received straight into a buffer of the final message
+    // size, so it is never copied as it grows. A peer should only make us
+    // hold memory for data it actually sends though: messages larger than
+    // RECV_FIRST_PART_SIZE get their final buffer once that much of their
+    // data is in, at the cost of copying that first part once. Messages
+    // with a malformed header never get more than the next part.
+    if (vRecv.size() == nDataPos) {
+        if (nDataPos == 0 || !hdr.IsValid(Params().MessageStart()))
+            vRecv.resize(std::min(hdr.nMessageSize, nDataPos + RECV_FIRST_PART_SIZE));
+        else
+            vRecv.resize(hdr.nMessageSize);
+    }
+
+    nRemaining = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
 
 
 
@@ -628,23 +775,51 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CPooledData>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert(it->size() > pnode->nSendOffset);
+#ifdef WIN32
+        size_t nAttempt = it->size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &(*it)[pnode->nSendOffset], nAttempt, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand as many queued messages as possible to the kernel at once
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nAttempt = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CPooledData>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; itIov++) {
+            iov[nIov].iov_base = &(*itIov)[nOffset];
+            iov[nIov].iov_len = itIov->size() - nOffset;
+            nAttempt += iov[nIov].iov_len;
+            nOffset = 0;
+            nIov++;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // drop the messages that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = it->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nAttempt) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -667,6 +842,9 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    if (pnode->vSendMsg.empty() == pnode->fSocketWriteInterest)
+        SocketEventsSetWriteInterest(pnode, !pnode->vSendMsg.empty());
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -851,7 +1029,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!fSocketEventsEpoll && !IsSelectableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -887,6 +1065,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     CNode* pnode = new CNode(hSocket, addr, "", true);
     pnode->AddRef();
     pnode->fWhitelisted = whitelisted;
+    SocketEventsAddNode(pnode);
 
     LogPrint("net", "connection from %s accepted\n", addr.ToString());
 
@@ -896,74 +1075,313 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+static bool ReceiveBufferFull(CNode* pnode)
+{
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+        pnode->GetTotalRecvSize() > ReceiveFloodSize();
+}
+
+// requires LOCK(cs_vRecvMsg)
+// Returns true if data was read, i.e. the socket may have more to read.
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    // Once a message's header is in, the rest of it is received straight
+    // into the message's own buffer.
+    unsigned int nSize = 0;
+    char* pchMsg = pnode->GetRecvMsgBuffer(nSize);
+    int nBytes = pchMsg ? recv(pnode->hSocket, pchMsg, nSize, MSG_DONTWAIT) :
+                          recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pchMsg)
+            pnode->ReceivedMsgData(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Socket handler loop for -socketevents=epoll. Only sockets that became
+ * ready are looked at, so the cost of a wakeup does not grow with the number
+ * of connections.
+ *
+ * Notifications are edge-triggered and not repeated, so a node that was
+ * reported ready is kept in setRecvReady/setSendReady (holding a reference)
+ * until its socket has been read until it would block, or its send queue has
+ * been written out. Nodes whose receive buffer is full stay there until the
+ * message handler has made room.
+ */
+static void ThreadSocketHandlerEpoll()
+{
+    // Reads per node and wakeup before moving on to the next node
+    static const int MAX_RECV_PER_WAKEUP = 4;
+
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    set<CNode*> setRecvReady;
+    set<CNode*> setSendReady;
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    bool fMoreData = false;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
+
+        int nEvents = epoll_wait(hEpoll, events, MAX_SOCKET_EVENTS, fMoreData ? 0 : 50);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            int nErr = errno;
+            if (nErr != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            //
+            // Accept new connections
+            //
+            bool fListenSocket = false;
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            {
+                if (events[i].data.ptr == &hListenSocket)
+                {
+                    AcceptConnection(hListenSocket);
+                    fListenSocket = true;
+                    break;
+                }
+            }
+            if (fListenSocket)
+                continue;
+
+            // Nodes are unregistered before their socket is closed, and only
+            // deleted by this thread, so the node is still there.
+            CNode* pnode = static_cast<CNode*>(events[i].data.ptr);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                if (setRecvReady.insert(pnode).second)
+                    pnode->AddRef();
+            if (events[i].events & EPOLLOUT)
+                if (setSendReady.insert(pnode).second)
+                    pnode->AddRef();
+        }
+
+        //
+        // Receive
+        //
+        fMoreData = false;
+        for (set<CNode*>::iterator it = setRecvReady.begin(); it != setRecvReady.end(); )
+        {
+            boost::this_thread::interruption_point();
+            CNode* pnode = *it;
+            bool fDrained = true;
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                fDrained = false;
+                if (lockRecv)
+                {
+                    int nReads = 0;
+                    while (!ReceiveBufferFull(pnode) && nReads < MAX_RECV_PER_WAKEUP)
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        if (!SocketRecvData(pnode))
+                        {
+                            fDrained = true;
+                            break;
+                        }
+                        nReads++;
                     }
+                    if (nReads == MAX_RECV_PER_WAKEUP)
+                        fMoreData = true;
                 }
             }
+            if (fDrained)
+            {
+                setRecvReady.erase(it++);
+                pnode->Release();
+            }
+            else
+                ++it;
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+
+        //
+        // Send
+        //
+        for (set<CNode*>::iterator it = setSendReady.begin(); it != setSendReady.end(); )
+        {
+            CNode* pnode = *it;
+            bool fSent = true;
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                    SocketSendData(pnode);
+                else
+                    fSent = false;
+            }
+            if (fSent)
+            {
+                setSendReady.erase(it++);
+                pnode->Release();
+            }
+            else
+                ++it;
         }
 
+        //
+        // Inactivity checking
+        //
+        int64_t nTime = GetTime();
+        if (nTime != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = nTime;
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                InactivityCheck(pnode);
+        }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll != -1)
+    {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
+
         //
         // Find which sockets have data to receive
         //
@@ -1020,9 +1438,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && !ReceiveBufferFull(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -1080,39 +1496,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1130,30 +1514,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1597,11 +1958,20 @@ void ThreadMessageHandler()
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Each handler thread starts its pass at a different node, and
+        // skips nodes another thread is busy with. A node is handled by one
+        // thread at a time and ProcessMessages takes at most one message
+        // from it per pass, so a slow peer holds up only itself.
+        size_t nStart = vNodesCopy.empty() ? 0 : GetRand(vNodesCopy.size());
+        for (size_t i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            if (pnode->fInMessageHandler.exchange(true))
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1619,7 +1989,6 @@ void ThreadMessageHandler()
                     }
                 }
             }
-            boost::this_thread::interruption_point();
 
             // Send messages
             {
@@ -1627,6 +1996,8 @@ void ThreadMessageHandler()
                 if (lockSend)
                     g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
             }
+
+            pnode->fInMessageHandler = false;
             boost::this_thread::interruption_point();
         }
 
@@ -1833,6 +2204,7 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+    InitSocketEvents();
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1842,7 +2214,13 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = GetArg("-msghandlers", DEFAULT_MESSAGE_HANDLER_THREADS);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads = std::min(4, (int)boost::thread::hardware_concurrency());
+    nMessageHandlerThreads = std::max(1, std::min(MAX_MESSAGE_HANDLER_THREADS, nMessageHandlerThreads));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpAddresses, DUMP_ADDRESSES_INTERVAL);
@@ -1889,6 +2267,11 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1)
+            close(hEpoll);
+        hEpoll = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1910,14 +2293,8 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
-}
-
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
-{
+    // mapRelay and the relay log hold the same copy of the transaction
+    boost::shared_ptr<const CTransaction> ptx(new CTransaction(tx));
     CInv inv(MSG_TX, tx.GetHash());
     {
         LOCK(cs_mapRelay);
@@ -1928,23 +2305,55 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
-    {
-        if(!pnode->fRelayTxes)
-            continue;
-        LOCK(pnode->cs_filter);
-        if (pnode->pfilter)
-        {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
-                pnode->PushInventory(inv);
-        } else
-            pnode->PushInventory(inv);
+        mapRelay.insert(std::make_pair(inv, ptx));
+        vRelayExpiration.push_back(std::make_pair(GetTime() + RELAY_EXPIRY, inv));
     }
+    // Peers pick it up from the log at their next inventory broadcast
+    relayLog.Append(ptx, GetTime());
+}
+
+void CRelayLog::Append(const boost::shared_ptr<const CTransaction>& ptx, int64_t nTime)
+{
+    Entry entry;
+    entry.nTime = nTime;
+    entry.tx = ptx;
+
+    LOCK(cs);
+    while (!entries.empty() && entries.front().nTime < nTime - RELAY_EXPIRY)
+        entries.pop_front();
+    entries.push_back(entry);
+    nNextSequence++;
+}
+
+uint64_t CRelayLog::GetHead() const
+{
+    LOCK(cs);
+    return nNextSequence;
+}
+
+uint64_t CRelayLog::Read(uint64_t nCursor, size_t nMax, std::vector<boost::shared_ptr<const CTransaction> >& vtx) const
+{
+    LOCK(cs);
+    // Sequence numbers in the log are contiguous, ending at nNextSequence
+    uint64_t nFirst = nNextSequence - entries.size();
+    if (nCursor < nFirst)
+        nCursor = nFirst;
+    size_t nCount = std::min<uint64_t>(nNextSequence - nCursor, nMax);
+    vtx.reserve(vtx.size() + nCount);
+    for (size_t i = 0; i < nCount; i++)
+        vtx.push_back(entries[nCursor - nFirst + i].tx);
+    return nCursor + nCount;
+}
+
+size_t CRelayLog::size() const
+{
+    LOCK(cs);
+    return entries.size();
+}
+
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
 }
 
 void CNode::RecordBytesRecv(uint64_t bytes)
@@ -2113,7 +2522,7 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(5000, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2135,6 +2544,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fInMessageHandler = false;
+    fSocketWriteInterest = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2144,6 +2555,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fRelayTxes = false;
     fSentAddr = false;
     pfilter = new CBloomFilter();
+    nRelayCursor = relayLog.GetHead();
+    nNextInvSend = 0;
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
@@ -2260,8 +2673,9 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
+    // Queue the serialized message itself rather than a copy of it
+    std::deque<CPooledData>::iterator it = vSendMsg.insert(vSendMsg.end(), CPooledData());
+    ssSend.SwapAndClear(*it);
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
@@ -10,15 +10,16 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
+#include "support/allocators/pooled.h"
 #include "sync.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
 #include <stdint.h>
 
@@ -28,12 +29,14 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
 class CBlockIndex;
 class CScheduler;
 class CNode;
+class CTransaction;
 
 namespace boost {
     class thread_group;
@@ -47,8 +50,16 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Average delay between transaction inventory broadcasts to inbound peers, in seconds (half that for outbound). */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of relayed transactions announced to a peer per broadcast. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 1000;
+/** Time transactions stay in the relay log and mapRelay, in seconds. */
+static const int64_t RELAY_EXPIRY = 15 * 60;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
+/** Larger messages are only given a buffer of their full size once this much of their data is in */
+static const unsigned int RECV_FIRST_PART_SIZE = 256 * 1024;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** -upnp default */
@@ -61,6 +72,20 @@ static const bool DEFAULT_UPNP = false;
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 /** The maximum number of entries in setAskFor (larger due to getdata latency)*/
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
+/** -msghandlers default (number of message handler threads, 0 = auto) */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 0;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+/** -socketevents default (how the socket handler waits for socket readiness) */
+#ifdef HAVE_SYS_EPOLL_H
+static const char DEFAULT_SOCKETEVENTS[] = "epoll";
+#else
+static const char DEFAULT_SOCKETEVENTS[] = "select";
+#endif
+/** Maximum number of socket events handled per wakeup of the socket handler */
+static const int MAX_SOCKET_EVENTS = 256;
+/** Maximum number of queued messages handed to a single sendmsg() call */
+static const int MAX_SEND_IOV = 64;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -144,10 +169,12 @@ extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** Wait for socket readiness with epoll instead of select(), which is limited to FD_SETSIZE sockets */
+extern bool fSocketEventsEpoll;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, boost::shared_ptr<const CTransaction> > mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -191,6 +218,9 @@ public:
 
 
 
+/** Stream over the data of a received message, held in a pooled buffer */
+typedef CBaseDataStream<CPooledData> CNetDataStream;
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
@@ -199,7 +229,7 @@ public:
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CNetDataStream vRecv;           // received message data
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
@@ -227,6 +257,11 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    // Buffer for the next part of the message data: at most the first
+    // RECV_FIRST_PART_SIZE bytes, then the rest of the message. Sets
+    // nRemaining to the size of the part.
+    char* GetDataBuffer(unsigned int& nRemaining);
 };
 
 
@@ -240,11 +275,11 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream ssSend;
+    CNetDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CPooledData> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -273,6 +308,13 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Set while a message handler thread is processing or sending messages
+    // for this node; the others leave it alone, which keeps its messages in
+    // order.
+    std::atomic<bool> fInMessageHandler;
+    // Whether the socket is registered for writability events, which is only
+    // the case while vSendMsg has data the socket did not accept (cs_vSend)
+    bool fSocketWriteInterest;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -304,15 +346,22 @@ public:
     int nStartingHeight;
 
     // flood relay
+    CCriticalSection cs_addr;
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    // Hashes recently announced to or by the peer; a few thousand entries at
+    // a false positive rate of one in a million take about 72 KB per peer.
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    // Position in relayLog up to which transactions were considered for
+    // announcing to this peer, and when to do so next (only used by SendMessages)
+    uint64_t nRelayCursor;
+    int64_t nNextInvSend;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
 
@@ -365,6 +414,15 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // Buffer for the next part of the message being received, so that its
+    // data can be received into it directly, or NULL if no message data is due.
+    char* GetRecvMsgBuffer(unsigned int& nSize);
+
+    // requires LOCK(cs_vRecvMsg)
+    // Account for nBytes received into the buffer from GetRecvMsgBuffer
+    void ReceivedMsgData(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -388,6 +446,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addr);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -396,6 +455,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addr);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -410,7 +470,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -418,7 +478,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -628,10 +688,50 @@ public:
 };
 
 
+/**
+ * Log of the transactions we relay. RelayTransaction appends each one once;
+ * every peer keeps a cursor into the log and SendMessages announces what was
+ * added since, in batches, so relaying a transaction costs the same however
+ * many peers we have. Entries expire after RELAY_EXPIRY seconds.
+ */
+class CRelayLog
+{
+private:
+    struct Entry
+    {
+        int64_t nTime;
+        boost::shared_ptr<const CTransaction> tx;
+    };
+
+    mutable CCriticalSection cs;
+    std::deque<Entry> entries;
+    //! Sequence number of the next transaction appended
+    uint64_t nNextSequence;
+
+public:
+    CRelayLog() : nNextSequence(0) {}
+
+    //! Add a transaction, sharing it with mapRelay
+    void Append(const boost::shared_ptr<const CTransaction>& ptx, int64_t nTime);
+
+    //! Sequence number a cursor starts at to see only transactions appended from now on
+    uint64_t GetHead() const;
+
+    /**
+     * Get up to nMax transactions appended at or after nCursor (skipping any
+     * that expired) and return the cursor to continue from.
+     */
+    uint64_t Read(uint64_t nCursor, size_t nMax, std::vector<boost::shared_ptr<const CTransaction> >& vtx) const;
+
+    size_t size() const;
+};
+
+extern CRelayLog relayLog;
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -25,6 +25,7 @@
 #include <arpa/inet.h>
 #endif
 #include <fcntl.h>
+#include <poll.h>
 #endif
 
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
@@ -227,6 +228,7 @@ bool LookupNumeric(const char *pszName, CService& addr, int portDefault)
     return Lookup(pszName, addr, portDefault, false);
 }
 
+#ifdef WIN32
 /**
  * Convert milliseconds to a struct timeval for select.
  */
@@ -237,6 +239,30 @@ struct timeval static MillisToTimeval(int64_t nTimeout)
     timeout.tv_usec = (nTimeout % 1000) * 1000;
     return timeout;
 }
+#endif
+
+/**
+ * Wait up to nTimeout milliseconds for hSocket to become readable, or
+ * writable if fWrite is set. Returns 1 if it did, 0 on timeout and
+ * SOCKET_ERROR on error. Uses poll() where available, which unlike select()
+ * works for descriptors beyond FD_SETSIZE.
+ */
+static int WaitForSocket(SOCKET hSocket, bool fWrite, int64_t nTimeout)
+{
+#ifdef WIN32
+    struct timeval tval = MillisToTimeval(nTimeout);
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, fWrite ? NULL : &fdset, fWrite ? &fdset : NULL, NULL, &tval);
+#else
+    struct pollfd pfd;
+    pfd.fd = hSocket;
+    pfd.events = fWrite ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, nTimeout);
+#endif
+}
 
 /**
  * Read bytes from socket. This will either read the full number of bytes requested
@@ -266,14 +292,7 @@ bool static InterruptibleRecv(char* data, size_t len, int timeout, SOCKET& hSock
         } else { // Other error or blocking
             int nErr = WSAGetLastError();
             if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL) {
-                if (!IsSelectableSocket(hSocket)) {
-                    return false;
-                }
-                struct timeval tval = MillisToTimeval(std::min(endTime - curTime, maxWait));
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                FD_SET(hSocket, &fdset);
-                int nRet = select(hSocket + 1, &fdset, NULL, NULL, &tval);
+                int nRet = WaitForSocket(hSocket, false, std::min(endTime - curTime, maxWait));
                 if (nRet == SOCKET_ERROR) {
                     return false;
                 }
@@ -467,11 +486,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
         {
-            struct timeval timeout = MillisToTimeval(nTimeout);
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+            int nRet = WaitForSocket(hSocket, true, nTimeout);
             if (nRet == 0)
             {
                 LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
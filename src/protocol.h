@@ -153,6 +153,9 @@ enum {
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Nodes that negotiated compact blocks with sendcmpct may request a
+    // MSG_CMPCT_BLOCK in a getdata; it never appears in invs.
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // BITCOIN_PROTOCOL_H
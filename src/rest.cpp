@@ -3,12 +3,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "main.h"
 #include "rpcserver.h"
 #include "streams.h"
 #include "sync.h"
+#include "txindex.h"
 #include "txmempool.h"
 #include "utilstrencodings.h"
 #include "version.h"
@@ -20,6 +22,10 @@ using namespace std;
 using namespace json_spirit;
 
 static const int MAX_GETUTXOS_OUTPOINTS = 15; //allow a max of 15 outpoints to be queried at once
+static const long MAX_REST_HEADERS_RESULTS = 100000;
+static const long MAX_REST_BLOCKS_RESULTS = 1000;
+//! Replies larger than this are sent in chunks as they are produced
+static const size_t REST_CHUNK_SIZE = 256 * 1024;
 
 enum RetFormat {
     RF_UNDEF,
@@ -62,7 +68,7 @@ public:
 };
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
-extern Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, CJSONWriter& result, bool txDetails = false);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex);
 
 static RestErr RESTERR(enum HTTPStatusCode status, string message)
@@ -73,6 +79,57 @@ static RestErr RESTERR(enum HTTPStatusCode status, string message)
     return re;
 }
 
+/**
+ * Reply of unknown size. A reply that fits in one chunk is sent as usual;
+ * a larger one is sent with chunked transfer encoding as it is produced, so
+ * it is never held in memory as a whole. Once the first chunk is out, errors
+ * can't be reported anymore: the handler then drops the connection instead,
+ * which the client sees as a truncated reply.
+ */
+class StreamedReply
+{
+public:
+    StreamedReply(AcceptedConnection* connIn, bool fRunIn, const char* contentTypeIn) :
+        conn(connIn), fRun(fRunIn), contentType(contentTypeIn), fChunked(false) {}
+
+    //! Returns false once the client has gone away
+    bool Write(const string& strData)
+    {
+        strBuffer += strData;
+        if (strBuffer.size() < REST_CHUNK_SIZE)
+            return true;
+        if (!fChunked) {
+            conn->stream() << HTTPReplyChunkedHeader(HTTP_OK, fRun, contentType);
+            fChunked = true;
+        }
+        conn->stream() << HTTPChunk(strBuffer);
+        strBuffer.clear();
+        return conn->flush();
+    }
+
+    //! Whether part of the reply was sent already
+    bool Started() const { return fChunked; }
+
+    void End()
+    {
+        if (fChunked) {
+            if (!strBuffer.empty())
+                conn->stream() << HTTPChunk(strBuffer);
+            conn->stream() << HTTPChunk("") << std::flush;
+        } else {
+            conn->stream() << HTTPReply(HTTP_OK, strBuffer, fRun, false, contentType) << std::flush;
+        }
+        strBuffer.clear();
+    }
+
+private:
+    AcceptedConnection* conn;
+    bool fRun;
+    const char* contentType;
+    bool fChunked;
+    string strBuffer;
+};
+
 static enum RetFormat ParseDataFormat(vector<string>& params, const string strReq)
 {
     boost::split(params, strReq, boost::is_any_of("."));
@@ -110,67 +167,98 @@ static bool ParseHashStr(const string& strReq, uint256& v)
     return true;
 }
 
-static bool rest_headers(AcceptedConnection* conn,
-                         const std::string& strURIPart,
-                         const std::string& strRequest,
-                         const std::map<std::string, std::string>& mapHeaders,
-                         bool fRun)
+//! Split "path?key=value&..." into the path and its query parameters
+static string SplitQueryString(const string& strURIPart, map<string, string>& mapQuery)
+{
+    size_t nQuery = strURIPart.find('?');
+    if (nQuery == string::npos)
+        return strURIPart;
+
+    vector<string> vParams;
+    string strQuery = strURIPart.substr(nQuery + 1);
+    boost::split(vParams, strQuery, boost::is_any_of("&"));
+    BOOST_FOREACH(const string& strParam, vParams) {
+        size_t nEq = strParam.find('=');
+        if (nEq == string::npos)
+            mapQuery[strParam] = "";
+        else
+            mapQuery[strParam.substr(0, nEq)] = strParam.substr(nEq + 1);
+    }
+    return strURIPart.substr(0, nQuery);
+}
+
+/**
+ * Parse a range request of the form <count>/<hash>.<ext>, or <count>.<ext>?since=<height>,
+ * and look up the blocks of the active chain it covers. When the range starts past the
+ * tip, it is empty: a client following the chain with since= simply polls again later.
+ */
+static RetFormat ParseBlockRange(const string& strURIPart, const char* endpoint, const char* item, long nMaxCount,
+                                 vector<const CBlockIndex*>& vRange)
 {
+    map<string, string> mapQuery;
+    string strPath = SplitQueryString(strURIPart, mapQuery);
+
     vector<string> params;
-    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    const RetFormat rf = ParseDataFormat(params, strPath);
     vector<string> path;
     boost::split(path, params[0], boost::is_any_of("/"));
 
-    if (path.size() != 2)
-        throw RESTERR(HTTP_BAD_REQUEST, "No header count specified. Use /rest/headers/<count>/<hash>.<ext>.");
+    bool fSince = mapQuery.count("since") > 0;
+    if (path.size() != (fSince ? 1 : 2))
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("No %s count specified. Use /rest/%s/<count>/<hash>.<ext> or /rest/%s/<count>.<ext>?since=<height>.",
+                                                  boost::to_lower_copy(string(item)), endpoint, endpoint));
 
     long count = strtol(path[0].c_str(), NULL, 10);
-    if (count < 1 || count > 2000)
-        throw RESTERR(HTTP_BAD_REQUEST, "Header count out of range: " + path[0]);
-
-    string hashStr = path[1];
-    uint256 hash;
-    if (!ParseHashStr(hashStr, hash))
-        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
-
-    std::vector<CBlockHeader> headers;
-    headers.reserve(count);
-    {
-        LOCK(cs_main);
+    if (count < 1 || count > nMaxCount)
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("%s count out of range: %s", item, path[0]));
+
+    vRange.reserve(count);
+    LOCK(cs_main);
+    const CBlockIndex *pindex = NULL;
+    if (fSince) {
+        int32_t nHeight;
+        if (!ParseInt32(mapQuery["since"], &nHeight) || nHeight < 0)
+            throw RESTERR(HTTP_BAD_REQUEST, "Invalid height: " + mapQuery["since"]);
+        pindex = chainActive[nHeight];
+    } else {
+        uint256 hash;
+        if (!ParseHashStr(path[1], hash))
+            throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + path[1]);
         BlockMap::const_iterator it = mapBlockIndex.find(hash);
-        const CBlockIndex *pindex = (it != mapBlockIndex.end()) ? it->second : NULL;
-        while (pindex != NULL && chainActive.Contains(pindex)) {
-            headers.push_back(pindex->GetBlockHeader());
-            if (headers.size() == (unsigned long)count)
-                break;
-            pindex = chainActive.Next(pindex);
-        }
-    }
-
-    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
-    BOOST_FOREACH(const CBlockHeader &header, headers) {
-        ssHeader << header;
+        pindex = (it != mapBlockIndex.end()) ? it->second : NULL;
     }
-
-    switch (rf) {
-    case RF_BINARY: {
-        string binaryHeader = ssHeader.str();
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, binaryHeader.size(), "application/octet-stream") << binaryHeader << std::flush;
-        return true;
+    while (pindex != NULL && chainActive.Contains(pindex)) {
+        vRange.push_back(pindex);
+        if (vRange.size() == (unsigned long)count)
+            break;
+        pindex = chainActive.Next(pindex);
     }
+    return rf;
+}
 
-    case RF_HEX: {
-        string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
-        return true;
-    }
+static bool rest_headers(AcceptedConnection* conn,
+                         const std::string& strURIPart,
+                         const std::string& strRequest,
+                         const std::map<std::string, std::string>& mapHeaders,
+                         bool fRun)
+{
+    vector<const CBlockIndex*> vRange;
+    const RetFormat rf = ParseBlockRange(strURIPart, "headers", "Header", MAX_REST_HEADERS_RESULTS, vRange);
 
-    default: {
+    if (rf != RF_BINARY && rf != RF_HEX)
         throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: .bin, .hex)");
-    }
-    }
 
-    // not reached
+    // Headers come from the block index, nothing is read from disk
+    StreamedReply reply(conn, fRun, rf == RF_BINARY ? "application/octet-stream" : "text/plain");
+    BOOST_FOREACH(const CBlockIndex* pindex, vRange) {
+        CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+        ssHeader << pindex->GetBlockHeader();
+        if (!reply.Write(rf == RF_BINARY ? ssHeader.str() : HexStr(ssHeader.begin(), ssHeader.end())))
+            return false;
+    }
+    if (rf == RF_HEX && !reply.Write("\n"))
+        return false;
+    reply.End();
     return true; // continue to process further HTTP reqs on this cxn
 }
 
@@ -190,6 +278,7 @@ static bool rest_block(AcceptedConnection* conn,
         throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
     CBlock block;
+    vector<unsigned char> vRawBlock;
     CBlockIndex* pblockindex = NULL;
     {
         LOCK(cs_main);
@@ -200,30 +289,34 @@ static bool rest_block(AcceptedConnection* conn,
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
 
-        if (!ReadBlockFromDisk(block, pblockindex))
+        // The binary formats are sent as stored, only JSON needs the block itself
+        if (rf == RF_BINARY || rf == RF_HEX) {
+            if (!ReadRawBlockFromDisk(vRawBlock, pblockindex, Params().MessageStart()))
+                throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+        } else if (!ReadBlockFromDisk(block, pblockindex)) {
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+        }
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
-        string binaryBlock = ssBlock.str();
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, binaryBlock.size(), "application/octet-stream") << binaryBlock << std::flush;
+        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, vRawBlock.size(), "application/octet-stream");
+        conn->stream().write((const char*)&vRawBlock[0], vRawBlock.size());
+        conn->stream() << std::flush;
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
+        string strHex = HexStr(vRawBlock.begin(), vRawBlock.end()) + "\n";
         conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
         return true;
     }
 
     case RF_JSON: {
-        Object objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = write_string(Value(objBlock), false) + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        CJSONWriter writer;
+        blockToJSON(block, pblockindex, writer, showTxDetails);
+        const string& strJSON = writer.str();
+        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, strJSON.size() + 1) << strJSON << "\n" << std::flush;
         return true;
     }
 
@@ -254,6 +347,89 @@ static bool rest_block_notxdetails(AcceptedConnection* conn,
     return rest_block(conn, strURIPart, strRequest, mapHeaders, fRun, false);
 }
 
+static bool rest_blocks(AcceptedConnection* conn,
+                        const std::string& strURIPart,
+                        const std::string& strRequest,
+                        const std::map<std::string, std::string>& mapHeaders,
+                        bool fRun,
+                        bool showTxDetails)
+{
+    vector<const CBlockIndex*> vRange;
+    const RetFormat rf = ParseBlockRange(strURIPart, "blocks", "Block", MAX_REST_BLOCKS_RESULTS, vRange);
+
+    const char* contentType;
+    switch (rf) {
+    case RF_BINARY: contentType = "application/octet-stream"; break;
+    case RF_HEX:    contentType = "text/plain"; break;
+    case RF_JSON:   contentType = "application/json"; break;
+    default:
+        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH(const CBlockIndex* pindex, vRange)
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA) && pindex->nTx > 0)
+                throw RESTERR(HTTP_NOT_FOUND, pindex->GetBlockHash().GetHex() + " not available (pruned data)");
+    }
+
+    // Blocks are read one at a time without holding cs_main, and handed to the
+    // client as they are read
+    StreamedReply reply(conn, fRun, contentType);
+    if (rf == RF_JSON && !reply.Write("["))
+        return false;
+    for (size_t i = 0; i < vRange.size(); i++) {
+        const CBlockIndex* pindex = vRange[i];
+        string strData;
+        if (rf == RF_JSON) {
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindex)) {
+                if (reply.Started())
+                    return false;
+                throw RESTERR(HTTP_NOT_FOUND, pindex->GetBlockHash().GetHex() + " not found");
+            }
+            CJSONWriter writer;
+            blockToJSON(block, pindex, writer, showTxDetails);
+            strData = (i > 0 ? "," : "") + writer.str();
+        } else {
+            vector<unsigned char> vRawBlock;
+            if (!ReadRawBlockFromDisk(vRawBlock, pindex, Params().MessageStart())) {
+                if (reply.Started())
+                    return false;
+                throw RESTERR(HTTP_NOT_FOUND, pindex->GetBlockHash().GetHex() + " not found");
+            }
+            if (rf == RF_BINARY)
+                strData.assign(vRawBlock.begin(), vRawBlock.end());
+            else
+                strData = HexStr(vRawBlock.begin(), vRawBlock.end());
+        }
+        if (!reply.Write(strData))
+            return false;
+    }
+    if (!reply.Write(rf == RF_JSON ? "]\n" : (rf == RF_HEX ? "\n" : "")))
+        return false;
+    reply.End();
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
+static bool rest_blocks_extended(AcceptedConnection* conn,
+                       const std::string& strURIPart,
+                       const std::string& strRequest,
+                       const std::map<std::string, std::string>& mapHeaders,
+                       bool fRun)
+{
+    return rest_blocks(conn, strURIPart, strRequest, mapHeaders, fRun, true);
+}
+
+static bool rest_blocks_notxdetails(AcceptedConnection* conn,
+                       const std::string& strURIPart,
+                       const std::string& strRequest,
+                       const std::map<std::string, std::string>& mapHeaders,
+                       bool fRun)
+{
+    return rest_blocks(conn, strURIPart, strRequest, mapHeaders, fRun, false);
+}
+
 static bool rest_chaininfo(AcceptedConnection* conn,
                            const std::string& strURIPart,
                            const std::string& strRequest,
@@ -295,10 +471,15 @@ static bool rest_tx(AcceptedConnection* conn,
     if (!ParseHashStr(hashStr, hash))
         throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
+    bool fTxIndexSynced = !ptxindex || ptxindex->BlockUntilSyncedToCurrentChain();
+
     CTransaction tx;
     uint256 hashBlock = uint256();
-    if (!GetTransaction(hash, tx, hashBlock, true))
+    if (!GetTransaction(hash, tx, hashBlock, true)) {
+        if (!fTxIndexSynced)
+            throw RESTERR(HTTP_SERVICE_UNAVAILABLE, "The txindex is still being built");
         throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+    }
 
     CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
     ssTx << tx;
@@ -540,6 +721,8 @@ static const struct {
       {"/rest/tx/", rest_tx},
       {"/rest/block/notxdetails/", rest_block_notxdetails},
       {"/rest/block/", rest_block_extended},
+      {"/rest/blocks/notxdetails/", rest_blocks_notxdetails},
+      {"/rest/blocks/", rest_blocks_extended},
       {"/rest/chaininfo", rest_chaininfo},
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
@@ -8,6 +8,7 @@
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpcserver.h"
+#include "snapshot.h"
 #include "sync.h"
 #include "util.h"
 
@@ -39,7 +40,11 @@ double GetDifficultyINTERNAL(const CBlockIndex* blockindex, bool networkDifficul
     } else {
         bits = blockindex->nBits;
     }
+    return GetDifficultyFromBits(bits);
+}
 
+double GetDifficultyFromBits(uint32_t bits)
+{
     uint32_t powLimit =
         UintToArith256(Params().GetConsensus().powLimit).GetCompact();
     int nShift = (bits >> 24) & 0xff;
@@ -73,58 +78,89 @@ double GetNetworkDifficulty(const CBlockIndex* blockindex)
     return GetDifficultyINTERNAL(blockindex, true);
 }
 
+double GetNetworkDifficulty(const CChainTipSnapshot& tip)
+{
+    if (tip.pindexTip == NULL)
+        return 1.0;
+    return GetDifficultyFromBits(tip.nNextBits);
+}
+
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, CJSONWriter& result, bool txDetails = false)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    result.BeginObject();
+    result.Key("hash");
+    result.String(block.GetHash().GetHex());
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
     if (chainActive.Contains(blockindex))
         confirmations = chainActive.Height() - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    Array txs;
+    result.Key("confirmations");
+    result.Int(confirmations);
+    result.Key("size");
+    result.Int(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    result.Key("height");
+    result.Int(blockindex->nHeight);
+    result.Key("version");
+    result.Int(block.nVersion);
+    result.Key("merkleroot");
+    result.String(block.hashMerkleRoot.GetHex());
+    result.Key("tx");
+    result.BeginArray();
     BOOST_FOREACH(const CTransaction&tx, block.vtx)
     {
         if(txDetails)
         {
+            // Only one transaction is built as a Value at a time
             Object objTx;
             TxToJSON(tx, uint256(), objTx);
-            txs.push_back(objTx);
+            result.Write(objTx);
         }
         else
-            txs.push_back(tx.GetHash().GetHex());
+            result.String(tx.GetHash().GetHex());
+    }
+    result.EndArray();
+    result.Key("time");
+    result.Int(block.GetBlockTime());
+    result.Key("nonce");
+    result.String(block.nNonce.GetHex());
+    result.Key("solution");
+    result.String(HexStr(block.nSolution));
+    result.Key("bits");
+    result.String(strprintf("%08x", block.nBits));
+    result.Key("difficulty");
+    result.Real(GetDifficulty(blockindex));
+    result.Key("chainwork");
+    result.String(blockindex->nChainWork.GetHex());
+
+    if (blockindex->pprev) {
+        result.Key("previousblockhash");
+        result.String(blockindex->pprev->GetBlockHash().GetHex());
     }
-    result.push_back(Pair("tx", txs));
-    result.push_back(Pair("time", block.GetBlockTime()));
-    result.push_back(Pair("nonce", block.nNonce.GetHex()));
-    result.push_back(Pair("solution", HexStr(block.nSolution)));
-    result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
-
-    if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
     CBlockIndex *pnext = chainActive.Next(blockindex);
-    if (pnext)
-        result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
+    if (pnext) {
+        result.Key("nextblockhash");
+        result.String(pnext->GetBlockHash().GetHex());
+    }
 
-	
     if ( block.IsAuxpow() )
     {
-        result.push_back(Pair("AuxBlock", block.GetChainId()));
-        result.push_back(Pair("ParentVersion", (boost::uint64_t)block.auxpow.get()->vParentBlockHeader.nVersion));
-        result.push_back(Pair("ParentHashPrev", block.auxpow.get()->vParentBlockHeader.hashPrevBlock.ToString().c_str()));
-        result.push_back(Pair("ParentnBits", strprintf("%08x", block.auxpow.get()->vParentBlockHeader.nBits)));
-        result.push_back(Pair("ParentnPow", block.auxpow.get()->GetPoWHash().GetHex()));
-        result.push_back(Pair("ParentScriptSig", HexStr(block.auxpow.get()->mMerkleTx.vin[0].scriptSig)));
-        result.push_back(Pair("ParentSize", (int)::GetSerializeSize(*block.auxpow.get(), SER_NETWORK, PROTOCOL_VERSION)));
+        result.Key("AuxBlock");
+        result.Int(block.GetChainId());
+        result.Key("ParentVersion");
+        result.Uint((uint64_t)block.auxpow.get()->vParentBlockHeader.nVersion);
+        result.Key("ParentHashPrev");
+        result.String(block.auxpow.get()->vParentBlockHeader.hashPrevBlock.ToString());
+        result.Key("ParentnBits");
+        result.String(strprintf("%08x", block.auxpow.get()->vParentBlockHeader.nBits));
+        result.Key("ParentnPow");
+        result.String(block.auxpow.get()->GetPoWHash().GetHex());
+        result.Key("ParentScriptSig");
+        result.String(HexStr(block.auxpow.get()->mMerkleTx.vin[0].scriptSig));
+        result.Key("ParentSize");
+        result.Int(::GetSerializeSize(*block.auxpow.get(), SER_NETWORK, PROTOCOL_VERSION));
     }
-    return result;
+    result.EndObject();
 }
 
 
@@ -141,8 +177,7 @@ Value getblockcount(const Array& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSnapshot()->nHeight;
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -158,8 +193,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainTipSnapshot()->hashBestBlock.GetHex();
 }
 
 Value getdifficulty(const Array& params, bool fHelp)
@@ -175,12 +209,11 @@ Value getdifficulty(const Array& params, bool fHelp)
             + HelpExampleRpc("getdifficulty", "")
         );
 
-    LOCK(cs_main);
-    return GetNetworkDifficulty();
+    return GetNetworkDifficulty(*GetChainTipSnapshot());
 }
 
 
-Value getrawmempool(const Array& params, bool fHelp)
+void getrawmempool(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() > 1)
         throw runtime_error(
@@ -221,44 +254,59 @@ Value getrawmempool(const Array& params, bool fHelp)
     if (fVerbose)
     {
         LOCK(mempool.cs);
-        Object o;
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        result.BeginObject();
+        for (CTxMemPool::indexed_transaction_set::iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
-            Object info;
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
+            const CTxMemPoolEntry& e = *it;
+            const uint256& hash = e.GetTx().GetHash();
+            result.Key(hash.ToString());
+            result.BeginObject();
+            result.Key("size");
+            result.Int(e.GetTxSize());
+            result.Key("fee");
+            result.Real(ValueFromAmount(e.GetFee()).get_real());
+            result.Key("time");
+            result.Int(e.GetTime());
+            result.Key("height");
+            result.Int(e.GetHeight());
+            result.Key("startingpriority");
+            result.Real(e.GetPriority(e.GetHeight()));
+            result.Key("currentpriority");
+            result.Real(e.GetPriority(chainActive.Height()));
             set<string> setDepends;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
-            Array depends(setDepends.begin(), setDepends.end());
-            info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
+            BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(it))
+                setDepends.insert(parent->GetTx().GetHash().ToString());
+            result.Key("depends");
+            result.BeginArray();
+            BOOST_FOREACH(const string& dep, setDepends)
+                result.String(dep);
+            result.EndArray();
+            result.EndObject();
         }
-        return o;
+        result.EndObject();
     }
     else
     {
         vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
 
-        Array a;
+        result.BeginArray();
         BOOST_FOREACH(const uint256& hash, vtxid)
-            a.push_back(hash.ToString());
-
-        return a;
+            result.String(hash.ToString());
+        result.EndArray();
     }
 }
 
+Value getrawmempool(const Array& params, bool fHelp)
+{
+    CJSONWriter result;
+    getrawmempool(params, fHelp, result);
+    Value ret;
+    if (!ParseJSON(result.str(), ret))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Failed to parse the streamed result");
+    return ret;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -284,7 +332,7 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+void getblock(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -346,10 +394,21 @@ Value getblock(const Array& params, bool fHelp)
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
         ssBlock << block;
         std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        result.String(strHex);
+        return;
     }
 
-    return blockToJSON(block, pblockindex);
+    blockToJSON(block, pblockindex, result);
+}
+
+Value getblock(const Array& params, bool fHelp)
+{
+    CJSONWriter result;
+    getblock(params, fHelp, result);
+    Value ret;
+    if (!ParseJSON(result.str(), ret))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Failed to parse the streamed result");
+    return ret;
 }
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
@@ -366,7 +425,7 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (of the per-shard hashes, in order)\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
@@ -374,13 +433,37 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
-    LOCK(cs_main);
+    // Only the flush needs cs_main: the chain state backend computes the
+    // statistics from a consistent view of its own, so block validation
+    // carries on while the coin set is being hashed.
+    uint256 hashBestBlock;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        hashBestBlock = pcoinsTip->GetBestBlock();
+    }
 
     Object ret;
 
+    // Monitoring tends to poll this; reuse the last result while the tip
+    // has not moved, and make concurrent callers wait for one computation.
+    static CCriticalSection cs_txoutsetinfo;
+    static CCoinsStats statsCached;
+    LOCK(cs_txoutsetinfo);
+
     CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
+    bool fHaveStats = !statsCached.hashBlock.IsNull() && statsCached.hashBlock == hashBestBlock;
+    if (fHaveStats) {
+        stats = statsCached;
+    } else if (pcoinsTip->GetStats(stats)) {
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi != mapBlockIndex.end())
+            stats.nHeight = mi->second->nHeight;
+        statsCached = stats;
+        fHaveStats = true;
+    }
+    if (fHaveStats) {
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
@@ -392,6 +475,62 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value dumpchainstate(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumpchainstate \"filename\"\n"
+            "\nWrites a snapshot of the chain state at the current tip to a file on the server.\n"
+            "A new node can be started from it with -loadsnapshot=<file> once its height,\n"
+            "hash_serialized and hash_shielded are pinned in the chain parameters of a release.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The snapshot file to write\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\":n,     (numeric) The height of the snapshot block\n"
+            "  \"bestblock\": \"hex\",   (string) the snapshot block hash hex\n"
+            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"txouts\": n,            (numeric) The number of output transactions\n"
+            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash, as in gettxoutsetinfo\n"
+            "  \"hash_shielded\": \"hash\",     (string) The hash of the best anchor, anchor trees and nullifiers\n"
+            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumpchainstate", "\"snapshot.dat\"")
+            + HelpExampleRpc("dumpchainstate", "\"snapshot.dat\"")
+        );
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+
+    // As with gettxoutsetinfo, only the flush needs cs_main; the snapshot is
+    // read from a consistent view of the chain state backend.
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+    }
+
+    CCoinsStats stats;
+    uint256 hashShielded;
+    std::string strError;
+    if (!DumpChainStateSnapshot(pcoinsTip, path, stats, hashShielded, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    Object ret;
+    ret.push_back(Pair("height", (int64_t)stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+    ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+    ret.push_back(Pair("hash_shielded", hashShielded.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -501,10 +640,10 @@ Value verifychain(const Array& params, bool fHelp)
 }
 
 /** Implementation of IsSuperMajority with better feedback */
-Object SoftForkMajorityDesc(int minVersion, CBlockIndex* pindex, int nRequired, const Consensus::Params& consensusParams)
+Object SoftForkMajorityDesc(int minVersion, const CBlockIndex* pindex, int nRequired, const Consensus::Params& consensusParams)
 {
     int nFound = 0;
-    CBlockIndex* pstart = pindex;
+    const CBlockIndex* pstart = pindex;
     for (int i = 0; i < consensusParams.nMajorityWindow && pstart != NULL; i++)
     {
         if (pstart->nVersion >= minVersion)
@@ -520,7 +659,7 @@ Object SoftForkMajorityDesc(int minVersion, CBlockIndex* pindex, int nRequired,
     return rv;
 }
 
-Object SoftForkDesc(const std::string &name, int version, CBlockIndex* pindex, const Consensus::Params& consensusParams)
+Object SoftForkDesc(const std::string &name, int version, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
     Object rv;
     rv.push_back(Pair("id", name));
@@ -564,20 +703,22 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             + HelpExampleRpc("getblockchaininfo", "")
         );
 
-    LOCK(cs_main);
+    // Everything but the prune height is about the tip, and the tip's ancestors
+    // never change, so the snapshot is all that's needed
+    boost::shared_ptr<const CChainTipSnapshot> snapshot = GetChainTipSnapshot();
+    const CBlockIndex* tip = snapshot->pindexTip;
 
     Object obj;
     obj.push_back(Pair("chain",                 Params().NetworkIDString()));
-    obj.push_back(Pair("blocks",                (int)chainActive.Height()));
-    obj.push_back(Pair("headers",               pindexBestHeader ? pindexBestHeader->nHeight : -1));
-    obj.push_back(Pair("bestblockhash",         chainActive.Tip()->GetBlockHash().GetHex()));
-    obj.push_back(Pair("difficulty",            (double)GetNetworkDifficulty()));
-    obj.push_back(Pair("verificationprogress",  Checkpoints::GuessVerificationProgress(Params().Checkpoints(), chainActive.Tip())));
-    obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("blocks",                snapshot->nHeight));
+    obj.push_back(Pair("headers",               snapshot->nHeadersHeight));
+    obj.push_back(Pair("bestblockhash",         snapshot->hashBestBlock.GetHex()));
+    obj.push_back(Pair("difficulty",            GetNetworkDifficulty(*snapshot)));
+    obj.push_back(Pair("verificationprogress",  Checkpoints::GuessVerificationProgress(Params().Checkpoints(), tip)));
+    obj.push_back(Pair("chainwork",             snapshot->nChainWork.GetHex()));
     obj.push_back(Pair("pruned",                fPruneMode));
 
     const Consensus::Params& consensusParams = Params().GetConsensus();
-    CBlockIndex* tip = chainActive.Tip();
     Array softforks;
     softforks.push_back(SoftForkDesc("bip34", 2, tip, consensusParams));
     softforks.push_back(SoftForkDesc("bip66", 3, tip, consensusParams));
@@ -586,6 +727,7 @@ Value getblockchaininfo(const Array& params, bool fHelp)
 
     if (fPruneMode)
     {
+        LOCK(cs_main);
         CBlockIndex *block = chainActive.Tip();
         while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
             block = block->pprev;
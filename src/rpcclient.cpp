@@ -25,6 +25,11 @@ static const CRPCConvertParam vRPCConvertParams[] =
 {
     { "stop", 0 },
     { "setmocktime", 0 },
+    { "getaddressdeltas", 0 },
+    { "getaddressbalance", 0 },
+    { "getaddresstxids", 0 },
+    { "getaddressutxos", 0 },
+    { "getspentinfo", 0 },
     { "getaddednodeinfo", 0 },
     { "setgenerate", 0 },
     { "setgenerate", 1 },
@@ -103,6 +108,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "z_gettotalbalance", 0},
     { "z_sendmany", 1},
     { "z_sendmany", 2},
+    { "z_sendmanybatch", 1},
+    { "z_sendmanybatch", 2},
     { "z_getoperationstatus", 0},
     { "z_getoperationresult", 0},
     { "z_importkey", 1 }
@@ -0,0 +1,462 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcjson.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <boost/foreach.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+//! Deepest nesting of objects and arrays ParseJSON accepts
+static const int MAX_JSON_DEPTH = 512;
+
+void CJSONWriter::Separator()
+{
+    if (fAfterKey) {
+        fAfterKey = false;
+        return;
+    }
+    if (!vEmpty.empty()) {
+        if (!vEmpty.back())
+            strOut += ',';
+        vEmpty.back() = false;
+    }
+}
+
+void CJSONWriter::Escaped(const std::string& str)
+{
+    static const char* hexdigits = "0123456789ABCDEF";
+
+    strOut += '"';
+    for (std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+    {
+        unsigned char c = *it;
+        switch (c)
+        {
+            case '"':  strOut += "\\\""; break;
+            case '\\': strOut += "\\\\"; break;
+            case '\b': strOut += "\\b";  break;
+            case '\f': strOut += "\\f";  break;
+            case '\n': strOut += "\\n";  break;
+            case '\r': strOut += "\\r";  break;
+            case '\t': strOut += "\\t";  break;
+            default:
+                // Like json_spirit, escape everything that isn't printable ASCII
+                if (c >= 0x20 && c < 0x7f) {
+                    strOut += c;
+                } else {
+                    strOut += "\\u00";
+                    strOut += hexdigits[c >> 4];
+                    strOut += hexdigits[c & 0xf];
+                }
+        }
+    }
+    strOut += '"';
+}
+
+void CJSONWriter::BeginObject()
+{
+    Separator();
+    strOut += '{';
+    vEmpty.push_back(true);
+}
+
+void CJSONWriter::EndObject()
+{
+    strOut += '}';
+    vEmpty.pop_back();
+}
+
+void CJSONWriter::BeginArray()
+{
+    Separator();
+    strOut += '[';
+    vEmpty.push_back(true);
+}
+
+void CJSONWriter::EndArray()
+{
+    strOut += ']';
+    vEmpty.pop_back();
+}
+
+void CJSONWriter::Key(const std::string& strKey)
+{
+    Separator();
+    Escaped(strKey);
+    strOut += ':';
+    fAfterKey = true;
+}
+
+void CJSONWriter::Null()
+{
+    Separator();
+    strOut += "null";
+}
+
+void CJSONWriter::Bool(bool fValue)
+{
+    Separator();
+    strOut += fValue ? "true" : "false";
+}
+
+void CJSONWriter::Int(int64_t nValue)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%" PRId64, nValue);
+    Separator();
+    strOut += buf;
+}
+
+void CJSONWriter::Uint(uint64_t nValue)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%" PRIu64, nValue);
+    Separator();
+    strOut += buf;
+}
+
+void CJSONWriter::Real(double dValue)
+{
+    // json_spirit writes reals with std::fixed and a precision of 8
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%.8f", dValue);
+    Separator();
+    strOut += buf;
+}
+
+void CJSONWriter::String(const std::string& strValue)
+{
+    Separator();
+    Escaped(strValue);
+}
+
+void CJSONWriter::Write(const Value& value)
+{
+    switch (value.type())
+    {
+        case obj_type:
+            BeginObject();
+            BOOST_FOREACH(const Pair& pair, value.get_obj()) {
+                Key(pair.name_);
+                Write(pair.value_);
+            }
+            EndObject();
+            break;
+        case array_type:
+            BeginArray();
+            BOOST_FOREACH(const Value& v, value.get_array())
+                Write(v);
+            EndArray();
+            break;
+        case str_type:
+            String(value.get_str());
+            break;
+        case bool_type:
+            Bool(value.get_bool());
+            break;
+        case int_type:
+            if (value.is_uint64())
+                Uint(value.get_uint64());
+            else
+                Int(value.get_int64());
+            break;
+        case real_type:
+            Real(value.get_real());
+            break;
+        case null_type:
+            Null();
+            break;
+    }
+}
+
+void CJSONWriter::Raw(const std::string& strJSON)
+{
+    Separator();
+    strOut += strJSON;
+}
+
+void CJSONWriter::Clear()
+{
+    strOut.clear();
+    vEmpty.clear();
+    fAfterKey = false;
+}
+
+
+/**
+ * Recursive descent JSON parser. Values are parsed in place into their
+ * parent object or array, so nothing is copied once parsed (except when the
+ * parent grows).
+ */
+class CJSONParser
+{
+public:
+    CJSONParser(const std::string& str) : p(str.data()), end(str.data() + str.size()) {}
+
+    bool ParseDocument(Value& value)
+    {
+        SkipWhitespace();
+        if (!ParseValue(value, 0))
+            return false;
+        SkipWhitespace();
+        return p == end;
+    }
+
+private:
+    const char* p;
+    const char* end;
+
+    void SkipWhitespace()
+    {
+        while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '\f' || *p == '\v'))
+            p++;
+    }
+
+    bool Consume(const char* literal)
+    {
+        const char* q = p;
+        for (; *literal; literal++, q++)
+            if (q == end || *q != *literal)
+                return false;
+        p = q;
+        return true;
+    }
+
+    bool ParseValue(Value& value, int nDepth)
+    {
+        if (p == end)
+            return false;
+        switch (*p)
+        {
+            case '{':
+                return ParseObject(value, nDepth + 1);
+            case '[':
+                return ParseArray(value, nDepth + 1);
+            case '"': {
+                std::string str;
+                if (!ParseString(str))
+                    return false;
+                value = Value(str);
+                return true;
+            }
+            case 't':
+                value = Value(true);
+                return Consume("true");
+            case 'f':
+                value = Value(false);
+                return Consume("false");
+            case 'n':
+                value = Value();
+                return Consume("null");
+            default:
+                return ParseNumber(value);
+        }
+    }
+
+    bool ParseObject(Value& value, int nDepth)
+    {
+        if (nDepth > MAX_JSON_DEPTH)
+            return false;
+        p++;
+        value = Object();
+        Object& obj = value.get_obj();
+        SkipWhitespace();
+        if (p != end && *p == '}') {
+            p++;
+            return true;
+        }
+        while (true)
+        {
+            std::string strName;
+            if (p == end || *p != '"' || !ParseString(strName))
+                return false;
+            SkipWhitespace();
+            if (p == end || *p != ':')
+                return false;
+            p++;
+            SkipWhitespace();
+            obj.push_back(Pair(strName, Value()));
+            if (!ParseValue(obj.back().value_, nDepth))
+                return false;
+            SkipWhitespace();
+            if (p == end)
+                return false;
+            if (*p == '}') {
+                p++;
+                return true;
+            }
+            if (*p != ',')
+                return false;
+            p++;
+            SkipWhitespace();
+        }
+    }
+
+    bool ParseArray(Value& value, int nDepth)
+    {
+        if (nDepth > MAX_JSON_DEPTH)
+            return false;
+        p++;
+        value = Array();
+        Array& arr = value.get_array();
+        SkipWhitespace();
+        if (p != end && *p == ']') {
+            p++;
+            return true;
+        }
+        while (true)
+        {
+            arr.push_back(Value());
+            if (!ParseValue(arr.back(), nDepth))
+                return false;
+            SkipWhitespace();
+            if (p == end)
+                return false;
+            if (*p == ']') {
+                p++;
+                return true;
+            }
+            if (*p != ',')
+                return false;
+            p++;
+            SkipWhitespace();
+        }
+    }
+
+    static int HexDigit(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool ParseHex(int nDigits, unsigned int& n)
+    {
+        n = 0;
+        for (int i = 0; i < nDigits; i++, p++) {
+            int d = (p == end) ? -1 : HexDigit(*p);
+            if (d < 0)
+                return false;
+            n = (n << 4) | d;
+        }
+        return true;
+    }
+
+    bool ParseString(std::string& str)
+    {
+        p++;
+        while (true)
+        {
+            // Copy runs of plain characters at once
+            const char* q = p;
+            while (q != end && *q != '"' && *q != '\\')
+                q++;
+            str.append(p, q);
+            p = q;
+            if (p == end)
+                return false;
+            if (*p++ == '"')
+                return true;
+
+            if (p == end)
+                return false;
+            unsigned int c;
+            switch (*p++)
+            {
+                case '"':  str += '"';  break;
+                case '\\': str += '\\'; break;
+                case '/':  str += '/';  break;
+                case 'b':  str += '\b'; break;
+                case 'f':  str += '\f'; break;
+                case 'n':  str += '\n'; break;
+                case 'r':  str += '\r'; break;
+                case 't':  str += '\t'; break;
+                case 'x':
+                    // json_spirit extension
+                    if (!ParseHex(2, c))
+                        return false;
+                    str += (char)c;
+                    break;
+                case 'u':
+                    // Like json_spirit, keep the low byte only. This is what
+                    // makes the bytes CJSONWriter escapes as \u00XX round-trip.
+                    if (!ParseHex(4, c))
+                        return false;
+                    str += (char)c;
+                    break;
+                default:
+                    return false;
+            }
+        }
+    }
+
+    bool ParseNumber(Value& value)
+    {
+        const char* start = p;
+        bool fReal = false;
+        if (p != end && (*p == '-' || *p == '+'))
+            p++;
+        const char* digits = p;
+        while (p != end && *p >= '0' && *p <= '9')
+            p++;
+        if (p != end && *p == '.') {
+            fReal = true;
+            p++;
+            while (p != end && *p >= '0' && *p <= '9')
+                p++;
+        }
+        if (p == digits || (p == digits + 1 && *digits == '.'))
+            return false;
+        if (p != end && (*p == 'e' || *p == 'E')) {
+            fReal = true;
+            p++;
+            if (p != end && (*p == '-' || *p == '+'))
+                p++;
+            const char* exponent = p;
+            while (p != end && *p >= '0' && *p <= '9')
+                p++;
+            if (p == exponent)
+                return false;
+        }
+
+        std::string strNumber(start, p);
+        char* pEnd;
+        errno = 0;
+        if (fReal) {
+            double d = strtod(strNumber.c_str(), &pEnd);
+            if (*pEnd != 0 || errno == ERANGE)
+                return false;
+            value = Value(d);
+        } else if (*start == '-') {
+            long long n = strtoll(strNumber.c_str(), &pEnd, 10);
+            if (*pEnd != 0 || errno == ERANGE)
+                return false;
+            value = Value((int64_t)n);
+        } else {
+            unsigned long long n = strtoull(strNumber.c_str(), &pEnd, 10);
+            if (*pEnd != 0 || errno == ERANGE)
+                return false;
+            // Like json_spirit, only use uint64 for what doesn't fit in an int64
+            if (n <= (unsigned long long)INT64_MAX)
+                value = Value((int64_t)n);
+            else
+                value = Value((uint64_t)n);
+        }
+        return true;
+    }
+};
+
+bool ParseJSON(const std::string& strJSON, Value& value)
+{
+    CJSONParser parser(strJSON);
+    return parser.ParseDocument(value);
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCJSON_H
+#define BITCOIN_RPCJSON_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "json/json_spirit_value.h"
+
+/**
+ * Writes JSON text into a string as it is produced, so a large result doesn't
+ * have to be built as a tree of json_spirit values first. The output is the
+ * same as json_spirit's write_string(value, false).
+ *
+ * Members of objects are written as a Key followed by a value:
+ *
+ *     writer.BeginObject();
+ *     writer.Key("height");
+ *     writer.Int(nHeight);
+ *     writer.EndObject();
+ */
+class CJSONWriter
+{
+public:
+    CJSONWriter() : fAfterKey(false) {}
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+
+    void Null();
+    void Bool(bool fValue);
+    void Int(int64_t nValue);
+    void Uint(uint64_t nValue);
+    void Real(double dValue);
+    void String(const std::string& strValue);
+
+    //! Write a json_spirit value, e.g. one returned by a regular RPC call
+    void Write(const json_spirit::Value& value);
+    //! Write a value that is already serialized as JSON
+    void Raw(const std::string& strJSON);
+
+    //! The JSON text written so far
+    std::string& str() { return strOut; }
+    void Clear();
+
+private:
+    std::string strOut;
+    //! For each object or array being written, whether it is still empty
+    std::vector<bool> vEmpty;
+    bool fAfterKey;
+
+    void Separator();
+    void Escaped(const std::string& str);
+};
+
+/**
+ * Parse JSON text into a json_spirit value. Gives the same values as
+ * json_spirit's read_string for valid JSON, without the cost of its generic
+ * parser. Returns false if the text isn't a single valid JSON value.
+ */
+bool ParseJSON(const std::string& strJSON, json_spirit::Value& value);
+
+#endif // BITCOIN_RPCJSON_H
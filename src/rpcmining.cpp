@@ -33,16 +33,12 @@ using namespace json_spirit;
 using namespace std;
 
 /**
- * Return average network hashes per second based on the last 'lookup' blocks,
- * or over the difficulty averaging window if 'lookup' is nonpositive.
- * If 'height' is nonnegative, compute the estimate at the time when a given block was found.
+ * Return average network hashes per second based on the last 'lookup' blocks
+ * before and including 'pb', or over the difficulty averaging window if
+ * 'lookup' is nonpositive. Only reads what doesn't change once a block is in
+ * the index, so it doesn't need cs_main.
  */
-int64_t GetNetworkHashPS(int lookup, int height) {
-    CBlockIndex *pb = chainActive.Tip();
-
-    if (height >= 0 && height < chainActive.Height())
-        pb = chainActive[height];
-
+int64_t GetNetworkHashPS(int lookup, const CBlockIndex* pb) {
     if (pb == NULL || !pb->nHeight)
         return 0;
 
@@ -54,7 +50,7 @@ int64_t GetNetworkHashPS(int lookup, int height) {
     if (lookup > pb->nHeight)
         lookup = pb->nHeight;
 
-    CBlockIndex *pb0 = pb;
+    const CBlockIndex *pb0 = pb;
     int64_t minTime = pb0->GetBlockTime();
     int64_t maxTime = minTime;
     for (int i = 0; i < lookup; i++) {
@@ -74,6 +70,19 @@ int64_t GetNetworkHashPS(int lookup, int height) {
     return (int64_t)(workDiff.getdouble() / timeDiff);
 }
 
+/**
+ * Same as above, at the tip of the active chain. If 'height' is nonnegative,
+ * compute the estimate at the time when a given block was found.
+ */
+int64_t GetNetworkHashPS(int lookup, int height) {
+    CBlockIndex *pb = chainActive.Tip();
+
+    if (height >= 0 && height < chainActive.Height())
+        pb = chainActive[height];
+
+    return GetNetworkHashPS(lookup, pb);
+}
+
 Value getnetworkhashps(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -92,8 +101,13 @@ Value getnetworkhashps(const Array& params, bool fHelp)
             + HelpExampleRpc("getnetworkhashps", "")
        );
 
+    int lookup = params.size() > 0 ? params[0].get_int() : 120;
+    int height = params.size() > 1 ? params[1].get_int() : -1;
+    if (height < 0)
+        return GetNetworkHashPS(lookup, GetChainTipSnapshot()->pindexTip);
+
     LOCK(cs_main);
-    return GetNetworkHashPS(params.size() > 0 ? params[0].get_int() : 120, params.size() > 1 ? params[1].get_int() : -1);
+    return GetNetworkHashPS(lookup, height);
 }
 
 #ifdef ENABLE_WALLET
@@ -287,22 +301,22 @@ Value getmininginfo(const Array& params, bool fHelp)
             + HelpExampleRpc("getmininginfo", "")
         );
 
-
-    LOCK(cs_main);
+    // Served from the chain tip snapshot, so polling this doesn't hold up block validation
+    boost::shared_ptr<const CChainTipSnapshot> snapshot = GetChainTipSnapshot();
 
     Object obj;
-    obj.push_back(Pair("blocks",           (int)chainActive.Height()));
+    obj.push_back(Pair("blocks",           snapshot->nHeight));
     obj.push_back(Pair("currentblocksize", (uint64_t)nLastBlockSize));
     obj.push_back(Pair("currentblocktx",   (uint64_t)nLastBlockTx));
-    obj.push_back(Pair("difficulty",       (double)GetNetworkDifficulty()));
+    obj.push_back(Pair("difficulty",       GetNetworkDifficulty(*snapshot)));
     obj.push_back(Pair("errors",           GetWarnings("statusbar")));
     obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", -1)));
-    obj.push_back(Pair("networkhashps",    getnetworkhashps(params, false)));
+    obj.push_back(Pair("networkhashps",    GetNetworkHashPS(120, snapshot->pindexTip)));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",          Params().TestnetToBeDeprecatedFieldRPC()));
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
 #ifdef ENABLE_WALLET
-    obj.push_back(Pair("generate",         getgenerate(params, false)));
+    obj.push_back(Pair("generate",         GetBoolArg("-gen", false)));
 #endif
     return obj;
 }
@@ -460,7 +474,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end()) {
                 CBlockIndex *pindex = mi->second;
-                if (pindex->IsValid(BLOCK_VALID_SCRIPTS))
+                if (pindex->IsValidOrAssumed(BLOCK_VALID_SCRIPTS))
                     return "duplicate";
                 if (pindex->nStatus & BLOCK_FAILED_MASK)
                     return "duplicate-invalid";
@@ -703,7 +717,7 @@ Value submitblock(const Array& params, bool fHelp)
         BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end()) {
             CBlockIndex *pindex = mi->second;
-            if (pindex->IsValid(BLOCK_VALID_SCRIPTS))
+            if (pindex->IsValidOrAssumed(BLOCK_VALID_SCRIPTS))
                 return "duplicate";
             if (pindex->nStatus & BLOCK_FAILED_MASK)
                 return "duplicate-invalid";
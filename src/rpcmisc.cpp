@@ -3,6 +3,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "addressindex.h"
 #include "base58.h"
 #include "clientversion.h"
 #include "init.h"
@@ -11,6 +12,7 @@
 #include "netbase.h"
 #include "rpcserver.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
@@ -460,3 +462,402 @@ Value setmocktime(const Array& params, bool fHelp)
 
     return Value::null;
 }
+
+/** Maximum number of entries a paginated address index query returns at once */
+static const unsigned int MAX_ADDRESSINDEX_RESULTS = 100000;
+
+/** Wait for an index to cover the chain tip, so that queries see the blocks already connected */
+static void EnsureIndexAvailable(const CBaseIndex* pindexer, const string& strName)
+{
+    if (!pindexer)
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("The %s is not enabled, restart with -%s", strName, strName));
+    if (!pindexer->BlockUntilSyncedToCurrentChain())
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("The %s is still being built", strName));
+}
+
+static vector<pair<AddressIndexType, uint160> > ParseAddressesParam(const Object& o)
+{
+    const Value& addressesVal = find_value(o, "addresses");
+    if (addressesVal.type() != array_type)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, addresses must be an array");
+
+    vector<pair<AddressIndexType, uint160> > vAddresses;
+    BOOST_FOREACH(const Value& addressVal, addressesVal.get_array()) {
+        if (addressVal.type() != str_type)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        CBitcoinAddress address(addressVal.get_str());
+        uint160 hashBytes;
+        AddressIndexType type = ADDRESSINDEX_NONE;
+        if (address.IsValid())
+            type = GetScriptAddress(GetScriptForDestination(address.Get()), hashBytes);
+        if (type == ADDRESSINDEX_NONE)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address: " + addressVal.get_str());
+        vAddresses.push_back(make_pair(type, hashBytes));
+    }
+    return vAddresses;
+}
+
+static string AddressIndexToString(unsigned char type, const uint160& hashBytes)
+{
+    if (type == ADDRESSINDEX_P2SH)
+        return CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    return CBitcoinAddress(CKeyID(hashBytes)).ToString();
+}
+
+static int ParseIntParam(const Object& o, const string& strName, int nDefault)
+{
+    const Value& val = find_value(o, strName);
+    if (val.type() == null_type)
+        return nDefault;
+    if (val.type() != int_type || val.get_int() < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, " + strName + " must be a non-negative integer");
+    return val.get_int();
+}
+
+static string EncodeAddressIndexCursor(const CAddressIndexKey& key)
+{
+    CDataStream ssKey(SER_NETWORK, PROTOCOL_VERSION);
+    ssKey << key;
+    return HexStr(ssKey.begin(), ssKey.end());
+}
+
+/** Parse the "limit" and "cursor" of a paginated query of a single address */
+static bool ParsePagination(const Object& o, const vector<pair<AddressIndexType, uint160> >& vAddresses,
+                            unsigned int& nLimit, CAddressIndexKey& cursor)
+{
+    nLimit = ParseIntParam(o, "limit", 0);
+    const Value& cursorVal = find_value(o, "cursor");
+    if (nLimit == 0 && cursorVal.type() == null_type)
+        return false;
+    if (nLimit == 0 || nLimit > MAX_ADDRESSINDEX_RESULTS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Invalid parameter, limit must be between 1 and %u", MAX_ADDRESSINDEX_RESULTS));
+    if (vAddresses.size() != 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, a limit requires exactly one address");
+    if (cursorVal.type() != null_type) {
+        if (cursorVal.type() != str_type || !IsHex(cursorVal.get_str()))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        vector<unsigned char> vch = ParseHex(cursorVal.get_str());
+        CDataStream ssKey(vch, SER_NETWORK, PROTOCOL_VERSION);
+        try {
+            ssKey >> cursor;
+        } catch (const std::exception&) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        }
+        if (cursor.type != vAddresses[0].first || cursor.hashBytes != vAddresses[0].second)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor, it belongs to another address");
+    }
+    return true;
+}
+
+Value getaddressdeltas(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressdeltas {\"addresses\": [\"address\",...], \"start\": n, \"end\": n, \"limit\": n, \"cursor\": \"cursor\"}\n"
+            "\nReturns the changes to the balance of addresses, ordered by where they are in the chain (requires -addressindex).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"addresses\"       (array, required) The transparent addresses\n"
+            "  \"start\"           (numeric, optional) The first block height to include\n"
+            "  \"end\"             (numeric, optional) The last block height to include\n"
+            "  \"limit\"           (numeric, optional) Return at most this many deltas, for a single address\n"
+            "  \"cursor\"          (string, optional) Continue after the deltas returned by a previous call\n"
+            "}\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"satoshis\"  (numeric) The change of balance, negative for spends\n"
+            "    \"txid\"      (string) The transaction id\n"
+            "    \"index\"     (numeric) The output index, or the input index for spends\n"
+            "    \"blockindex\" (numeric) The position of the transaction in its block\n"
+            "    \"height\"    (numeric) The block height\n"
+            "    \"address\"   (string) The address\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nWith a limit or a cursor, the result is an object holding the \"deltas\" array, and a \"cursor\"\n"
+            "to pass to the next call if there may be more deltas.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}'")
+            + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"limit\": 1000}")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(obj_type));
+    EnsureIndexAvailable(paddressindex, "addressindex");
+
+    const Object& o = params[0].get_obj();
+    vector<pair<AddressIndexType, uint160> > vAddresses = ParseAddressesParam(o);
+    int nStart = ParseIntParam(o, "start", 0);
+    int nEnd = ParseIntParam(o, "end", 0);
+    if (nEnd > 0 && nEnd < nStart)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, end must not be below start");
+    unsigned int nLimit;
+    CAddressIndexKey cursor;
+    bool fPaginated = ParsePagination(o, vAddresses, nLimit, cursor);
+
+    AddressIndexEntries vAddressIndex;
+    for (unsigned int i = 0; i < vAddresses.size(); i++) {
+        bool fCursor = fPaginated && !cursor.txhash.IsNull();
+        if (!pblocktree->ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, nStart, nEnd,
+                                          fCursor ? &cursor : NULL, nLimit, vAddressIndex))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+    }
+
+    Array deltas;
+    BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, CAmount)& entry, vAddressIndex) {
+        Object delta;
+        delta.push_back(Pair("satoshis", entry.second));
+        delta.push_back(Pair("txid", entry.first.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)entry.first.nIndex));
+        delta.push_back(Pair("blockindex", (int)entry.first.nTxIndex));
+        delta.push_back(Pair("height", entry.first.nHeight));
+        delta.push_back(Pair("address", AddressIndexToString(entry.first.type, entry.first.hashBytes)));
+        deltas.push_back(delta);
+    }
+
+    if (!fPaginated)
+        return deltas;
+
+    Object result;
+    result.push_back(Pair("deltas", deltas));
+    if (vAddressIndex.size() == nLimit)
+        result.push_back(Pair("cursor", EncodeAddressIndexCursor(vAddressIndex.back().first)));
+    return result;
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance {\"addresses\": [\"address\",...]}\n"
+            "\nReturns the balance of addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"addresses\"       (array, required) The transparent addresses\n"
+            "}\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\"    (numeric) The current balance in satoshis\n"
+            "  \"received\"   (numeric) The total received in satoshis, including change\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}'")
+            + HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(obj_type));
+    EnsureIndexAvailable(paddressindex, "addressindex");
+
+    vector<pair<AddressIndexType, uint160> > vAddresses = ParseAddressesParam(params[0].get_obj());
+
+    // Sum the entries a chunk at a time, so that busy addresses don't need to fit in memory
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    for (unsigned int i = 0; i < vAddresses.size(); i++) {
+        AddressIndexEntries vAddressIndex;
+        CAddressIndexKey cursor;
+        do {
+            vAddressIndex.clear();
+            if (!pblocktree->ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, 0, 0,
+                                              cursor.txhash.IsNull() ? NULL : &cursor, MAX_ADDRESSINDEX_RESULTS, vAddressIndex))
+                throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+            BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, CAmount)& entry, vAddressIndex) {
+                if (entry.second > 0)
+                    nReceived += entry.second;
+                nBalance += entry.second;
+            }
+            if (!vAddressIndex.empty())
+                cursor = vAddressIndex.back().first;
+        } while (vAddressIndex.size() == MAX_ADDRESSINDEX_RESULTS);
+    }
+
+    Object result;
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+    return result;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids {\"addresses\": [\"address\",...], \"start\": n, \"end\": n}\n"
+            "\nReturns the ids of the transactions paying or spending from addresses, in chain order (requires -addressindex).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"addresses\"       (array, required) The transparent addresses\n"
+            "  \"start\"           (numeric, optional) The first block height to include\n"
+            "  \"end\"             (numeric, optional) The last block height to include\n"
+            "}\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"transactionid\"  (string) The transaction id\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}'")
+            + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000}")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(obj_type));
+    EnsureIndexAvailable(paddressindex, "addressindex");
+
+    const Object& o = params[0].get_obj();
+    vector<pair<AddressIndexType, uint160> > vAddresses = ParseAddressesParam(o);
+    int nStart = ParseIntParam(o, "start", 0);
+    int nEnd = ParseIntParam(o, "end", 0);
+    if (nEnd > 0 && nEnd < nStart)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, end must not be below start");
+
+    // A transaction is identified by its height and position in its block, which also orders them
+    map<pair<int, unsigned int>, uint256> mapTxids;
+    for (unsigned int i = 0; i < vAddresses.size(); i++) {
+        AddressIndexEntries vAddressIndex;
+        if (!pblocktree->ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, nStart, nEnd, NULL, 0, vAddressIndex))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+        BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, CAmount)& entry, vAddressIndex)
+            mapTxids[make_pair(entry.first.nHeight, entry.first.nTxIndex)] = entry.first.txhash;
+    }
+
+    Array result;
+    for (map<pair<int, unsigned int>, uint256>::const_iterator it = mapTxids.begin(); it != mapTxids.end(); it++)
+        result.push_back(it->second.GetHex());
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos {\"addresses\": [\"address\",...], \"limit\": n, \"cursor\": \"cursor\"}\n"
+            "\nReturns the unspent outputs of addresses in the chain (requires -addressindex).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"addresses\"       (array, required) The transparent addresses\n"
+            "  \"limit\"           (numeric, optional) Return at most this many outputs, for a single address\n"
+            "  \"cursor\"          (string, optional) Continue after the outputs returned by a previous call\n"
+            "}\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\"       (string) The address\n"
+            "    \"txid\"          (string) The transaction id\n"
+            "    \"outputIndex\"   (numeric) The output index\n"
+            "    \"script\"        (string) The script hex\n"
+            "    \"satoshis\"      (numeric) The value of the output in satoshis\n"
+            "    \"height\"        (numeric) The block height\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nWith a limit or a cursor, the result is an object holding the \"utxos\" array, and a \"cursor\"\n"
+            "to pass to the next call if there may be more outputs.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}'")
+            + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"limit\": 1000}")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(obj_type));
+    EnsureIndexAvailable(paddressindex, "addressindex");
+
+    const Object& o = params[0].get_obj();
+    vector<pair<AddressIndexType, uint160> > vAddresses = ParseAddressesParam(o);
+    unsigned int nLimit;
+    CAddressIndexKey cursor;
+    bool fPaginated = ParsePagination(o, vAddresses, nLimit, cursor);
+
+    // The index has every output an address received; the ones still unspent are
+    // those in the UTXO set
+    LOCK(cs_main);
+
+    Array utxos;
+    bool fMore = false;
+    for (unsigned int i = 0; i < vAddresses.size() && !fMore; i++) {
+        AddressIndexEntries vAddressIndex;
+        CAddressIndexKey after = cursor;
+        do {
+            vAddressIndex.clear();
+            if (!pblocktree->ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, 0, 0,
+                                              after.txhash.IsNull() ? NULL : &after, MAX_ADDRESSINDEX_RESULTS, vAddressIndex))
+                throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+            BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, CAmount)& entry, vAddressIndex) {
+                after = entry.first;
+                if (entry.first.fSpending)
+                    continue;
+                CCoins coins;
+                if (!pcoinsTip->GetCoins(entry.first.txhash, coins) || !coins.IsAvailable(entry.first.nIndex))
+                    continue;
+                const CScript& script = coins.vout[entry.first.nIndex].scriptPubKey;
+                Object utxo;
+                utxo.push_back(Pair("address", AddressIndexToString(entry.first.type, entry.first.hashBytes)));
+                utxo.push_back(Pair("txid", entry.first.txhash.GetHex()));
+                utxo.push_back(Pair("outputIndex", (int)entry.first.nIndex));
+                utxo.push_back(Pair("script", HexStr(script.begin(), script.end())));
+                utxo.push_back(Pair("satoshis", entry.second));
+                utxo.push_back(Pair("height", entry.first.nHeight));
+                utxos.push_back(utxo);
+                if (fPaginated && utxos.size() == nLimit) {
+                    cursor = after;
+                    fMore = true;
+                    break;
+                }
+            }
+        } while (!fMore && vAddressIndex.size() == MAX_ADDRESSINDEX_RESULTS);
+    }
+
+    if (!fPaginated)
+        return utxos;
+
+    Object result;
+    result.push_back(Pair("utxos", utxos));
+    if (fMore)
+        result.push_back(Pair("cursor", EncodeAddressIndexCursor(cursor)));
+    return result;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getspentinfo {\"txid\": \"txid\", \"index\": n}\n"
+            "\nReturns where an output was spent in the chain (requires -spentindex).\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"txid\"            (string, required) The id of the transaction holding the output\n"
+            "  \"index\"           (numeric, required) The output index\n"
+            "}\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\"      (string) The id of the spending transaction\n"
+            "  \"index\"     (numeric) The input index\n"
+            "  \"height\"    (numeric) The height of the block holding the spending transaction\n"
+            "  \"satoshis\"  (numeric) The value of the output in satoshis\n"
+            "  \"address\"   (string, optional) The address the output paid, if it is a known kind\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'")
+            + HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(obj_type));
+    EnsureIndexAvailable(pspentindex, "spentindex");
+
+    const Object& o = params[0].get_obj();
+    RPCTypeCheck(o, boost::assign::map_list_of("txid", str_type)("index", int_type));
+    uint256 txid = ParseHashO(o, "txid");
+    int nOutput = find_value(o, "index").get_int();
+    if (nOutput < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, index must be non-negative");
+
+    CSpentIndexValue value;
+    if (!pblocktree->ReadSpentIndex(CSpentIndexKey(txid, nOutput), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object result;
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("index", (int)value.nInput));
+    result.push_back(Pair("height", value.nHeight));
+    result.push_back(Pair("satoshis", value.nValue));
+    if (value.addressType != ADDRESSINDEX_NONE)
+        result.push_back(Pair("address", AddressIndexToString(value.addressType, value.addressHash)));
+    return result;
+}
@@ -106,7 +106,11 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"download_window\": n,      (numeric) How many blocks we keep requested from this peer at once\n"
+            "    \"download_rtt\": n,         (numeric) Smoothed round trip time of block requests to this peer, in seconds\n"
+            "    \"download_rate\": n,        (numeric) Smoothed block download rate from this peer, in bytes per second\n"
+            "    \"blocks_downloaded\": n,    (numeric) The number of requested blocks this peer has delivered\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -156,6 +160,10 @@ Value getpeerinfo(const Array& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("download_window", statestats.nDownloadWindow));
+            obj.push_back(Pair("download_rtt", statestats.nBlockRTT / 1e6));
+            obj.push_back(Pair("download_rate", statestats.nBlockBytesPerSecond));
+            obj.push_back(Pair("blocks_downloaded", statestats.nBlocksDownloaded));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -31,6 +31,9 @@ using namespace json_spirit;
 //! Number of bytes to allocate and read at most at once in post data
 const size_t POST_READ_SIZE = 256 * 1024;
 
+//! Maximum size of the request line and headers of a buffered request
+const size_t MAX_HEADERS_SIZE = 8192;
+
 /**
  * HTTP protocol
  * 
@@ -68,6 +71,7 @@ static const char *httpStatusDescription(int nStatus)
         case HTTP_FORBIDDEN: return "Forbidden";
         case HTTP_NOT_FOUND: return "Not Found";
         case HTTP_INTERNAL_SERVER_ERROR: return "Internal Server Error";
+        case HTTP_SERVICE_UNAVAILABLE: return "Service Unavailable";
         default: return "";
     }
 }
@@ -126,6 +130,29 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive,
     }
 }
 
+string HTTPReplyChunkedHeader(int nStatus, bool keepalive, const char *contentType)
+{
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: %s\r\n"
+            "Server: bitcoin-json-rpc/%s\r\n"
+            "\r\n",
+        nStatus,
+        httpStatusDescription(nStatus),
+        rfc1123Time(),
+        keepalive ? "keep-alive" : "close",
+        contentType,
+        FormatFullVersion());
+}
+
+string HTTPChunk(const string& strData)
+{
+    return strprintf("%x\r\n", strData.size()) + strData + "\r\n";
+}
+
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          string& http_method, string& http_uri)
 {
@@ -244,6 +271,51 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
     return HTTP_OK;
 }
 
+int ParseHTTPRequest(const string& buffer, size_t max_size, int &proto,
+                     string& http_method, string& http_uri,
+                     map<string, string>& mapHeadersRet, string& strMessageRet,
+                     size_t* pnSizeRet)
+{
+    // Empty lines between pipelined requests are allowed
+    size_t nStart = buffer.find_first_not_of("\r\n");
+    if (nStart == string::npos)
+        return buffer.size() > MAX_HEADERS_SIZE ? -1 : 0;
+
+    // Wait for the empty line ending the headers
+    size_t nHeaderEnd = string::npos;
+    size_t nPos = buffer.find("\n\r\n", nStart);
+    if (nPos != string::npos)
+        nHeaderEnd = nPos + 3;
+    nPos = buffer.find("\n\n", nStart);
+    if (nPos != string::npos && nPos + 2 < nHeaderEnd)
+        nHeaderEnd = nPos + 2;
+    if (nHeaderEnd == string::npos)
+        return buffer.size() - nStart > MAX_HEADERS_SIZE ? -1 : 0;
+    if (nHeaderEnd - nStart > MAX_HEADERS_SIZE)
+        return -1;
+
+    // Find the length of the body, and wait for all of it
+    istringstream ssHeaders(buffer.substr(nStart, nHeaderEnd - nStart));
+    map<string, string> mapHeaders;
+    if (!ReadHTTPRequestLine(ssHeaders, proto, http_method, http_uri))
+        return -1;
+    int nLen = ReadHTTPHeaders(ssHeaders, mapHeaders);
+    if (nLen < 0 || (size_t)nLen > max_size)
+        return -1;
+    if (buffer.size() < nHeaderEnd + nLen) {
+        if (pnSizeRet)
+            *pnSizeRet = nHeaderEnd + nLen;
+        mapHeadersRet = mapHeaders;
+        return 0;
+    }
+
+    istringstream ssRequest(buffer.substr(nStart, nHeaderEnd + nLen - nStart));
+    ReadHTTPRequestLine(ssRequest, proto, http_method, http_uri);
+    if (ReadHTTPMessage(ssRequest, mapHeadersRet, strMessageRet, proto, max_size) != HTTP_OK)
+        return -1;
+    return nHeaderEnd + nLen;
+}
+
 /**
  * JSON-RPC protocol.  Bitcoin speaks version 1.0 for maximum compatibility,
  * but uses JSON-RPC 1.1/2.0 standards for parts of the 1.0 standard that were
@@ -154,12 +154,29 @@ std::string HTTPReplyHeader(int nStatus, bool keepalive, size_t contentLength,
 std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive,
                       bool headerOnly = false,
                       const char *contentType = "application/json");
+/** Header of a reply whose body follows in chunks of unknown total size */
+std::string HTTPReplyChunkedHeader(int nStatus, bool keepalive,
+                      const char *contentType = "application/json");
+/** One chunk of a chunked reply body; an empty chunk ends the body */
+std::string HTTPChunk(const std::string& strData);
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          std::string& http_method, std::string& http_uri);
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto);
 int ReadHTTPHeaders(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet);
 int ReadHTTPMessage(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet,
                     std::string& strMessageRet, int nProto, size_t max_size);
+/**
+ * Parse the HTTP request at the start of buffer without blocking. Returns the
+ * number of bytes the request takes up in buffer, 0 if it isn't complete yet,
+ * or -1 if it is malformed or too large. If only the body is missing, the
+ * size the whole request will take up is stored in pnSizeRet, so the caller
+ * can wait for that much before parsing again, and the headers are already
+ * returned in mapHeadersRet.
+ */
+int ParseHTTPRequest(const std::string& buffer, size_t max_size, int &proto,
+                     std::string& http_method, std::string& http_uri,
+                     std::map<std::string, std::string>& mapHeadersRet, std::string& strMessageRet,
+                     size_t* pnSizeRet = NULL);
 std::string JSONRPCRequest(const std::string& strMethod, const json_spirit::Array& params, const json_spirit::Value& id);
 json_spirit::Object JSONRPCReplyObj(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
 std::string JSONRPCReply(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
@@ -17,6 +17,7 @@
 #include "script/script_error.h"
 #include "script/sign.h"
 #include "script/standard.h"
+#include "txindex.h"
 #include "uint256.h"
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
@@ -216,6 +217,9 @@ Value getrawtransaction(const Array& params, bool fHelp)
             + HelpExampleRpc("getrawtransaction", "\"mytxid\", 1")
         );
 
+    // Let the transaction index catch up with the blocks already connected
+    bool fTxIndexSynced = !ptxindex || ptxindex->BlockUntilSyncedToCurrentChain();
+
     LOCK(cs_main);
 
     uint256 hash = ParseHashV(params[0], "parameter 1");
@@ -226,8 +230,11 @@ Value getrawtransaction(const Array& params, bool fHelp)
 
     CTransaction tx;
     uint256 hashBlock;
-    if (!GetTransaction(hash, tx, hashBlock, true))
+    if (!GetTransaction(hash, tx, hashBlock, true)) {
+        if (!fTxIndexSynced)
+            throw JSONRPCError(RPC_MISC_ERROR, "The txindex is still being built");
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
+    }
 
     string strHex = EncodeHexTx(tx);
 
@@ -275,6 +282,8 @@ Value gettxoutproof(const Array& params, bool fHelp)
        oneTxid = hash;
     }
 
+    bool fTxIndexSynced = !ptxindex || ptxindex->BlockUntilSyncedToCurrentChain();
+
     LOCK(cs_main);
 
     CBlockIndex* pblockindex = NULL;
@@ -295,8 +304,11 @@ Value gettxoutproof(const Array& params, bool fHelp)
     if (pblockindex == NULL)
     {
         CTransaction tx;
-        if (!GetTransaction(oneTxid, tx, hashBlock, false) || hashBlock.IsNull())
+        if (!GetTransaction(oneTxid, tx, hashBlock, false) || hashBlock.IsNull()) {
+            if (!fTxIndexSynced)
+                throw JSONRPCError(RPC_MISC_ERROR, "The txindex is still being built");
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not yet in block");
+        }
         if (!mapBlockIndex.count(hashBlock))
             throw JSONRPCError(RPC_INTERNAL_ERROR, "Transaction index corrupt");
         pblockindex = mapBlockIndex[hashBlock];
@@ -16,15 +16,19 @@
 #include "wallet/wallet.h"
 #endif
 #include "asyncrpcqueue.h"
+#include "rpcworkqueue.h"
 
 #include <memory>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
+#include <boost/function.hpp>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/shared_ptr.hpp>
@@ -44,11 +48,26 @@ static bool fRPCInWarmup = true;
 static std::string rpcWarmupStatus("RPC server started");
 static CCriticalSection cs_rpcWarmup;
 
+//! Number of bytes read from a connection at once
+static const size_t RPC_READ_SIZE = 64 * 1024;
+//! Requests of one connection waiting to be handled before we stop reading from it
+static const size_t MAX_PIPELINED_REQUESTS = 16;
+//! Bytes of a streamed reply that may wait to be sent before its handler is held up
+static const size_t MAX_STREAM_BUFFER = 4 * 1024 * 1024;
+//! Largest request body buffered before the client has sent valid credentials
+static const size_t MAX_UNAUTHORIZED_BODY_SIZE = 4096;
+
+typedef CRPCWorkQueue< boost::function<void ()> > RPCRequestQueue;
+
 //! These are created by StartRPCThreads, destroyed in StopRPCThreads
 static boost::asio::io_service* rpc_io_service = NULL;
 static map<string, boost::shared_ptr<deadline_timer> > deadlineTimers;
 static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
+static RPCRequestQueue* rpc_work_queue = NULL;
+static bool fRPCKeepAlive = true;
+static int64_t nRPCServerTimeout = DEFAULT_RPC_SERVER_TIMEOUT;
+static boost::atomic<int> nRPCConnections(0);
 static boost::asio::io_service::work *rpc_dummy_work = NULL;
 static std::vector<CSubNet> rpc_allow_subnets; //!< List of subnets to allow RPC connections from
 static std::vector< boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
@@ -263,143 +282,188 @@ Value stop(const Array& params, bool fHelp)
     return "Zcash server stopping";
 }
 
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "\nReturns the state of the RPC server and its work queue.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"connections\": n,     (numeric) Open HTTP connections\n"
+            "  \"threads\": n,         (numeric) Worker threads handling requests\n"
+            "  \"busy\": n,            (numeric) Workers handling a request, including this one\n"
+            "  \"queued\": n,          (numeric) Requests waiting for a worker\n"
+            "  \"maxqueued\": n,       (numeric) Requests that may wait before new ones are rejected\n"
+            "  \"peakqueued\": n,      (numeric) Most requests that have waited at once\n"
+            "  \"processed\": n,       (numeric) Requests handled since startup\n"
+            "  \"rejected\": n         (numeric) Requests answered with 503 because the queue was full\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcinfo", "")
+            + HelpExampleRpc("getrpcinfo", "")
+        );
+
+    Object obj;
+    obj.push_back(Pair("connections", nRPCConnections.load()));
+    if (rpc_work_queue != NULL) {
+        CRPCWorkQueueStats stats = rpc_work_queue->GetStats();
+        obj.push_back(Pair("threads", stats.nWorkers));
+        obj.push_back(Pair("busy", stats.nBusy));
+        obj.push_back(Pair("queued", (uint64_t)stats.nDepth));
+        obj.push_back(Pair("maxqueued", (uint64_t)stats.nMaxDepth));
+        obj.push_back(Pair("peakqueued", (uint64_t)stats.nPeakDepth));
+        obj.push_back(Pair("processed", stats.nProcessed));
+        obj.push_back(Pair("rejected", stats.nRejected));
+    }
+    return obj;
+}
+
 
 
 /**
  * Call Table
  */
 static const CRPCCommand vRPCCommands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
+{ //  category              name                      actor (function)         okSafeMode  streamActor
+  //  --------------------- ------------------------  -----------------------  ----------  --------------
     /* Overall control/query calls */
-    { "control",            "getinfo",                &getinfo,                true  }, /* uses wallet if enabled */
-    { "control",            "help",                   &help,                   true  },
-    { "control",            "stop",                   &stop,                   true  },
+    { "control",            "getinfo",                &getinfo,                true,       NULL           }, /* uses wallet if enabled */
+    { "control",            "getrpcinfo",             &getrpcinfo,             true,       NULL           },
+    { "control",            "help",                   &help,                   true,       NULL           },
+    { "control",            "stop",                   &stop,                   true,       NULL           },
 
     /* P2P networking */
-    { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
-    { "network",            "addnode",                &addnode,                true  },
-    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
-    { "network",            "getconnectioncount",     &getconnectioncount,     true  },
-    { "network",            "getnettotals",           &getnettotals,           true  },
-    { "network",            "getpeerinfo",            &getpeerinfo,            true  },
-    { "network",            "ping",                   &ping,                   true  },
+    { "network",            "getnetworkinfo",         &getnetworkinfo,         true,       NULL           },
+    { "network",            "addnode",                &addnode,                true,       NULL           },
+    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,       NULL           },
+    { "network",            "getconnectioncount",     &getconnectioncount,     true,       NULL           },
+    { "network",            "getnettotals",           &getnettotals,           true,       NULL           },
+    { "network",            "getpeerinfo",            &getpeerinfo,            true,       NULL           },
+    { "network",            "ping",                   &ping,                   true,       NULL           },
 
     /* Block chain and UTXO */
-    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true  },
-    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
-    { "blockchain",         "getblockcount",          &getblockcount,          true  },
-    { "blockchain",         "getblock",               &getblock,               true  },
-    { "blockchain",         "getblockhash",           &getblockhash,           true  },
-    { "blockchain",         "getchaintips",           &getchaintips,           true  },
-    { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
-    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
-    { "blockchain",         "gettxout",               &gettxout,               true  },
-    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
-    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true  },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
-    { "blockchain",         "verifychain",            &verifychain,            true  },
+    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,       NULL           },
+    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,       NULL           },
+    { "blockchain",         "getblockcount",          &getblockcount,          true,       NULL           },
+    { "blockchain",         "getblock",               &getblock,               true,       &getblock      },
+    { "blockchain",         "getblockhash",           &getblockhash,           true,       NULL           },
+    { "blockchain",         "getchaintips",           &getchaintips,           true,       NULL           },
+    { "blockchain",         "getdifficulty",          &getdifficulty,          true,       NULL           },
+    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,       NULL           },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          true,       &getrawmempool },
+    { "blockchain",         "gettxout",               &gettxout,               true,       NULL           },
+    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true,       NULL           },
+    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true,       NULL           },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,       NULL           },
+    { "blockchain",         "dumpchainstate",         &dumpchainstate,         true,       NULL           },
+    { "blockchain",         "verifychain",            &verifychain,            true,       NULL           },
 
     /* Mining */
-    { "mining",             "getblocktemplate",       &getblocktemplate,       true  },
-    { "mining",             "getmininginfo",          &getmininginfo,          true  },
-    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true  },
-    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true  },
-    { "mining",             "submitblock",            &submitblock,            true  },
-    { "mining",             "getblocksubsidy",        &getblocksubsidy,        true  },
+    { "mining",             "getblocktemplate",       &getblocktemplate,       true,       NULL           },
+    { "mining",             "getmininginfo",          &getmininginfo,          true,       NULL           },
+    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,       NULL           },
+    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,       NULL           },
+    { "mining",             "submitblock",            &submitblock,            true,       NULL           },
+    { "mining",             "getblocksubsidy",        &getblocksubsidy,        true,       NULL           },
 
 #ifdef ENABLE_WALLET
     /* Coin generation */
-    { "generating",         "getgenerate",            &getgenerate,            true  },
-    { "generating",         "setgenerate",            &setgenerate,            true  },
-    { "generating",         "generate",               &generate,               true  },
-    { "generating",         "getauxblock",            &getauxblock,            true  },
+    { "generating",         "getgenerate",            &getgenerate,            true,       NULL           },
+    { "generating",         "setgenerate",            &setgenerate,            true,       NULL           },
+    { "generating",         "generate",               &generate,               true,       NULL           },
+    { "generating",         "getauxblock",            &getauxblock,            true,       NULL           },
 #endif
 
     /* Raw transactions */
-    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true  },
-    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true  },
-    { "rawtransactions",    "decodescript",           &decodescript,           true  },
-    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true  },
-    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false },
-    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false }, /* uses wallet if enabled */
+    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true,       NULL           },
+    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,       NULL           },
+    { "rawtransactions",    "decodescript",           &decodescript,           true,       NULL           },
+    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,       NULL           },
+    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false,      NULL           },
+    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false,      NULL           }, /* uses wallet if enabled */
 
     /* Utility functions */
-    { "util",               "createmultisig",         &createmultisig,         true  },
-    { "util",               "validateaddress",        &validateaddress,        true  }, /* uses wallet if enabled */
-    { "util",               "verifymessage",          &verifymessage,          true  },
-    { "util",               "estimatefee",            &estimatefee,            true  },
-    { "util",               "estimatepriority",       &estimatepriority,       true  },
-    { "util",               "z_validateaddress",      &z_validateaddress,      true  }, /* uses wallet if enabled */
+    { "util",               "createmultisig",         &createmultisig,         true,       NULL           },
+    { "util",               "getaddressbalance",      &getaddressbalance,      true,       NULL           },
+    { "util",               "getaddressdeltas",       &getaddressdeltas,       true,       NULL           },
+    { "util",               "getaddresstxids",        &getaddresstxids,        true,       NULL           },
+    { "util",               "getaddressutxos",        &getaddressutxos,        true,       NULL           },
+    { "util",               "getspentinfo",           &getspentinfo,           true,       NULL           },
+    { "util",               "validateaddress",        &validateaddress,        true,       NULL           }, /* uses wallet if enabled */
+    { "util",               "verifymessage",          &verifymessage,          true,       NULL           },
+    { "util",               "estimatefee",            &estimatefee,            true,       NULL           },
+    { "util",               "estimatepriority",       &estimatepriority,       true,       NULL           },
+    { "util",               "z_validateaddress",      &z_validateaddress,      true,       NULL           }, /* uses wallet if enabled */
 
     /* Not shown in help */
-    { "hidden",             "invalidateblock",        &invalidateblock,        true  },
-    { "hidden",             "reconsiderblock",        &reconsiderblock,        true  },
-    { "hidden",             "setmocktime",            &setmocktime,            true  },
+    { "hidden",             "invalidateblock",        &invalidateblock,        true,       NULL           },
+    { "hidden",             "reconsiderblock",        &reconsiderblock,        true,       NULL           },
+    { "hidden",             "setmocktime",            &setmocktime,            true,       NULL           },
 #ifdef ENABLE_WALLET
-    { "hidden",             "resendwallettransactions", &resendwallettransactions, true},
+    { "hidden",             "resendwallettransactions", &resendwallettransactions, true,       NULL           },
 #endif
 
 #ifdef ENABLE_WALLET
     /* Wallet */
-    { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true  },
-    { "wallet",             "backupwallet",           &backupwallet,           true  },
-    { "wallet",             "dumpprivkey",            &dumpprivkey,            true  },
-    { "wallet",             "dumpwallet",             &dumpwallet,             true  },
-    { "wallet",             "encryptwallet",          &encryptwallet,          true  },
-    { "wallet",             "getaccountaddress",      &getaccountaddress,      true  },
-    { "wallet",             "getaccount",             &getaccount,             true  },
-    { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true  },
-    { "wallet",             "getbalance",             &getbalance,             false },
-    { "wallet",             "getnewaddress",          &getnewaddress,          true  },
-    { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true  },
-    { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false },
-    { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false },
-    { "wallet",             "gettransaction",         &gettransaction,         false },
-    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false },
-    { "wallet",             "getwalletinfo",          &getwalletinfo,          false },
-    { "wallet",             "importprivkey",          &importprivkey,          true  },
-    { "wallet",             "importwallet",           &importwallet,           true  },
-    { "wallet",             "importaddress",          &importaddress,          true  },
-    { "wallet",             "keypoolrefill",          &keypoolrefill,          true  },
-    { "wallet",             "listaccounts",           &listaccounts,           false },
-    { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false },
-    { "wallet",             "listlockunspent",        &listlockunspent,        false },
-    { "wallet",             "listreceivedbyaccount",  &listreceivedbyaccount,  false },
-    { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false },
-    { "wallet",             "listsinceblock",         &listsinceblock,         false },
-    { "wallet",             "listtransactions",       &listtransactions,       false },
-    { "wallet",             "listunspent",            &listunspent,            false },
-    { "wallet",             "lockunspent",            &lockunspent,            true  },
-    { "wallet",             "move",                   &movecmd,                false },
-    { "wallet",             "sendfrom",               &sendfrom,               false },
-    { "wallet",             "sendmany",               &sendmany,               false },
-    { "wallet",             "sendtoaddress",          &sendtoaddress,          false },
-    { "wallet",             "setaccount",             &setaccount,             true  },
-    { "wallet",             "settxfee",               &settxfee,               true  },
-    { "wallet",             "signmessage",            &signmessage,            true  },
-    { "wallet",             "walletlock",             &walletlock,             true  },
-    { "wallet",             "walletpassphrasechange", &walletpassphrasechange, true  },
-    { "wallet",             "walletpassphrase",       &walletpassphrase,       true  },
-    { "wallet",             "zcbenchmark",            &zc_benchmark,           true  },
-    { "wallet",             "zcrawkeygen",            &zc_raw_keygen,          true  },
-    { "wallet",             "zcrawjoinsplit",         &zc_raw_joinsplit,       true  },
-    { "wallet",             "zcrawreceive",           &zc_raw_receive,         true  },
-    { "wallet",             "zcsamplejoinsplit",      &zc_sample_joinsplit,    true  },
-    { "wallet",             "z_listreceivedbyaddress",&z_listreceivedbyaddress,false },
-    { "wallet",             "z_getbalance",           &z_getbalance,           false },
-    { "wallet",             "z_gettotalbalance",      &z_gettotalbalance,      false },
-    { "wallet",             "z_sendmany",             &z_sendmany,             false },
-    { "wallet",             "z_getoperationstatus",   &z_getoperationstatus,   true  },
-    { "wallet",             "z_getoperationresult",   &z_getoperationresult,   true  },
-    { "wallet",             "z_listoperationids",     &z_listoperationids,     true  },
-    { "wallet",             "z_getnewaddress",        &z_getnewaddress,        true  },
-    { "wallet",             "z_listaddresses",        &z_listaddresses,        true  },
-    { "wallet",             "z_exportkey",            &z_exportkey,            true  },
-    { "wallet",             "z_importkey",            &z_importkey,            true  },
-    { "wallet",             "z_exportwallet",         &z_exportwallet,         true  },
-    { "wallet",             "z_importwallet",         &z_importwallet,         true  }
+    { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true,       NULL           },
+    { "wallet",             "backupwallet",           &backupwallet,           true,       NULL           },
+    { "wallet",             "dumpprivkey",            &dumpprivkey,            true,       NULL           },
+    { "wallet",             "dumpwallet",             &dumpwallet,             true,       NULL           },
+    { "wallet",             "encryptwallet",          &encryptwallet,          true,       NULL           },
+    { "wallet",             "getaccountaddress",      &getaccountaddress,      true,       NULL           },
+    { "wallet",             "getaccount",             &getaccount,             true,       NULL           },
+    { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true,       NULL           },
+    { "wallet",             "getbalance",             &getbalance,             false,      NULL           },
+    { "wallet",             "getnewaddress",          &getnewaddress,          true,       NULL           },
+    { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true,       NULL           },
+    { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false,      NULL           },
+    { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false,      NULL           },
+    { "wallet",             "gettransaction",         &gettransaction,         false,      NULL           },
+    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false,      NULL           },
+    { "wallet",             "getwalletinfo",          &getwalletinfo,          false,      NULL           },
+    { "wallet",             "importprivkey",          &importprivkey,          true,       NULL           },
+    { "wallet",             "importwallet",           &importwallet,           true,       NULL           },
+    { "wallet",             "importaddress",          &importaddress,          true,       NULL           },
+    { "wallet",             "keypoolrefill",          &keypoolrefill,          true,       NULL           },
+    { "wallet",             "listaccounts",           &listaccounts,           false,      NULL           },
+    { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false,      NULL           },
+    { "wallet",             "listlockunspent",        &listlockunspent,        false,      NULL           },
+    { "wallet",             "listreceivedbyaccount",  &listreceivedbyaccount,  false,      NULL           },
+    { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false,      NULL           },
+    { "wallet",             "listsinceblock",         &listsinceblock,         false,      NULL           },
+    { "wallet",             "listtransactions",       &listtransactions,       false,      NULL           },
+    { "wallet",             "listunspent",            &listunspent,            false,      NULL           },
+    { "wallet",             "lockunspent",            &lockunspent,            true,       NULL           },
+    { "wallet",             "move",                   &movecmd,                false,      NULL           },
+    { "wallet",             "sendfrom",               &sendfrom,               false,      NULL           },
+    { "wallet",             "sendmany",               &sendmany,               false,      NULL           },
+    { "wallet",             "sendtoaddress",          &sendtoaddress,          false,      NULL           },
+    { "wallet",             "setaccount",             &setaccount,             true,       NULL           },
+    { "wallet",             "settxfee",               &settxfee,               true,       NULL           },
+    { "wallet",             "signmessage",            &signmessage,            true,       NULL           },
+    { "wallet",             "walletlock",             &walletlock,             true,       NULL           },
+    { "wallet",             "walletpassphrasechange", &walletpassphrasechange, true,       NULL           },
+    { "wallet",             "walletpassphrase",       &walletpassphrase,       true,       NULL           },
+    { "wallet",             "zcbenchmark",            &zc_benchmark,           true,       NULL           },
+    { "wallet",             "zcrawkeygen",            &zc_raw_keygen,          true,       NULL           },
+    { "wallet",             "zcrawjoinsplit",         &zc_raw_joinsplit,       true,       NULL           },
+    { "wallet",             "zcrawreceive",           &zc_raw_receive,         true,       NULL           },
+    { "wallet",             "zcsamplejoinsplit",      &zc_sample_joinsplit,    true,       NULL           },
+    { "wallet",             "z_listreceivedbyaddress",&z_listreceivedbyaddress,false,      NULL           },
+    { "wallet",             "z_getbalance",           &z_getbalance,           false,      NULL           },
+    { "wallet",             "z_gettotalbalance",      &z_gettotalbalance,      false,      NULL           },
+    { "wallet",             "z_sendmany",             &z_sendmany,             false,      NULL           },
+    { "wallet",             "z_sendmanybatch",        &z_sendmanybatch,        false,      NULL           },
+    { "wallet",             "z_getoperationstatus",   &z_getoperationstatus,   true,       NULL           },
+    { "wallet",             "z_getoperationresult",   &z_getoperationresult,   true,       NULL           },
+    { "wallet",             "z_listoperationids",     &z_listoperationids,     true,       NULL           },
+    { "wallet",             "z_getnewaddress",        &z_getnewaddress,        true,       NULL           },
+    { "wallet",             "z_listaddresses",        &z_listaddresses,        true,       NULL           },
+    { "wallet",             "z_exportkey",            &z_exportkey,            true,       NULL           },
+    { "wallet",             "z_importkey",            &z_importkey,            true,       NULL           },
+    { "wallet",             "z_exportwallet",         &z_exportwallet,         true,       NULL           },
+    { "wallet",             "z_importwallet",         &z_importwallet,         true,       NULL           }
 #endif // ENABLE_WALLET
 };
 
@@ -476,19 +540,28 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+/** A request read from a connection, waiting for a worker */
+struct HTTPRequest
+{
+    int nProto;
+    std::string strMethod;
+    std::string strURI;
+    std::map<std::string, std::string> mapHeaders;
+    std::string strRequest;
+    bool fKeepAlive;
+};
+
+/**
+ * Connection handed to the request handlers. Their reply is collected in
+ * memory and sent by the I/O thread, so a worker never waits on the network.
+ */
+class BufferedConnection : public AcceptedConnection
 {
 public:
-    AcceptedConnectionImpl(
-            boost::asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
-        sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
-    {
-    }
+    typedef boost::function<bool(const std::string&)> FlushFunction;
+
+    BufferedConnection(const std::string& peerIn, const FlushFunction& flushFnIn = FlushFunction()) :
+        peer(peerIn), flushFn(flushFnIn) {}
 
     virtual std::iostream& stream()
     {
@@ -497,47 +570,421 @@ public:
 
     virtual std::string peer_address_to_string() const
     {
-        return peer.address().to_string();
+        return peer;
     }
 
     virtual void close()
     {
-        _stream.close();
     }
 
-    typename Protocol::endpoint peer;
-    boost::asio::ssl::stream<typename Protocol::socket> sslStream;
+    virtual bool flush()
+    {
+        if (!flushFn)
+            return true;
+        std::string strData = _stream.str();
+        _stream.str("");
+        return strData.empty() || flushFn(strData);
+    }
+
+    //! What was written since the last flush
+    std::string reply() const
+    {
+        return _stream.str();
+    }
+
+private:
+    std::string peer;
+    std::stringstream _stream;
+    FlushFunction flushFn;
+};
+
+static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
+                            string& strRequest,
+                            map<string, string>& mapHeaders,
+                            bool fRun);
+
+/**
+ * HTTP/1.1 connection serviced with asynchronous I/O.
+ *
+ * Requests are parsed as they arrive and may be pipelined; they are handed
+ * to the work queue one at a time, so replies go out in request order. An
+ * idle keep-alive connection only costs its buffers, not a thread. All
+ * members except peer and the ones guarded by cs_stream are only touched by
+ * handlers running through strand.
+ */
+class HTTPConnection : public boost::enable_shared_from_this<HTTPConnection>
+{
+public:
+    HTTPConnection(boost::asio::io_service& io_service, ssl::context &context, bool fUseSSLIn) :
+        sslStream(io_service, context), strand(io_service), timer(io_service), fUseSSL(fUseSSLIn),
+        readChunk(RPC_READ_SIZE), nRequestSize(0), fReading(false), fEOF(false), fWriting(false), fProcessing(false),
+        fClosing(false), fClosed(false), nWriteBytes(0), fStreamAborted(false)
+    {
+        nRPCConnections++;
+    }
+
+    ~HTTPConnection()
+    {
+        nRPCConnections--;
+    }
+
+    ip::tcp::endpoint peer;
+    boost::asio::ssl::stream<ip::tcp::socket> sslStream;
+
+    void Start();
+    void Reject(int nStatus);
 
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    boost::iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    io_service::strand strand;
+    deadline_timer timer;
+    bool fUseSSL;
+
+    std::vector<char> readChunk;
+    std::string readBuffer;
+    size_t nRequestSize;    //!< Bytes readBuffer needs for the next request, once its headers are in
+    std::deque<HTTPRequest> pending;
+    std::deque<std::string> writeQueue;
+
+    bool fReading;      //!< A read is outstanding
+    bool fEOF;          //!< The client is done sending, but still wants the replies to what it sent
+    bool fWriting;      //!< A write is outstanding
+    bool fProcessing;   //!< A request of this connection is queued or being handled
+    bool fClosing;      //!< No more requests will be read; close once the rest is answered
+    bool fClosed;
+
+    //! Lets a worker streaming a reply wait for the client to catch up
+    boost::mutex cs_stream;
+    boost::condition_variable cond_stream;
+    size_t nWriteBytes;     //!< Bytes waiting in writeQueue or about to be queued
+    bool fStreamAborted;    //!< The connection was closed, stop streaming
+
+    void HandleHandshake(const boost::system::error_code& error);
+    void Read();
+    void HandleRead(const boost::system::error_code& error, size_t nBytes);
+    void Parse();
+    void Dispatch();
+    void Process(HTTPRequest req);
+    void HandleProcessed(const std::string& strReply, bool fKeepAlive);
+    bool Flush(const std::string& strData);
+    void Write(const std::string& strData);
+    void Queue(const std::string& strData);
+    void WriteNext();
+    void HandleWrite(const boost::system::error_code& error);
+    void SetTimeout();
+    void HandleTimeout(const boost::system::error_code& error);
+    void MaybeClose();
+    void Close();
 };
 
-void ServiceConnection(AcceptedConnection *conn);
+void HTTPConnection::Start()
+{
+    boost::system::error_code ec;
+    sslStream.lowest_layer().set_option(ip::tcp::no_delay(true), ec);
+    SetTimeout();
+    if (fUseSSL)
+        sslStream.async_handshake(ssl::stream_base::server,
+            strand.wrap(boost::bind(&HTTPConnection::HandleHandshake, shared_from_this(),
+                boost::asio::placeholders::error)));
+    else
+        Read();
+}
+
+void HTTPConnection::Reject(int nStatus)
+{
+    // Only send a reply if we're not using SSL to prevent a DoS during the SSL handshake.
+    fClosing = true;
+    if (fUseSSL) {
+        Close();
+    } else {
+        SetTimeout();
+        Write(HTTPError(nStatus, false));
+    }
+}
+
+void HTTPConnection::HandleHandshake(const boost::system::error_code& error)
+{
+    if (fClosed)
+        return;
+    if (error) {
+        LogPrint("rpc", "%s: SSL handshake with %s failed: %s\n", __func__, peer.address().to_string(), error.message());
+        Close();
+        return;
+    }
+    Read();
+}
+
+void HTTPConnection::Read()
+{
+    fReading = true;
+    if (fUseSSL)
+        sslStream.async_read_some(boost::asio::buffer(readChunk),
+            strand.wrap(boost::bind(&HTTPConnection::HandleRead, shared_from_this(),
+                boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+    else
+        sslStream.next_layer().async_read_some(boost::asio::buffer(readChunk),
+            strand.wrap(boost::bind(&HTTPConnection::HandleRead, shared_from_this(),
+                boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void HTTPConnection::HandleRead(const boost::system::error_code& error, size_t nBytes)
+{
+    fReading = false;
+    if (fClosed)
+        return;
+    if (error == boost::asio::error::eof) {
+        fEOF = true;
+    } else if (error) {
+        Close();
+        return;
+    }
+    readBuffer.append(&readChunk[0], nBytes);
+    SetTimeout();
+    Parse();
+}
+
+/**
+ * Parse the buffered requests, hand the next one to the work queue and keep
+ * reading, unless too many requests are waiting already.
+ */
+void HTTPConnection::Parse()
+{
+    while (!fClosing && pending.size() < MAX_PIPELINED_REQUESTS)
+    {
+        // Don't parse a large body again for every chunk that arrives
+        if (readBuffer.size() < nRequestSize)
+            break;
+        HTTPRequest req;
+        nRequestSize = 0;
+        int nLen = ParseHTTPRequest(readBuffer, MAX_SIZE, req.nProto, req.strMethod, req.strURI,
+                                    req.mapHeaders, req.strRequest, &nRequestSize);
+        if (nLen > 0 || nRequestSize > 0) {
+            // Only buffer a large body once the client has authenticated
+            size_t nBodySize = nLen > 0 ? req.strRequest.size() : atoi(req.mapHeaders["content-length"].c_str());
+            if (nBodySize > MAX_UNAUTHORIZED_BODY_SIZE && !HTTPAuthorized(req.mapHeaders)) {
+                LogPrint("rpc", "%s: unauthorized %u byte request from %s\n", __func__, nBodySize, peer.address().to_string());
+                nLen = -1;
+            }
+        }
+        if (nLen == 0) {
+            readBuffer.reserve(nRequestSize);
+            break;
+        }
+        if (nLen < 0) {
+            // Answer what came before, then drop the connection
+            LogPrint("rpc", "%s: malformed request from %s\n", __func__, peer.address().to_string());
+            fClosing = true;
+            break;
+        }
+        readBuffer.erase(0, nLen);
+
+        // ParseHTTPRequest sets the connection header from the protocol version if the client didn't
+        req.fKeepAlive = fRPCKeepAlive && req.mapHeaders["connection"] != "close";
+        if (!req.fKeepAlive)
+            fClosing = true;
+        pending.push_back(req);
+    }
+    // Once everything the client sent has been parsed, there is nothing left to wait for
+    if (fEOF && pending.size() < MAX_PIPELINED_REQUESTS)
+        fClosing = true;
+    if (fClosing) {
+        readBuffer.clear();
+        nRequestSize = 0;
+    }
+
+    Dispatch();
+    if (fClosing)
+        MaybeClose();
+    else if (!fReading && !fEOF && pending.size() < MAX_PIPELINED_REQUESTS)
+        Read();
+}
+
+void HTTPConnection::Dispatch()
+{
+    while (!fProcessing && !pending.empty())
+    {
+        HTTPRequest req = pending.front();
+        pending.pop_front();
+        if (rpc_work_queue->Enqueue(boost::bind(&HTTPConnection::Process, shared_from_this(), req))) {
+            fProcessing = true;
+        } else {
+            LogPrint("rpc", "%s: work queue depth exceeded, rejecting request from %s\n", __func__, peer.address().to_string());
+            Write(HTTPError(HTTP_SERVICE_UNAVAILABLE, req.fKeepAlive));
+        }
+    }
+}
+
+//! Runs on a worker thread
+void HTTPConnection::Process(HTTPRequest req)
+{
+    BufferedConnection conn(peer.address().to_string(), boost::bind(&HTTPConnection::Flush, this, _1));
+    bool fRun = req.fKeepAlive && !ShutdownRequested();
+    bool fKeepAlive = false;
+
+    // Process via JSON-RPC API
+    if (req.strURI == "/") {
+        fKeepAlive = HTTPReq_JSONRPC(&conn, req.strRequest, req.mapHeaders, fRun);
+
+    // Process via HTTP REST API
+    } else if (req.strURI.substr(0, 6) == "/rest/" && GetBoolArg("-rest", false)) {
+        fKeepAlive = HTTPReq_REST(&conn, req.strURI, req.strRequest, req.mapHeaders, fRun);
+
+    } else {
+        conn.stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
+    }
+
+    strand.post(boost::bind(&HTTPConnection::HandleProcessed, shared_from_this(),
+                            conn.reply(), fKeepAlive && fRun));
+}
+
+void HTTPConnection::HandleProcessed(const std::string& strReply, bool fKeepAlive)
+{
+    fProcessing = false;
+    if (fClosed)
+        return;
+    Write(strReply);
+    if (!fKeepAlive) {
+        fClosing = true;
+        pending.clear();
+    }
+    Parse();
+}
+
+//! Runs on a worker thread, for handlers that stream their reply
+bool HTTPConnection::Flush(const std::string& strData)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_stream);
+        // Once the io_service is stopped nothing drains the buffer any more,
+        // so check every now and then whether the server is shutting down
+        while (!fStreamAborted && nWriteBytes >= MAX_STREAM_BUFFER && IsRPCRunning())
+            cond_stream.timed_wait(lock, boost::posix_time::milliseconds(100));
+        if (fStreamAborted || !IsRPCRunning())
+            return false;
+        nWriteBytes += strData.size();
+    }
+    strand.post(boost::bind(&HTTPConnection::Queue, shared_from_this(), strData));
+    return true;
+}
+
+void HTTPConnection::Write(const std::string& strData)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_stream);
+        nWriteBytes += strData.size();
+    }
+    Queue(strData);
+}
+
+//! Send data that is already counted in nWriteBytes
+void HTTPConnection::Queue(const std::string& strData)
+{
+    if (fClosed)
+        return;
+    writeQueue.push_back(strData);
+    if (!fWriting)
+        WriteNext();
+}
+
+void HTTPConnection::WriteNext()
+{
+    fWriting = true;
+    if (fUseSSL)
+        boost::asio::async_write(sslStream, boost::asio::buffer(writeQueue.front()),
+            strand.wrap(boost::bind(&HTTPConnection::HandleWrite, shared_from_this(),
+                boost::asio::placeholders::error)));
+    else
+        boost::asio::async_write(sslStream.next_layer(), boost::asio::buffer(writeQueue.front()),
+            strand.wrap(boost::bind(&HTTPConnection::HandleWrite, shared_from_this(),
+                boost::asio::placeholders::error)));
+}
+
+void HTTPConnection::HandleWrite(const boost::system::error_code& error)
+{
+    fWriting = false;
+    if (fClosed)
+        return;
+    if (error) {
+        Close();
+        return;
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(cs_stream);
+        nWriteBytes -= writeQueue.front().size();
+        cond_stream.notify_all();
+    }
+    writeQueue.pop_front();
+    SetTimeout();
+    if (!writeQueue.empty())
+        WriteNext();
+    else
+        MaybeClose();
+}
+
+void HTTPConnection::SetTimeout()
+{
+    // Setting the expiry cancels the previous wait
+    timer.expires_from_now(boost::posix_time::seconds(nRPCServerTimeout));
+    timer.async_wait(strand.wrap(boost::bind(&HTTPConnection::HandleTimeout, shared_from_this(),
+                                             boost::asio::placeholders::error)));
+}
+
+void HTTPConnection::HandleTimeout(const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted || fClosed)
+        return;
+    // Long polls may keep a worker busy for longer than the timeout. A streamed
+    // reply the client stopped reading is not making progress though.
+    if (fProcessing && !fWriting) {
+        SetTimeout();
+        return;
+    }
+    LogPrint("rpc", "%s: closing idle connection from %s\n", __func__, peer.address().to_string());
+    Close();
+}
+
+void HTTPConnection::MaybeClose()
+{
+    if (fClosing && !fProcessing && pending.empty() && !fWriting)
+        Close();
+}
+
+void HTTPConnection::Close()
+{
+    if (fClosed)
+        return;
+    fClosed = true;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_stream);
+        fStreamAborted = true;
+        cond_stream.notify_all();
+    }
+    boost::system::error_code ec;
+    timer.cancel(ec);
+    sslStream.lowest_layer().shutdown(ip::tcp::socket::shutdown_both, ec);
+    sslStream.lowest_layer().close(ec);
+}
 
 //! Forward declaration required for RPCListen
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr<HTTPConnection> conn,
                              const boost::system::error_code& error);
 
 /**
  * Sets up I/O resources to accept and handle a new connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                    ssl::context& context,
                    const bool fUseSSL)
 {
     // Accept connection
-    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
+    boost::shared_ptr<HTTPConnection> conn(new HTTPConnection(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
             conn->peer,
-            boost::bind(&RPCAcceptHandler<Protocol, SocketAcceptorService>,
+            boost::bind(&RPCAcceptHandler,
                 acceptor,
                 boost::ref(context),
                 fUseSSL,
@@ -549,37 +996,30 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
 /**
  * Accept and handle incoming connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr<HTTPConnection> conn,
                              const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != boost::asio::error::operation_aborted && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
-
     if (error)
     {
         // TODO: Actually handle errors
         LogPrintf("%s: Error: %s\n", __func__, error.message());
     }
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading any request, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    else if (!ClientAllowed(conn->peer.address()))
     {
-        // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
-        if (!fUseSSL)
-            conn->stream() << HTTPError(HTTP_FORBIDDEN, false) << std::flush;
-        conn->close();
+        conn->Reject(HTTP_FORBIDDEN);
     }
     else {
-        ServiceConnection(conn.get());
-        conn->close();
+        conn->Start();
     }
 }
 
@@ -645,6 +1085,9 @@ void StartRPCThreads()
     assert(rpc_io_service == NULL);
     rpc_io_service = new boost::asio::io_service();
     rpc_ssl_context = new ssl::context(*rpc_io_service, ssl::context::sslv23);
+    rpc_work_queue = new RPCRequestQueue(std::max<int64_t>(1, GetArg("-rpcworkqueue", DEFAULT_RPC_WORK_QUEUE)));
+    fRPCKeepAlive = GetBoolArg("-rpckeepalive", true);
+    nRPCServerTimeout = std::max<int64_t>(1, GetArg("-rpcservertimeout", DEFAULT_RPC_SERVER_TIMEOUT));
 
     const bool fUseSSL = GetBoolArg("-rpcssl", false);
 
@@ -744,15 +1187,18 @@ void StartRPCThreads()
         return;
     }
 
+    // One thread does the network I/O of all connections, the workers
+    // handle the requests
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&boost::asio::io_service::run, rpc_io_service));
+    rpc_worker_group->create_thread(boost::bind(&boost::asio::io_service::run, rpc_io_service));
+    for (int i = 0; i < GetArg("-rpcthreads", DEFAULT_RPC_THREADS); i++)
+        rpc_worker_group->create_thread(boost::bind(&RPCRequestQueue::Run, rpc_work_queue));
     fRPCRunning = true;
     g_rpcSignals.Started();
 
-    // Launch one async rpc worker.  The ability to launch multiple workers is not recommended at present and thus the option is disabled.
-    getAsyncRPCQueue()->addWorker();
-/*   
+    // Launch the async rpc workers. Operations computing proofs are limited
+    // separately, as each of them needs several GB of memory and libsnark
+    // already uses all cores for a single proof.
     int n = GetArg("-rpcasyncthreads", 1);
     if (n<1) {
         LogPrintf("ERROR: Invalid value %d for -rpcasyncthreads.  Must be at least 1.\n", n);
@@ -761,9 +1207,13 @@ void StartRPCThreads()
         StartShutdown();
         return;
     }
-    for (int i = 0; i < n; i++)
-        getAsyncRPCQueue()->addWorker();
-*/
+    std::shared_ptr<AsyncRPCQueue> q = getAsyncRPCQueue();
+    q->setMaxProvingOperations(std::max<int64_t>(1, GetArg("-rpcasyncprovingthreads", 1)));
+    q->setOperationTTL(GetArg("-rpcasyncoperationttl", 24 * 60 * 60));
+    q->setNumberOfWorkers(n);
+    // Extra workers are off by default: operations don't lock the notes and
+    // coins they select, so concurrent sends could try to spend the same ones.
+    q->setMaxWorkers(std::max<int64_t>(n, GetArg("-rpcasyncmaxthreads", 1)));
 }
 
 void StartDummyRPCThread()
@@ -805,12 +1255,15 @@ void StopRPCThreads()
     }
     deadlineTimers.clear();
 
+    if (rpc_work_queue != NULL)
+        rpc_work_queue->Interrupt();
     rpc_io_service->stop();
     g_rpcSignals.Stopped();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
     delete rpc_dummy_work; rpc_dummy_work = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
+    delete rpc_work_queue; rpc_work_queue = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
 
@@ -906,37 +1359,57 @@ void JSONRequest::parse(const Value& valRequest)
 }
 
 
-static Object JSONRPCExecOne(const Value& req)
+/**
+ * Execute a request and write the reply object, with the result streamed
+ * straight into it. Throws like CRPCTable::execute, leaving reply incomplete.
+ */
+static void JSONRPCExecReply(const JSONRequest& jreq, CJSONWriter& reply)
+{
+    reply.BeginObject();
+    reply.Key("result");
+    tableRPC.execute(jreq.strMethod, jreq.params, reply);
+    reply.Key("error");
+    reply.Null();
+    reply.Key("id");
+    reply.Write(jreq.id);
+    reply.EndObject();
+}
+
+static void JSONRPCExecOne(const Value& req, CJSONWriter& reply)
 {
-    Object rpc_result;
+    CJSONWriter rpc_result;
 
     JSONRequest jreq;
     try {
         jreq.parse(req);
-
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
+        JSONRPCExecReply(jreq, rpc_result);
     }
     catch (const Object& objError)
     {
-        rpc_result = JSONRPCReplyObj(Value::null, objError, jreq.id);
+        rpc_result.Clear();
+        rpc_result.Write(JSONRPCReplyObj(Value::null, objError, jreq.id));
     }
     catch (const std::exception& e)
     {
-        rpc_result = JSONRPCReplyObj(Value::null,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        rpc_result.Clear();
+        rpc_result.Write(JSONRPCReplyObj(Value::null,
+                                         JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id));
     }
 
-    return rpc_result;
+    reply.Raw(rpc_result.str());
 }
 
 static string JSONRPCExecBatch(const Array& vReq)
 {
-    Array ret;
+    CJSONWriter reply;
+    reply.BeginArray();
     for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+        JSONRPCExecOne(vReq[reqIdx], reply);
+    reply.EndArray();
 
-    return write_string(Value(ret), false) + "\n";
+    string strReply;
+    strReply.swap(reply.str());
+    return strReply + "\n";
 }
 
 static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
@@ -968,7 +1441,7 @@ static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
     {
         // Parse request
         Value valRequest;
-        if (!read_string(strRequest, valRequest))
+        if (!ParseJSON(strRequest, valRequest))
             throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
         // Return immediately if in warmup
@@ -984,10 +1457,12 @@ static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
         if (valRequest.type() == obj_type) {
             jreq.parse(valRequest);
 
-            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+            CJSONWriter reply;
+            JSONRPCExecReply(jreq, reply);
 
             // Send reply
-            strReply = JSONRPCReply(result, Value::null, jreq.id);
+            strReply.swap(reply.str());
+            strReply += "\n";
 
         // array of requests
         } else if (valRequest.type() == array_type)
@@ -1010,62 +1485,46 @@ static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
     return true;
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
 {
-    bool fRun = true;
-    while (fRun && !ShutdownRequested())
-    {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
-
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
-
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto, MAX_SIZE);
-
-        // TODO #1856: Re-enable support for persistent connections.
-        // We have disabled support for HTTP Keep-Alive until resolution of #1680, upstream rpc deadlock.
-        // Close connection immediately.
-        fRun = false;
-        /*
-        // HTTP Keep-Alive is false; close connection immediately
-        if ((mapHeaders["connection"] == "close") || (!GetBoolArg("-rpckeepalive", true)))
-            fRun = false;
-        */
-
-        // Process via JSON-RPC API
-        if (strURI == "/") {
-            if (!HTTPReq_JSONRPC(conn, strRequest, mapHeaders, fRun))
-                break;
+    // Find method
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+    if (!pcmd)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
 
-        // Process via HTTP REST API
-        } else if (strURI.substr(0, 6) == "/rest/" && GetBoolArg("-rest", false)) {
-            if (!HTTPReq_REST(conn, strURI, strRequest, mapHeaders, fRun))
-                break;
+    g_rpcSignals.PreCommand(*pcmd);
 
-        } else {
-            conn->stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
-            break;
-        }
+    try
+    {
+        // Execute
+        return pcmd->actor(params, false);
+    }
+    catch (const std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
+
+    g_rpcSignals.PostCommand(*pcmd);
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& result) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
     if (!pcmd)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
 
+    if (!pcmd->streamActor) {
+        result.Write(execute(strMethod, params));
+        return;
+    }
+
     g_rpcSignals.PreCommand(*pcmd);
 
     try
     {
         // Execute
-        return pcmd->actor(params, false);
+        pcmd->streamActor(params, false, result);
     }
     catch (const std::exception& e)
     {
@@ -7,6 +7,7 @@
 #define BITCOIN_RPCSERVER_H
 
 #include "amount.h"
+#include "rpcjson.h"
 #include "rpcprotocol.h"
 #include "uint256.h"
 
@@ -32,8 +33,13 @@ namespace RPCServer
 }
 
 class CBlockIndex;
+struct CChainTipSnapshot;
 class CNetAddr;
 
+static const int DEFAULT_RPC_THREADS = 4;
+static const int DEFAULT_RPC_WORK_QUEUE = 64;
+static const int DEFAULT_RPC_SERVER_TIMEOUT = 30;
+
 class AcceptedConnection
 {
 public:
@@ -42,6 +48,13 @@ public:
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+
+    /**
+     * Send what was written to stream() so far, so a large reply can be
+     * produced in pieces. Blocks while the client is far behind. Returns
+     * false once the client has gone away.
+     */
+    virtual bool flush() { return true; }
 };
 
 /** Start RPC threads */
@@ -96,6 +109,7 @@ void RPCRunLater(const std::string& name, boost::function<void(void)> func, int6
 extern CNetAddr BoostAsioToCNetAddr(boost::asio::ip::address address);
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
 
 class CRPCCommand
 {
@@ -104,6 +118,9 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    //! Optional, for calls with large results: writes the result straight
+    //! into the reply. actor must return the same result.
+    rpcstreamfn_type streamActor;
 };
 
 /**
@@ -126,6 +143,14 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, writing its result into result. Methods with a
+     * streamActor write it directly, without building it as a Value.
+     * @throws an exception (json_spirit::Value) when an error happens; what
+     * was written to result so far is then incomplete.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& result) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -147,6 +172,8 @@ extern CAmount AmountFromValue(const json_spirit::Value& value);
 extern json_spirit::Value ValueFromAmount(const CAmount& amount);
 extern double GetDifficulty(const CBlockIndex* blockindex = NULL);
 extern double GetNetworkDifficulty(const CBlockIndex* blockindex = NULL);
+extern double GetNetworkDifficulty(const CChainTipSnapshot& tip);
+extern double GetDifficultyFromBits(uint32_t bits);
 extern std::string HelpRequiringPassphrase();
 extern std::string HelpExampleCli(std::string methodname, std::string args);
 extern std::string HelpExampleRpc(std::string methodname, std::string args);
@@ -210,6 +237,11 @@ extern json_spirit::Value walletlock(const json_spirit::Array& params, bool fHel
 extern json_spirit::Value encryptwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value validateaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressdeltas(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressbalance(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddresstxids(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressutxos(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getspentinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwalletinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockchaininfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnetworkinfo(const json_spirit::Array& params, bool fHelp);
@@ -239,9 +271,12 @@ extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool f
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempool(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value dumpchainstate(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getchaintips(const json_spirit::Array& params, bool fHelp);
@@ -260,6 +295,7 @@ extern json_spirit::Value z_listreceivedbyaddress(const json_spirit::Array& para
 extern json_spirit::Value z_getbalance(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
 extern json_spirit::Value z_gettotalbalance(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
 extern json_spirit::Value z_sendmany(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
+extern json_spirit::Value z_sendmanybatch(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
 extern json_spirit::Value z_getoperationstatus(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
 extern json_spirit::Value z_getoperationresult(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
 extern json_spirit::Value z_listoperationids(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
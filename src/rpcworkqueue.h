@@ -0,0 +1,123 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCWORKQUEUE_H
+#define BITCOIN_RPCWORKQUEUE_H
+
+#include <algorithm>
+#include <deque>
+#include <stdint.h>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Snapshot of the state of a CRPCWorkQueue */
+struct CRPCWorkQueueStats
+{
+    size_t nDepth;          //!< Requests waiting for a worker
+    size_t nMaxDepth;       //!< Requests that may wait before new ones are rejected
+    size_t nPeakDepth;      //!< Highest depth seen
+    int nWorkers;           //!< Worker threads running the queue
+    int nBusy;              //!< Workers handling a request
+    uint64_t nProcessed;    //!< Requests handled
+    uint64_t nRejected;     //!< Requests turned away because the queue was full
+};
+
+/**
+ * Bounded queue of RPC requests, handled by a pool of worker threads.
+ * The requests are represented by a type T, which must provide an operator().
+ *
+ * Enqueue never blocks: when the queue is full the request is refused, so the
+ * caller can answer it with an error right away instead of holding on to it.
+ */
+template <typename T>
+class CRPCWorkQueue
+{
+private:
+    //! Mutex to protect the inner state
+    boost::mutex mutex;
+
+    //! Worker threads block on this when out of work
+    boost::condition_variable cond;
+
+    //! The queue of requests to be handled, in arrival order
+    std::deque<T> queue;
+
+    //! Whether the workers should keep running
+    bool fRunning;
+
+    size_t nMaxDepth;
+    size_t nPeakDepth;
+    int nWorkers;
+    int nBusy;
+    uint64_t nProcessed;
+    uint64_t nRejected;
+
+public:
+    CRPCWorkQueue(size_t nMaxDepthIn) : fRunning(true), nMaxDepth(nMaxDepthIn), nPeakDepth(0),
+        nWorkers(0), nBusy(0), nProcessed(0), nRejected(0) {}
+
+    //! Add a request, unless the queue is full or shutting down
+    bool Enqueue(const T& item)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fRunning || queue.size() >= nMaxDepth) {
+            nRejected++;
+            return false;
+        }
+        queue.push_back(item);
+        nPeakDepth = std::max(nPeakDepth, queue.size());
+        cond.notify_one();
+        return true;
+    }
+
+    //! Worker thread body: handle requests until Interrupt is called
+    void Run()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkers++;
+        while (true) {
+            while (fRunning && queue.empty())
+                cond.wait(lock);
+            if (!fRunning)
+                break;
+            T item = queue.front();
+            queue.pop_front();
+            nBusy++;
+            lock.unlock();
+            item();
+            lock.lock();
+            nBusy--;
+            nProcessed++;
+        }
+        nWorkers--;
+    }
+
+    //! Make the workers return once they are done with their current request.
+    //! Requests still waiting are dropped.
+    void Interrupt()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = false;
+        queue.clear();
+        cond.notify_all();
+    }
+
+    CRPCWorkQueueStats GetStats()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CRPCWorkQueueStats stats;
+        stats.nDepth = queue.size();
+        stats.nMaxDepth = nMaxDepth;
+        stats.nPeakDepth = nPeakDepth;
+        stats.nWorkers = nWorkers;
+        stats.nBusy = nBusy;
+        stats.nProcessed = nProcessed;
+        stats.nRejected = nRejected;
+        return stats;
+    }
+};
+
+#endif // BITCOIN_RPCWORKQUEUE_H
@@ -5,86 +5,102 @@
 
 #include "sigcache.h"
 
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <algorithm>
 
-namespace {
-
-/**
- * Valid signature cache, to avoid doing expensive ECDSA signature checking
- * twice for every transaction (once when accepted into memory pool, and
- * again when accepted into the block chain)
- */
-class CSignatureCache
+void CSignatureCache::GetSlots(const uint256& entry, size_t& nSlot1, size_t& nSlot2) const
 {
-private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+    nSlot1 = ReadLE64(entry.begin()) & nMask;
+    nSlot2 = ReadLE64(entry.begin() + 8) & nMask;
+    if (nSlot2 == nSlot1)
+        nSlot2 = nSlot1 ^ 1;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+bool CSignatureCache::Matches(size_t nSlot, const uint256& entry) const
+{
+    for (size_t i = 0; i < WORDS_PER_ENTRY; i++) {
+        if (table[nSlot * WORDS_PER_ENTRY + i].load(std::memory_order_relaxed) != ReadLE64(entry.begin() + 8 * i))
+            return false;
     }
+    return true;
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+bool CSignatureCache::IsEmpty(size_t nSlot) const
+{
+    for (size_t i = 0; i < WORDS_PER_ENTRY; i++) {
+        if (table[nSlot * WORDS_PER_ENTRY + i].load(std::memory_order_relaxed) != 0)
+            return false;
+    }
+    return true;
+}
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+CSignatureCache::CSignatureCache(size_t nMaxCacheBytes) : nMask(0)
+{
+    size_t nEntries = 0;
+    if (nMaxCacheBytes >= 2 * WORDS_PER_ENTRY * sizeof(uint64_t)) {
+        nEntries = 2;
+        while (2 * nEntries * WORDS_PER_ENTRY * sizeof(uint64_t) <= nMaxCacheBytes)
+            nEntries *= 2;
+        nMask = nEntries - 1;
+    }
+    std::vector<std::atomic<uint64_t> > tableNew(nEntries * WORDS_PER_ENTRY);
+    table.swap(tableNew);
+    GetRandBytes(nonce.begin(), 32);
+}
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+void CSignatureCache::ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+{
+    CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size()).Write(vchSig.data(), vchSig.size()).Finalize(entry.begin());
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
-    }
-};
+bool CSignatureCache::Get(const uint256& entry) const
+{
+    if (table.empty())
+        return false;
+    size_t nSlot1, nSlot2;
+    GetSlots(entry, nSlot1, nSlot2);
+    return Matches(nSlot1, entry) || Matches(nSlot2, entry);
+}
 
+void CSignatureCache::Set(const uint256& entry)
+{
+    if (table.empty())
+        return;
+    size_t nSlot1, nSlot2;
+    GetSlots(entry, nSlot1, nSlot2);
+    size_t nSlot;
+    if (Matches(nSlot1, entry) || Matches(nSlot2, entry))
+        return;
+    else if (IsEmpty(nSlot1))
+        nSlot = nSlot1;
+    else if (IsEmpty(nSlot2))
+        nSlot = nSlot2;
+    else
+        nSlot = (entry.begin()[16] & 1) ? nSlot1 : nSlot2;
+    for (size_t i = 0; i < WORDS_PER_ENTRY; i++)
+        table[nSlot * WORDS_PER_ENTRY + i].store(ReadLE64(entry.begin() + 8 * i), std::memory_order_relaxed);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    static CSignatureCache signatureCache(std::min(std::max(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0), (int64_t)MAX_MAX_SIG_CACHE_SIZE) << 20);
+
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    if (signatureCache.Get(entry))
         return true;
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
     return true;
 }
@@ -7,11 +7,61 @@
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
 #include "script/interpreter.h"
+#include "uint256.h"
 
+#include <atomic>
 #include <vector>
 
+/** Default for -maxsigcachesize, maximum MiB used by the signature cache */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+/** Largest -maxsigcachesize in MiB; it used to count entries, so old configs can be far larger */
+static const unsigned int MAX_MAX_SIG_CACHE_SIZE = 1024;
+
 class CPubKey;
 
+/**
+ * Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain)
+ *
+ * Entries are salted SHA256 digests of (signature hash, public key,
+ * signature), kept in a fixed table. Each digest can live in one of two
+ * slots picked by its own bits; when both are taken a digest bit decides
+ * which one is overwritten. The salt is random, so nobody can aim entries at
+ * slots or pre-compute a set of signatures that evict each other.
+ *
+ * The table is read and written without locks, so script check threads never
+ * wait on each other here. A write racing with a read can only make the read
+ * miss.
+ */
+class CSignatureCache
+{
+private:
+    static const size_t WORDS_PER_ENTRY = 4;
+
+    //! Random salt for the digests
+    uint256 nonce;
+    //! WORDS_PER_ENTRY words per entry, all zero while the entry is empty
+    std::vector<std::atomic<uint64_t> > table;
+    //! Number of entries minus one (a power of two minus one)
+    size_t nMask;
+
+    void GetSlots(const uint256& entry, size_t& nSlot1, size_t& nSlot2) const;
+    bool Matches(size_t nSlot, const uint256& entry) const;
+    bool IsEmpty(size_t nSlot) const;
+
+public:
+    //! Use the largest power of two number of entries that fits in nMaxCacheBytes
+    explicit CSignatureCache(size_t nMaxCacheBytes);
+
+    //! Number of entries the table can hold
+    size_t Capacity() const { return table.size() / WORDS_PER_ENTRY; }
+
+    void ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const;
+    bool Get(const uint256& entry) const;
+    void Set(const uint256& entry);
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -0,0 +1,557 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshot.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "hash.h"
+#include "main.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <deque>
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static const char SNAPSHOT_MAGIC[4] = {'Z', 'C', 'S', 'N'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+static const char SNAPSHOT_BLOCK_INDEX = 'b';
+static const char SNAPSHOT_ANCHOR = 'a';
+static const char SNAPSHOT_NULLIFIER = 'n';
+static const char SNAPSHOT_COINS = 'c';
+static const char SNAPSHOT_END = 'e';
+
+//! Chunks are flushed once their payload reaches this size
+static const size_t SNAPSHOT_CHUNK_SIZE = 4 << 20;
+//! Upper bound on a chunk payload accepted by the loader
+static const uint32_t MAX_SNAPSHOT_CHUNK_SIZE = 64 << 20;
+//! Coins handed to the chain state per BatchWrite while loading
+static const size_t SNAPSHOT_LOAD_BATCH = 100000;
+
+namespace {
+
+/** Incrementally computes gettxoutsetinfo statistics over coins fed in txid order */
+class CSnapshotStats
+{
+private:
+    std::vector<CCoinsStats> vStats;
+    std::vector<CHashWriter> vWriters;
+
+public:
+    CSnapshotStats() : vStats(COINS_STATS_SHARDS), vWriters(COINS_STATS_SHARDS, CHashWriter(SER_GETHASH, PROTOCOL_VERSION)) {}
+
+    void Add(const uint256 &txid, const CCoins &coins)
+    {
+        int nShard = CoinsStatsShard(txid);
+        ApplyCoinsStats(vStats[nShard], vWriters[nShard], txid, coins, ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION));
+    }
+
+    void Finalize(CCoinsStats &stats)
+    {
+        std::vector<uint256> vHashes(COINS_STATS_SHARDS);
+        for (int i = 0; i < COINS_STATS_SHARDS; i++)
+            vHashes[i] = vWriters[i].GetHash();
+        FinalizeCoinsStats(stats, vStats, vHashes);
+    }
+};
+
+/**
+ * Computes the commitment to the shielded part of a snapshot: the best
+ * anchor, then every anchor tree and every nullifier, fed in ascending order.
+ */
+class CSnapshotShieldedHash
+{
+private:
+    CHashWriter ss;
+
+public:
+    CSnapshotShieldedHash(const uint256 &hashAnchor) : ss(SER_GETHASH, PROTOCOL_VERSION)
+    {
+        ss << hashAnchor;
+    }
+
+    void AddAnchor(const uint256 &rt, const ZCIncrementalMerkleTree &tree)
+    {
+        ss << SNAPSHOT_ANCHOR << rt << tree;
+    }
+
+    void AddNullifier(const uint256 &nullifier)
+    {
+        ss << SNAPSHOT_NULLIFIER << nullifier;
+    }
+
+    uint256 GetHash() { return ss.GetHash(); }
+};
+
+class CSnapshotWriter : public CCoinsViewVisitor
+{
+private:
+    CAutoFile &fileout;
+    CDataStream ssChunk;
+    char chChunkType;
+    uint32_t nChunkCount;
+    CSnapshotStats statsBuilder;
+    boost::scoped_ptr<CSnapshotShieldedHash> shieldedBuilder;
+    uint256 hashLast;
+
+    void FlushChunk()
+    {
+        if (nChunkCount == 0)
+            return;
+        fileout << chChunkType << nChunkCount << (uint32_t)ssChunk.size();
+        fileout.write(&ssChunk[0], ssChunk.size());
+        fileout << Hash(ssChunk.begin(), ssChunk.end());
+        ssChunk.clear();
+        nChunkCount = 0;
+    }
+
+    CDataStream& Entry(char chType)
+    {
+        if (chType != chChunkType || ssChunk.size() >= SNAPSHOT_CHUNK_SIZE)
+            FlushChunk();
+        chChunkType = chType;
+        nChunkCount++;
+        return ssChunk;
+    }
+
+    //! Whether hash follows the last anchor or nullifier visited, which the loader insists on
+    bool InOrder(char chType, const uint256 &hash)
+    {
+        bool fInOrder = chType != chChunkType || hashLast < hash;
+        hashLast = hash;
+        if (!fInOrder)
+            strError = "Chain state anchors or nullifiers are not in ascending order";
+        return fInOrder;
+    }
+
+public:
+    CCoinsStats stats;
+    uint256 hashShielded;
+    std::string strError;
+
+    CSnapshotWriter(CAutoFile &fileoutIn) : fileout(fileoutIn), ssChunk(SER_DISK, CLIENT_VERSION), chChunkType(0), nChunkCount(0) {}
+
+    bool VisitBest(const uint256 &hashBlock, const uint256 &hashAnchor)
+    {
+        std::vector<CDiskBlockIndex> vIndex;
+        {
+            LOCK(cs_main);
+            BlockMap::const_iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi == mapBlockIndex.end()) {
+                strError = "Chain state best block is not in the block index";
+                return false;
+            }
+            vIndex.reserve(mi->second->nHeight + 1);
+            for (const CBlockIndex *pindex = mi->second; pindex; pindex = pindex->pprev) {
+                // Only headers and validity travel; the loading node has
+                // none of the block or undo data.
+                CDiskBlockIndex index(pindex);
+                index.nStatus = pindex->nStatus & BLOCK_VALID_MASK;
+                index.nFile = 0;
+                index.nDataPos = 0;
+                index.nUndoPos = 0;
+                vIndex.push_back(index);
+            }
+            stats.nHeight = mi->second->nHeight;
+        }
+        stats.hashBlock = hashBlock;
+        shieldedBuilder.reset(new CSnapshotShieldedHash(hashAnchor));
+
+        fileout.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        fileout << SNAPSHOT_VERSION << FLATDATA(Params().MessageStart());
+        fileout << hashBlock << stats.nHeight << hashAnchor;
+
+        for (std::vector<CDiskBlockIndex>::const_reverse_iterator it = vIndex.rbegin(); it != vIndex.rend(); it++)
+            Entry(SNAPSHOT_BLOCK_INDEX) << *it;
+        return true;
+    }
+
+    bool VisitAnchor(const uint256 &rt, const ZCIncrementalMerkleTree &tree)
+    {
+        if (!InOrder(SNAPSHOT_ANCHOR, rt))
+            return false;
+        Entry(SNAPSHOT_ANCHOR) << rt << tree;
+        shieldedBuilder->AddAnchor(rt, tree);
+        return true;
+    }
+
+    bool VisitNullifier(const uint256 &nullifier)
+    {
+        if (!InOrder(SNAPSHOT_NULLIFIER, nullifier))
+            return false;
+        Entry(SNAPSHOT_NULLIFIER) << nullifier;
+        shieldedBuilder->AddNullifier(nullifier);
+        return true;
+    }
+
+    bool VisitCoins(const uint256 &txid, const CCoins &coins)
+    {
+        boost::this_thread::interruption_point();
+        Entry(SNAPSHOT_COINS) << txid << coins;
+        statsBuilder.Add(txid, coins);
+        return true;
+    }
+
+    void Finish()
+    {
+        statsBuilder.Finalize(stats);
+        hashShielded = shieldedBuilder->GetHash();
+        Entry(SNAPSHOT_END) << stats.nTransactions << stats.nTransactionOutputs << stats.nSerializedSize
+                            << stats.nTotalAmount << stats.hashSerialized;
+        FlushChunk();
+    }
+};
+
+} // anon namespace
+
+bool DumpChainStateSnapshot(const CCoinsView *view, const boost::filesystem::path &path, CCoinsStats &stats, uint256 &hashShielded, std::string &strError)
+{
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".tmp";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file) {
+        strError = strprintf("Unable to create %s", pathTmp.string());
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    bool fWritten = false;
+    try {
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        CSnapshotWriter writer(fileout);
+        if (!view->Traverse(writer)) {
+            strError = writer.strError.empty() ? "Unable to read the chain state" : writer.strError;
+        } else {
+            writer.Finish();
+            stats = writer.stats;
+            hashShielded = writer.hashShielded;
+            if (fflush(fileout.Get()) != 0) {
+                strError = "Unable to flush snapshot";
+            } else {
+                FileCommit(fileout.Get());
+                fWritten = true;
+            }
+        }
+    } catch (const std::exception &e) {
+        strError = strprintf("Unable to write snapshot: %s", e.what());
+    }
+    if (fWritten && !RenameOver(pathTmp, path)) {
+        strError = strprintf("Unable to rename %s", pathTmp.string());
+        fWritten = false;
+    }
+    if (!fWritten) {
+        // The file is closed once fileout goes out of scope
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathTmp, ec);
+        return false;
+    }
+    LogPrintf("Wrote chain state snapshot at height %d (%u transactions) to %s in %dms\n",
+        stats.nHeight, stats.nTransactions, path.string(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/** Rebuild the header a block index entry of a snapshot describes */
+static CBlockHeader GetSnapshotHeader(const CDiskBlockIndex &index)
+{
+    CBlockHeader header;
+    header.nVersion = index.nVersion;
+    header.hashPrevBlock = index.hashPrev;
+    header.hashMerkleRoot = index.hashMerkleRoot;
+    header.hashReserved = index.hashReserved;
+    header.nTime = index.nTime;
+    header.nBits = index.nBits;
+    header.nNonce = index.nNonce;
+    header.nSolution = index.nSolution;
+    header.nChainId = index.nChainId;
+    return header;
+}
+
+/**
+ * Run a snapshot header through the checks a header received from a peer
+ * gets. vWindow holds the last headers, as far back as the difficulty
+ * adjustment and the median time past look; the block index isn't loaded
+ * yet when a snapshot is.
+ */
+static bool CheckSnapshotHeader(const CBlockHeader &header, int nHeight, std::deque<CBlockIndex> &vWindow)
+{
+    const size_t nWindow = Params().GetConsensus().nPowAveragingWindow + CBlockIndex::nMedianTimeSpan + 1;
+    CBlockIndex *pindexPrev = vWindow.empty() ? NULL : &vWindow.back();
+    CValidationState state;
+    if (!CheckBlockHeader(header, state) || !ContextualCheckBlockHeader(header, state, pindexPrev))
+        return false;
+
+    vWindow.push_back(CBlockIndex(header));
+    vWindow.back().pprev = pindexPrev;
+    vWindow.back().nHeight = nHeight;
+    if (vWindow.size() > nWindow) {
+        vWindow.pop_front();
+        vWindow.front().pprev = NULL;
+    }
+    return true;
+}
+
+/**
+ * Read the snapshot at path. Without a view it is only verified, headers
+ * included; with one its contents are written to view and the block tree
+ * database, rechecking everything but the headers.
+ */
+static bool ReadChainStateSnapshot(const boost::filesystem::path &path, CCoinsView *view, CCoinsStats &stats, std::string &strError)
+{
+    FILE *file = fopen(path.string().c_str(), "rb");
+    if (!file) {
+        strError = strprintf("Unable to open %s", path.string());
+        return false;
+    }
+
+    const bool fVerify = (view == NULL);
+    try {
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+
+        char pchMagic[sizeof(SNAPSHOT_MAGIC)];
+        uint32_t nVersion;
+        CMessageHeader::MessageStartChars pchMessageStart;
+        filein.read(pchMagic, sizeof(pchMagic));
+        filein >> nVersion >> FLATDATA(pchMessageStart);
+        if (memcmp(pchMagic, SNAPSHOT_MAGIC, sizeof(pchMagic)) != 0 || nVersion != SNAPSHOT_VERSION) {
+            strError = "Not a chain state snapshot, or an unsupported version";
+            return false;
+        }
+        if (memcmp(pchMessageStart, Params().MessageStart(), sizeof(pchMessageStart)) != 0) {
+            strError = "Snapshot is for a different network";
+            return false;
+        }
+
+        uint256 hashBlock, hashAnchor;
+        int nHeight;
+        filein >> hashBlock >> nHeight >> hashAnchor;
+
+        // Nothing in the file can vouch for it, whoever changes the coins,
+        // anchors or nullifiers can recompute any hash it carries: only a
+        // snapshot this release trusts is loaded.
+        MapSnapshots::const_iterator itTrusted = Params().Snapshots().find(nHeight);
+        if (itTrusted == Params().Snapshots().end() || itTrusted->second.hashBlock != hashBlock) {
+            strError = strprintf("Snapshot at height %d is not one this release trusts", nHeight);
+            return false;
+        }
+
+        uint256 hashPrev;
+        int nNextHeight = 0;
+        std::deque<CBlockIndex> vWindow;
+        uint256 txidLast;
+        bool fFirstCoins = true;
+        CSnapshotStats statsBuilder;
+        CSnapshotShieldedHash shieldedBuilder(hashAnchor);
+        uint256 rtLast, nfLast;
+        bool fFirstAnchor = true, fFirstNullifier = true;
+        // The empty tree is never stored, any other best anchor must be
+        bool fBestAnchorFound = (hashAnchor == ZCIncrementalMerkleTree::empty_root());
+        CCoinsMap mapCoins;
+        CAnchorsMap mapAnchors;
+        CNullifiersMap mapNullifiers;
+        const std::string strSectionOrder = {SNAPSHOT_BLOCK_INDEX, SNAPSHOT_ANCHOR, SNAPSHOT_NULLIFIER, SNAPSHOT_COINS, SNAPSHOT_END};
+        char chLastType = SNAPSHOT_BLOCK_INDEX;
+
+        while (true) {
+            boost::this_thread::interruption_point();
+            char chType;
+            uint32_t nCount, nSize;
+            filein >> chType >> nCount >> nSize;
+            if (nSize > MAX_SNAPSHOT_CHUNK_SIZE) {
+                strError = "Snapshot chunk too large";
+                return false;
+            }
+            CDataStream ssChunk(SER_DISK, CLIENT_VERSION);
+            ssChunk.resize(nSize);
+            if (nSize > 0)
+                filein.read(&ssChunk[0], nSize);
+            uint256 hashChecksum;
+            filein >> hashChecksum;
+            if (Hash(ssChunk.begin(), ssChunk.end()) != hashChecksum) {
+                strError = "Snapshot checksum mismatch";
+                return false;
+            }
+            // Sections must come in the order the writer produces them
+            if (strSectionOrder.find(chType) < strSectionOrder.find(chLastType)) {
+                strError = "Snapshot sections are out of order";
+                return false;
+            }
+            chLastType = chType;
+
+            if (chType == SNAPSHOT_BLOCK_INDEX) {
+                std::vector<CDiskBlockIndex> vIndex(nCount);
+                for (uint32_t i = 0; i < nCount; i++) {
+                    CDiskBlockIndex &index = vIndex[i];
+                    ssChunk >> index;
+                    CBlockHeader header = GetSnapshotHeader(index);
+                    uint256 hash = header.GetHash();
+                    if (index.hashPrev != hashPrev || index.nHeight != nNextHeight || index.nTx == 0 ||
+                        (nNextHeight == 0 && hash != Params().GetConsensus().hashGenesisBlock)) {
+                        strError = strprintf("Snapshot block index is not a chain from genesis (height %d)", nNextHeight);
+                        return false;
+                    }
+                    if (fVerify && !CheckSnapshotHeader(header, nNextHeight, vWindow)) {
+                        strError = strprintf("Snapshot block header at height %d is invalid", nNextHeight);
+                        return false;
+                    }
+                    // The validity of the file is not taken as is: only the
+                    // headers were checked, the transactions of these blocks
+                    // never are.
+                    index.nStatus = BLOCK_VALID_TREE | BLOCK_ASSUMED_VALID;
+                    index.nFile = 0;
+                    index.nDataPos = 0;
+                    index.nUndoPos = 0;
+                    hashPrev = hash;
+                    nNextHeight++;
+                }
+                if (!fVerify && !pblocktree->WriteDiskBlockIndex(vIndex)) {
+                    strError = "Failed to write to block index database";
+                    return false;
+                }
+            } else if (chType == SNAPSHOT_ANCHOR) {
+                for (uint32_t i = 0; i < nCount; i++) {
+                    uint256 rt;
+                    CAnchorsCacheEntry entry;
+                    ssChunk >> rt >> entry.tree;
+                    if (!fFirstAnchor && !(rtLast < rt)) {
+                        strError = "Snapshot anchors are not in canonical order";
+                        return false;
+                    }
+                    if (entry.tree.root() != rt) {
+                        strError = strprintf("Snapshot anchor %s does not match its tree", rt.GetHex());
+                        return false;
+                    }
+                    fFirstAnchor = false;
+                    rtLast = rt;
+                    if (rt == hashAnchor)
+                        fBestAnchorFound = true;
+                    shieldedBuilder.AddAnchor(rt, entry.tree);
+                    if (fVerify)
+                        continue;
+                    entry.entered = true;
+                    entry.flags = CAnchorsCacheEntry::DIRTY;
+                    mapAnchors[rt] = entry;
+                }
+            } else if (chType == SNAPSHOT_NULLIFIER) {
+                for (uint32_t i = 0; i < nCount; i++) {
+                    uint256 nf;
+                    ssChunk >> nf;
+                    if (!fFirstNullifier && !(nfLast < nf)) {
+                        strError = "Snapshot nullifiers are not in canonical order";
+                        return false;
+                    }
+                    fFirstNullifier = false;
+                    nfLast = nf;
+                    shieldedBuilder.AddNullifier(nf);
+                    if (fVerify)
+                        continue;
+                    CNullifiersCacheEntry &entry = mapNullifiers[nf];
+                    entry.entered = true;
+                    entry.flags = CNullifiersCacheEntry::DIRTY;
+                }
+            } else if (chType == SNAPSHOT_COINS) {
+                for (uint32_t i = 0; i < nCount; i++) {
+                    uint256 txid;
+                    CCoinsCacheEntry entry;
+                    ssChunk >> txid >> entry.coins;
+                    if ((!fFirstCoins && !(txidLast < txid)) || entry.coins.IsPruned()) {
+                        strError = "Snapshot coins are not in canonical order";
+                        return false;
+                    }
+                    fFirstCoins = false;
+                    txidLast = txid;
+                    statsBuilder.Add(txid, entry.coins);
+                    if (fVerify)
+                        continue;
+                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    mapCoins[txid] = entry;
+                }
+            } else if (chType == SNAPSHOT_END) {
+                // The statistics the writer recorded are not checked, the
+                // coins are checked against the trusted hashes instead
+                stats = CCoinsStats();
+                stats.hashBlock = hashBlock;
+                stats.nHeight = nHeight;
+                statsBuilder.Finalize(stats);
+                if (nNextHeight != nHeight + 1 || hashPrev != hashBlock) {
+                    strError = "Snapshot block index does not end at the snapshot block";
+                    return false;
+                }
+                if (stats.hashSerialized != itTrusted->second.hashSerialized) {
+                    strError = strprintf("Snapshot coins do not match the trusted hash_serialized %s", itTrusted->second.hashSerialized.GetHex());
+                    return false;
+                }
+                if (!fBestAnchorFound) {
+                    strError = strprintf("Snapshot best anchor %s is not one of its anchors", hashAnchor.GetHex());
+                    return false;
+                }
+                // Left out nullifiers would allow double spends, made up
+                // anchors spends of notes that never existed
+                if (shieldedBuilder.GetHash() != itTrusted->second.hashShielded) {
+                    strError = strprintf("Snapshot anchors and nullifiers do not match the trusted hash_shielded %s", itTrusted->second.hashShielded.GetHex());
+                    return false;
+                }
+
+                // Everything checked out: commit the remaining entries
+                // together with the best block and anchor.
+                if (!fVerify && (!view->BatchWrite(mapCoins, hashBlock, hashAnchor, mapAnchors, mapNullifiers) ||
+                                 !pblocktree->WriteFlag("snapshot", true))) {
+                    strError = "Failed to write the chain state";
+                    return false;
+                }
+                return true;
+            } else {
+                strError = strprintf("Unknown snapshot chunk type %d", chType);
+                return false;
+            }
+
+            if (!fVerify && mapCoins.size() + mapAnchors.size() + mapNullifiers.size() >= SNAPSHOT_LOAD_BATCH) {
+                if (!view->BatchWrite(mapCoins, uint256(), uint256(), mapAnchors, mapNullifiers)) {
+                    strError = "Failed to write the chain state";
+                    return false;
+                }
+            }
+        }
+    } catch (const std::exception &e) {
+        strError = strprintf("Unable to read snapshot: %s", e.what());
+        return false;
+    }
+}
+
+bool LoadChainStateSnapshot(CCoinsView *view, const boost::filesystem::path &path, std::string &strError)
+{
+    if (!view->GetBestBlock().IsNull()) {
+        strError = "The chain state is not empty";
+        return false;
+    }
+
+    // The snapshot is read twice, so that nothing of a snapshot that fails
+    // any check ever reaches the databases: the first pass verifies it as a
+    // whole, the second writes it.
+    LogPrintf("Verifying chain state snapshot %s\n", path.string());
+    int64_t nStart = GetTimeMillis();
+    CCoinsStats stats;
+    if (!ReadChainStateSnapshot(path, NULL, stats, strError))
+        return false;
+    LogPrintf("Verified chain state snapshot at height %d in %dms\n", stats.nHeight, GetTimeMillis() - nStart);
+
+    nStart = GetTimeMillis();
+    if (!ReadChainStateSnapshot(path, view, stats, strError)) {
+        // Only a snapshot changed on disk since it was verified, or a
+        // database failure, gets here with part of it written
+        strError += ", restart with -reindex to clear the partially loaded chain state";
+        return false;
+    }
+    LogPrintf("Loaded chain state snapshot at height %d (%u transactions, hash_serialized=%s) in %dms\n",
+        stats.nHeight, stats.nTransactions, stats.hashSerialized.GetHex(), GetTimeMillis() - nStart);
+    return true;
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SNAPSHOT_H
+#define BITCOIN_SNAPSHOT_H
+
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+class CCoinsView;
+class uint256;
+struct CCoinsStats;
+
+/**
+ * Chain state snapshots let a new node start from a copy of another node's
+ * chain state instead of connecting every block since genesis.
+ *
+ * A snapshot holds the block index of the active chain up to the snapshot
+ * block (headers only, no block data), every anchor tree, every
+ * spent nullifier and the unspent coins, each in ascending order. It is written as a
+ * header followed by chunks of at most a few MiB, each carrying its own
+ * checksum; the final chunk records the gettxoutsetinfo statistics.
+ *
+ * The loader only accepts a snapshot pinned in the chain parameters, and
+ * verifies the whole of it before writing any of it: the checksums, the
+ * headers (proof of work, difficulty, timestamps and checkpoints, as for
+ * headers from a peer), the order of the anchors, nullifiers and coins, that
+ * every anchor is the root of its tree and the best anchor one of them, the
+ * hash_serialized of the coins and the hash_shielded of the best anchor,
+ * anchor trees and nullifiers against the pinned ones. The statistics in the
+ * file are informational only.
+ *
+ * The blocks below the snapshot are marked BLOCK_ASSUMED_VALID, their
+ * transactions are never checked. As the history below a snapshot is not
+ * validated in the background yet, no snapshot is pinned on any network. A
+ * node bootstrapped from one does not have the block data below the snapshot
+ * and behaves like a pruned node for that part of the chain.
+ */
+
+/** Write a snapshot of the persisted state of view to path, returning what a release pins for it */
+bool DumpChainStateSnapshot(const CCoinsView *view, const boost::filesystem::path &path, CCoinsStats &stats, uint256 &hashShielded, std::string &strError);
+
+/** Bulk-load the snapshot at path into an empty view and the block tree database */
+bool LoadChainStateSnapshot(CCoinsView *view, const boost::filesystem::path &path, std::string &strError);
+
+#endif // BITCOIN_SNAPSHOT_H
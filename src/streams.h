@@ -299,6 +299,14 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Hand the unread data over to data without copying it, leaving the
+    // stream empty. Whatever data held before is discarded.
+    void SwapAndClear(vector_type &data) {
+        Compact();
+        data.swap(vch);
+        clear();
+    }
 };
 
 class CDataStream : public CBaseDataStream<CSerializeData>
@@ -0,0 +1,69 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
+
+#include "support/bufferpool.h"
+
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Allocator for buffers of public data, backed by CBufferPool. Memory is not
+ * cleared on release, and elements are default-initialized, so resizing a
+ * byte vector does not zero the new bytes either: they are expected to be
+ * overwritten right away.
+ */
+template <typename T>
+struct pooled_allocator : public std::allocator<T> {
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    pooled_allocator() throw() {}
+    pooled_allocator(const pooled_allocator& a) throw() : base(a) {}
+    template <typename U>
+    pooled_allocator(const pooled_allocator<U>& a) throw() : base(a)
+    {
+    }
+    ~pooled_allocator() throw() {}
+    template <typename _Other>
+    struct rebind {
+        typedef pooled_allocator<_Other> other;
+    };
+
+    T* allocate(std::size_t n, const void* hint = 0)
+    {
+        return static_cast<T*>(CBufferPool::Allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        CBufferPool::Free(p, sizeof(T) * n);
+    }
+
+    template <typename U>
+    void construct(U* p)
+    {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+// Byte-vector for network data, allocated from the buffer pool and not cleared.
+typedef std::vector<char, pooled_allocator<char> > CPooledData;
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
@@ -0,0 +1,112 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "support/bufferpool.h"
+
+#include <new>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+namespace {
+
+const int NUM_SIZE_CLASSES = 11; // 4 KiB .. 4 MiB
+
+struct SizeClass {
+    boost::mutex mutex;
+    std::vector<void*> vFree;
+};
+
+struct PoolState {
+    SizeClass classes[NUM_SIZE_CLASSES];
+    boost::mutex mutexCached;
+    size_t nCachedBytes;
+
+    PoolState() : nCachedBytes(0) {}
+};
+
+PoolState& GetPoolState()
+{
+    // Never destroyed: buffers may still be released by other static
+    // destructors during shutdown.
+    static PoolState* state = new PoolState();
+    return *state;
+}
+
+/** Size class for nSize, or -1 if it is not pooled */
+int GetSizeClass(size_t nSize)
+{
+    if (nSize < CBufferPool::MIN_POOLED_SIZE || nSize > CBufferPool::MAX_POOLED_SIZE)
+        return -1;
+    int nClass = 0;
+    size_t nClassSize = CBufferPool::MIN_POOLED_SIZE;
+    while (nClassSize < nSize) {
+        nClassSize <<= 1;
+        nClass++;
+    }
+    return nClass;
+}
+
+size_t GetClassSize(int nClass)
+{
+    return CBufferPool::MIN_POOLED_SIZE << nClass;
+}
+
+}
+
+void* CBufferPool::Allocate(size_t nSize)
+{
+    int nClass = GetSizeClass(nSize);
+    if (nClass < 0)
+        return ::operator new(nSize);
+
+    PoolState& state = GetPoolState();
+    SizeClass& sizeClass = state.classes[nClass];
+    void* p = NULL;
+    {
+        boost::mutex::scoped_lock lock(sizeClass.mutex);
+        if (!sizeClass.vFree.empty()) {
+            p = sizeClass.vFree.back();
+            sizeClass.vFree.pop_back();
+        }
+    }
+    if (p == NULL)
+        return ::operator new(GetClassSize(nClass));
+
+    boost::mutex::scoped_lock lock(state.mutexCached);
+    state.nCachedBytes -= GetClassSize(nClass);
+    return p;
+}
+
+void CBufferPool::Free(void* p, size_t nSize)
+{
+    if (p == NULL)
+        return;
+    int nClass = GetSizeClass(nSize);
+    if (nClass < 0) {
+        ::operator delete(p);
+        return;
+    }
+
+    PoolState& state = GetPoolState();
+    {
+        boost::mutex::scoped_lock lock(state.mutexCached);
+        if (state.nCachedBytes + GetClassSize(nClass) > MAX_CACHED_BYTES) {
+            lock.unlock();
+            ::operator delete(p);
+            return;
+        }
+        state.nCachedBytes += GetClassSize(nClass);
+    }
+    SizeClass& sizeClass = state.classes[nClass];
+    boost::mutex::scoped_lock lock(sizeClass.mutex);
+    sizeClass.vFree.push_back(p);
+}
+
+size_t CBufferPool::CachedBytes()
+{
+    PoolState& state = GetPoolState();
+    boost::mutex::scoped_lock lock(state.mutexCached);
+    return state.nCachedBytes;
+}
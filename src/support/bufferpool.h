@@ -0,0 +1,34 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_BUFFERPOOL_H
+#define BITCOIN_SUPPORT_BUFFERPOOL_H
+
+#include <stddef.h>
+
+/**
+ * Process-wide pool of heap blocks for short-lived buffers holding public
+ * data, such as messages received from the network.
+ *
+ * Requests from MIN_POOLED_SIZE to MAX_POOLED_SIZE bytes are rounded up to a
+ * power of two and served from the free list of that size class. Released
+ * blocks go back onto their free list without being cleared, as long as the
+ * pool caches less than MAX_CACHED_BYTES. Other sizes go straight to the
+ * heap.
+ */
+class CBufferPool
+{
+public:
+    static const size_t MIN_POOLED_SIZE = 4 * 1024;
+    static const size_t MAX_POOLED_SIZE = 4 * 1024 * 1024;
+    static const size_t MAX_CACHED_BYTES = 64 * 1024 * 1024;
+
+    static void* Allocate(size_t nSize);
+    static void Free(void* p, size_t nSize);
+
+    //! Bytes held in free lists
+    static size_t CachedBytes();
+};
+
+#endif // BITCOIN_SUPPORT_BUFFERPOOL_H
@@ -28,13 +28,17 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    unsigned int nTxSize;
+    int64_t nTimeExpire;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern size_t nOrphanTransactionsSize;
+extern std::map<NodeId, size_t> mapOrphanTransactionsSizeByPeer;
 
 CService ip(uint32_t i)
 {
@@ -117,6 +121,18 @@ CTransaction RandomOrphan()
     return it->second.tx;
 }
 
+CMutableTransaction OrphanWithRandomParent()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    return tx;
+}
+
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 {
     CKey key;
@@ -189,13 +205,52 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    size_t nNoSizeLimit = std::numeric_limits<size_t>::max();
+    LimitOrphanTxSize(40, nNoSizeLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, nNoSizeLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, nNoSizeLimit);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0);
+    BOOST_CHECK(mapOrphanTransactionsSizeByPeer.empty());
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_size)
+{
+    // 40 orphans from each of two peers
+    size_t nTxSize = 0;
+    for (int i = 0; i < 80; i++)
+    {
+        CMutableTransaction tx = OrphanWithRandomParent();
+        nTxSize = CTransaction(tx).GetSerializeSize(SER_NETWORK, tx.nVersion);
+        BOOST_CHECK(AddOrphanTx(tx, i % 2));
+    }
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 80 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsSizeByPeer[0], 40 * nTxSize);
+
+    // Both peers are within their share of the pool
+    LimitOrphanTxSize(1000, 4 * 50 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 80);
+
+    // A peer going over its share only loses its own orphans
+    for (int i = 0; i < 20; i++)
+        BOOST_CHECK(AddOrphanTx(OrphanWithRandomParent(), 0));
+    LimitOrphanTxSize(1000, 4 * 50 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsSizeByPeer[0], 50 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsSizeByPeer[1], 40 * nTxSize);
+
+    // The byte budget holds for the pool as a whole
+    LimitOrphanTxSize(1000, 30 * nTxSize);
+    BOOST_CHECK(nOrphanTransactionsSize <= 30 * nTxSize);
+
+    // Orphans whose inputs never show up expire
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 1);
+    LimitOrphanTxSize(1000, 1000 * nTxSize);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0);
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
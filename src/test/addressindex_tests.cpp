@@ -0,0 +1,169 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "key.h"
+#include "main.h"
+#include "script/standard.h"
+#include "txdb.h"
+#include "undo.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(addressindex_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    uint160 hash;
+    hash.SetHex("0102030405060708090a0b0c0d0e0f1011121314");
+
+    // Keys of an address sort by height, then by position in the block,
+    // which needs the big endian serialization
+    CAddressIndexKey key1(ADDRESSINDEX_P2PKH, hash, 255, 7, uint256(), 0, false);
+    CAddressIndexKey key2(ADDRESSINDEX_P2PKH, hash, 256, 1, uint256(), 0, false);
+    CAddressIndexKey key3(ADDRESSINDEX_P2PKH, hash, 256, 256, uint256(), 0, false);
+
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION), ss3(SER_DISK, CLIENT_VERSION);
+    ss1 << key1;
+    ss2 << key2;
+    ss3 << key3;
+    BOOST_CHECK_EQUAL(ss1.size(), key1.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(ss1.str() < ss2.str());
+    BOOST_CHECK(ss2.str() < ss3.str());
+
+    // The iterator key is a prefix of the keys at its height
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << CAddressIndexIteratorKey(ADDRESSINDEX_P2PKH, hash, 256);
+    BOOST_CHECK_EQUAL(ss2.str().substr(0, ssPrefix.size()), ssPrefix.str());
+
+    CAddressIndexKey key;
+    ss3 >> key;
+    BOOST_CHECK_EQUAL(key.nHeight, 256);
+    BOOST_CHECK_EQUAL(key.nTxIndex, 256U);
+    BOOST_CHECK(key.hashBytes == hash);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_script_address)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint160 hashBytes;
+
+    BOOST_CHECK_EQUAL(GetScriptAddress(GetScriptForDestination(pubkey.GetID()), hashBytes), ADDRESSINDEX_P2PKH);
+    BOOST_CHECK(hashBytes == pubkey.GetID());
+
+    // Pay to public key outputs are indexed under the key hash
+    BOOST_CHECK_EQUAL(GetScriptAddress(CScript() << ToByteVector(pubkey) << OP_CHECKSIG, hashBytes), ADDRESSINDEX_P2PKH);
+    BOOST_CHECK(hashBytes == pubkey.GetID());
+
+    CScript redeemScript = GetScriptForMultisig(1, std::vector<CPubKey>(1, pubkey));
+    BOOST_CHECK_EQUAL(GetScriptAddress(GetScriptForDestination(CScriptID(redeemScript)), hashBytes), ADDRESSINDEX_P2SH);
+    BOOST_CHECK(hashBytes == CScriptID(redeemScript));
+
+    BOOST_CHECK_EQUAL(GetScriptAddress(redeemScript, hashBytes), ADDRESSINDEX_NONE);
+    BOOST_CHECK_EQUAL(GetScriptAddress(CScript() << OP_RETURN, hashBytes), ADDRESSINDEX_NONE);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_block_entries)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyID keyID = key.GetPubKey().GetID();
+    CScript script = GetScriptForDestination(keyID);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.push_back(CTxOut(10 * COIN, script));
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(uint256S("0x01"), 3);
+    spend.vout.push_back(CTxOut(1 * COIN, CScript() << OP_RETURN));
+    spend.vout.push_back(CTxOut(4 * COIN, script));
+
+    CBlock block;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(spend);
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(5 * COIN, script)));
+
+    AddressIndexEntries vAddressIndex;
+    SpentIndexEntries vSpentIndex;
+    GetAddressIndexEntries(block, blockundo, 10, &vAddressIndex, &vSpentIndex);
+
+    BOOST_REQUIRE_EQUAL(vAddressIndex.size(), 3U);
+    CAmount nBalance = 0;
+    for (unsigned int i = 0; i < vAddressIndex.size(); i++) {
+        BOOST_CHECK(vAddressIndex[i].first.hashBytes == keyID);
+        BOOST_CHECK_EQUAL(vAddressIndex[i].first.nHeight, 10);
+        nBalance += vAddressIndex[i].second;
+    }
+    BOOST_CHECK_EQUAL(nBalance, 9 * COIN);
+    BOOST_CHECK(vAddressIndex[1].first.fSpending);
+    BOOST_CHECK_EQUAL(vAddressIndex[1].second, -5 * COIN);
+    BOOST_CHECK_EQUAL(vAddressIndex[2].first.nIndex, 1U);
+
+    BOOST_REQUIRE_EQUAL(vSpentIndex.size(), 1U);
+    BOOST_CHECK(vSpentIndex[0].first.txid == uint256S("0x01"));
+    BOOST_CHECK_EQUAL(vSpentIndex[0].first.nOutput, 3U);
+    BOOST_CHECK(vSpentIndex[0].second.txid == block.vtx[1].GetHash());
+    BOOST_CHECK_EQUAL(vSpentIndex[0].second.nValue, 5 * COIN);
+    BOOST_CHECK(vSpentIndex[0].second.addressHash == keyID);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_read_ranges)
+{
+    uint160 hash, other;
+    hash.SetHex("01");
+    other.SetHex("02");
+
+    AddressIndexEntries vWrite;
+    for (int nHeight = 1; nHeight <= 10; nHeight++) {
+        vWrite.push_back(std::make_pair(CAddressIndexKey(ADDRESSINDEX_P2PKH, hash, nHeight, 1, uint256(), 0, false), nHeight));
+        vWrite.push_back(std::make_pair(CAddressIndexKey(ADDRESSINDEX_P2PKH, other, nHeight, 1, uint256(), 0, false), nHeight));
+    }
+    CLevelDBBatch batch;
+    pblocktree->WriteAddressIndexes(batch, vWrite, SpentIndexEntries());
+    BOOST_CHECK(pblocktree->WriteIndexBatch(batch, "addressindex", uint256S("0x0a")));
+
+    uint256 hashBest;
+    BOOST_CHECK(pblocktree->ReadIndexBestBlock("addressindex", hashBest));
+    BOOST_CHECK(hashBest == uint256S("0x0a"));
+
+    AddressIndexEntries vRead;
+    BOOST_CHECK(pblocktree->ReadAddressIndex(ADDRESSINDEX_P2PKH, hash, 0, 0, NULL, 0, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 10U);
+
+    vRead.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(ADDRESSINDEX_P2PKH, hash, 3, 5, NULL, 0, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 3U);
+    BOOST_CHECK_EQUAL(vRead[0].first.nHeight, 3);
+    BOOST_CHECK_EQUAL(vRead[2].first.nHeight, 5);
+
+    // Pages continue after the last entry of the previous one
+    vRead.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(ADDRESSINDEX_P2PKH, hash, 0, 0, NULL, 4, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 4U);
+    CAddressIndexKey cursor = vRead.back().first;
+    vRead.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(ADDRESSINDEX_P2PKH, hash, 0, 0, &cursor, 4, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 4U);
+    BOOST_CHECK_EQUAL(vRead[0].first.nHeight, 5);
+
+    // Removing the index forgets how far it got as well as its entries
+    CAddressIndex index;
+    BOOST_CHECK(index.Remove());
+    BOOST_CHECK(!pblocktree->ReadIndexBestBlock("addressindex", hashBest));
+    vRead.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(ADDRESSINDEX_P2PKH, other, 0, 0, NULL, 0, vRead));
+    BOOST_CHECK(vRead.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "util.h"
 
+#include "support/allocators/pooled.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
@@ -117,4 +118,35 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(test_BufferPool)
+{
+    const size_t nSize = 100000; // rounds up to the 128 KiB size class
+    void* p = CBufferPool::Allocate(nSize);
+    BOOST_REQUIRE(p != NULL);
+    size_t nCachedBefore = CBufferPool::CachedBytes();
+    CBufferPool::Free(p, nSize);
+    BOOST_CHECK_EQUAL(CBufferPool::CachedBytes(), nCachedBefore + 128 * 1024);
+
+    // Any size of the same class gets the released block back
+    void* q = CBufferPool::Allocate(120000);
+    BOOST_CHECK(q == p);
+    BOOST_CHECK_EQUAL(CBufferPool::CachedBytes(), nCachedBefore);
+    CBufferPool::Free(q, 120000);
+
+    // Sizes outside the pooled range are not cached
+    size_t nCached = CBufferPool::CachedBytes();
+    CBufferPool::Free(CBufferPool::Allocate(100), 100);
+    CBufferPool::Free(CBufferPool::Allocate(CBufferPool::MAX_POOLED_SIZE + 1), CBufferPool::MAX_POOLED_SIZE + 1);
+    BOOST_CHECK_EQUAL(CBufferPool::CachedBytes(), nCached);
+
+    // Pooled vectors keep their contents across copies and resizes
+    CPooledData v;
+    v.resize(nSize);
+    v[0] = 'a';
+    v[nSize - 1] = 'z';
+    CPooledData w(v);
+    w.resize(2 * nSize);
+    BOOST_CHECK(w[0] == 'a' && w[nSize - 1] == 'z');
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,108 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(3);
+    block.vtx[0] = tx;
+    block.nVersion = 4;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = tx;
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(reconstruct_from_mempool)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+    BOOST_CHECK_EQUAL(shortIDs2.BlockTxCount(), 3);
+    BOOST_CHECK_EQUAL(shortIDs2.GetShortID(block.vtx[1].GetHash()), shortIDs.GetShortID(block.vtx[1].GetHash()));
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+
+    // Missing transactions must be supplied exactly
+    CBlock block2;
+    std::vector<CTransaction> vtx_missing;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_INVALID);
+
+    // The wrong transaction gives a merkle mismatch
+    vtx_missing.push_back(block.vtx[2]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_FAILED);
+
+    vtx_missing[0] = block.vtx[1];
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block2.BuildMerkleTree().ToString(), block.hashMerkleRoot.ToString());
+}
+
+BOOST_AUTO_TEST_CASE(blocktxn_request_roundtrip)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.resize(4);
+    req1.indexes[0] = 0;
+    req1.indexes[1] = 1;
+    req1.indexes[2] = 3;
+    req1.indexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK_EQUAL(req1.indexes.size(), req2.indexes.size());
+    for (size_t i = 0; i < req1.indexes.size(); i++)
+        BOOST_CHECK_EQUAL(req1.indexes[i], req2.indexes[i]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,307 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinslog.h"
+#include "random.h"
+#include "script/script.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+
+#include <stdio.h>
+
+#include <map>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+void WriteSample(CCoinsView &view, const uint256 &txid, const uint256 &nf, ZCIncrementalMerkleTree &tree)
+{
+    CCoinsMap mapCoins;
+    CCoinsCacheEntry &entry = mapCoins[txid];
+    entry.coins.nVersion = 1;
+    entry.coins.nHeight = 7;
+    entry.coins.vout.resize(2);
+    entry.coins.vout[1].nValue = 12345;
+    entry.coins.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    entry.flags = CCoinsCacheEntry::DIRTY;
+
+    CAnchorsMap mapAnchors;
+    tree.append(GetRandHash());
+    CAnchorsCacheEntry &anchor = mapAnchors[tree.root()];
+    anchor.entered = true;
+    anchor.tree = tree;
+    anchor.flags = CAnchorsCacheEntry::DIRTY;
+
+    CNullifiersMap mapNullifiers;
+    CNullifiersCacheEntry &nullifier = mapNullifiers[nf];
+    nullifier.entered = true;
+    nullifier.flags = CNullifiersCacheEntry::DIRTY;
+
+    BOOST_CHECK(view.BatchWrite(mapCoins, GetRandHash(), tree.root(), mapAnchors, mapNullifiers));
+}
+
+void CheckSample(const CCoinsView &view, const uint256 &txid, const uint256 &nf, const ZCIncrementalMerkleTree &tree)
+{
+    CCoins coins;
+    BOOST_CHECK(view.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 7);
+    BOOST_CHECK_EQUAL(coins.vout[1].nValue, 12345);
+    BOOST_CHECK(view.GetNullifier(nf));
+    BOOST_CHECK(view.GetBestAnchor() == tree.root());
+    ZCIncrementalMerkleTree treeRead;
+    BOOST_CHECK(view.GetAnchorAt(tree.root(), treeRead));
+    BOOST_CHECK(treeRead.root() == tree.root());
+}
+
+// Write coins with scripts large enough for the write to take several records
+std::vector<uint256> WriteLargeSample(CCoinsView &view)
+{
+    std::vector<uint256> vTxid;
+    CCoinsMap mapCoins;
+    for (int i = 0; i < 40; i++) {
+        vTxid.push_back(GetRandHash());
+        CCoinsCacheEntry &entry = mapCoins[vTxid.back()];
+        entry.coins.nVersion = 1;
+        entry.coins.vout.resize(1);
+        entry.coins.vout[0].nValue = i;
+        entry.coins.vout[0].scriptPubKey.assign(512 * 1024, OP_NOP);
+        entry.flags = CCoinsCacheEntry::DIRTY;
+    }
+    CAnchorsMap mapAnchors;
+    CNullifiersMap mapNullifiers;
+    BOOST_CHECK(view.BatchWrite(mapCoins, GetRandHash(), uint256(), mapAnchors, mapNullifiers));
+    return vTxid;
+}
+
+// Flip the byte at nOffset from the start of path, or from its end if negative
+void FlipByte(const boost::filesystem::path &path, long nOffset)
+{
+    FILE *file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, nOffset, nOffset < 0 ? SEEK_END : SEEK_SET);
+    int ch = fgetc(file);
+    fseek(file, nOffset, nOffset < 0 ? SEEK_END : SEEK_SET);
+    fputc(ch ^ 0xff, file);
+    fclose(file);
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(coinslog_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(coinslog_reload)
+{
+    boost::filesystem::path path = GetDataDir() / "chainstate-log-test";
+    uint256 txid = GetRandHash();
+    uint256 nf = GetRandHash();
+    ZCIncrementalMerkleTree tree;
+    uint256 hashBlock;
+    {
+        CCoinsViewLog view(path, false, true);
+        WriteSample(view, txid, nf, tree);
+        hashBlock = view.GetBestBlock();
+    }
+    {
+        CCoinsViewLog view(path);
+        CheckSample(view, txid, nf, tree);
+        BOOST_CHECK(view.GetBestBlock() == hashBlock);
+        BOOST_CHECK(!view.HaveCoins(GetRandHash()));
+        BOOST_CHECK(!view.GetNullifier(GetRandHash()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coinslog_torn_record)
+{
+    boost::filesystem::path path = GetDataDir() / "chainstate-log-test";
+    uint256 txid = GetRandHash();
+    uint256 nf = GetRandHash();
+    ZCIncrementalMerkleTree tree;
+    {
+        CCoinsViewLog view(path, false, true);
+        WriteSample(view, txid, nf, tree);
+    }
+
+    // Simulate a crash in the middle of appending the next record
+    FILE *file = fopen((path / "log.dat").string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    fwrite("ZCLG\xff\xff", 1, 6, file);
+    fclose(file);
+
+    {
+        CCoinsViewLog view(path);
+        CheckSample(view, txid, nf, tree);
+        uint256 txid2 = GetRandHash();
+        uint256 nf2 = GetRandHash();
+        WriteSample(view, txid2, nf2, tree);
+    }
+    {
+        CCoinsViewLog view(path);
+        CheckSample(view, txid, nf, tree);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coinslog_split_write)
+{
+    boost::filesystem::path path = GetDataDir() / "chainstate-log-test";
+    boost::filesystem::path pathLog = path / "log.dat";
+    std::vector<uint256> vTxid, vTxidTorn;
+    uint64_t nSizeBefore;
+    {
+        CCoinsViewLog view(path, false, true);
+        vTxid = WriteLargeSample(view);
+        nSizeBefore = boost::filesystem::file_size(pathLog);
+        vTxidTorn = WriteLargeSample(view);
+    }
+
+    // The write didn't fit in one record
+    FILE *file = fopen(pathLog.string().c_str(), "rb");
+    BOOST_REQUIRE(file);
+    char pchMagic[4];
+    BOOST_CHECK(fread(pchMagic, 1, sizeof(pchMagic), file) == sizeof(pchMagic));
+    BOOST_CHECK(memcmp(pchMagic, "ZCLP", sizeof(pchMagic)) == 0);
+    fclose(file);
+
+    // Simulate a crash before the record committing the second write was
+    // synced: none of that write is replayed, though its first record is intact
+    boost::filesystem::resize_file(pathLog, boost::filesystem::file_size(pathLog) - 10);
+    {
+        CCoinsViewLog view(path);
+        for (size_t i = 0; i < vTxid.size(); i++)
+            BOOST_CHECK(view.HaveCoins(vTxid[i]));
+        for (size_t i = 0; i < vTxidTorn.size(); i++)
+            BOOST_CHECK(!view.HaveCoins(vTxidTorn[i]));
+        CCoins coins;
+        BOOST_CHECK(view.GetCoins(vTxid[1], coins));
+        BOOST_CHECK_EQUAL(coins.vout[0].nValue, 1);
+        BOOST_CHECK_EQUAL(coins.vout[0].scriptPubKey.size(), 512 * 1024);
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathLog), nSizeBefore);
+}
+
+BOOST_AUTO_TEST_CASE(coinslog_corrupt_record)
+{
+    boost::filesystem::path path = GetDataDir() / "chainstate-log-test";
+    boost::filesystem::path pathLog = path / "log.dat";
+    uint256 txid = GetRandHash();
+    uint256 nf = GetRandHash();
+    ZCIncrementalMerkleTree tree;
+    {
+        CCoinsViewLog view(path, false, true);
+        WriteSample(view, txid, nf, tree);
+        ZCIncrementalMerkleTree tree2;
+        WriteSample(view, GetRandHash(), GetRandHash(), tree2);
+    }
+
+    // Damage to the last record is a write torn by a crash: it is dropped
+    uint64_t nSize = boost::filesystem::file_size(pathLog);
+    FlipByte(pathLog, -40);
+    {
+        CCoinsViewLog view(path);
+        CheckSample(view, txid, nf, tree);
+    }
+    BOOST_CHECK(boost::filesystem::file_size(pathLog) < nSize);
+
+    // but damage to a record followed by others is corruption, and nothing
+    // of the log is dropped
+    {
+        CCoinsViewLog view(path);
+        ZCIncrementalMerkleTree tree2;
+        WriteSample(view, GetRandHash(), GetRandHash(), tree2);
+    }
+    nSize = boost::filesystem::file_size(pathLog);
+    FlipByte(pathLog, 40);
+    BOOST_CHECK_THROW(CCoinsViewLog view(path), std::runtime_error);
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathLog), nSize);
+}
+
+BOOST_AUTO_TEST_CASE(coinslog_compact)
+{
+    boost::filesystem::path path = GetDataDir() / "chainstate-log-test";
+    uint256 txid = GetRandHash();
+    uint256 nf = GetRandHash();
+    ZCIncrementalMerkleTree tree;
+    CCoinsStats statsBefore;
+    {
+        CCoinsViewLog view(path, false, true);
+        WriteSample(view, txid, nf, tree);
+        BOOST_CHECK(view.GetStats(statsBefore));
+        BOOST_CHECK(view.Compact());
+        BOOST_CHECK(boost::filesystem::file_size(path / "log.dat") == 0);
+    }
+    {
+        CCoinsViewLog view(path);
+        CheckSample(view, txid, nf, tree);
+        CCoinsStats statsAfter;
+        BOOST_CHECK(view.GetStats(statsAfter));
+        BOOST_CHECK(statsAfter.hashSerialized == statsBefore.hashSerialized);
+        BOOST_CHECK_EQUAL(statsAfter.nTotalAmount, 12345);
+    }
+}
+
+namespace
+{
+// Records the coins a traversal visits, changing the view once it started
+class ChangingVisitor : public CCoinsViewVisitor
+{
+public:
+    CCoinsView &view;
+    CCoinsMap mapChanges;
+    std::map<uint256, CAmount> mapVisited;
+
+    ChangingVisitor(CCoinsView &viewIn) : view(viewIn) {}
+
+    bool VisitBest(const uint256 &hashBlock, const uint256 &hashAnchor)
+    {
+        CAnchorsMap mapAnchors;
+        CNullifiersMap mapNullifiers;
+        return view.BatchWrite(mapChanges, GetRandHash(), uint256(), mapAnchors, mapNullifiers);
+    }
+    bool VisitAnchor(const uint256 &rt, const ZCIncrementalMerkleTree &tree) { return true; }
+    bool VisitNullifier(const uint256 &nullifier) { return true; }
+    bool VisitCoins(const uint256 &txid, const CCoins &coins)
+    {
+        mapVisited[txid] = coins.vout[1].nValue;
+        return true;
+    }
+};
+}
+
+BOOST_AUTO_TEST_CASE(coinslog_traverse_consistent)
+{
+    CCoinsViewLog view(GetDataDir(), true);
+    ZCIncrementalMerkleTree tree;
+    uint256 txidSpent = GetRandHash();
+    uint256 txidChanged = GetRandHash();
+    WriteSample(view, txidSpent, GetRandHash(), tree);
+    WriteSample(view, txidChanged, GetRandHash(), tree);
+    CCoinsStats statsBefore;
+    BOOST_CHECK(view.GetStats(statsBefore));
+
+    // Spend one coin, change another and add a third while the walk runs
+    ChangingVisitor visitor(view);
+    visitor.mapChanges[txidSpent].flags = CCoinsCacheEntry::DIRTY;
+    CCoinsCacheEntry &changed = visitor.mapChanges[txidChanged];
+    BOOST_CHECK(view.GetCoins(txidChanged, changed.coins));
+    changed.coins.vout[1].nValue = 1;
+    changed.flags = CCoinsCacheEntry::DIRTY;
+    CCoinsCacheEntry &added = visitor.mapChanges[GetRandHash()];
+    added.coins = changed.coins;
+    added.flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(view.Traverse(visitor));
+
+    // The walk only sees the state it started from
+    BOOST_CHECK_EQUAL(visitor.mapVisited.size(), 2);
+    BOOST_CHECK_EQUAL(visitor.mapVisited[txidSpent], 12345);
+    BOOST_CHECK_EQUAL(visitor.mapVisited[txidChanged], 12345);
+
+    // while the view moved on
+    BOOST_CHECK(!view.HaveCoins(txidSpent));
+    CCoinsStats statsAfter;
+    BOOST_CHECK(view.GetStats(statsAfter));
+    BOOST_CHECK(statsAfter.hashSerialized != statsBefore.hashSerialized);
+    BOOST_CHECK_EQUAL(statsAfter.nTransactions, 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -47,4 +47,13 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Test vector from the SipHash reference implementation, for the 32-byte
+    // message 00 01 .. 1f and key 00 01 .. 0f
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL,
+                      uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")),
+                      0x7127512f72f27cceull);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
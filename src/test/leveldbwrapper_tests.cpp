@@ -0,0 +1,75 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+#include "util.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(leveldbwrapper_tests, BasicTestingSetup)
+
+static void ClearOptionArgs()
+{
+    const char* const pszKnobs[] = {"blockcache", "writebuffer", "blocksize", "maxopenfiles", "bloombits", "compression"};
+    for (size_t i = 0; i < sizeof(pszKnobs) / sizeof(pszKnobs[0]); i++) {
+        mapArgs.erase(std::string("-db") + pszKnobs[i]);
+        mapArgs.erase(std::string("-anchorsdb") + pszKnobs[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_options_args)
+{
+    ClearOptionArgs();
+    CLevelDBOptions defaults;
+    CLevelDBOptions tuning;
+    tuning.ApplyArgs("chainstate");
+    BOOST_CHECK_EQUAL(tuning.nBlockCachePercent, defaults.nBlockCachePercent);
+    BOOST_CHECK_EQUAL(tuning.nWriteBufferPercent, defaults.nWriteBufferPercent);
+    BOOST_CHECK_EQUAL(tuning.nBlockSize, defaults.nBlockSize);
+    BOOST_CHECK_EQUAL(tuning.nMaxOpenFiles, defaults.nMaxOpenFiles);
+    BOOST_CHECK_EQUAL(tuning.nBloomFilterBits, defaults.nBloomFilterBits);
+    BOOST_CHECK_EQUAL(tuning.fCompression, defaults.fCompression);
+
+    // -db<opt> applies to every database, -<name>db<opt> overrides it for one
+    mapArgs["-dbmaxopenfiles"] = "100";
+    mapArgs["-dbblocksize"] = "8";
+    mapArgs["-dbcompression"] = "1";
+    mapArgs["-anchorsdbmaxopenfiles"] = "200";
+    mapArgs["-anchorsdbcompression"] = "0";
+    CLevelDBOptions chainstate;
+    chainstate.ApplyArgs("chainstate");
+    BOOST_CHECK_EQUAL(chainstate.nMaxOpenFiles, 100);
+    BOOST_CHECK_EQUAL(chainstate.nBlockSize, 8 * 1024);
+    BOOST_CHECK(chainstate.fCompression);
+    CLevelDBOptions anchors;
+    anchors.ApplyArgs("anchors");
+    BOOST_CHECK_EQUAL(anchors.nMaxOpenFiles, 200);
+    BOOST_CHECK_EQUAL(anchors.nBlockSize, 8 * 1024);
+    BOOST_CHECK(!anchors.fCompression);
+
+    // Values LevelDB can't cope with are clamped
+    ClearOptionArgs();
+    mapArgs["-dbblockcache"] = "150";
+    mapArgs["-dbwritebuffer"] = "0";
+    mapArgs["-dbblocksize"] = "0";
+    mapArgs["-dbmaxopenfiles"] = "1";
+    mapArgs["-dbbloombits"] = "-5";
+    CLevelDBOptions clamped;
+    clamped.ApplyArgs("chainstate");
+    BOOST_CHECK_EQUAL(clamped.nBlockCachePercent, 100);
+    BOOST_CHECK_EQUAL(clamped.nWriteBufferPercent, 1);
+    BOOST_CHECK_EQUAL(clamped.nBlockSize, 1024);
+    BOOST_CHECK_EQUAL(clamped.nMaxOpenFiles, 16);
+    BOOST_CHECK_EQUAL(clamped.nBloomFilterBits, 0);
+
+    mapArgs["-dbblockcache"] = "50";
+    mapArgs["-dbwritebuffer"] = "40";
+    clamped.ApplyArgs("chainstate");
+    BOOST_CHECK_EQUAL(clamped.nWriteBufferPercent, 25);
+    ClearOptionArgs();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
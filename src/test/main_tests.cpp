@@ -101,4 +101,109 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(chain_tip_snapshot)
+{
+    boost::shared_ptr<const CChainTipSnapshot> snapshot = GetChainTipSnapshot();
+    BOOST_CHECK(snapshot);
+
+    LOCK(cs_main);
+    // The genesis block was connected by the fixture
+    BOOST_CHECK(snapshot->pindexTip == chainActive.Tip());
+    BOOST_CHECK_EQUAL(snapshot->nHeight, 0);
+    BOOST_CHECK(snapshot->hashBestBlock == Params().GenesisBlock().GetHash());
+    BOOST_CHECK(snapshot->nChainWork == chainActive.Tip()->nChainWork);
+    BOOST_CHECK_EQUAL(snapshot->nHeadersHeight, 0);
+
+    // A snapshot that was handed out stays the same when the tip changes
+    CBlockIndex* pindexGenesis = chainActive.Tip();
+    UnloadBlockIndex();
+    BOOST_CHECK_EQUAL(snapshot->nHeight, 0);
+    BOOST_CHECK_EQUAL(GetChainTipSnapshot()->nHeight, -1);
+    BOOST_CHECK(GetChainTipSnapshot()->pindexTip == NULL);
+    BOOST_CHECK(snapshot->pindexTip == pindexGenesis);
+}
+
+// A peer answering a lone request after nRTT, then delivering a full queue
+// at one block every nServiceTime microseconds
+static CBlockDownloadStats MeasureDownloadPeer(int64_t nRTT, int64_t nServiceTime, int nBlocks)
+{
+    CBlockDownloadStats stats;
+    int64_t nNow = 1000000;
+    UpdateBlockDownloadStats(stats, nNow, true, 1000, nNow + nRTT);
+    int64_t nRequested = nNow + nRTT;
+    nNow = nRequested;
+    for (int i = 0; i < nBlocks; i++) {
+        nNow += nServiceTime;
+        UpdateBlockDownloadStats(stats, nRequested, false, 1000, nNow);
+    }
+    return stats;
+}
+
+BOOST_AUTO_TEST_CASE(block_download_window_growth)
+{
+    // Until blocks were delivered from a full queue, the default window is used
+    CBlockDownloadStats stats;
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(stats), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    stats = MeasureDownloadPeer(100000, 0, 0);
+    BOOST_CHECK_EQUAL(stats.nBlockRTT, 100000);
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(stats), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Round trip plus the queue time, at the rate of the peer
+    stats = MeasureDownloadPeer(100000, 100000, 20);
+    BOOST_CHECK_EQUAL(stats.nBlockServiceTime, 100000);
+    BOOST_CHECK_EQUAL(stats.nBlocksDownloaded, 21);
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(stats), 1 + (100000 + 1000000 * (int)BLOCK_DOWNLOAD_QUEUE_TIME) / 100000);
+
+    // Fast peers are capped, slow ones keep a minimum
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(MeasureDownloadPeer(100000, 1000, 20)), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(MeasureDownloadPeer(1000000, 10000000, 20)), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(block_download_window_shrink)
+{
+    CBlockDownloadStats stats = MeasureDownloadPeer(100000, 1000, 20);
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(stats), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A peer that slows down to a block a second sees its window shrink
+    // with every block, down to what covers its queue time
+    int nWindow = GetBlockDownloadWindow(stats);
+    int64_t nNow = stats.nLastBlockReceived;
+    for (int i = 0; i < 100; i++) {
+        nNow += 1000000;
+        UpdateBlockDownloadStats(stats, 0, false, 1000, nNow);
+        BOOST_CHECK(GetBlockDownloadWindow(stats) <= nWindow);
+        nWindow = GetBlockDownloadWindow(stats);
+    }
+    BOOST_CHECK_EQUAL(nWindow, 1 + (100000 + 1000000 * (int)BLOCK_DOWNLOAD_QUEUE_TIME) / 1000000);
+}
+
+BOOST_AUTO_TEST_CASE(block_download_peer_ranking)
+{
+    CBlockDownloadStats unmeasured;
+    CBlockDownloadStats fast = MeasureDownloadPeer(100000, 10000, 20);
+    CBlockDownloadStats similar = MeasureDownloadPeer(100000, 15000, 20);
+    CBlockDownloadStats slow = MeasureDownloadPeer(100000, 100000, 20);
+
+    BOOST_CHECK(IsFasterDownloadPeer(fast, slow));
+    BOOST_CHECK(!IsFasterDownloadPeer(slow, fast));
+    // Blocks are only moved to a peer at least twice as fast
+    BOOST_CHECK(!IsFasterDownloadPeer(fast, similar));
+    BOOST_CHECK(!IsFasterDownloadPeer(similar, fast));
+    // A peer we know nothing about is never preferred, but always overtaken
+    BOOST_CHECK(IsFasterDownloadPeer(fast, unmeasured));
+    BOOST_CHECK(!IsFasterDownloadPeer(unmeasured, fast));
+    BOOST_CHECK(!IsFasterDownloadPeer(unmeasured, unmeasured));
+}
+
+BOOST_AUTO_TEST_CASE(block_download_rate)
+{
+    // The rate follows the bytes the peer sent, such as a compact block and
+    // the transactions it was missing, not the size of the block
+    CBlockDownloadStats stats;
+    UpdateBlockDownloadStats(stats, 0, true, 50000, 100000);
+    BOOST_CHECK_EQUAL(stats.nBlockBytesPerSecond, 0);
+    UpdateBlockDownloadStats(stats, 0, false, 5000, 200000);
+    BOOST_CHECK_EQUAL(stats.nBlockBytesPerSecond, 50000);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -101,4 +102,84 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Three unrelated transactions of the same size with different fees
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11 << i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 1000, 300, 0.0, 1));
+    pool.addUnchecked(tx[1].GetHash(), CTxMemPoolEntry(tx[1], 3000, 100, 0.0, 1));
+    pool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], 2000, 200, 0.0, 1));
+
+    std::vector<uint256> vtxid;
+    pool.queryHashesByFeeRate(vtxid);
+    BOOST_REQUIRE_EQUAL(vtxid.size(), 3);
+    BOOST_CHECK(vtxid[0] == tx[1].GetHash());
+    BOOST_CHECK(vtxid[1] == tx[2].GetHash());
+    BOOST_CHECK(vtxid[2] == tx[0].GetHash());
+
+    // A fee delta moves the entry in the fee rate order
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, 5000);
+    pool.queryHashesByFeeRate(vtxid);
+    BOOST_CHECK(vtxid[0] == tx[0].GetHash());
+
+    // Child of tx[2], linked both ways
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(tx[2].GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 9 * COIN;
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 100, 400, 0.0, 1));
+    CTxMemPool::txiter itParent = pool.mapTx.find(tx[2].GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itParent).size(), 1);
+    BOOST_CHECK(pool.GetMemPoolParents(itChild).count(itParent));
+
+    // Expiry goes by entry time, and takes descendants along
+    BOOST_CHECK_EQUAL(pool.Expire(150), 1);
+    BOOST_CHECK(!pool.exists(tx[1].GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(250), 2);
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpireAndAnchorTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11 << i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    uint256 anchor = GetRandHash();
+    tx[2].vjoinsplit.resize(1);
+    tx[2].vjoinsplit[0].anchor = anchor;
+    for (int i = 0; i < 3; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000 * (i + 1), i, 0.0, 1));
+
+    // Expiry removes what entered before the given time
+    BOOST_CHECK_EQUAL(pool.Expire(0), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(1), 1);
+    BOOST_CHECK(!pool.exists(tx[0].GetHash()));
+
+    // Only the transaction spending from the invalidated anchor goes
+    pool.removeWithAnchor(GetRandHash());
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    pool.removeWithAnchor(anchor);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(tx[1].GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
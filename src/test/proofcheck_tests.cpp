@@ -0,0 +1,273 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/validation.h"
+#include "init.h"
+#include "main.h"
+#include "random.h"
+#include "script/interpreter.h"
+#include "sodium.h"
+#include "zcash/JoinSplit.hpp"
+
+#include "test/test_bitcoin.h"
+
+#include <map>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+/**
+ * Stands in for the verifying key: accepts or rejects every proof, records
+ * the threads proofs were verified on and can hold up a verification.
+ */
+class FakeJoinSplit : public ZCJoinSplit
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    bool fHold;
+    bool fHeld;
+    std::map<boost::thread::id, int> mapCalls;
+
+public:
+    bool fValid;
+
+    FakeJoinSplit() : fHold(false), fHeld(false), fValid(true) {}
+
+    void setProvingKeyPath(std::string) {}
+    void loadProvingKey() {}
+    void saveProvingKey(std::string path) {}
+    void loadVerifyingKey(std::string path) {}
+    void saveVerifyingKey(std::string path) {}
+    void saveR1CS(std::string path) {}
+
+    libzcash::ZCProof prove(const boost::array<libzcash::JSInput, ZC_NUM_JS_INPUTS>& inputs,
+                  const boost::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS>& outputs,
+                  boost::array<libzcash::Note, ZC_NUM_JS_OUTPUTS>& out_notes,
+                  boost::array<ZCNoteEncryption::Ciphertext, ZC_NUM_JS_OUTPUTS>& out_ciphertexts,
+                  uint256& out_ephemeralKey,
+                  const uint256& pubKeyHash,
+                  uint256& out_randomSeed,
+                  boost::array<uint256, ZC_NUM_JS_INPUTS>& out_hmacs,
+                  boost::array<uint256, ZC_NUM_JS_INPUTS>& out_nullifiers,
+                  boost::array<uint256, ZC_NUM_JS_OUTPUTS>& out_commitments,
+                  uint64_t vpub_old,
+                  uint64_t vpub_new,
+                  const uint256& rt,
+                  bool computeProof)
+    {
+        return libzcash::ZCProof();
+    }
+
+    bool verify(const libzcash::ZCProof& proof,
+                const uint256& pubKeyHash,
+                const uint256& randomSeed,
+                const boost::array<uint256, ZC_NUM_JS_INPUTS>& hmacs,
+                const boost::array<uint256, ZC_NUM_JS_INPUTS>& nullifiers,
+                const boost::array<uint256, ZC_NUM_JS_OUTPUTS>& commitments,
+                uint64_t vpub_old,
+                uint64_t vpub_new,
+                const uint256& rt)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        mapCalls[boost::this_thread::get_id()]++;
+        if (fHold) {
+            fHold = false;
+            fHeld = true;
+            cond.notify_all();
+            while (fHeld)
+                cond.wait(lock);
+        }
+        return fValid;
+    }
+
+    //! Hold up the next verification until Release
+    void Hold()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fHold = true;
+    }
+
+    //! Wait for the verification Hold asked for to start
+    void WaitHeld()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fHeld)
+            cond.wait(lock);
+    }
+
+    void Release()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fHeld = false;
+        cond.notify_all();
+    }
+
+    int Calls(boost::thread::id id)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return mapCalls[id];
+    }
+
+    int Calls()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        int nCalls = 0;
+        for (std::map<boost::thread::id, int>::const_iterator it = mapCalls.begin(); it != mapCalls.end(); it++)
+            nCalls += it->second;
+        return nCalls;
+    }
+};
+
+/** Verify proofs with a FakeJoinSplit and nThreads script check threads while in scope */
+class FakeParamsScope
+{
+private:
+    ZCJoinSplit* pOldParams;
+    int nOldThreads;
+
+public:
+    FakeParamsScope(FakeJoinSplit& params, int nThreads) : pOldParams(pzcashParams), nOldThreads(nScriptCheckThreads)
+    {
+        pzcashParams = &params;
+        nScriptCheckThreads = nThreads;
+    }
+
+    ~FakeParamsScope()
+    {
+        pzcashParams = pOldParams;
+        nScriptCheckThreads = nOldThreads;
+    }
+};
+
+// A transaction with nJoinSplits joinsplits that passes every check but the proofs
+CTransaction MakeShieldedTransaction(unsigned int nJoinSplits)
+{
+    CMutableTransaction mtx;
+    mtx.nVersion = 2;
+    unsigned char joinSplitPrivKey[crypto_sign_SECRETKEYBYTES];
+    crypto_sign_keypair(mtx.joinSplitPubKey.begin(), joinSplitPrivKey);
+    for (unsigned int i = 0; i < nJoinSplits; i++) {
+        mtx.vjoinsplit.push_back(JSDescription());
+        mtx.vjoinsplit.back().nullifiers[0] = GetRandHash();
+        mtx.vjoinsplit.back().nullifiers[1] = GetRandHash();
+    }
+
+    CScript scriptCode;
+    CTransaction signTx(mtx);
+    uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL);
+    BOOST_REQUIRE(crypto_sign_detached(&mtx.joinSplitSig[0], NULL, dataToBeSigned.begin(), 32, joinSplitPrivKey) == 0);
+    return mtx;
+}
+
+void CheckTransactionInThread(const CTransaction& tx, bool* pfValid)
+{
+    CValidationState state;
+    *pfValid = CheckTransaction(tx, state);
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(proofcheck_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(verifiedtx_cache_hit)
+{
+    FakeJoinSplit params;
+    FakeParamsScope scope(params, 0);
+    CTransaction tx = MakeShieldedTransaction(1);
+    CValidationState state;
+    BOOST_CHECK(!verifiedTxCache.Get(tx.GetHash()));
+    BOOST_CHECK(CheckTransaction(tx, state));
+    BOOST_CHECK_EQUAL(params.Calls(), 1);
+    BOOST_CHECK(verifiedTxCache.Get(tx.GetHash()));
+
+    // Once cached, the transaction is accepted without running any check
+    // again: the proof would fail now
+    params.fValid = false;
+    BOOST_CHECK(CheckTransaction(tx, state));
+    BOOST_CHECK_EQUAL(params.Calls(), 1);
+
+    // Transactions without joinsplits have no proofs to save and aren't cached
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 0;
+    CTransaction txTransparent(mtx);
+    BOOST_CHECK(CheckTransaction(txTransparent, state));
+    BOOST_CHECK(!verifiedTxCache.Get(txTransparent.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(verifiedtx_cache_failures)
+{
+    FakeJoinSplit params;
+    FakeParamsScope scope(params, 0);
+
+    // Failing a context-free check, before the proofs are looked at
+    CMutableTransaction mtx(MakeShieldedTransaction(1));
+    mtx.vjoinsplit[0].vpub_old = -1;
+    CTransaction txBadValue(mtx);
+    CValidationState state;
+    BOOST_CHECK(!CheckTransaction(txBadValue, state));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-vpub_old-negative");
+    BOOST_CHECK(!verifiedTxCache.Get(txBadValue.GetHash()));
+
+    // Failing the joinsplit signature
+    mtx = CMutableTransaction(MakeShieldedTransaction(1));
+    mtx.joinSplitSig[0] ^= 1;
+    CTransaction txBadSig(mtx);
+    BOOST_CHECK(!CheckTransaction(txBadSig, state));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-invalid-joinsplit-signature");
+    BOOST_CHECK(!verifiedTxCache.Get(txBadSig.GetHash()));
+    BOOST_CHECK_EQUAL(params.Calls(), 0);
+
+    // Failing the proofs
+    CTransaction tx = MakeShieldedTransaction(2);
+    params.fValid = false;
+    BOOST_CHECK(!CheckTransaction(tx, state));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-joinsplit-verification-failed");
+    BOOST_CHECK(!verifiedTxCache.Get(tx.GetHash()));
+
+    // so the proofs are verified again next time
+    int nCalls = params.Calls();
+    params.fValid = true;
+    BOOST_CHECK(CheckTransaction(tx, state));
+    BOOST_CHECK_EQUAL(params.Calls(), nCalls + 2);
+    BOOST_CHECK(verifiedTxCache.Get(tx.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(proofcheck_queue_busy)
+{
+    FakeJoinSplit params;
+    FakeParamsScope scope(params, 2);
+
+    // Hold up a transaction while it has the proof check queue
+    CTransaction txQueued = MakeShieldedTransaction(2);
+    bool fQueuedValid = false;
+    params.Hold();
+    boost::thread threadQueued(boost::bind(&CheckTransactionInThread, boost::cref(txQueued), &fQueuedValid));
+    params.WaitHeld();
+
+    // Another transaction doesn't wait for the queue: it verifies its proofs
+    // on its own thread
+    CTransaction tx = MakeShieldedTransaction(2);
+    bool fValid = false;
+    boost::thread thread(boost::bind(&CheckTransactionInThread, boost::cref(tx), &fValid));
+    boost::thread::id idThread = thread.get_id();
+    bool fFinished = thread.timed_join(boost::posix_time::seconds(30));
+    BOOST_CHECK(fFinished);
+    params.Release();
+    if (!fFinished)
+        thread.join();
+    threadQueued.join();
+
+    BOOST_CHECK(fValid);
+    BOOST_CHECK(fQueuedValid);
+    BOOST_CHECK_EQUAL(params.Calls(idThread), 2);
+    BOOST_CHECK_EQUAL(params.Calls(), 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,85 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+#include "primitives/transaction.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CTransaction MakeTransaction(unsigned int n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = n;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n;
+    return tx;
+}
+
+boost::shared_ptr<const CTransaction> MakeShared(unsigned int n)
+{
+    return boost::shared_ptr<const CTransaction>(new CTransaction(MakeTransaction(n)));
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(relay_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(relaylog_cursor)
+{
+    CRelayLog log;
+    int64_t nTime = 1000000;
+
+    uint64_t nCursorA = log.GetHead();
+    log.Append(MakeShared(0), nTime);
+    log.Append(MakeShared(1), nTime);
+    uint64_t nCursorB = log.GetHead();
+    log.Append(MakeShared(2), nTime);
+
+    std::vector<boost::shared_ptr<const CTransaction> > vtx;
+    nCursorA = log.Read(nCursorA, 2, vtx);
+    BOOST_CHECK_EQUAL(vtx.size(), 2);
+    BOOST_CHECK(vtx[0]->GetHash() == MakeTransaction(0).GetHash());
+    BOOST_CHECK(vtx[1]->GetHash() == MakeTransaction(1).GetHash());
+
+    // The rest comes with the next batch
+    vtx.clear();
+    nCursorA = log.Read(nCursorA, 1000, vtx);
+    BOOST_CHECK_EQUAL(vtx.size(), 1);
+    BOOST_CHECK(vtx[0]->GetHash() == MakeTransaction(2).GetHash());
+    BOOST_CHECK_EQUAL(nCursorA, log.GetHead());
+
+    // A cursor taken later only sees what was appended after it
+    vtx.clear();
+    nCursorB = log.Read(nCursorB, 1000, vtx);
+    BOOST_CHECK_EQUAL(vtx.size(), 1);
+    BOOST_CHECK_EQUAL(nCursorB, nCursorA);
+
+    vtx.clear();
+    BOOST_CHECK_EQUAL(log.Read(nCursorA, 1000, vtx), nCursorA);
+    BOOST_CHECK(vtx.empty());
+}
+
+BOOST_AUTO_TEST_CASE(relaylog_expiry)
+{
+    CRelayLog log;
+    int64_t nTime = 1000000;
+
+    uint64_t nCursor = log.GetHead();
+    log.Append(MakeShared(0), nTime);
+    log.Append(MakeShared(1), nTime + 1);
+    log.Append(MakeShared(2), nTime + RELAY_EXPIRY + 1);
+    BOOST_CHECK_EQUAL(log.size(), 2);
+
+    // A cursor that fell behind skips the expired entries
+    std::vector<boost::shared_ptr<const CTransaction> > vtx;
+    nCursor = log.Read(nCursor, 1000, vtx);
+    BOOST_CHECK_EQUAL(vtx.size(), 2);
+    BOOST_CHECK(vtx[0]->GetHash() == MakeTransaction(1).GetHash());
+    BOOST_CHECK_EQUAL(nCursor, log.GetHead());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
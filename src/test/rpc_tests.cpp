@@ -4,14 +4,20 @@
 
 #include "rpcserver.h"
 #include "rpcclient.h"
+#include "rpcworkqueue.h"
 
 #include "base58.h"
+#include "chainparams.h"
 #include "netbase.h"
 
 #include "test/test_bitcoin.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/function.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace json_spirit;
@@ -179,4 +185,186 @@ BOOST_AUTO_TEST_CASE(rpc_boostasiotocnetaddr)
     BOOST_CHECK_EQUAL(BoostAsioToCNetAddr(boost::asio::ip::address::from_string("::ffff:127.0.0.1")).ToString(), "127.0.0.1");
 }
 
+BOOST_AUTO_TEST_CASE(rpc_jsonwriter)
+{
+    // Same output as json_spirit
+    Object obj;
+    Array arr;
+    arr.push_back(1);
+    arr.push_back(-2.5);
+    arr.push_back(ValueFromAmount(2099999999999999LL));
+    arr.push_back((uint64_t)18446744073709551615ULL);
+    arr.push_back(std::string("esc\"aped\\\n\t\x01\xe9"));
+    arr.push_back(true);
+    arr.push_back(Value::null);
+    obj.push_back(Pair("array", arr));
+    obj.push_back(Pair("empty", Object()));
+    obj.push_back(Pair("emptyarray", Array()));
+    CJSONWriter writer;
+    writer.Write(obj);
+    BOOST_CHECK_EQUAL(writer.str(), write_string(Value(obj), false));
+
+    // Written member by member
+    writer.Clear();
+    writer.BeginObject();
+    writer.Key("a");
+    writer.BeginArray();
+    writer.Int(1);
+    writer.Raw("{\"b\":2}");
+    writer.String("c");
+    writer.EndArray();
+    writer.Key("d");
+    writer.Null();
+    writer.EndObject();
+    BOOST_CHECK_EQUAL(writer.str(), "{\"a\":[1,{\"b\":2},\"c\"],\"d\":null}");
+}
+
+BOOST_AUTO_TEST_CASE(rpc_parsejson)
+{
+    const char* docs[] = {
+        "{\"method\": \"getblock\", \"params\": [\"00ab\", true], \"id\": 1}",
+        " [1, -2, 2.50, 1e3, 18446744073709551615, null, false, {}, []] ",
+        "\"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u0041\\u00e9\"",
+        "0.00000001",
+    };
+    BOOST_FOREACH(const char* doc, docs) {
+        Value value, expected;
+        BOOST_CHECK(read_string(std::string(doc), expected));
+        BOOST_CHECK(ParseJSON(doc, value));
+        BOOST_CHECK_EQUAL(write_string(value, false), write_string(expected, false));
+    }
+
+    Value value;
+    BOOST_CHECK(ParseJSON("[1, 1.0]", value));
+    BOOST_CHECK_EQUAL(value.get_array()[0].type(), int_type);
+    BOOST_CHECK_EQUAL(value.get_array()[1].type(), real_type);
+
+    // Same cases as json_parse_errors
+    BOOST_CHECK(!ParseJSON("[1.0", value));
+    BOOST_CHECK(!ParseJSON("a1.0", value));
+    BOOST_CHECK(!ParseJSON("1.0sds", value));
+    BOOST_CHECK(!ParseJSON("1.0]", value));
+    BOOST_CHECK(!ParseJSON("175tWpb8K1S7NmH4Zx6rewF9WQrcZv245W", value));
+    BOOST_CHECK(!ParseJSON("3J98t1WpEZ73CNmQviecrnyiWrnqRhWNL", value));
+    // And some more
+    BOOST_CHECK(!ParseJSON("", value));
+    BOOST_CHECK(!ParseJSON("[1,]", value));
+    BOOST_CHECK(!ParseJSON("{\"a\"}", value));
+    BOOST_CHECK(!ParseJSON("\"unterminated", value));
+    BOOST_CHECK(!ParseJSON("99999999999999999999", value));
+    BOOST_CHECK(!ParseJSON(std::string(1000, '['), value));
+}
+
+BOOST_AUTO_TEST_CASE(rpc_streamed_results)
+{
+    // Streamed results are the same as the regular ones
+    std::string strHash = Params().GenesisBlock().GetHash().GetHex();
+    Array params;
+    params.push_back(strHash);
+    CJSONWriter writer;
+    tableRPC.execute("getblock", params, writer);
+    BOOST_CHECK_EQUAL(writer.str(), write_string(tableRPC.execute("getblock", params), false));
+    BOOST_CHECK_EQUAL(find_value(CallRPC("getblock " + strHash).get_obj(), "hash").get_str(), strHash);
+
+    params.push_back(false);
+    writer.Clear();
+    tableRPC.execute("getblock", params, writer);
+    BOOST_CHECK_EQUAL(writer.str(), write_string(tableRPC.execute("getblock", params), false));
+
+    params.clear();
+    params.push_back(true);
+    writer.Clear();
+    tableRPC.execute("getrawmempool", params, writer);
+    BOOST_CHECK_EQUAL(writer.str(), "{}");
+    BOOST_CHECK_EQUAL(CallRPC("getrawmempool").get_array().size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_parsehttprequest)
+{
+    int nProto;
+    string strMethod, strURI, strBody;
+    map<string, string> mapHeaders;
+
+    // Pipelined requests are taken one at a time
+    string buffer = "POST / HTTP/1.1\r\nContent-Length: 4\r\n\r\nabcd"
+                    "\r\nGET /rest/chaininfo.json HTTP/1.0\r\n\r\n"
+                    "POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\nabcd";
+    int nLen = ParseHTTPRequest(buffer, MAX_SIZE, nProto, strMethod, strURI, mapHeaders, strBody);
+    BOOST_CHECK_EQUAL(nLen, 42);
+    BOOST_CHECK_EQUAL(strMethod, "POST");
+    BOOST_CHECK_EQUAL(strBody, "abcd");
+    BOOST_CHECK_EQUAL(mapHeaders["connection"], "keep-alive");
+    buffer.erase(0, nLen);
+
+    nLen = ParseHTTPRequest(buffer, MAX_SIZE, nProto, strMethod, strURI, mapHeaders, strBody);
+    BOOST_CHECK_EQUAL(nLen, 39);
+    BOOST_CHECK_EQUAL(strMethod, "GET");
+    BOOST_CHECK_EQUAL(strURI, "/rest/chaininfo.json");
+    BOOST_CHECK_EQUAL(strBody, "");
+    // HTTP/1.0 closes by default
+    BOOST_CHECK_EQUAL(mapHeaders["connection"], "close");
+    buffer.erase(0, nLen);
+
+    // The body of the last one isn't complete yet, but its size and headers are known
+    size_t nSize = 0;
+    mapHeaders.clear();
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(buffer, MAX_SIZE, nProto, strMethod, strURI, mapHeaders, strBody, &nSize), 0);
+    BOOST_CHECK_EQUAL(nSize, 49U);
+    BOOST_CHECK_EQUAL(mapHeaders["content-length"], "10");
+    buffer.append("efghij");
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(buffer, MAX_SIZE, nProto, strMethod, strURI, mapHeaders, strBody), 49);
+    BOOST_CHECK_EQUAL(strBody, "abcdefghij");
+    buffer.erase(buffer.size() - 6);
+    BOOST_CHECK_EQUAL(ParseHTTPRequest("POST / HTTP/1.1\r\nContent-Le", MAX_SIZE, nProto, strMethod, strURI, mapHeaders, strBody), 0);
+
+    // Malformed or too large
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(buffer, 5, nProto, strMethod, strURI, mapHeaders, strBody), -1);
+    BOOST_CHECK_EQUAL(ParseHTTPRequest("PUT / HTTP/1.1\r\n\r\n", MAX_SIZE, nProto, strMethod, strURI, mapHeaders, strBody), -1);
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(string(10000, 'a'), MAX_SIZE, nProto, strMethod, strURI, mapHeaders, strBody), -1);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_httpchunk)
+{
+    BOOST_CHECK_EQUAL(HTTPChunk("abcd"), "4\r\nabcd\r\n");
+    BOOST_CHECK_EQUAL(HTTPChunk(string(300, 'x')).substr(0, 5), "12c\r\n");
+    // The empty chunk ends the body
+    BOOST_CHECK_EQUAL(HTTPChunk(""), "0\r\n\r\n");
+
+    string strHeader = HTTPReplyChunkedHeader(200, true, "application/octet-stream");
+    BOOST_CHECK(strHeader.find("Transfer-Encoding: chunked\r\n") != string::npos);
+    BOOST_CHECK(strHeader.find("Content-Length") == string::npos);
+}
+
+static void IncrementCounter(int* pn)
+{
+    (*pn)++;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_workqueue)
+{
+    int nCalls = 0;
+    CRPCWorkQueue< boost::function<void ()> > queue(2);
+
+    // Requests beyond the depth are rejected rather than queued
+    BOOST_CHECK(queue.Enqueue(boost::bind(IncrementCounter, &nCalls)));
+    BOOST_CHECK(queue.Enqueue(boost::bind(IncrementCounter, &nCalls)));
+    BOOST_CHECK(!queue.Enqueue(boost::bind(IncrementCounter, &nCalls)));
+    CRPCWorkQueueStats stats = queue.GetStats();
+    BOOST_CHECK_EQUAL(stats.nDepth, 2);
+    BOOST_CHECK_EQUAL(stats.nPeakDepth, 2);
+    BOOST_CHECK_EQUAL(stats.nRejected, 1);
+
+    boost::thread worker(boost::bind(&CRPCWorkQueue< boost::function<void ()> >::Run, &queue));
+    while (queue.GetStats().nProcessed < 2)
+        MilliSleep(1);
+    queue.Interrupt();
+    worker.join();
+
+    stats = queue.GetStats();
+    BOOST_CHECK_EQUAL(nCalls, 2);
+    BOOST_CHECK_EQUAL(stats.nDepth, 0);
+    BOOST_CHECK_EQUAL(stats.nWorkers, 0);
+    BOOST_CHECK(!queue.Enqueue(boost::bind(IncrementCounter, &nCalls)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
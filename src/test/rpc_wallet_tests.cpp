@@ -17,6 +17,7 @@
 #include "asyncrpcqueue.h"
 #include "asyncrpcoperation.h"
 #include "wallet/asyncrpcoperation_sendmany.h"
+#include "wallet/asyncrpcoperation_sendmanybatch.h"
 #include "rpcprotocol.h"
 #include "init.h"
 
@@ -737,6 +738,71 @@ BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_parallel_cancel)
     BOOST_CHECK(ids.size()==0);
 }
 
+class MockProvingOperation : public MockSleepOperation {
+public:
+    MockProvingOperation(int t=1000) : MockSleepOperation(t) {}
+    virtual ~MockProvingOperation() {}
+    virtual bool isProving() const {
+        return true;
+    }
+};
+
+// This tests the queue starting operations by priority and limiting proving operations
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_priority)
+{
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    q->setMaxProvingOperations(1);
+
+    std::shared_ptr<AsyncRPCOperation> prove1(new MockProvingOperation(1500));
+    prove1->setPriority(OperationPriority::LOW);
+    q->addOperation(prove1);
+    std::shared_ptr<AsyncRPCOperation> prove2(new MockProvingOperation(1500));
+    prove2->setPriority(OperationPriority::LOW);
+    q->addOperation(prove2);
+    std::shared_ptr<AsyncRPCOperation> quick(new MockSleepOperation(100));
+    quick->setPriority(OperationPriority::HIGH);
+    q->addOperation(quick);
+    BOOST_CHECK(q->getOperationCount() == 3);
+
+    q->setNumberOfWorkers(2);
+    BOOST_CHECK(q->getNumberOfWorkers() == 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // The quick operation went first, and only one proof runs at a time
+    // even though a worker is free
+    BOOST_CHECK_EQUAL(quick->isSuccess(), true);
+    BOOST_CHECK_EQUAL(prove1->isExecuting(), true);
+    BOOST_CHECK_EQUAL(prove2->isReady(), true);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    BOOST_CHECK_EQUAL(prove1->isSuccess(), true);
+    BOOST_CHECK_EQUAL(prove2->isExecuting(), true);
+
+    q->finishAndWait();
+    BOOST_CHECK_EQUAL(prove2->isSuccess(), true);
+}
+
+// This tests the queue forgetting finished operations after their TTL
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_ttl)
+{
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    q->setOperationTTL(1);
+    q->addWorker();
+
+    std::shared_ptr<AsyncRPCOperation> op1(new MockSleepOperation(100));
+    q->addOperation(op1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    BOOST_CHECK_EQUAL(op1->isSuccess(), true);
+    BOOST_CHECK(q->getOperationForId(op1->getId()));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    std::shared_ptr<AsyncRPCOperation> op2(new MockSleepOperation(100));
+    q->addOperation(op2);
+    BOOST_CHECK(!q->getOperationForId(op1->getId()));
+    BOOST_CHECK(q->getOperationForId(op2->getId()));
+    q->finishAndWait();
+}
+
 // This tests z_getoperationstatus, z_getoperationresult, z_listoperationids
 BOOST_AUTO_TEST_CASE(rpc_z_getoperations)
 {
@@ -1112,6 +1178,147 @@ BOOST_AUTO_TEST_CASE(rpc_z_sendmany_internals)
 }
 
 
+BOOST_AUTO_TEST_CASE(rpc_z_sendmanybatch_select_inputs)
+{
+    std::vector<CAmount> values = {5, 40, 10, 25};
+    std::vector<bool> used(values.size(), false);
+
+    // A single value large enough: the smallest such one
+    std::vector<size_t> selected = AsyncRPCOperation_sendmanybatch::select_inputs(values, used, 20, 4);
+    BOOST_CHECK(selected == std::vector<size_t>({3}));
+
+    // Largest first, with the last pick the smallest that still covers the rest
+    selected = AsyncRPCOperation_sendmanybatch::select_inputs(values, used, 48, 4);
+    BOOST_CHECK(selected == std::vector<size_t>({1, 2}));
+
+    // Too few values allowed, or not enough in total
+    BOOST_CHECK(AsyncRPCOperation_sendmanybatch::select_inputs(values, used, 70, 2).empty());
+    BOOST_CHECK(AsyncRPCOperation_sendmanybatch::select_inputs(values, used, 81, 4).empty());
+
+    // Values already used are passed over
+    used[1] = true;
+    selected = AsyncRPCOperation_sendmanybatch::select_inputs(values, used, 20, 4);
+    BOOST_CHECK(selected == std::vector<size_t>({3}));
+}
+
+BOOST_AUTO_TEST_CASE(rpc_z_sendmanybatch_plan)
+{
+    SelectParams(CBaseChainParams::TESTNET);
+
+    LOCK(pwalletMain->cs_wallet);
+
+    std::string zaddr1 = pwalletMain->GenerateNewZKey().ToString();
+    std::vector<SendManyRecipient> recipients;
+    for (int i = 0; i < 5; i++) {
+        recipients.push_back(SendManyRecipient(pwalletMain->GenerateNewZKey().ToString(), (i + 1) * COIN, ""));
+    }
+
+    std::shared_ptr<AsyncRPCOperation> operation( new AsyncRPCOperation_sendmanybatch(zaddr1, {}, recipients, 1) );
+    BOOST_CHECK(operation->isProving());
+    std::shared_ptr<AsyncRPCOperation_sendmanybatch> ptr = std::dynamic_pointer_cast<AsyncRPCOperation_sendmanybatch> (operation);
+    TEST_FRIEND_AsyncRPCOperation_sendmanybatch proxy(ptr);
+
+    // Not enough funds: nothing is planned
+    std::vector<SendManyInputJSOP> inputs;
+    inputs.push_back(SendManyInputJSOP(JSOutPoint(GetRandHash(), 0, 0), Note(), 10 * COIN));
+    proxy.setZInputs(inputs);
+    try {
+        proxy.plan_transactions();
+        BOOST_FAIL("Should have caused an error");
+    } catch (const Object& objError) {
+        BOOST_CHECK( find_error(objError, "Insufficient funds"));
+    }
+
+    // 15 to pay: the 10 and 8 notes are spent by the first joinsplit, which
+    // pays the fee and the largest recipient. Each of the others spends the
+    // change of the one before it and pays the next recipient.
+    inputs.push_back(SendManyInputJSOP(JSOutPoint(GetRandHash(), 0, 1), Note(), 8 * COIN));
+    inputs.push_back(SendManyInputJSOP(JSOutPoint(GetRandHash(), 0, 0), Note(), 1 * COIN));
+    proxy.setZInputs(inputs);
+    proxy.plan_transactions();
+    std::vector<BatchTransactionPlan> plans = proxy.getPlans();
+    BOOST_CHECK_EQUAL(plans.size(), 1);
+    BatchTransactionPlan& plan = plans[0];
+    BOOST_CHECK_EQUAL(plan.joinsplits.size(), recipients.size());
+    BOOST_CHECK_EQUAL(plan.change, 18 * COIN - 15 * COIN - ASYNC_RPC_OPERATION_DEFAULT_MINERS_FEE);
+
+    CAmount vpubNew = 0;
+    size_t nOutputs = 0;
+    for (size_t i = 0; i < plan.joinsplits.size(); i++) {
+        const BatchJoinSplitPlan& js = plan.joinsplits[i];
+        // No value passes through the transparent pool between joinsplits
+        BOOST_CHECK_EQUAL(js.vpub_old, 0);
+        BOOST_CHECK_EQUAL(js.spends_change, i > 0);
+        BOOST_CHECK(js.inputs.size() + js.spends_change <= ZC_NUM_JS_INPUTS);
+        BOOST_CHECK(js.outputs.size() <= ZC_NUM_JS_OUTPUTS);
+        vpubNew += js.vpub_new;
+        nOutputs += js.outputs.size();
+    }
+    BOOST_CHECK_EQUAL(plan.joinsplits[0].inputs.size(), 2);
+    BOOST_CHECK_EQUAL(vpubNew, plan.fee);
+    // A recipient and a change note in each
+    BOOST_CHECK_EQUAL(nOutputs, 2 * recipients.size());
+    BOOST_CHECK_EQUAL(plan.joinsplits.back().outputs.back().value, plan.change);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_z_sendmanybatch_plan_transparent)
+{
+    SelectParams(CBaseChainParams::TESTNET);
+
+    LOCK(pwalletMain->cs_wallet);
+
+    std::string zaddr1 = pwalletMain->GenerateNewZKey().ToString();
+    std::vector<SendManyRecipient> recipients = { SendManyRecipient("tmRr6yJonqGK23UVhrKuyvTpF8qxQQjKigJ", 5 * COIN / 2, "") };
+
+    std::shared_ptr<AsyncRPCOperation> operation( new AsyncRPCOperation_sendmanybatch(zaddr1, recipients, {}, 1) );
+    std::shared_ptr<AsyncRPCOperation_sendmanybatch> ptr = std::dynamic_pointer_cast<AsyncRPCOperation_sendmanybatch> (operation);
+    TEST_FRIEND_AsyncRPCOperation_sendmanybatch proxy(ptr);
+
+    // The first joinsplit sends both of its notes to the transparent pool
+    // and has no outputs, so the next one has no change to spend.
+    std::vector<SendManyInputJSOP> inputs;
+    for (int i = 0; i < 3; i++) {
+        inputs.push_back(SendManyInputJSOP(JSOutPoint(GetRandHash(), 0, 0), Note(), 1 * COIN));
+    }
+    proxy.setZInputs(inputs);
+    proxy.plan_transactions();
+    std::vector<BatchTransactionPlan> plans = proxy.getPlans();
+    BOOST_CHECK_EQUAL(plans.size(), 1);
+    BatchTransactionPlan& plan = plans[0];
+    BOOST_CHECK_EQUAL(plan.joinsplits.size(), 2);
+    BOOST_CHECK_EQUAL(plan.joinsplits[0].inputs.size(), 2);
+    BOOST_CHECK_EQUAL(plan.joinsplits[0].outputs.size(), 0);
+    BOOST_CHECK_EQUAL(plan.joinsplits[0].vpub_new, 2 * COIN);
+    BOOST_CHECK(!plan.joinsplits[1].spends_change);
+    BOOST_CHECK_EQUAL(plan.joinsplits[1].inputs.size(), 1);
+    BOOST_CHECK_EQUAL(plan.joinsplits[1].vpub_new, COIN / 2 + ASYNC_RPC_OPERATION_DEFAULT_MINERS_FEE);
+    BOOST_CHECK_EQUAL(plan.joinsplits[1].outputs.size(), 1);
+    BOOST_CHECK_EQUAL(plan.joinsplits[1].outputs[0].value, plan.change);
+
+    // Proving the second joinsplit only anchors it after the dummy outputs
+    // of the first, without looking for a change note.
+    JSDescription prevJoinSplit;
+    prevJoinSplit.commitments[0] = GetRandHash();
+    prevJoinSplit.commitments[1] = GetRandHash();
+    boost::array<size_t, ZC_NUM_JS_OUTPUTS> outputMap = {{1, 0}};
+    ZCIncrementalMerkleTree tree;
+    tree.append(GetRandHash());
+    uint256 root = tree.root();
+    std::vector<uint256> previousCommitments;
+    std::vector<Note> notes;
+    std::vector<boost::optional < ZCIncrementalWitness>> witnesses;
+    BOOST_CHECK_NO_THROW(proxy.append_previous_joinsplit(plan, 1, prevJoinSplit, outputMap, tree, previousCommitments, notes, witnesses));
+    BOOST_CHECK_EQUAL(previousCommitments.size(), 2);
+    BOOST_CHECK(tree.root() != root);
+    BOOST_CHECK(notes.empty());
+    BOOST_CHECK(witnesses.empty());
+
+    // Spending the change of a joinsplit without outputs is a planning error
+    plan.joinsplits[1].spends_change = true;
+    BOOST_CHECK_THROW(proxy.append_previous_joinsplit(plan, 1, prevJoinSplit, outputMap, tree, previousCommitments, notes, witnesses), std::logic_error);
+}
+
+
 /*
  * This test covers storing encrypted zkeys in the wallet.
  */
@@ -4,6 +4,7 @@
 
 #include "serialize.h"
 #include "streams.h"
+#include "support/allocators/pooled.h"
 #include "hash.h"
 #include "test/test_bitcoin.h"
 #include "utilstrencodings.h"
@@ -346,4 +347,25 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(swap_and_clear)
+{
+    CBaseDataStream<CPooledData> ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << (uint32_t)0x04030201 << (uint8_t)5;
+    uint8_t n;
+    ss.ignore(1);
+
+    // Unread data is handed over, data's previous contents are dropped
+    CPooledData d(3, 'x');
+    ss.SwapAndClear(d);
+    BOOST_CHECK(ss.empty());
+    BOOST_REQUIRE_EQUAL(d.size(), 4);
+    BOOST_CHECK_EQUAL(d[0], 2);
+    BOOST_CHECK_EQUAL(d[3], 5);
+
+    // The stream is usable again afterwards
+    ss << (uint8_t)7;
+    ss >> n;
+    BOOST_CHECK_EQUAL(n, 7);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,75 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "script/sigcache.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(sigcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(sigcache_capacity)
+{
+    // Each entry takes 32 bytes, rounded down to a power of two entries
+    BOOST_CHECK_EQUAL(CSignatureCache(0).Capacity(), 0U);
+    BOOST_CHECK_EQUAL(CSignatureCache(63).Capacity(), 0U);
+    BOOST_CHECK_EQUAL(CSignatureCache(64).Capacity(), 2U);
+    BOOST_CHECK_EQUAL(CSignatureCache(127).Capacity(), 2U);
+    BOOST_CHECK_EQUAL(CSignatureCache(128).Capacity(), 4U);
+    BOOST_CHECK_EQUAL(CSignatureCache(1 << 20).Capacity(), 1U << 15);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_get_set)
+{
+    CSignatureCache cache(1 << 20);
+    std::vector<uint256> entries;
+    for (int i = 0; i < 100; i++)
+        entries.push_back(GetRandHash());
+
+    for (size_t i = 0; i < entries.size(); i++)
+        BOOST_CHECK(!cache.Get(entries[i]));
+    for (size_t i = 0; i < entries.size(); i++)
+        cache.Set(entries[i]);
+
+    // Far below capacity, so nothing should have been evicted
+    int nFound = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+        nFound += cache.Get(entries[i]);
+    BOOST_CHECK_GE(nFound, 99);
+    BOOST_CHECK(cache.Get(entries.back()));
+    BOOST_CHECK(!cache.Get(GetRandHash()));
+
+    // Setting an entry again keeps it
+    cache.Set(entries.back());
+    BOOST_CHECK(cache.Get(entries.back()));
+
+    // A cache without room stores nothing
+    CSignatureCache empty(0);
+    empty.Set(entries[0]);
+    BOOST_CHECK(!empty.Get(entries[0]));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_eviction)
+{
+    CSignatureCache cache(4 * 32);
+    BOOST_CHECK_EQUAL(cache.Capacity(), 4U);
+
+    std::vector<uint256> entries;
+    for (int i = 0; i < 100; i++) {
+        entries.push_back(GetRandHash());
+        cache.Set(entries.back());
+        // The newest entry always gets a slot
+        BOOST_CHECK(cache.Get(entries.back()));
+    }
+
+    // Older entries were overwritten, never more than the table holds remain
+    int nFound = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+        nFound += cache.Get(entries[i]);
+    BOOST_CHECK_GE(nFound, 1);
+    BOOST_CHECK_LE(nFound, 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,253 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "coinslog.h"
+#include "main.h"
+#include "random.h"
+#include "script/script.h"
+#include "snapshot.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+// A few coins, anchors and nullifiers on top of the genesis block
+struct SampleState
+{
+    CCoinsMap mapCoins;
+    CAnchorsMap mapAnchors;
+    CNullifiersMap mapNullifiers;
+    uint256 hashAnchor;
+
+    SampleState()
+    {
+        for (int i = 0; i < 10; i++) {
+            CCoinsCacheEntry &entry = mapCoins[GetRandHash()];
+            entry.coins.nVersion = 1;
+            entry.coins.nHeight = i;
+            entry.coins.vout.resize(1);
+            entry.coins.vout[0].nValue = 1000 + i;
+            entry.coins.vout[0].scriptPubKey = CScript() << OP_TRUE;
+            entry.flags = CCoinsCacheEntry::DIRTY;
+        }
+
+        ZCIncrementalMerkleTree tree;
+        for (int i = 0; i < 2; i++) {
+            tree.append(GetRandHash());
+            CAnchorsCacheEntry &anchor = mapAnchors[tree.root()];
+            anchor.entered = true;
+            anchor.tree = tree;
+            anchor.flags = CAnchorsCacheEntry::DIRTY;
+        }
+        hashAnchor = tree.root();
+
+        for (int i = 0; i < 2; i++) {
+            CNullifiersCacheEntry &nullifier = mapNullifiers[GetRandHash()];
+            nullifier.entered = true;
+            nullifier.flags = CNullifiersCacheEntry::DIRTY;
+        }
+    }
+
+    void WriteTo(CCoinsView &view) const
+    {
+        // BatchWrite empties the maps it is given
+        CCoinsMap mapCoinsCopy(mapCoins);
+        CAnchorsMap mapAnchorsCopy(mapAnchors);
+        CNullifiersMap mapNullifiersCopy(mapNullifiers);
+        BOOST_CHECK(view.BatchWrite(mapCoinsCopy, chainActive.Tip()->GetBlockHash(), hashAnchor, mapAnchorsCopy, mapNullifiersCopy));
+    }
+};
+
+// Make the main network trust the snapshot dumpchainstate described so
+void PinSnapshot(const CCoinsStats &stats, const uint256 &hashShielded)
+{
+    MapSnapshots snapshots;
+    snapshots[stats.nHeight].hashBlock = stats.hashBlock;
+    snapshots[stats.nHeight].hashSerialized = stats.hashSerialized;
+    snapshots[stats.nHeight].hashShielded = hashShielded;
+    Params(CBaseChainParams::MAIN).SetSnapshots(snapshots);
+}
+
+// Dump state to path and check that loading it is refused, leaving nothing
+// behind; with fPin even when what it dumped is pinned
+void CheckRefused(const SampleState &state, const boost::filesystem::path &path, bool fPin)
+{
+    CCoinsViewLog viewFrom(GetDataDir(), true);
+    state.WriteTo(viewFrom);
+    CCoinsStats stats;
+    uint256 hashShielded;
+    std::string strError;
+    BOOST_REQUIRE(DumpChainStateSnapshot(&viewFrom, path, stats, hashShielded, strError));
+    if (fPin)
+        PinSnapshot(stats, hashShielded);
+
+    CCoinsViewLog viewTo(GetDataDir(), true);
+    BOOST_CHECK(!LoadChainStateSnapshot(&viewTo, path, strError));
+    BOOST_CHECK(viewTo.GetBestBlock().IsNull());
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(snapshot_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip)
+{
+    boost::filesystem::path path = GetDataDir() / "snapshot-test.dat";
+    SampleState state;
+    CCoinsViewLog viewFrom(GetDataDir(), true);
+    state.WriteTo(viewFrom);
+
+    CCoinsStats statsDump;
+    uint256 hashShielded;
+    std::string strError;
+    BOOST_REQUIRE(DumpChainStateSnapshot(&viewFrom, path, statsDump, hashShielded, strError));
+    BOOST_CHECK_EQUAL(statsDump.nHeight, 0);
+    BOOST_CHECK_EQUAL(statsDump.nTransactions, 10);
+
+    // Only a pinned snapshot is loaded
+    CCoinsViewLog viewTo(GetDataDir(), true);
+    BOOST_CHECK(!LoadChainStateSnapshot(&viewTo, path, strError));
+    BOOST_CHECK(viewTo.GetBestBlock().IsNull());
+    PinSnapshot(statsDump, hashShielded);
+    BOOST_REQUIRE(LoadChainStateSnapshot(&viewTo, path, strError));
+    BOOST_CHECK(viewTo.GetBestBlock() == viewFrom.GetBestBlock());
+    BOOST_CHECK(viewTo.GetBestAnchor() == state.hashAnchor);
+    for (CAnchorsMap::const_iterator it = state.mapAnchors.begin(); it != state.mapAnchors.end(); it++) {
+        ZCIncrementalMerkleTree tree;
+        BOOST_CHECK(viewTo.GetAnchorAt(it->first, tree));
+        BOOST_CHECK(tree.root() == it->first);
+    }
+    for (CNullifiersMap::const_iterator it = state.mapNullifiers.begin(); it != state.mapNullifiers.end(); it++)
+        BOOST_CHECK(viewTo.GetNullifier(it->first));
+
+    CCoinsStats statsLoad;
+    BOOST_CHECK(viewTo.GetStats(statsLoad));
+    BOOST_CHECK(statsLoad.hashSerialized == statsDump.hashSerialized);
+    BOOST_CHECK_EQUAL(statsLoad.nTotalAmount, statsDump.nTotalAmount);
+
+    // A second load into a non-empty view is refused
+    BOOST_CHECK(!LoadChainStateSnapshot(&viewTo, path, strError));
+    Params(CBaseChainParams::MAIN).SetSnapshots(MapSnapshots());
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_untrusted)
+{
+    boost::filesystem::path path = GetDataDir() / "snapshot-test.dat";
+    SampleState state;
+    CCoinsViewLog viewFrom(GetDataDir(), true);
+    state.WriteTo(viewFrom);
+
+    CCoinsStats stats;
+    uint256 hashShielded;
+    std::string strError;
+    BOOST_REQUIRE(DumpChainStateSnapshot(&viewFrom, path, stats, hashShielded, strError));
+
+    // Coins that don't hash to the pinned value are refused, whatever the
+    // statistics in the file say
+    stats.hashSerialized = GetRandHash();
+    PinSnapshot(stats, hashShielded);
+    CCoinsViewLog viewTo(GetDataDir(), true);
+    BOOST_CHECK(!LoadChainStateSnapshot(&viewTo, path, strError));
+    BOOST_CHECK(viewTo.GetBestBlock().IsNull());
+    Params(CBaseChainParams::MAIN).SetSnapshots(MapSnapshots());
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_nullifier_dropped)
+{
+    boost::filesystem::path path = GetDataDir() / "snapshot-test.dat";
+    SampleState state;
+    CCoinsViewLog viewFrom(GetDataDir(), true);
+    state.WriteTo(viewFrom);
+
+    CCoinsStats stats;
+    uint256 hashShielded;
+    std::string strError;
+    BOOST_REQUIRE(DumpChainStateSnapshot(&viewFrom, path, stats, hashShielded, strError));
+    PinSnapshot(stats, hashShielded);
+
+    // Same coins, so the same hash_serialized, but a spent note made
+    // spendable again
+    SampleState tampered(state);
+    tampered.mapNullifiers.erase(tampered.mapNullifiers.begin());
+    CheckRefused(tampered, path, false);
+    Params(CBaseChainParams::MAIN).SetSnapshots(MapSnapshots());
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_anchor_swapped)
+{
+    boost::filesystem::path path = GetDataDir() / "snapshot-test.dat";
+    SampleState state;
+    CCoinsViewLog viewFrom(GetDataDir(), true);
+    state.WriteTo(viewFrom);
+
+    CCoinsStats stats;
+    uint256 hashShielded;
+    std::string strError;
+    BOOST_REQUIRE(DumpChainStateSnapshot(&viewFrom, path, stats, hashShielded, strError));
+    PinSnapshot(stats, hashShielded);
+
+    // A genuine tree in place of one of the anchors differs from the pinned one
+    SampleState tampered(state);
+    ZCIncrementalMerkleTree tree;
+    tree.append(GetRandHash());
+    tampered.mapAnchors.erase(tampered.mapAnchors.begin());
+    CAnchorsCacheEntry &anchor = tampered.mapAnchors[tree.root()];
+    anchor.entered = true;
+    anchor.tree = tree;
+    anchor.flags = CAnchorsCacheEntry::DIRTY;
+    tampered.hashAnchor = tree.root();
+    CheckRefused(tampered, path, false);
+
+    // A tree under a root it doesn't have is refused even when pinned
+    tampered = state;
+    tampered.mapAnchors.begin()->second.tree = tree;
+    CheckRefused(tampered, path, true);
+
+    // So is a best anchor that isn't one of the anchors
+    tampered = state;
+    tampered.hashAnchor = GetRandHash();
+    CheckRefused(tampered, path, true);
+    Params(CBaseChainParams::MAIN).SetSnapshots(MapSnapshots());
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_corrupt)
+{
+    boost::filesystem::path path = GetDataDir() / "snapshot-test.dat";
+    SampleState state;
+    CCoinsViewLog viewFrom(GetDataDir(), true);
+    state.WriteTo(viewFrom);
+
+    CCoinsStats stats;
+    uint256 hashShielded;
+    std::string strError;
+    BOOST_REQUIRE(DumpChainStateSnapshot(&viewFrom, path, stats, hashShielded, strError));
+    PinSnapshot(stats, hashShielded);
+
+    // Flip a byte near the end, inside the coins or statistics
+    FILE *file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, -40, SEEK_END);
+    int ch = fgetc(file);
+    fseek(file, -40, SEEK_END);
+    fputc(ch ^ 0xff, file);
+    fclose(file);
+
+    // Nothing of a snapshot that fails verification is written
+    CCoinsViewLog viewTo(GetDataDir(), true);
+    BOOST_CHECK(!LoadChainStateSnapshot(&viewTo, path, strError));
+    BOOST_CHECK(viewTo.GetBestBlock().IsNull());
+    CCoinsStats statsTo;
+    BOOST_CHECK(viewTo.GetStats(statsTo));
+    BOOST_CHECK_EQUAL(statsTo.nTransactions, 0);
+    bool fSnapshot = false;
+    BOOST_CHECK(!pblocktree->ReadFlag("snapshot", fSnapshot) || !fSnapshot);
+    Params(CBaseChainParams::MAIN).SetSnapshots(MapSnapshots());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
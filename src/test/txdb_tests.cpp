@@ -0,0 +1,97 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txdb_tests, TestingSetup)
+
+//! Key prefix of anchors, in chainstate/ before the anchor database and in anchors/ since
+static const char DB_ANCHOR = 'A';
+static const char DB_COINS = 'c';
+
+// Trees of successive sizes, more than one migration batch of them
+static std::vector<ZCIncrementalMerkleTree> MakeTrees()
+{
+    std::vector<ZCIncrementalMerkleTree> vTrees;
+    ZCIncrementalMerkleTree tree;
+    for (int i = 0; i < 2500; i++) {
+        tree.append(GetRandHash());
+        vTrees.push_back(tree);
+    }
+    return vTrees;
+}
+
+static void WriteAnchors(const boost::filesystem::path& path, const std::vector<ZCIncrementalMerkleTree>& vTrees, size_t nCount)
+{
+    CLevelDBWrapper db(path, 1 << 20);
+    CLevelDBBatch batch;
+    for (size_t i = 0; i < nCount; i++)
+        batch.Write(std::make_pair(DB_ANCHOR, vTrees[i].root()), vTrees[i]);
+    BOOST_REQUIRE(db.WriteBatch(batch, true));
+}
+
+static void CheckMigrated(const std::vector<ZCIncrementalMerkleTree>& vTrees, const uint256& txid)
+{
+    {
+        CCoinsViewDB view(1 << 20);
+        for (size_t i = 0; i < vTrees.size(); i++) {
+            ZCIncrementalMerkleTree tree;
+            BOOST_CHECK(view.GetAnchorAt(vTrees[i].root(), tree));
+            BOOST_CHECK(tree.root() == vTrees[i].root());
+        }
+        BOOST_CHECK(view.HaveCoins(txid));
+    }
+
+    CLevelDBWrapper db(GetDataDir() / "chainstate", 1 << 20);
+    for (size_t i = 0; i < vTrees.size(); i++)
+        BOOST_CHECK(!db.Exists(std::make_pair(DB_ANCHOR, vTrees[i].root())));
+}
+
+// Put a coin in chainstate/, which the migration must leave alone
+static uint256 WriteCoins()
+{
+    uint256 txid = GetRandHash();
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 1;
+    CLevelDBWrapper db(GetDataDir() / "chainstate", 1 << 20);
+    BOOST_REQUIRE(db.Write(std::make_pair(DB_COINS, txid), coins, true));
+    return txid;
+}
+
+BOOST_AUTO_TEST_CASE(anchors_migrate)
+{
+    // A chain state written before the anchor database existed
+    std::vector<ZCIncrementalMerkleTree> vTrees = MakeTrees();
+    uint256 txid = WriteCoins();
+    WriteAnchors(GetDataDir() / "chainstate", vTrees, vTrees.size());
+
+    CheckMigrated(vTrees, txid);
+    // and opening it again finds nothing left to move
+    CheckMigrated(vTrees, txid);
+}
+
+BOOST_AUTO_TEST_CASE(anchors_migrate_interrupted)
+{
+    // Stopped after some anchors were written to anchors/, before they were
+    // erased from chainstate/
+    std::vector<ZCIncrementalMerkleTree> vTrees = MakeTrees();
+    uint256 txid = WriteCoins();
+    WriteAnchors(GetDataDir() / "chainstate", vTrees, vTrees.size());
+    WriteAnchors(GetDataDir() / "anchors", vTrees, 1000);
+
+    CheckMigrated(vTrees, txid);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+#include "main.h"
+#include "random.h"
+#include "txdb.h"
+#include "txindex.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txindex_tests, TestingSetup)
+
+static bool WaitForSync(const CTxIndex& index)
+{
+    for (int i = 0; i < 500 && !index.IsSynced(); i++)
+        MilliSleep(10);
+    return index.IsSynced();
+}
+
+BOOST_AUTO_TEST_CASE(txindex_sync)
+{
+    uint256 hashGenesis;
+    {
+        LOCK(cs_main);
+        hashGenesis = chainActive.Genesis()->GetBlockHash();
+    }
+
+    // A new index catches up with the chain and records how far it got
+    CTxIndex index;
+    BOOST_CHECK(!index.BlockUntilSyncedToCurrentChain());
+    BOOST_REQUIRE(index.Start());
+    BOOST_REQUIRE(WaitForSync(index));
+    BOOST_CHECK(index.BlockUntilSyncedToCurrentChain());
+    index.Stop();
+    BOOST_CHECK(!index.BlockUntilSyncedToCurrentChain());
+
+    uint256 hashBest;
+    BOOST_CHECK(pblocktree->ReadIndexBestBlock("txindex", hashBest));
+    BOOST_CHECK(hashBest == hashGenesis);
+
+    BOOST_CHECK(index.Remove());
+    BOOST_CHECK(!pblocktree->ReadIndexBestBlock("txindex", hashBest));
+}
+
+BOOST_AUTO_TEST_CASE(txindex_unknown_best_block)
+{
+    // Synced to a block lost in a crash: the index is rebuilt instead of failing
+    CLevelDBBatch batch;
+    BOOST_CHECK(pblocktree->WriteIndexBatch(batch, "txindex", GetRandHash()));
+    CTxIndex index;
+    BOOST_REQUIRE(index.Start());
+    BOOST_REQUIRE(WaitForSync(index));
+    index.Stop();
+
+    uint256 hashBest;
+    BOOST_CHECK(pblocktree->ReadIndexBestBlock("txindex", hashBest));
+    LOCK(cs_main);
+    BOOST_CHECK(hashBest == chainActive.Genesis()->GetBlockHash());
+}
+
+BOOST_AUTO_TEST_CASE(txindex_legacy_upgrade)
+{
+    // An index written as blocks were connected is taken as complete up to the tip
+    BOOST_CHECK(pblocktree->WriteFlag("txindex", true));
+    CTxIndex index;
+    BOOST_REQUIRE(index.Start());
+    index.Stop();
+
+    bool fLegacy = true;
+    BOOST_CHECK(pblocktree->ReadFlag("txindex", fLegacy));
+    BOOST_CHECK(!fLegacy);
+    uint256 hashBest;
+    BOOST_CHECK(pblocktree->ReadIndexBestBlock("txindex", hashBest));
+    LOCK(cs_main);
+    BOOST_CHECK(hashBest == chainActive.Tip()->GetBlockHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -13,6 +13,9 @@
 
 #include <stdint.h>
 
+#include <atomic>
+
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -23,6 +26,9 @@ static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_ADDRESSINDEX = 'd';
+static const char DB_SPENTINDEX = 'p';
+static const char DB_INDEX_BEST = 'I';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_BEST_ANCHOR = 'a';
@@ -65,7 +71,72 @@ void static BatchWriteHashBestAnchor(CLevelDBBatch &batch, const uint256 &hash)
     batch.Write(DB_BEST_ANCHOR, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+static CLevelDBOptions GetCoinsDBOptions()
+{
+    CLevelDBOptions tuning;
+    tuning.ApplyArgs("chainstate");
+    return tuning;
+}
+
+static CLevelDBOptions GetAnchorDBOptions()
+{
+    // Trees are large, rarely read and never probed for absence, so favour
+    // bigger blocks and fewer open files over point-lookup speed.
+    CLevelDBOptions tuning;
+    tuning.nBlockSize = 16 << 10;
+    tuning.nMaxOpenFiles = 16;
+    tuning.nBloomFilterBits = 0;
+    tuning.fCompression = true;
+    tuning.ApplyArgs("anchors");
+    return tuning;
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) :
+    db(GetDataDir() / "chainstate", nCacheSize - nCacheSize / nAnchorDbCacheDivisor, fMemory, fWipe, GetCoinsDBOptions()),
+    anchordb(GetDataDir() / "anchors", nCacheSize / nAnchorDbCacheDivisor, fMemory, fWipe, GetAnchorDBOptions())
+{
+    if (!fWipe && !MigrateAnchors())
+        throw std::runtime_error("CCoinsViewDB(): failed to move anchors to the anchor database");
+}
+
+bool CCoinsViewDB::MigrateAnchors()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_ANCHOR;
+    pcursor->Seek(ssKeySet.str());
+
+    size_t nMoved = 0;
+    while (pcursor->Valid()) {
+        CLevelDBBatch batchAdd, batchErase;
+        size_t nBatch = 0;
+        for (; pcursor->Valid() && nBatch < 1000; pcursor->Next(), nBatch++) {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != DB_ANCHOR)
+                break;
+            uint256 root;
+            ssKey >> root;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ZCIncrementalMerkleTree tree;
+            ssValue >> tree;
+            batchAdd.Write(make_pair(DB_ANCHOR, root), tree);
+            batchErase.Erase(make_pair(DB_ANCHOR, root));
+        }
+        if (nBatch == 0)
+            break;
+        // The copy must be durable before the originals go away.
+        if (!anchordb.WriteBatch(batchAdd, true) || !db.WriteBatch(batchErase))
+            return false;
+        nMoved += nBatch;
+    }
+    if (nMoved > 0)
+        LogPrintf("Moved %u anchors from chainstate to the anchor database, older versions can no longer use this data directory\n", nMoved);
+    return true;
 }
 
 
@@ -76,7 +147,7 @@ bool CCoinsViewDB::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree)
         return true;
     }
 
-    bool read = db.Read(make_pair(DB_ANCHOR, rt), tree);
+    bool read = anchordb.Read(make_pair(DB_ANCHOR, rt), tree);
 
     return read;
 }
@@ -115,9 +186,10 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               const uint256 &hashAnchor,
                               CAnchorsMap &mapAnchors,
                               CNullifiersMap &mapNullifiers) {
-    CLevelDBBatch batch;
+    CLevelDBBatch batch, batchAnchorsAdd, batchAnchorsErase;
     size_t count = 0;
     size_t changed = 0;
+    size_t anchorsAdded = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             BatchWriteCoins(batch, it->first, it->second.coins);
@@ -130,7 +202,12 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
 
     for (CAnchorsMap::iterator it = mapAnchors.begin(); it != mapAnchors.end();) {
         if (it->second.flags & CAnchorsCacheEntry::DIRTY) {
-            BatchWriteAnchor(batch, it->first, it->second.tree, it->second.entered);
+            if (it->second.entered) {
+                BatchWriteAnchor(batchAnchorsAdd, it->first, it->second.tree, true);
+                anchorsAdded++;
+            } else {
+                BatchWriteAnchor(batchAnchorsErase, it->first, it->second.tree, false);
+            }
             // TODO: changed++?
         }
         CAnchorsMap::iterator itOld = it++;
@@ -152,10 +229,26 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
         BatchWriteHashBestAnchor(batch, hashAnchor);
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+
+    // Anchors are keyed by their root, so a tree written ahead of the best
+    // anchor pointer is harmless, while one erased ahead of it is not. New
+    // trees are therefore made durable before chainstate/ moves, and
+    // disconnected ones are only dropped afterwards.
+    if (anchorsAdded > 0 && !anchordb.WriteBatch(batchAnchorsAdd, true))
+        return false;
+    if (!db.WriteBatch(batch))
+        return false;
+    return anchordb.WriteBatch(batchAnchorsErase);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+static CLevelDBOptions GetBlockTreeDBOptions()
+{
+    CLevelDBOptions tuning;
+    tuning.ApplyArgs("blockindex");
+    return tuning;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, GetBlockTreeDBOptions()) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -178,17 +271,98 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+void ApplyCoinsStats(CCoinsStats &stats, CHashWriter &ss, const uint256 &txid, const CCoins &coins, size_t nValueSize)
+{
+    ss << txid;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    stats.nSerializedSize += 32 + nValueSize;
+    ss << VARINT(0);
+}
+
+static void HashCoinsStatsShards(const boost::function<bool(int, CCoinsStats&, CHashWriter&)> &hashShard,
+                                 std::atomic<int> &nNextShard, std::atomic<bool> &fOk,
+                                 std::vector<CCoinsStats> &vStats, std::vector<uint256> &vHashes)
+{
+    int nShard;
+    while (fOk && (nShard = nNextShard++) < COINS_STATS_SHARDS) {
+        try {
+            CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+            if (!hashShard(nShard, vStats[nShard], ss))
+                fOk = false;
+            vHashes[nShard] = ss.GetHash();
+        } catch (const std::exception& e) {
+            LogPrintf("%s: shard %d failed: %s\n", __func__, nShard, e.what());
+            fOk = false;
+        }
+    }
+}
+
+bool ComputeCoinsStats(CCoinsStats &stats, const boost::function<bool(int, CCoinsStats&, CHashWriter&)> &hashShard)
+{
+    std::vector<CCoinsStats> vStats(COINS_STATS_SHARDS);
+    std::vector<uint256> vHashes(COINS_STATS_SHARDS);
+    std::atomic<int> nNextShard(0);
+    std::atomic<bool> fOk(true);
+
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), COINS_STATS_SHARDS));
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&HashCoinsStatsShards, boost::cref(hashShard),
+            boost::ref(nNextShard), boost::ref(fOk), boost::ref(vStats), boost::ref(vHashes)));
+    try {
+        HashCoinsStatsShards(hashShard, nNextShard, fOk, vStats, vHashes);
+    } catch (const boost::thread_interrupted&) {
+        // The helpers are only interrupted through the calling thread
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+    threadGroup.join_all();
+    if (!fOk)
+        return false;
+
+    FinalizeCoinsStats(stats, vStats, vHashes);
+    return true;
+}
+
+void FinalizeCoinsStats(CCoinsStats &stats, const std::vector<CCoinsStats> &vStats, const std::vector<uint256> &vHashes)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << stats.hashBlock;
+    for (int i = 0; i < COINS_STATS_SHARDS; i++) {
+        ss << vHashes[i];
+        stats.nTransactions += vStats[i].nTransactions;
+        stats.nTransactionOutputs += vStats[i].nTransactionOutputs;
+        stats.nSerializedSize += vStats[i].nSerializedSize;
+        stats.nTotalAmount += vStats[i].nTotalAmount;
+    }
+    stats.hashSerialized = ss.GetHash();
+}
+
+bool CCoinsViewDB::GetStatsShard(const leveldb::Snapshot* snapshot, int nShard, CCoinsStats &stats, CHashWriter &ss) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator(snapshot));
+
+    uint256 txidStart;
+    *txidStart.begin() = (nShard * 256 + COINS_STATS_SHARDS - 1) / COINS_STATS_SHARDS;
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_COINS, txidStart);
+    pcursor->Seek(ssKeySet.str());
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -196,41 +370,112 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == DB_COINS) {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
-            }
+            if (chType != DB_COINS)
+                break;
+            uint256 txhash;
+            ssKey >> txhash;
+            if (CoinsStatsShard(txhash) != nShard)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+            ApplyCoinsStats(stats, ss, txhash, coins, slValue.size());
             pcursor->Next();
         } catch (const std::exception& e) {
             return error("%s: Deserialize or I/O error - %s", __func__, e.what());
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    // Work from a snapshot so blocks can keep being connected (and flushed)
+    // while the coin set is walked; the best block is read from the same
+    // snapshot so it always matches the coins that were hashed.
+    CLevelDBWrapper& dbMutable = const_cast<CLevelDBWrapper&>(db);
+    const leveldb::Snapshot* snapshot = dbMutable.GetSnapshot();
+    bool ret = false;
+    try {
+        stats.hashBlock = uint256();
+        db.Read(DB_BEST_BLOCK, stats.hashBlock, snapshot);
+
+        ret = ComputeCoinsStats(stats, boost::bind(&CCoinsViewDB::GetStatsShard, this, snapshot, _1, _2, _3));
+    } catch (const boost::thread_interrupted&) {
+        dbMutable.ReleaseSnapshot(snapshot);
+        throw;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    dbMutable.ReleaseSnapshot(snapshot);
+    return ret;
+}
+
+bool CCoinsViewDB::Traverse(CCoinsViewVisitor &visitor) const {
+    // Anchors are keyed by root, so a snapshot of anchors/ taken after the
+    // one of chainstate/ holds every tree the latter can refer to.
+    CLevelDBWrapper& dbMutable = const_cast<CLevelDBWrapper&>(db);
+    CLevelDBWrapper& anchordbMutable = const_cast<CLevelDBWrapper&>(anchordb);
+    const leveldb::Snapshot* snapshot = dbMutable.GetSnapshot();
+    const leveldb::Snapshot* snapshotAnchors = anchordbMutable.GetSnapshot();
+    bool ret = true;
+    try {
+        uint256 hashBlock, hashAnchor = ZCIncrementalMerkleTree::empty_root();
+        db.Read(DB_BEST_BLOCK, hashBlock, snapshot);
+        db.Read(DB_BEST_ANCHOR, hashAnchor, snapshot);
+        ret = visitor.VisitBest(hashBlock, hashAnchor);
+
+        boost::scoped_ptr<leveldb::Iterator> pcursor(dbMutable.NewIterator(snapshot));
+
+        boost::scoped_ptr<leveldb::Iterator> pcursorAnchors(anchordbMutable.NewIterator(snapshotAnchors));
+        for (pcursorAnchors->SeekToFirst(); ret && pcursorAnchors->Valid(); pcursorAnchors->Next()) {
+            leveldb::Slice slKey = pcursorAnchors->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != DB_ANCHOR)
+                continue;
+            uint256 root;
+            ssKey >> root;
+            leveldb::Slice slValue = pcursorAnchors->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ZCIncrementalMerkleTree tree;
+            ssValue >> tree;
+            ret = visitor.VisitAnchor(root, tree);
+        }
+
+        const char chTypes[] = {DB_NULLIFIER, DB_COINS};
+        for (unsigned int i = 0; ret && i < sizeof(chTypes); i++) {
+            CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+            ssKeySet << chTypes[i];
+            for (pcursor->Seek(ssKeySet.str()); ret && pcursor->Valid(); pcursor->Next()) {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != chTypes[i])
+                    break;
+                uint256 hash;
+                ssKey >> hash;
+                if (chType == DB_NULLIFIER) {
+                    ret = visitor.VisitNullifier(hash);
+                } else {
+                    leveldb::Slice slValue = pcursor->value();
+                    CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                    CCoins coins;
+                    ssValue >> coins;
+                    ret = visitor.VisitCoins(hash, coins);
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        ret = error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    anchordbMutable.ReleaseSnapshot(snapshotAnchors);
+    dbMutable.ReleaseSnapshot(snapshot);
+    return ret;
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
     CLevelDBBatch batch;
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
@@ -243,17 +488,145 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::WriteDiskBlockIndex(const std::vector<CDiskBlockIndex>& vIndex) {
+    CLevelDBBatch batch;
+    for (std::vector<CDiskBlockIndex>::const_iterator it = vIndex.begin(); it != vIndex.end(); it++)
+        batch.Write(make_pair(DB_BLOCK_INDEX, it->GetBlockHash()), *it);
+    return WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair(DB_TXINDEX, txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
-    CLevelDBBatch batch;
+void CBlockTreeDB::WriteTxIndex(CLevelDBBatch &batch, const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
+}
+
+void CBlockTreeDB::WriteAddressIndexes(CLevelDBBatch &batch, const AddressIndexEntries &vAddressIndex, const SpentIndexEntries &vSpentIndex) {
+    for (AddressIndexEntries::const_iterator it = vAddressIndex.begin(); it != vAddressIndex.end(); it++)
+        batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+    for (SpentIndexEntries::const_iterator it = vSpentIndex.begin(); it != vSpentIndex.end(); it++)
+        batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
+}
+
+void CBlockTreeDB::EraseAddressIndexes(CLevelDBBatch &batch, const AddressIndexEntries &vAddressIndex, const SpentIndexEntries &vSpentIndex) {
+    for (AddressIndexEntries::const_iterator it = vAddressIndex.begin(); it != vAddressIndex.end(); it++)
+        batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
+    for (SpentIndexEntries::const_iterator it = vSpentIndex.begin(); it != vSpentIndex.end(); it++)
+        batch.Erase(make_pair(DB_SPENTINDEX, it->first));
+}
+
+bool CBlockTreeDB::ReadAddressIndex(unsigned char type, const uint160 &hashBytes, int nStartHeight, int nEndHeight,
+                                    const CAddressIndexKey *pAfter, size_t nLimit, AddressIndexEntries &vAddressIndex) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    if (pAfter)
+        ssKeySet << make_pair(DB_ADDRESSINDEX, *pAfter);
+    else
+        ssKeySet << make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, hashBytes, nStartHeight));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid() && (nLimit == 0 || vAddressIndex.size() < nLimit)) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType;
+            if (chType != DB_ADDRESSINDEX)
+                break;
+            ssKey >> key;
+            if (key.type != type || key.hashBytes != hashBytes || (nEndHeight > 0 && key.nHeight > nEndHeight))
+                break;
+            // The cursor is positioned on the last entry already returned
+            if (pAfter && slKey.ToString() == ssKeySet.str()) {
+                pcursor->Next();
+                continue;
+            }
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAmount nValue;
+            ssValue >> nValue;
+            vAddressIndex.push_back(make_pair(key, nValue));
+            pcursor->Next();
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+
+    return true;
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value) {
+    return Read(make_pair(DB_SPENTINDEX, key), value);
+}
+
+template <typename K>
+bool CBlockTreeDB::WipePrefix(char chPrefix) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    pcursor->Seek(std::string(1, chPrefix));
+
+    // Erase in batches to bound memory use
+    std::vector<K> vKeys;
+    while (true) {
+        boost::this_thread::interruption_point();
+        bool fDone = !pcursor->Valid();
+        if (!fDone) {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != chPrefix) {
+                fDone = true;
+            } else {
+                K key;
+                ssKey >> key;
+                vKeys.push_back(key);
+                pcursor->Next();
+            }
+        }
+        if (fDone || vKeys.size() == 100000) {
+            CLevelDBBatch batch;
+            for (typename std::vector<K>::const_iterator it = vKeys.begin(); it != vKeys.end(); it++)
+                batch.Erase(make_pair(chPrefix, *it));
+            if (!WriteBatch(batch))
+                return false;
+            vKeys.clear();
+        }
+        if (fDone)
+            return true;
+    }
+}
+
+bool CBlockTreeDB::WipeTxIndex() {
+    return WipePrefix<uint256>(DB_TXINDEX);
+}
+
+bool CBlockTreeDB::WipeAddressIndex() {
+    return WipePrefix<CAddressIndexKey>(DB_ADDRESSINDEX);
+}
+
+bool CBlockTreeDB::WipeSpentIndex() {
+    return WipePrefix<CSpentIndexKey>(DB_SPENTINDEX);
+}
+
+bool CBlockTreeDB::WriteIndexBatch(CLevelDBBatch &batch, const std::string &name, const uint256 &hashBestBlock) {
+    batch.Write(make_pair(DB_INDEX_BEST, name), hashBestBlock);
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadIndexBestBlock(const std::string &name, uint256 &hashBestBlock) {
+    return Read(make_pair(DB_INDEX_BEST, name), hashBestBlock);
+}
+
+bool CBlockTreeDB::EraseIndexBestBlock(const std::string &name) {
+    return Erase(make_pair(DB_INDEX_BEST, name));
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "addressindex.h"
 #include "coins.h"
 #include "leveldbwrapper.h"
 
@@ -14,8 +15,12 @@
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
+
 class CBlockFileInfo;
 class CBlockIndex;
+class CDiskBlockIndex;
+class CHashWriter;
 struct CDiskTxPos;
 class uint256;
 
@@ -25,12 +30,30 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -chainstatebackend default
+static const char * const DEFAULT_CHAINSTATE_BACKEND = "leveldb";
+//! the anchor database gets 1/n of the chain state database cache
+static const int64_t nAnchorDbCacheDivisor = 8;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/** CCoinsView backed by the LevelDB coin database (chainstate/).
+ *
+ * Coins, nullifiers and the best block/anchor pointers are hit on every
+ * transaction and live in chainstate/. Incremental merkle trees are only read
+ * when a joinsplit names them as its anchor, so they live in their own
+ * database (anchors/) with its own cache budget and tuning.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    CLevelDBWrapper anchordb;
+
+    //! Move anchors left in chainstate/ by older versions into anchors/. This
+    //! is one way: those versions find no anchors in the chain state after it.
+    bool MigrateAnchors();
+
+    //! Hash the coins of one gettxoutsetinfo shard as seen by snapshot
+    bool GetStatsShard(const leveldb::Snapshot* snapshot, int nShard, CCoinsStats &stats, CHashWriter &ss) const;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -46,8 +69,34 @@ public:
                     CAnchorsMap &mapAnchors,
                     CNullifiersMap &mapNullifiers);
     bool GetStats(CCoinsStats &stats) const;
+    bool Traverse(CCoinsViewVisitor &visitor) const;
 };
 
+//! gettxoutsetinfo hashes the coin set in this many shards, split on the first txid byte
+static const int COINS_STATS_SHARDS = 16;
+
+/** Shard of the coin set a txid falls in for gettxoutsetinfo */
+inline int CoinsStatsShard(const uint256 &txid)
+{
+    return *txid.begin() * COINS_STATS_SHARDS / 256;
+}
+
+/** Add one transaction's unspent outputs to a shard of a gettxoutsetinfo
+ *  computation. Within a shard every chain state backend must feed coins in
+ *  ascending txid order so their hash_serialized values agree. */
+void ApplyCoinsStats(CCoinsStats &stats, CHashWriter &ss, const uint256 &txid, const CCoins &coins, size_t nValueSize);
+
+/**
+ * Compute gettxoutsetinfo statistics for stats.hashBlock by calling
+ * hashShard for every shard, spread over several threads. The serialized
+ * hash commits to the best block followed by the hash of each shard in
+ * order, so the result does not depend on the number of threads.
+ */
+bool ComputeCoinsStats(CCoinsStats &stats, const boost::function<bool(int, CCoinsStats&, CHashWriter&)> &hashShard);
+
+/** Combine per-shard statistics and hashes into stats (see ComputeCoinsStats) */
+void FinalizeCoinsStats(CCoinsStats &stats, const std::vector<CCoinsStats> &vStats, const std::vector<uint256> &vHashes);
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
@@ -58,15 +107,34 @@ private:
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
+    bool WriteDiskBlockIndex(const std::vector<CDiskBlockIndex>& vIndex);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    void WriteTxIndex(CLevelDBBatch &batch, const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    void WriteAddressIndexes(CLevelDBBatch &batch, const AddressIndexEntries &vAddressIndex, const SpentIndexEntries &vSpentIndex);
+    void EraseAddressIndexes(CLevelDBBatch &batch, const AddressIndexEntries &vAddressIndex, const SpentIndexEntries &vSpentIndex);
+    /**
+     * Read the address index entries of an address between two heights (nEndHeight 0
+     * meaning the tip), starting after pAfter if given, up to nLimit entries (0 for all).
+     */
+    bool ReadAddressIndex(unsigned char type, const uint160 &hashBytes, int nStartHeight, int nEndHeight,
+                          const CAddressIndexKey *pAfter, size_t nLimit, AddressIndexEntries &vAddressIndex);
+    bool ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value);
+    bool WipeTxIndex();
+    bool WipeAddressIndex();
+    bool WipeSpentIndex();
+    //! Write a batch of entries of an index, along with the block the index is synced to
+    bool WriteIndexBatch(CLevelDBBatch &batch, const std::string &name, const uint256 &hashBestBlock);
+    bool ReadIndexBestBlock(const std::string &name, uint256 &hashBestBlock);
+    bool EraseIndexBestBlock(const std::string &name);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
+private:
+    template <typename K> bool WipePrefix(char chPrefix);
 };
 
 #endif // BITCOIN_TXDB_H
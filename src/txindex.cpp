@@ -0,0 +1,60 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txindex.h"
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+CTxIndex* ptxindex = NULL;
+
+bool CTxIndex::WriteBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    vPos.reserve(block.vtx.size());
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        vPos.push_back(std::make_pair(tx.GetHash(), pos));
+        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+    pblocktree->WriteTxIndex(batch, vPos);
+    return true;
+}
+
+bool CTxIndex::Wipe()
+{
+    return pblocktree->WipeTxIndex();
+}
+
+bool CTxIndex::Start()
+{
+    // Earlier versions wrote the transaction index as blocks were connected,
+    // so it is complete up to the tip of the chain they left
+    bool fLegacy = false;
+    pblocktree->ReadFlag("txindex", fLegacy);
+    if (fLegacy) {
+        uint256 hashTip;
+        {
+            LOCK(cs_main);
+            if (chainActive.Tip() != NULL)
+                hashTip = chainActive.Tip()->GetBlockHash();
+        }
+        CLevelDBBatch batch;
+        if (!hashTip.IsNull() && !pblocktree->WriteIndexBatch(batch, GetName(), hashTip))
+            return error("%s: failed to upgrade the transaction index", __func__);
+        if (!pblocktree->WriteFlag("txindex", false))
+            return error("%s: failed to upgrade the transaction index", __func__);
+    }
+    return CBaseIndex::Start();
+}
+
+bool CTxIndex::Remove()
+{
+    if (!pblocktree->WriteFlag("txindex", false))
+        return error("%s: failed to clear the transaction index flag", __func__);
+    return CBaseIndex::Remove();
+}
@@ -0,0 +1,30 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXINDEX_H
+#define BITCOIN_TXINDEX_H
+
+#include "baseindex.h"
+
+/** Default for -txindex */
+static const bool DEFAULT_TXINDEX = false;
+
+/** Index of where each transaction of the chain is in the block files */
+class CTxIndex : public CBaseIndex
+{
+protected:
+    bool WriteBlock(CLevelDBBatch& batch, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex);
+    bool Wipe();
+
+public:
+    CTxIndex() : CBaseIndex("txindex") {}
+
+    bool Start();
+    bool Remove();
+};
+
+/** The transaction index, NULL unless -txindex is set */
+extern CTxIndex* ptxindex;
+
+#endif // BITCOIN_TXINDEX_H
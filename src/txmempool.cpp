@@ -18,7 +18,7 @@
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false)
+    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false), feeDelta(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -27,7 +27,7 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight, bool poolHasNoInputsOf):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
-    hadNoDependencies(poolHasNoInputsOf)
+    hadNoDependencies(poolHasNoInputsOf), feeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
     nModSize = tx.CalculateModifiedSize(nTxSize);
@@ -89,20 +89,60 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+namespace {
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
-    mapTx[hash] = entry;
-    const CTransaction& tx = mapTx[hash].GetTx();
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    std::pair<txiter, bool> inserted = mapTx.insert(entry);
+    if (!inserted.second)
+        return false;
+    txiter newit = inserted.first;
+    mapLinks.insert(make_pair(newit, TxLinks()));
+
+    // Pick up any prioritisation that arrived before the transaction did
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end() && pos->second.second != 0)
+        mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+    const CTransaction& tx = newit->GetTx();
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        txiter parent = mapTx.find(tx.vin[i].prevout.hash);
+        if (parent != mapTx.end()) {
+            UpdateParent(newit, parent, true);
+            UpdateChild(parent, newit, true);
+        }
+    }
+    // Children can already be in the pool when a transaction is put back
+    // after its block was disconnected.
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.find(COutPoint(hash, i));
+        if (it == mapNextTx.end())
+            continue;
+        txiter child = mapTx.find(it->second.ptx->GetHash());
+        assert(child != mapTx.end());
+        UpdateChild(newit, child, true);
+        UpdateParent(child, newit, true);
+    }
     BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
         BOOST_FOREACH(const uint256 &nf, joinsplit.nullifiers) {
             mapNullifiers[nf] = &tx;
         }
+        mapAnchors[joinsplit.anchor].insert(newit);
     }
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
@@ -111,15 +151,106 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     return true;
 }
 
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    setEntries &parents = mapLinks[entry].parents;
+    if (add)
+        parents.insert(parent);
+    else
+        parents.erase(parent);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    setEntries &children = mapLinks[entry].children;
+    if (add)
+        children.insert(child);
+    else
+        children.erase(child);
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
+{
+    std::vector<txiter> stage;
+    if (setDescendants.insert(entryit).second)
+        stage.push_back(entryit);
+    while (!stage.empty()) {
+        txiter it = stage.back();
+        stage.pop_back();
+        BOOST_FOREACH(txiter child, GetMemPoolChildren(it)) {
+            if (setDescendants.insert(child).second)
+                stage.push_back(child);
+        }
+    }
+}
+
+void CTxMemPool::removeUnchecked(txiter it, std::list<CTransaction>& removed)
+{
+    const CTransaction& tx = it->GetTx();
+    const uint256 hash = tx.GetHash();
+
+    BOOST_FOREACH(txiter parent, GetMemPoolParents(it))
+        UpdateChild(parent, it, false);
+    BOOST_FOREACH(txiter child, GetMemPoolChildren(it))
+        UpdateParent(child, it, false);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapNextTx.erase(txin.prevout);
+    BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+        BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers) {
+            mapNullifiers.erase(nf);
+        }
+        std::map<uint256, setEntries>::iterator itAnchor = mapAnchors.find(joinsplit.anchor);
+        if (itAnchor != mapAnchors.end()) {
+            itAnchor->second.erase(it);
+            if (itAnchor->second.empty())
+                mapAnchors.erase(itAnchor);
+        }
+    }
+
+    removed.push_back(tx);
+    totalTxSize -= it->GetTxSize();
+    mapLinks.erase(it);
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+    minerPolicyEstimator->removeTx(hash);
+}
+
+void CTxMemPool::RemoveStaged(const setEntries &stage, std::list<CTransaction>& removed)
+{
+    LOCK(cs);
+    setEntries setAllRemoves;
+    BOOST_FOREACH(txiter it, stage)
+        CalculateDescendants(it, setAllRemoves);
+    BOOST_FOREACH(txiter it, setAllRemoves)
+        removeUnchecked(it, removed);
+}
 
 void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        setEntries txToRemove;
+        txiter origit = mapTx.find(origTx.GetHash());
+        if (origit != mapTx.end()) {
+            txToRemove.insert(origit);
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
@@ -128,37 +259,16 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
                 std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                txiter nextit = mapTx.find(it->second.ptx->GetHash());
+                assert(nextit != mapTx.end());
+                txToRemove.insert(nextit);
             }
         }
-        while (!txToRemove.empty())
-        {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
-                BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers) {
-                    mapNullifiers.erase(nf);
-                }
-            }
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
-            minerPolicyEstimator->removeTx(hash);
+        if (fRecursive) {
+            RemoveStaged(txToRemove, removed);
+        } else {
+            BOOST_FOREACH(txiter it, txToRemove)
+                removeUnchecked(it, removed);
         }
     }
 }
@@ -168,10 +278,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -196,22 +306,14 @@ void CTxMemPool::removeWithAnchor(const uint256 &invalidRoot)
     // from that root -- almost as though they were spending coinbases
     // which are no longer valid to spend due to coinbase maturity.
     LOCK(cs);
-    list<CTransaction> transactionsToRemove;
-
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
-        BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
-            if (joinsplit.anchor == invalidRoot) {
-                transactionsToRemove.push_back(tx);
-                break;
-            }
-        }
-    }
+    std::map<uint256, setEntries>::const_iterator it = mapAnchors.find(invalidRoot);
+    if (it == mapAnchors.end())
+        return;
 
-    BOOST_FOREACH(const CTransaction& tx, transactionsToRemove) {
-        list<CTransaction> removed;
-        remove(tx, removed, true);
-    }
+    // Copy, as removal updates mapAnchors
+    setEntries stage(it->second);
+    list<CTransaction> removed;
+    RemoveStaged(stage, removed);
 }
 
 void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed)
@@ -254,9 +356,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        indexed_transaction_set::const_iterator it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(*it);
     }
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
@@ -272,8 +374,11 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    mapNullifiers.clear();
+    mapAnchors.clear();
     totalTxSize = 0;
     ++nTransactionsUpdated;
 }
@@ -291,18 +396,20 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        const CTransaction& tx = it->GetTx();
         bool fDependsWait = false;
+        setEntries setParentCheck;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
+                setParentCheck.insert(it2);
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
                 assert(coins && coins->IsAvailable(txin.prevout.n));
@@ -314,7 +421,20 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == GetMemPoolParents(it));
+        // Check that the children links match mapNextTx
+        setEntries setChildrenCheck;
+        for (unsigned int n = 0; n < tx.vout.size(); n++) {
+            std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.find(COutPoint(tx.GetHash(), n));
+            if (iter != mapNextTx.end()) {
+                indexed_transaction_set::const_iterator childit = mapTx.find(iter->second.ptx->GetHash());
+                assert(childit != mapTx.end());
+                setChildrenCheck.insert(childit);
+            }
+        }
+        assert(setChildrenCheck == GetMemPoolChildren(it));
 
+        txiter itEntry = it;
         boost::unordered_map<uint256, ZCIncrementalMerkleTree, CCoinsKeyHasher> intermediates;
 
         BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
@@ -336,9 +456,12 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             }
 
             intermediates.insert(std::make_pair(tree.root(), tree));
+
+            std::map<uint256, setEntries>::const_iterator itAnchor = mapAnchors.find(joinsplit.anchor);
+            assert(itAnchor != mapAnchors.end() && itAnchor->second.count(itEntry));
         }
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
             assert(ContextualCheckInputs(tx, state, mempoolDuplicate, false, 0, false, Params().GetConsensus(), NULL));
@@ -362,9 +485,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
@@ -372,12 +495,17 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     for (std::map<uint256, const CTransaction*>::const_iterator it = mapNullifiers.begin(); it != mapNullifiers.end(); it++) {
         uint256 hash = it->second->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second);
     }
 
+    for (std::map<uint256, setEntries>::const_iterator it = mapAnchors.begin(); it != mapAnchors.end(); it++) {
+        assert(!it->second.empty());
+    }
+    assert(mapLinks.size() == mapTx.size());
+
     assert(totalTxSize == checkTotal);
 }
 
@@ -387,16 +515,41 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
+}
+
+void CTxMemPool::queryHashesByFeeRate(vector<uint256>& vtxid)
+{
+    vtxid.clear();
+
+    LOCK(cs);
+    vtxid.reserve(mapTx.size());
+    typedef indexed_transaction_set::index<fee_rate>::type::iterator feeiter;
+    for (feeiter mi = mapTx.get<fee_rate>().begin(); mi != mapTx.get<fee_rate>().end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
+}
+
+int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    typedef indexed_transaction_set::index<entry_time>::type::iterator timeiter;
+    setEntries toremove;
+    for (timeiter it = mapTx.get<entry_time>().begin();
+         it != mapTx.get<entry_time>().end() && it->GetTime() < nTime; ++it) {
+        toremove.insert(mapTx.project<0>(it));
+    }
+    list<CTransaction> removed;
+    RemoveStaged(toremove, removed);
+    return removed.size();
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
@@ -453,6 +606,9 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end())
+            mapTx.modify(it, update_fee_delta(deltas.second));
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
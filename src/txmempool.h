@@ -7,12 +7,17 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -44,6 +49,7 @@ private:
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
     bool hadNoDependencies; //! Not dependent on any other txs when it entered the mempool
+    CAmount feeDelta; //! Fee adjustment from PrioritiseTransaction
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -54,12 +60,52 @@ public:
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
+    CAmount GetModifiedFee() const { return nFee + feeDelta; }
+    void UpdateFeeDelta(CAmount newFeeDelta) { feeDelta = newFeeDelta; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
     bool WasClearAtEntry() const { return hadNoDependencies; }
 };
 
+// extracts a TxMemPoolEntry's transaction hash
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/** Sort by modified fee rate, highest first, with the hash as a tie breaker */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Sort by the time the entry entered the mempool, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+// Multi_index tag names
+struct fee_rate {};
+struct entry_time {};
+
 class CBlockPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -84,6 +130,16 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * mapTx is a boost::multi_index that sorts the mempool on three criteria:
+ * - transaction hash
+ * - modified fee rate (fee plus any PrioritiseTransaction delta, per byte)
+ * - time in mempool
+ *
+ * The in-mempool parents and children of every entry are kept in mapLinks,
+ * and the entries spending from each joinsplit anchor in mapAnchors, so that
+ * block template building, eviction and invalidation on a reorg only touch
+ * the entries involved instead of scanning the whole pool.
  */
 class CTxMemPool
 {
@@ -95,8 +151,52 @@ private:
     uint64_t totalTxSize = 0; //! sum of all mempool tx' byte sizes
 
 public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<fee_rate>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByFeeRate
+            >,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >
+        >
+    > indexed_transaction_set;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+private:
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+    std::map<uint256, setEntries> mapAnchors;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    void removeUnchecked(txiter entry, std::list<CTransaction>& removed);
+
+public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, const CTransaction*> mapNullifiers;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
@@ -122,6 +222,8 @@ public:
                         std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    /** Like queryHashes, but ordered by modified fee rate, highest first */
+    void queryHashesByFeeRate(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
@@ -131,6 +233,17 @@ public:
      */
     bool HasNoInputsOf(const CTransaction& tx) const;
 
+    /** In-mempool parents and children of an entry. mempool.cs must be held. */
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+    /** Add entry and everything in the mempool that depends on it to setDescendants */
+    void CalculateDescendants(txiter entry, setEntries& setDescendants);
+    /** Remove a set of entries and everything that depends on them */
+    void RemoveStaged(const setEntries& stage, std::list<CTransaction>& removed);
+
+    /** Remove transactions that entered the mempool before nTime. Returns the number removed. */
+    int Expire(int64_t nTime);
+
     /** Affect CreateNewBlock prioritisation of transactions */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta);
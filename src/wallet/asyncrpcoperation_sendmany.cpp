@@ -23,7 +23,9 @@
 #include "sodium.h"
 
 #include <iostream>
+#include <atomic>
 #include <chrono>
+#include <exception>
 #include <thread>
 #include <string>
 
@@ -87,6 +89,10 @@ AsyncRPCOperation_sendmany::AsyncRPCOperation_sendmany(
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("runtime error: ") + e.what());
         }
     }
+
+    // Transparent sends take moments, so don't queue them behind sends
+    // which spend minutes computing proofs.
+    setPriority(isProving() ? OperationPriority::LOW : OperationPriority::NORMAL);
 }
 
 AsyncRPCOperation_sendmany::~AsyncRPCOperation_sendmany() {
@@ -356,7 +362,9 @@ bool AsyncRPCOperation_sendmany::main_impl() {
         }
 
         // Create joinsplits, where each output represents a zaddr recipient.
-        Object obj;
+        // They spend no notes, so none depends on another and they can all
+        // be proven at once.
+        std::vector<AsyncJoinSplitInfo> vInfo;
         while (zOutputsDeque.size() > 0) {
             AsyncJoinSplitInfo info;
             info.vpub_old = 0;
@@ -379,8 +387,9 @@ bool AsyncRPCOperation_sendmany::main_impl() {
                 // Funds are removed from the value pool and enter the private pool
                 info.vpub_old += value;
             }
-            obj = perform_joinsplit(info);
+            vInfo.push_back(info);
         }
+        Object obj = perform_joinsplits(vInfo);
         sign_send_raw_transaction(obj);
         return true;
     }
@@ -868,6 +877,71 @@ Object AsyncRPCOperation_sendmany::perform_joinsplit(
         AsyncJoinSplitInfo & info,
         std::vector<boost::optional < ZCIncrementalWitness>> witnesses,
         uint256 anchor)
+{
+    boost::array<size_t, ZC_NUM_JS_INPUTS> inputMap;
+    boost::array<size_t, ZC_NUM_JS_OUTPUTS> outputMap;
+    JSDescription jsdesc = prove_joinsplit(info, witnesses, anchor, tx_.vjoinsplit.size(), inputMap, outputMap);
+    return add_joinsplit(jsdesc, inputMap, outputMap);
+}
+
+Object AsyncRPCOperation_sendmany::perform_joinsplits(std::vector<AsyncJoinSplitInfo> & infos) {
+    std::vector<boost::optional < ZCIncrementalWitness>> witnesses;
+    uint256 anchor;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        anchor = pcoinsTip->GetBestAnchor();    // As there are no inputs, ask the wallet for the best anchor
+    }
+
+    size_t nJoinSplits = infos.size();
+    size_t nFirstIndex = tx_.vjoinsplit.size();
+    std::vector<JSDescription> vjsdesc(nJoinSplits);
+    std::vector<boost::array<size_t, ZC_NUM_JS_INPUTS>> vInputMap(nJoinSplits);
+    std::vector<boost::array<size_t, ZC_NUM_JS_OUTPUTS>> vOutputMap(nJoinSplits);
+    std::vector<std::exception_ptr> vError(nJoinSplits);
+    std::atomic<size_t> nNext(0);
+
+    // Each worker takes the next joinsplit still to be proven. The proofs
+    // are added to the transaction in order afterwards, as every signature
+    // covers all the joinsplits before it.
+    auto worker = [&]() {
+        size_t i;
+        while ((i = nNext++) < nJoinSplits) {
+            try {
+                vjsdesc[i] = prove_joinsplit(infos[i], witnesses, anchor, nFirstIndex + i, vInputMap[i], vOutputMap[i]);
+            } catch (...) {
+                vError[i] = std::current_exception();
+            }
+        }
+    };
+
+    size_t nThreads = std::max<int64_t>(1, GetArg("-joinsplitproofthreads", DEFAULT_JOINSPLIT_PROOF_THREADS));
+    nThreads = std::min(nThreads, nJoinSplits);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nThreads; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::thread & t : threads) {
+        t.join();
+    }
+
+    Object obj;
+    for (size_t i = 0; i < nJoinSplits; i++) {
+        if (vError[i]) {
+            std::rethrow_exception(vError[i]);
+        }
+        obj = add_joinsplit(vjsdesc[i], vInputMap[i], vOutputMap[i]);
+    }
+    return obj;
+}
+
+JSDescription AsyncRPCOperation_sendmany::prove_joinsplit(
+        AsyncJoinSplitInfo & info,
+        std::vector<boost::optional < ZCIncrementalWitness>> witnesses,
+        uint256 anchor,
+        size_t index,
+        boost::array<size_t, ZC_NUM_JS_INPUTS> & inputMap,
+        boost::array<size_t, ZC_NUM_JS_OUTPUTS> & outputMap)
 {
     if (anchor.IsNull()) {
         throw std::runtime_error("anchor is null");
@@ -897,11 +971,9 @@ Object AsyncRPCOperation_sendmany::perform_joinsplit(
         throw runtime_error("unsupported joinsplit input/output counts");
     }
 
-    CMutableTransaction mtx(tx_);
-
     LogPrint("zrpc", "%s: creating joinsplit at index %d (vpub_old=%s, vpub_new=%s, in[0]=%s, in[1]=%s, out[0]=%s, out[1]=%s)\n",
             getId().substr(0,10),
-            tx_.vjoinsplit.size(),
+            index,
             FormatMoney(info.vpub_old, false), FormatMoney(info.vpub_new, false),
             FormatMoney(info.vjsin[0].note.value, false), FormatMoney(info.vjsin[1].note.value, false),
             FormatMoney(info.vjsout[0].value, false), FormatMoney(info.vjsout[1].value, false)
@@ -912,8 +984,6 @@ Object AsyncRPCOperation_sendmany::perform_joinsplit(
             {info.vjsin[0], info.vjsin[1]};
     boost::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> outputs
             {info.vjsout[0], info.vjsout[1]};
-    boost::array<size_t, ZC_NUM_JS_INPUTS> inputMap;
-    boost::array<size_t, ZC_NUM_JS_OUTPUTS> outputMap;
     JSDescription jsdesc = JSDescription::Randomized(
             *pzcashParams,
             joinSplitPubKey_,
@@ -930,6 +1000,15 @@ Object AsyncRPCOperation_sendmany::perform_joinsplit(
         throw std::runtime_error("error verifying joinsplit");
     }
 
+    return jsdesc;
+}
+
+Object AsyncRPCOperation_sendmany::add_joinsplit(
+        const JSDescription & jsdesc,
+        const boost::array<size_t, ZC_NUM_JS_INPUTS> & inputMap,
+        const boost::array<size_t, ZC_NUM_JS_OUTPUTS> & outputMap)
+{
+    CMutableTransaction mtx(tx_);
     mtx.vjoinsplit.push_back(jsdesc);
 
     // Empty output script.
@@ -19,6 +19,10 @@
 // TODO: Compute fee based on a heuristic, e.g. (num tx output * dust threshold) + joinsplit bytes * ?
 #define ASYNC_RPC_OPERATION_DEFAULT_MINERS_FEE   10000
 
+// transaction.h comment: spending taddr output requires CTxIn >= 148 bytes and typical taddr txout is 34 bytes
+#define CTXIN_SPEND_DUST_SIZE   148
+#define CTXOUT_REGULAR_SIZE     34
+
 using namespace libzcash;
 using namespace json_spirit;
 
@@ -54,6 +58,11 @@ public:
     
     virtual void main();
 
+    // Any joinsplit, whether spending notes or sending to a zaddr, needs a proof
+    virtual bool isProving() const {
+        return isfromzaddr_ || z_outputs_.size() > 0;
+    }
+
     bool testmode = false;  // Set to true to disable sending txs and generating proofs
 
 private:
@@ -97,6 +106,24 @@ private:
         std::vector<boost::optional < ZCIncrementalWitness>> witnesses,
         uint256 anchor);
 
+    // JoinSplits without any input notes to spend, proven concurrently
+    Object perform_joinsplits(std::vector<AsyncJoinSplitInfo> & infos);
+
+    // Generate the proof for a JoinSplit at the given index, without adding it to the transaction
+    JSDescription prove_joinsplit(
+        AsyncJoinSplitInfo & info,
+        std::vector<boost::optional < ZCIncrementalWitness>> witnesses,
+        uint256 anchor,
+        size_t index,
+        boost::array<size_t, ZC_NUM_JS_INPUTS> & inputMap,
+        boost::array<size_t, ZC_NUM_JS_OUTPUTS> & outputMap);
+
+    // Add a proven JoinSplit to the transaction and sign it
+    Object add_joinsplit(
+        const JSDescription & jsdesc,
+        const boost::array<size_t, ZC_NUM_JS_INPUTS> & inputMap,
+        const boost::array<size_t, ZC_NUM_JS_OUTPUTS> & outputMap);
+
     void sign_send_raw_transaction(Object obj);     // throws exception if there was an error
 
 };
@@ -0,0 +1,844 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "asyncrpcoperation_sendmanybatch.h"
+#include "amount.h"
+#include "core_io.h"
+#include "init.h"
+#include "main.h"
+#include "rpcserver.h"
+#include "util.h"
+#include "utilmoneystr.h"
+#include "utilstrencodings.h"
+#include "wallet.h"
+#include "script/interpreter.h"
+#include "rpcprotocol.h"
+#include "zcash/IncrementalMerkleTree.hpp"
+#include "sodium.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <string>
+#include <tuple>
+
+using namespace libzcash;
+
+AsyncRPCOperation_sendmanybatch::AsyncRPCOperation_sendmanybatch(
+        std::string fromAddress,
+        std::vector<SendManyRecipient> tOutputs,
+        std::vector<SendManyRecipient> zOutputs,
+        int minDepth) :
+        mindepth_(minDepth), fromaddress_(fromAddress), t_outputs_(tOutputs), z_outputs_(zOutputs)
+{
+    if (minDepth < 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Minconf cannot be negative");
+    }
+
+    if (fromAddress.size() == 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "From address parameter missing");
+    }
+
+    if (tOutputs.size() == 0 && zOutputs.size() == 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "No recipients");
+    }
+
+    fromtaddr_ = CBitcoinAddress(fromAddress);
+    isfromtaddr_ = fromtaddr_.IsValid();
+    isfromzaddr_ = false;
+
+    if (!isfromtaddr_) {
+        CZCPaymentAddress address(fromAddress);
+        try {
+            PaymentAddress addr = address.Get();
+
+            // We don't need to lock on the wallet as spending key related methods are thread-safe
+            SpendingKey key;
+            if (!pwalletMain->GetSpendingKey(addr, key)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid from address, no spending key found for zaddr");
+            }
+
+            isfromzaddr_ = true;
+            frompaymentaddress_ = addr;
+            spendingkey_ = key;
+        } catch (const std::runtime_error& e) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("runtime error: ") + e.what());
+        }
+    }
+
+    setPriority(isProving() ? OperationPriority::LOW : OperationPriority::NORMAL);
+}
+
+AsyncRPCOperation_sendmanybatch::~AsyncRPCOperation_sendmanybatch() {
+}
+
+void AsyncRPCOperation_sendmanybatch::main() {
+    if (isCancelled())
+        return;
+
+    set_state(OperationStatus::EXECUTING);
+    start_execution_clock();
+
+    bool success = false;
+
+    try {
+        success = main_impl();
+    } catch (const Object& objError) {
+        int code = find_value(objError, "code").get_int();
+        std::string message = find_value(objError, "message").get_str();
+        set_error_code(code);
+        set_error_message(message);
+    } catch (const runtime_error& e) {
+        set_error_code(-1);
+        set_error_message("runtime error: " + string(e.what()));
+    } catch (const logic_error& e) {
+        set_error_code(-1);
+        set_error_message("logic error: " + string(e.what()));
+    } catch (...) {
+        set_error_code(-2);
+        set_error_message("unknown error");
+    }
+
+    stop_execution_clock();
+
+    if (success) {
+        set_state(OperationStatus::SUCCESS);
+    } else {
+        size_t nSent;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            nSent = sent_txids_.size();
+        }
+        if (nSent > 0) {
+            set_error_message(getErrorMessage() + strprintf(" (%d of %d transactions were sent)", nSent, plans_.size()));
+        }
+        set_state(OperationStatus::FAILED);
+    }
+
+    std::string s = strprintf("async rpc %s finished (status=%s", getId(), getStateAsString());
+    if (success) {
+        s += strprintf(", txs=%d)\n", plans_.size());
+    } else {
+        s += strprintf(", error=%s)\n", getErrorMessage());
+    }
+    LogPrintf("%s",s);
+}
+
+bool AsyncRPCOperation_sendmanybatch::main_impl() {
+
+    assert(isfromtaddr_ != isfromzaddr_);
+
+    if (isfromtaddr_ && !find_utxos()) {
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Insufficient funds, no non-coinbase UTXOs found for taddr from address.");
+    }
+
+    if (isfromzaddr_ && !find_unspent_notes()) {
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Insufficient funds, no unspent notes found for zaddr from address.");
+    }
+
+    plan_transactions();
+
+    // Witness every note the batch spends against the same anchor, so the
+    // chain is only locked once.
+    std::vector<JSOutPoint> outPoints;
+    std::vector<size_t> witnessIndex(z_inputs_.size());
+    size_t nJoinSplits = 0;
+    for (const BatchTransactionPlan& plan : plans_) {
+        for (const BatchJoinSplitPlan& js : plan.joinsplits) {
+            for (size_t i : js.inputs) {
+                witnessIndex[i] = outPoints.size();
+                outPoints.push_back(std::get<0>(z_inputs_[i]));
+            }
+        }
+        nJoinSplits += plan.joinsplits.size();
+    }
+
+    std::vector<boost::optional < ZCIncrementalWitness>> witnesses;
+    uint256 anchor;
+    ZCIncrementalMerkleTree tree;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        if (outPoints.size() > 0) {
+            pwalletMain->GetNoteWitnesses(outPoints, witnesses, anchor);
+        } else {
+            anchor = pcoinsTip->GetBestAnchor();    // As there are no inputs, ask the wallet for the best anchor
+        }
+        // Joinsplits after the first of a transaction are anchored to this
+        // tree with the commitments of the ones before them appended
+        if (isfromzaddr_ && !pcoinsTip->GetAnchorAt(anchor, tree)) {
+            throw JSONRPCError(RPC_WALLET_ERROR, "Could not find the anchor of the note witnesses");
+        }
+    }
+    for (const boost::optional<ZCIncrementalWitness>& witness : witnesses) {
+        if (!witness) {
+            throw runtime_error("joinsplit input could not be found in tree");
+        }
+    }
+
+    LogPrint("zrpc", "%s: paying %d recipients in %d transactions with %d joinsplits\n",
+            getId().substr(0, 10), t_outputs_.size() + z_outputs_.size(), plans_.size(), nJoinSplits);
+
+    // Joinsplits spending notes follow each other's change, so those of one
+    // transaction are proven in order, while different transactions are
+    // proven concurrently. Joinsplits paying from a taddr don't depend on
+    // each other and are all proven concurrently.
+    std::vector<std::tuple<size_t, size_t, size_t>> jobs;   // transaction, first and end joinsplit
+    std::vector<std::vector<JSDescription>> vjsdesc(plans_.size());
+    for (size_t t = 0; t < plans_.size(); t++) {
+        size_t nJoinSplitsTx = plans_[t].joinsplits.size();
+        vjsdesc[t].resize(nJoinSplitsTx);
+        if (isfromzaddr_) {
+            jobs.push_back(std::make_tuple(t, 0, nJoinSplitsTx));
+        } else {
+            for (size_t j = 0; j < nJoinSplitsTx; j++) {
+                jobs.push_back(std::make_tuple(t, j, j + 1));
+            }
+        }
+    }
+    std::vector<std::exception_ptr> vError(jobs.size());
+    std::atomic<size_t> nNext(0);
+
+    auto prove = [&](size_t t, size_t nBegin, size_t nEnd) {
+        const BatchTransactionPlan& plan = plans_[t];
+        ZCIncrementalMerkleTree jsTree = tree;
+        std::vector<uint256> previousCommitments;
+        boost::array<size_t, ZC_NUM_JS_OUTPUTS> outputMap;
+        for (size_t j = nBegin; j < nEnd; j++) {
+            const BatchJoinSplitPlan& js = plan.joinsplits[j];
+            uint256 jsAnchor = anchor;
+            std::vector<Note> notes;
+            std::vector<boost::optional < ZCIncrementalWitness>> jsWitnesses;
+
+            if (j > nBegin) {
+                append_previous_joinsplit(plan, j, vjsdesc[t][j - 1], outputMap,
+                        jsTree, previousCommitments, notes, jsWitnesses);
+                jsAnchor = jsTree.root();
+            }
+
+            for (size_t n : js.inputs) {
+                ZCIncrementalWitness w = *witnesses[witnessIndex[n]];
+                for (const uint256& commitment : previousCommitments) {
+                    w.append(commitment);
+                }
+                notes.push_back(std::get<1>(z_inputs_[n]));
+                jsWitnesses.push_back(w);
+            }
+
+            vjsdesc[t][j] = prove_joinsplit(plan, js, notes, jsWitnesses, jsAnchor, outputMap);
+        }
+    };
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = nNext++) < jobs.size()) {
+            try {
+                prove(std::get<0>(jobs[i]), std::get<1>(jobs[i]), std::get<2>(jobs[i]));
+            } catch (...) {
+                vError[i] = std::current_exception();
+            }
+        }
+    };
+
+    size_t nThreads = std::max<int64_t>(1, GetArg("-joinsplitproofthreads", DEFAULT_JOINSPLIT_PROOF_THREADS));
+    nThreads = std::min(nThreads, jobs.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nThreads; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::thread & t : threads) {
+        t.join();
+    }
+    for (std::exception_ptr & error : vError) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Send the transactions one by one. If a later one fails, the error
+    // lists the txids of those already sent.
+    Array hexes;
+    for (size_t t = 0; t < plans_.size(); t++) {
+        std::string signedtxn = sign_send_transaction(plans_[t], vjsdesc[t]);
+        std::string txid = signedtxn;
+        if (testmode) {
+            CDataStream stream(ParseHex(signedtxn), SER_NETWORK, PROTOCOL_VERSION);
+            CTransaction tx;
+            stream >> tx;
+            txid = tx.GetHash().ToString();
+            hexes.push_back(signedtxn);
+        }
+        std::lock_guard<std::mutex> guard(lock_);
+        sent_txids_.push_back(txid);
+    }
+
+    Object o;
+    if (testmode) {
+        o.push_back(Pair("test", 1));
+        o.push_back(Pair("hex", hexes));
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        o.push_back(Pair("txids", sent_txids_));
+    }
+    set_result(Value(o));
+
+    return true;
+}
+
+/**
+ * Split the recipients over as many transactions as needed and lay out the
+ * joinsplits of each. Nothing is proven or sent if any part of the batch
+ * can't be funded.
+ */
+void AsyncRPCOperation_sendmanybatch::plan_transactions() {
+    plans_.clear();
+
+    // Largest first, so the notes spent by a joinsplit can pay the biggest
+    // recipients themselves
+    std::vector<SendManyRecipient> zOutputs = z_outputs_;
+    std::sort(zOutputs.begin(), zOutputs.end(), [](SendManyRecipient i, SendManyRecipient j) -> bool {
+        return ( std::get<1>(i) > std::get<1>(j));
+    });
+    std::vector<SendManyRecipient> tOutputs = t_outputs_;
+
+    std::vector<bool> used(isfromzaddr_ ? z_inputs_.size() : t_inputs_.size(), false);
+    while (zOutputs.size() > 0 || tOutputs.size() > 0) {
+        BatchTransactionPlan plan;
+        if (!plan_transaction(zOutputs, tOutputs, used, plan)) {
+            throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS,
+                strprintf("Insufficient funds to pay the remaining %d recipients after planning %d transactions",
+                zOutputs.size() + tOutputs.size(), plans_.size()));
+        }
+        crypto_sign_keypair(plan.joinSplitPubKey.begin(), plan.joinSplitPrivKey);
+        plans_.push_back(plan);
+    }
+}
+
+/**
+ * Plan the next transaction, taking as many of the remaining recipients as
+ * fit into it together with the inputs they need.
+ */
+bool AsyncRPCOperation_sendmanybatch::plan_transaction(
+        std::vector<SendManyRecipient>& zOutputs,
+        std::vector<SendManyRecipient>& tOutputs,
+        std::vector<bool>& used,
+        BatchTransactionPlan& plan)
+{
+    const size_t nJoinSplitSize = JSDescription().GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION);
+    CMutableTransaction mtxEmpty;
+    mtxEmpty.nVersion = 2;
+    // Leave room for the compact sizes of the vectors growing
+    const size_t nBaseSize = CTransaction(mtxEmpty).GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION) + 16;
+
+    std::vector<CAmount> values;
+    if (isfromzaddr_) {
+        for (const SendManyInputJSOP& t : z_inputs_) {
+            values.push_back(std::get<2>(t));
+        }
+    } else {
+        for (const SendManyInputUTXO& t : t_inputs_) {
+            values.push_back(std::get<2>(t));
+        }
+    }
+
+    // Transparent recipients take at most half of the transaction
+    size_t nTOutputs = std::min<size_t>(tOutputs.size(), (MAX_TX_SIZE / 2) / CTXOUT_REGULAR_SIZE);
+    CAmount tOutputsTotal = 0;
+    for (size_t i = 0; i < nTOutputs; i++) {
+        tOutputsTotal += std::get<1>(tOutputs[i]);
+    }
+
+    // One output for transparent change
+    size_t nFixedSize = nBaseSize + (nTOutputs + 1) * CTXOUT_REGULAR_SIZE;
+    if (nFixedSize > MAX_TX_SIZE) {
+        return false;
+    }
+    size_t nMaxJoinSplits = (MAX_TX_SIZE - nFixedSize) / nJoinSplitSize;
+    size_t nZOutputs = std::min<size_t>(zOutputs.size(), isfromzaddr_ ? nMaxJoinSplits : 2 * nMaxJoinSplits);
+
+    // Take fewer zaddr recipients until the inputs they need fit as well
+    while (true) {
+        if (nZOutputs == 0 && nTOutputs == 0) {
+            return false;
+        }
+
+        CAmount zOutputsTotal = 0;
+        for (size_t i = 0; i < nZOutputs; i++) {
+            zOutputsTotal += std::get<1>(zOutputs[i]);
+        }
+        CAmount fee = ASYNC_RPC_OPERATION_DEFAULT_MINERS_FEE;
+        CAmount target = zOutputsTotal + tOutputsTotal + fee;
+
+        // Chained joinsplits each take in a note or pay a recipient, at
+        // least. Paying from a taddr, they pay two recipients each.
+        size_t nMaxInputs = 0;
+        if (isfromzaddr_) {
+            if (nZOutputs < nMaxJoinSplits) {
+                nMaxInputs = nMaxJoinSplits - nZOutputs;
+            }
+        } else {
+            size_t nPayingJoinSplits = (nZOutputs + 1) / 2;
+            if (nPayingJoinSplits <= nMaxJoinSplits) {
+                nMaxInputs = (MAX_TX_SIZE - nFixedSize - nPayingJoinSplits * nJoinSplitSize) / CTXIN_SPEND_DUST_SIZE;
+            }
+        }
+
+        std::vector<size_t> selected = select_inputs(values, used, target, nMaxInputs);
+        if (selected.size() > 0) {
+            CAmount selectedTotal = 0;
+            for (size_t i : selected) {
+                used[i] = true;
+                selectedTotal += values[i];
+            }
+            plan.fee = fee;
+            plan.change = selectedTotal - target;
+            plan.t_outputs.assign(tOutputs.begin(), tOutputs.begin() + nTOutputs);
+            tOutputs.erase(tOutputs.begin(), tOutputs.begin() + nTOutputs);
+
+            std::vector<SendManyRecipient> zPlanned(zOutputs.begin(), zOutputs.begin() + nZOutputs);
+            zOutputs.erase(zOutputs.begin(), zOutputs.begin() + nZOutputs);
+
+            if (isfromtaddr_) {
+                for (size_t i : selected) {
+                    plan.t_inputs.push_back(t_inputs_[i]);
+                }
+
+                // Transparent change too small to spend is left to the miners
+                CScript scriptPubKey = GetScriptForDestination(CKeyID());
+                CAmount dustThreshold = CTxOut(CAmount(1), scriptPubKey).GetDustThreshold(minRelayTxFee);
+                if (plan.change > 0 && plan.change < dustThreshold) {
+                    plan.fee += plan.change;
+                    plan.change = 0;
+                }
+            }
+
+            plan_joinsplits(zPlanned, selected, plan);
+            return true;
+        }
+
+        if (nZOutputs == 0) {
+            return false;
+        }
+        nZOutputs--;
+    }
+}
+
+/**
+ * Lay out the joinsplits of a transaction. Spending notes, each joinsplit
+ * takes the change of the one before it and as many new notes as it has
+ * inputs left, pays whichever recipients it covers and sends the rest back
+ * to the zaddr, as z_sendmany does. The change of the last one is the change
+ * of the transaction. Paying from a taddr, recipients are paid two per
+ * joinsplit out of the transparent value pool.
+ */
+void AsyncRPCOperation_sendmanybatch::plan_joinsplits(
+        std::vector<SendManyRecipient> zOutputs,
+        const std::vector<size_t>& notes,
+        BatchTransactionPlan& plan)
+{
+    CAmount vpubOldTotal = 0;
+    CAmount vpubNewTotal = 0;
+
+    if (isfromzaddr_) {
+        // Only the transparent recipients and the fee leave the shielded pool
+        CAmount publicOut = plan.fee;
+        for (const SendManyRecipient& r : plan.t_outputs) {
+            publicOut += std::get<1>(r);
+        }
+
+        size_t nNext = 0;
+        CAmount carried = 0;
+        bool fMore = true;
+        while (fMore) {
+            BatchJoinSplitPlan js;
+            js.spends_change = carried > 0;
+            CAmount value = carried;
+            while (nNext < notes.size() && js.inputs.size() + js.spends_change < ZC_NUM_JS_INPUTS) {
+                js.inputs.push_back(notes[nNext]);
+                value += std::get<2>(z_inputs_[notes[nNext]]);
+                nNext++;
+            }
+
+            js.vpub_new = std::min(publicOut, value);
+            publicOut -= js.vpub_new;
+            value -= js.vpub_new;
+            vpubNewTotal += js.vpub_new;
+
+            // The last output is kept for the change, unless the last
+            // recipient takes exactly what is left
+            for (auto it = zOutputs.begin(); it != zOutputs.end() && js.outputs.size() < ZC_NUM_JS_OUTPUTS; ) {
+                CAmount amount = std::get<1>(*it);
+                bool fLast = nNext == notes.size() && publicOut == 0 && zOutputs.size() == 1 && amount == value;
+                if (amount <= value && (js.outputs.size() + 1 < ZC_NUM_JS_OUTPUTS || fLast)) {
+                    js.outputs.push_back(get_output(*it));
+                    value -= amount;
+                    it = zOutputs.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            if (value > 0) {
+                js.outputs.push_back(JSOutput(frompaymentaddress_, value));
+            }
+            fMore = nNext < notes.size() || zOutputs.size() > 0 || publicOut > 0;
+            if (!fMore && value != plan.change) {
+                throw std::logic_error("batch transaction plan does not balance");
+            }
+            carried = fMore ? value : 0;
+            plan.joinsplits.push_back(js);
+        }
+    }
+
+    for (size_t i = 0; i < zOutputs.size(); i += ZC_NUM_JS_OUTPUTS) {
+        BatchJoinSplitPlan js;
+        for (size_t n = i; n < zOutputs.size() && n < i + ZC_NUM_JS_OUTPUTS; n++) {
+            js.outputs.push_back(get_output(zOutputs[n]));
+            js.vpub_old += std::get<1>(zOutputs[n]);
+        }
+        vpubOldTotal += js.vpub_old;
+        plan.joinsplits.push_back(js);
+    }
+
+    // The transparent value pool must balance
+    CAmount tIn = vpubNewTotal;
+    for (const SendManyInputUTXO& t : plan.t_inputs) {
+        tIn += std::get<2>(t);
+    }
+    CAmount tOut = vpubOldTotal + plan.fee;
+    for (const SendManyRecipient& r : plan.t_outputs) {
+        tOut += std::get<1>(r);
+    }
+    if (isfromtaddr_) {
+        tOut += plan.change;
+    }
+    if (tIn != tOut) {
+        throw std::logic_error("batch transaction plan does not balance");
+    }
+}
+
+std::vector<size_t> AsyncRPCOperation_sendmanybatch::select_inputs(
+        const std::vector<CAmount>& values,
+        const std::vector<bool>& used,
+        CAmount target,
+        size_t nMaxCount)
+{
+    std::vector<size_t> selected;
+    if (nMaxCount == 0) {
+        return selected;
+    }
+
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < values.size(); i++) {
+        if (!used[i]) {
+            candidates.push_back(i);
+        }
+    }
+    // Largest first
+    std::sort(candidates.begin(), candidates.end(), [&values](size_t i, size_t j) -> bool {
+        return values[i] > values[j] || (values[i] == values[j] && i < j);
+    });
+
+    CAmount total = 0;
+    size_t nTaken = 0;
+    while (nTaken < candidates.size() && nTaken < nMaxCount && total < target) {
+        total += values[candidates[nTaken]];
+        nTaken++;
+    }
+    if (total < target) {
+        return selected;
+    }
+
+    // The last value taken only has to cover what the others leave; the
+    // smallest candidate doing that keeps the change down. With a single
+    // value this is the smallest one reaching the target by itself.
+    CAmount needed = target - (total - values[candidates[nTaken - 1]]);
+    size_t best = nTaken - 1;
+    for (size_t k = nTaken; k < candidates.size() && values[candidates[k]] >= needed; k++) {
+        best = k;
+    }
+
+    selected.assign(candidates.begin(), candidates.begin() + nTaken - 1);
+    selected.push_back(candidates[best]);
+    return selected;
+}
+
+Value AsyncRPCOperation_sendmanybatch::getError() const {
+    Value err = AsyncRPCOperation::getError();
+    if (err.is_null()) {
+        return err;
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    if (sent_txids_.size() == 0) {
+        return err;
+    }
+    Object error = err.get_obj();
+    error.push_back(Pair("txids", sent_txids_));
+    return Value(error);
+}
+
+JSOutput AsyncRPCOperation_sendmanybatch::get_output(const SendManyRecipient& recipient) {
+    PaymentAddress pa = CZCPaymentAddress(std::get<0>(recipient)).Get();
+    JSOutput jso = JSOutput(pa, std::get<1>(recipient));
+
+    std::vector<unsigned char> rawMemo = ParseHex(std::get<2>(recipient));
+    if (rawMemo.size() > ZC_MEMO_SIZE) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Memo size of %d is too big, maximum allowed is %d", rawMemo.size(), ZC_MEMO_SIZE));
+    }
+    std::copy(rawMemo.begin(), rawMemo.end(), jso.memo.begin());
+    return jso;
+}
+
+/**
+ * Append the commitments of the previous joinsplit of a transaction to the
+ * tree the next one is anchored to, and if it spends the change, add the
+ * change note and its witness to its inputs. A joinsplit that sends all of
+ * its value to the transparent pool has no change output.
+ */
+void AsyncRPCOperation_sendmanybatch::append_previous_joinsplit(
+        const BatchTransactionPlan& plan,
+        size_t j,
+        const JSDescription& prevJoinSplit,
+        const boost::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap,
+        ZCIncrementalMerkleTree& tree,
+        std::vector<uint256>& previousCommitments,
+        std::vector<Note>& notes,
+        std::vector<boost::optional < ZCIncrementalWitness>>& witnesses)
+{
+    const BatchJoinSplitPlan& js = plan.joinsplits[j];
+
+    // The change is the last output of the previous joinsplit
+    size_t nChange = ZC_NUM_JS_OUTPUTS;
+    if (js.spends_change) {
+        const BatchJoinSplitPlan& prev = plan.joinsplits[j - 1];
+        if (prev.outputs.empty()) {
+            throw std::logic_error("previous joinsplit has no change to spend");
+        }
+        for (size_t n = 0; n < ZC_NUM_JS_OUTPUTS; n++) {
+            if (outputMap[n] == prev.outputs.size() - 1) {
+                nChange = n;
+            }
+        }
+        if (nChange == ZC_NUM_JS_OUTPUTS) {
+            throw std::logic_error("change output of previous joinsplit not found");
+        }
+    }
+
+    boost::optional<ZCIncrementalWitness> changeWitness;
+    for (size_t n = 0; n < prevJoinSplit.commitments.size(); n++) {
+        tree.append(prevJoinSplit.commitments[n]);
+        previousCommitments.push_back(prevJoinSplit.commitments[n]);
+        if (changeWitness) {
+            changeWitness.get().append(prevJoinSplit.commitments[n]);
+        } else if (n == nChange) {
+            changeWitness = tree.witness();
+        }
+    }
+
+    if (js.spends_change) {
+        // Decrypt the change note to spend it
+        ZCNoteDecryption decryptor(spendingkey_.viewing_key());
+        auto hSig = prevJoinSplit.h_sig(*pzcashParams, plan.joinSplitPubKey);
+        try {
+            NotePlaintext plaintext = NotePlaintext::decrypt(
+                    decryptor,
+                    prevJoinSplit.ciphertexts[nChange],
+                    prevJoinSplit.ephemeralKey,
+                    hSig,
+                    (unsigned char) nChange);
+            notes.push_back(plaintext.note(frompaymentaddress_));
+        } catch (const std::exception& e) {
+            throw JSONRPCError(RPC_WALLET_ERROR, strprintf("Error decrypting output note of previous JoinSplit: %s", e.what()));
+        }
+        witnesses.push_back(changeWitness);
+    }
+}
+
+JSDescription AsyncRPCOperation_sendmanybatch::prove_joinsplit(
+        const BatchTransactionPlan& plan,
+        const BatchJoinSplitPlan& js,
+        const std::vector<Note>& notes,
+        const std::vector<boost::optional < ZCIncrementalWitness>>& witnesses,
+        const uint256& anchor,
+        boost::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap)
+{
+    if (anchor.IsNull()) {
+        throw std::runtime_error("anchor is null");
+    }
+
+    if (witnesses.size() != notes.size()) {
+        throw runtime_error("number of notes and witnesses do not match");
+    }
+
+    std::vector<JSInput> vjsin;
+    for (size_t i = 0; i < notes.size(); i++) {
+        if (!witnesses[i]) {
+            throw runtime_error("joinsplit input could not be found in tree");
+        }
+        vjsin.push_back(JSInput(*witnesses[i], notes[i], spendingkey_));
+    }
+    while (vjsin.size() < ZC_NUM_JS_INPUTS) {
+        vjsin.push_back(JSInput());
+    }
+
+    std::vector<JSOutput> vjsout = js.outputs;
+    while (vjsout.size() < ZC_NUM_JS_OUTPUTS) {
+        vjsout.push_back(JSOutput());
+    }
+
+    // Generate the proof, this can take over a minute.
+    boost::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> inputs
+            {vjsin[0], vjsin[1]};
+    boost::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> outputs
+            {vjsout[0], vjsout[1]};
+    boost::array<size_t, ZC_NUM_JS_INPUTS> inputMap;
+    JSDescription jsdesc = JSDescription::Randomized(
+            *pzcashParams,
+            plan.joinSplitPubKey,
+            anchor,
+            inputs,
+            outputs,
+            inputMap,
+            outputMap,
+            js.vpub_old,
+            js.vpub_new,
+            !this->testmode);
+
+    if (!(jsdesc.Verify(*pzcashParams, plan.joinSplitPubKey))) {
+        throw std::runtime_error("error verifying joinsplit");
+    }
+
+    return jsdesc;
+}
+
+/**
+ * Build, sign and send one transaction of the batch. Returns the txid, or
+ * in test mode the signed transaction without sending it.
+ */
+std::string AsyncRPCOperation_sendmanybatch::sign_send_transaction(
+        BatchTransactionPlan& plan,
+        const std::vector<JSDescription>& vjsdesc)
+{
+    CMutableTransaction mtx;
+    if (vjsdesc.size() > 0) {
+        mtx.nVersion = 2;
+        mtx.joinSplitPubKey = plan.joinSplitPubKey;
+        mtx.vjoinsplit = vjsdesc;
+    }
+
+    for (const SendManyInputUTXO& t : plan.t_inputs) {
+        mtx.vin.push_back(CTxIn(COutPoint(std::get<0>(t), std::get<1>(t))));
+    }
+
+    for (const SendManyRecipient& r : plan.t_outputs) {
+        CBitcoinAddress address(std::get<0>(r));
+        if (!address.IsValid()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid output address, not a valid taddr.");
+        }
+        mtx.vout.push_back(CTxOut(std::get<1>(r), GetScriptForDestination(address.Get())));
+    }
+
+    // Change from a taddr flows to a new taddr address
+    if (isfromtaddr_ && plan.change > 0) {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+        CReserveKey keyChange(pwalletMain);
+        CPubKey vchPubKey;
+        if (!keyChange.GetReservedKey(vchPubKey)) {
+            throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Could not generate a taddr to use as a change address"); // should never fail, as we just unlocked
+        }
+        keyChange.KeepKey();
+        mtx.vout.push_back(CTxOut(plan.change, GetScriptForDestination(vchPubKey.GetID())));
+    }
+
+    if (vjsdesc.size() > 0) {
+        // Empty output script.
+        CScript scriptCode;
+        CTransaction signTx(mtx);
+        uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL);
+
+        // Add the signature
+        if (!(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
+                dataToBeSigned.begin(), 32,
+                plan.joinSplitPrivKey
+                ) == 0))
+        {
+            throw std::runtime_error("crypto_sign_detached failed");
+        }
+    }
+
+    // Sign the transparent inputs
+    Value signResultValue = signrawtransaction({Value(EncodeHexTx(CTransaction(mtx)))}, false);
+    Object signResultObject = signResultValue.get_obj();
+    if (!find_value(signResultObject, "complete").get_bool()) {
+        throw JSONRPCError(RPC_WALLET_ENCRYPTION_FAILED, "Failed to sign transaction");
+    }
+    Value hexValue = find_value(signResultObject, "hex");
+    if (hexValue.is_null()) {
+        throw JSONRPCError(RPC_WALLET_ERROR, "Missing hex data for signed transaction");
+    }
+    std::string signedtxn = hexValue.get_str();
+
+    if (testmode) {
+        // Test mode does not send the transaction to the network.
+        return signedtxn;
+    }
+
+    Value sendResultValue = sendrawtransaction({Value(signedtxn)}, false);
+    if (sendResultValue.is_null()) {
+        throw JSONRPCError(RPC_WALLET_ERROR, "Send raw transaction did not return an error or a txid.");
+    }
+    return sendResultValue.get_str();
+}
+
+bool AsyncRPCOperation_sendmanybatch::find_utxos() {
+    set<CBitcoinAddress> setAddress = {fromtaddr_};
+    vector<COutput> vecOutputs;
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    // Coinbase utxos can't be spent here, as that doesn't allow change
+    pwalletMain->AvailableCoins(vecOutputs, false, NULL, true, false);
+
+    BOOST_FOREACH(const COutput& out, vecOutputs) {
+        if (out.nDepth < mindepth_) {
+            continue;
+        }
+
+        CTxDestination address;
+        if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address)) {
+            continue;
+        }
+        if (!setAddress.count(address)) {
+            continue;
+        }
+
+        if (out.tx->IsCoinBase()) {
+            continue;
+        }
+
+        CAmount nValue = out.tx->vout[out.i].nValue;
+        t_inputs_.push_back(SendManyInputUTXO(out.tx->GetHash(), out.i, nValue, false));
+    }
+
+    return t_inputs_.size() > 0;
+}
+
+bool AsyncRPCOperation_sendmanybatch::find_unspent_notes() {
+    std::vector<CNotePlaintextEntry> entries;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pwalletMain->GetFilteredNotes(entries, fromaddress_, mindepth_);
+    }
+
+    for (CNotePlaintextEntry & entry : entries) {
+        z_inputs_.push_back(SendManyInputJSOP(entry.jsop, entry.plaintext.note(frompaymentaddress_), CAmount(entry.plaintext.value)));
+    }
+
+    return z_inputs_.size() > 0;
+}
@@ -0,0 +1,170 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ASYNCRPCOPERATION_SENDMANYBATCH_H
+#define ASYNCRPCOPERATION_SENDMANYBATCH_H
+
+#include "asyncrpcoperation.h"
+#include "amount.h"
+#include "base58.h"
+#include "primitives/transaction.h"
+#include "wallet/asyncrpcoperation_sendmany.h"
+#include "zcash/JoinSplit.hpp"
+#include "zcash/Address.hpp"
+#include "json/json_spirit_value.h"
+
+#include <vector>
+
+using namespace libzcash;
+using namespace json_spirit;
+
+// A joinsplit planned by the batch operation. Spending notes, each joinsplit
+// after the first of a transaction can spend the change the one before it
+// sent back to the zaddr, so value moves between them inside notes and only
+// the transparent recipients and the fee leave through vpub_new. Paying from
+// a taddr, joinsplits take what they pay from the transparent inputs through
+// vpub_old.
+struct BatchJoinSplitPlan
+{
+    std::vector<size_t> inputs;     // indexes into the operation's z_inputs_
+    bool spends_change = false;     // also spends the last output of the previous joinsplit
+    std::vector<JSOutput> outputs;
+    CAmount vpub_old = 0;
+    CAmount vpub_new = 0;
+};
+
+// One transaction of the batch
+struct BatchTransactionPlan
+{
+    std::vector<SendManyInputUTXO> t_inputs;
+    std::vector<SendManyRecipient> t_outputs;
+    std::vector<BatchJoinSplitPlan> joinsplits;
+    CAmount change = 0;
+    CAmount fee = 0;
+
+    uint256 joinSplitPubKey;
+    unsigned char joinSplitPrivKey[crypto_sign_SECRETKEYBYTES];
+};
+
+/**
+ * Pay many recipients from one address, splitting them over several
+ * transactions when they don't fit in one. The whole batch is planned before
+ * anything is proven, so it fails early if the funds don't cover it.
+ */
+class AsyncRPCOperation_sendmanybatch : public AsyncRPCOperation {
+public:
+    AsyncRPCOperation_sendmanybatch(std::string fromAddress, std::vector<SendManyRecipient> tOutputs, std::vector<SendManyRecipient> zOutputs, int minDepth);
+    virtual ~AsyncRPCOperation_sendmanybatch();
+
+    // We don't want to be copied or moved around
+    AsyncRPCOperation_sendmanybatch(AsyncRPCOperation_sendmanybatch const&) = delete;             // Copy construct
+    AsyncRPCOperation_sendmanybatch(AsyncRPCOperation_sendmanybatch&&) = delete;                  // Move construct
+    AsyncRPCOperation_sendmanybatch& operator=(AsyncRPCOperation_sendmanybatch const&) = delete;  // Copy assign
+    AsyncRPCOperation_sendmanybatch& operator=(AsyncRPCOperation_sendmanybatch &&) = delete;      // Move assign
+
+    virtual void main();
+
+    // The error also lists the transactions sent before the failure
+    virtual Value getError() const;
+
+    virtual bool isProving() const {
+        return isfromzaddr_ || z_outputs_.size() > 0;
+    }
+
+    // Pick which of the values to spend to reach the target: a single value
+    // if one is large enough, otherwise the largest values until the target
+    // is reached, with the last one swapped for the smallest value that still
+    // reaches it. Returns indexes into values, or nothing if the target can't
+    // be reached with at most nMaxCount values.
+    static std::vector<size_t> select_inputs(const std::vector<CAmount>& values, const std::vector<bool>& used, CAmount target, size_t nMaxCount);
+
+    bool testmode = false;  // Set to true to disable sending txs and generating proofs
+
+private:
+    friend class TEST_FRIEND_AsyncRPCOperation_sendmanybatch;    // class for unit testing
+
+    int mindepth_;
+    std::string fromaddress_;
+    bool isfromtaddr_;
+    bool isfromzaddr_;
+    CBitcoinAddress fromtaddr_;
+    PaymentAddress frompaymentaddress_;
+    SpendingKey spendingkey_;
+
+    std::vector<SendManyRecipient> t_outputs_;
+    std::vector<SendManyRecipient> z_outputs_;
+    std::vector<SendManyInputUTXO> t_inputs_;
+    std::vector<SendManyInputJSOP> z_inputs_;
+
+    std::vector<BatchTransactionPlan> plans_;
+    Array sent_txids_;      // guarded by lock_
+
+    bool find_utxos();
+    bool find_unspent_notes();
+    void plan_transactions();
+    bool plan_transaction(std::vector<SendManyRecipient>& zOutputs, std::vector<SendManyRecipient>& tOutputs, std::vector<bool>& used, BatchTransactionPlan& plan);
+    void plan_joinsplits(std::vector<SendManyRecipient> zOutputs, const std::vector<size_t>& notes, BatchTransactionPlan& plan);
+    JSOutput get_output(const SendManyRecipient& recipient);
+    bool main_impl();
+
+    void append_previous_joinsplit(
+        const BatchTransactionPlan& plan,
+        size_t j,
+        const JSDescription& prevJoinSplit,
+        const boost::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap,
+        ZCIncrementalMerkleTree& tree,
+        std::vector<uint256>& previousCommitments,
+        std::vector<Note>& notes,
+        std::vector<boost::optional < ZCIncrementalWitness>>& witnesses);
+
+    JSDescription prove_joinsplit(
+        const BatchTransactionPlan& plan,
+        const BatchJoinSplitPlan& js,
+        const std::vector<Note>& notes,
+        const std::vector<boost::optional < ZCIncrementalWitness>>& witnesses,
+        const uint256& anchor,
+        boost::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap);
+
+    std::string sign_send_transaction(BatchTransactionPlan& plan, const std::vector<JSDescription>& vjsdesc);
+};
+
+
+// To test private methods, a friend class can act as a proxy
+class TEST_FRIEND_AsyncRPCOperation_sendmanybatch {
+public:
+    std::shared_ptr<AsyncRPCOperation_sendmanybatch> delegate;
+
+    TEST_FRIEND_AsyncRPCOperation_sendmanybatch(std::shared_ptr<AsyncRPCOperation_sendmanybatch> ptr) : delegate(ptr) {}
+
+    void setZInputs(std::vector<SendManyInputJSOP> inputs) {
+        delegate->z_inputs_ = inputs;
+    }
+
+    void setTInputs(std::vector<SendManyInputUTXO> inputs) {
+        delegate->t_inputs_ = inputs;
+    }
+
+    void plan_transactions() {
+        delegate->plan_transactions();
+    }
+
+    std::vector<BatchTransactionPlan> getPlans() {
+        return delegate->plans_;
+    }
+
+    void append_previous_joinsplit(
+            const BatchTransactionPlan& plan,
+            size_t j,
+            const JSDescription& prevJoinSplit,
+            const boost::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap,
+            ZCIncrementalMerkleTree& tree,
+            std::vector<uint256>& previousCommitments,
+            std::vector<Note>& notes,
+            std::vector<boost::optional < ZCIncrementalWitness>>& witnesses) {
+        delegate->append_previous_joinsplit(plan, j, prevJoinSplit, outputMap, tree, previousCommitments, notes, witnesses);
+    }
+};
+
+
+#endif /* ASYNCRPCOPERATION_SENDMANYBATCH_H */
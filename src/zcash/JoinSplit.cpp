@@ -4,8 +4,16 @@
 
 #include "zcash/util.h"
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <mutex>
+#include <streambuf>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
@@ -16,6 +24,10 @@
 #include "libsnark/gadgetlib1/gadgets/hashes/sha256/sha256_gadget.hpp"
 #include "libsnark/gadgetlib1/gadgets/merkle_tree/merkle_tree_check_read_gadget.hpp"
 
+#ifdef MULTICORE
+#include <omp.h>
+#endif
+
 #include "sync.h"
 #include "amount.h"
 
@@ -30,6 +42,33 @@ std::once_flag init_public_params_once_flag;
 CCriticalSection cs_ParamsIO;
 CCriticalSection cs_LoadKeys;
 
+//! Number of proofs being computed right now, across all circuits
+std::atomic<int> nActiveProvers(0);
+
+/**
+ * Keeps nActiveProvers up to date for the lifetime of a proof and shares
+ * the cores between the proofs running concurrently: libsnark parallelizes
+ * the multi-exponentiations and FFTs of each proof with OpenMP, and every
+ * proof asking for all cores at once would only oversubscribe them.
+ */
+class ProverScope {
+public:
+    ProverScope() {
+        int nProvers = ++nActiveProvers;
+#ifdef MULTICORE
+        // The thread count is per calling thread, so this only affects
+        // the parallel regions of this proof.
+        omp_set_num_threads(std::max(1, omp_get_num_procs() / nProvers));
+#else
+        (void)nProvers;
+#endif
+    }
+
+    ~ProverScope() {
+        --nActiveProvers;
+    }
+};
+
 template<typename T>
 void saveToFile(std::string path, T& obj) {
     LOCK(cs_ParamsIO);
@@ -44,24 +83,56 @@ void saveToFile(std::string path, T& obj) {
     fh.close();
 }
 
-template<typename T>
-void loadFromFile(std::string path, boost::optional<T>& objIn) {
-    LOCK(cs_ParamsIO);
+/**
+ * A parameter file mapped into memory, readable as a std::streambuf. The
+ * key parsers read straight from the page cache, so loading the proving key
+ * doesn't hold the file contents in memory twice.
+ */
+class MappedParamsFile : public std::streambuf {
+private:
+    void* data;
+    size_t size;
 
-    std::stringstream ss;
-    std::ifstream fh(path, std::ios::binary);
+    MappedParamsFile(const MappedParamsFile&);
+    MappedParamsFile& operator=(const MappedParamsFile&);
 
-    if(!fh.is_open()) {
-        throw std::runtime_error((boost::format("could not load param file at %s") % path).str());
+public:
+    MappedParamsFile(const std::string& path) : data(MAP_FAILED), size(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error((boost::format("could not load param file at %s") % path).str());
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = st.st_size;
+            data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error((boost::format("could not map param file at %s") % path).str());
+        }
+        // The keys are parsed front to back exactly once
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        char* begin = static_cast<char*>(data);
+        setg(begin, begin, begin + size);
     }
 
-    ss << fh.rdbuf();
-    fh.close();
+    ~MappedParamsFile() {
+        munmap(data, size);
+    }
+};
 
-    ss.rdbuf()->pubseekpos(0, std::ios_base::in);
+template<typename T>
+void loadFromFile(std::string path, boost::optional<T>& objIn) {
+    // Only writers take cs_ParamsIO; the caller's cs_LoadKeys already keeps
+    // a key from being loaded twice, and loading the proving key shouldn't
+    // hold up anything else for the time that takes.
+    MappedParamsFile file(path);
+    std::istream is(&file);
 
     T obj;
-    ss >> obj;
+    is >> obj;
 
     objIn = std::move(obj);
 }
@@ -77,6 +148,11 @@ public:
     boost::optional<r1cs_ppzksnark_processed_verification_key<ppzksnark_ppT>> vk_precomp;
     boost::optional<std::string> pkPath;
 
+    // The constraint system is the same for every proof, so it is generated
+    // once, on the first proof, and shared by all later ones.
+    std::once_flag constraint_system_once_flag;
+    boost::optional<r1cs_constraint_system<FieldT>> constraint_system;
+
     JoinSplitCircuit() {}
     ~JoinSplitCircuit() {}
 
@@ -138,6 +214,21 @@ public:
         return pb.get_constraint_system();
     }
 
+    const r1cs_constraint_system<FieldT>& get_constraint_system() {
+        std::call_once(constraint_system_once_flag, [this] {
+            r1cs_constraint_system<FieldT> r1cs = generate_r1cs();
+
+            // Swap A and B if it's beneficial (less arithmetic in G2)
+            // In our circuit, we already know that it's beneficial
+            // to swap, but it takes so little time to perform this
+            // estimate that it doesn't matter if we check.
+            r1cs.swap_AB_if_beneficial();
+
+            constraint_system = std::move(r1cs);
+        });
+        return *constraint_system;
+    }
+
     void generate() {
         LOCK(cs_LoadKeys);
 
@@ -317,10 +408,14 @@ public:
             return ZCProof();
         }
 
+        ProverScope scope;
+
+        // The gadget allocates its variables on construction, so the witness
+        // can be computed on a fresh protoboard without regenerating the
+        // constraints; those come from the cached constraint system.
         protoboard<FieldT> pb;
         {
             joinsplit_gadget<FieldT, NumInputs, NumOutputs> g(pb);
-            g.generate_r1cs_constraints();
             g.generate_r1cs_witness(
                 phi,
                 rt,
@@ -332,25 +427,21 @@ public:
             );
         }
 
-        // The constraint system must be satisfied or there is an unimplemented
-        // or incorrect sanity check above. Or the constraint system is broken!
-        assert(pb.is_satisfied());
+        const r1cs_constraint_system<FieldT>& r1cs = get_constraint_system();
+        assert(pb.num_variables() == r1cs.num_variables());
 
-        // TODO: These are copies, which is not strictly necessary.
-        std::vector<FieldT> primary_input = pb.primary_input();
-        std::vector<FieldT> aux_input = pb.auxiliary_input();
+        const r1cs_primary_input<FieldT> primary_input = pb.primary_input();
+        const r1cs_auxiliary_input<FieldT> aux_input = pb.auxiliary_input();
 
-        // Swap A and B if it's beneficial (less arithmetic in G2)
-        // In our circuit, we already know that it's beneficial
-        // to swap, but it takes so little time to perform this
-        // estimate that it doesn't matter if we check every time.
-        pb.constraint_system.swap_AB_if_beneficial();
+        // The constraint system must be satisfied or there is an unimplemented
+        // or incorrect sanity check above. Or the constraint system is broken!
+        assert(r1cs.is_satisfied(primary_input, aux_input));
 
         return ZCProof(r1cs_ppzksnark_prover<ppzksnark_ppT>(
             *pk,
             primary_input,
             aux_input,
-            pb.constraint_system
+            r1cs
         ));
     }
 };